@@ -15,43 +15,175 @@
  * If the test crashes, prints the message
  *  alarum: Terminated abnormally.
  *
- * 2. The test's stdout and stderr are saved to a temporary file,
- * and when the test is done, the test ID the
- * temporary file's contents are output all at once.
+ * 2. The test's stdout and stderr are captured through a pipe into
+ * memory (past a few megabytes, into an unlinked temporary file),
+ * and when the test is done, they are output all at once.  A collector
+ * process started by the first test to finish writes them, so that
+ * tests finishing together do not wait for each other; its socket and
+ * lock are kept in $ALARM_LOCKDIR (default /tmp).
  * If the test failed in any way, each line of the test's output
  * (including any timeout or crash message from this program)
  * is prefixed with ']] '.
  *
+ * 3. The test runs in a process group of its own, and in a cgroup of
+ * its own when the cgroup v2 hierarchy is writable by us, so a timeout,
+ * or a SIGINT, SIGTERM or SIGHUP sent to us, kills everything the test
+ * started, not just the test.  The exception is a wineserver the test
+ * started, which leaves the process group with setsid() and which the
+ * tests after it share: it is moved out of the cgroup and left running.
+ * The CPU time, peak memory and I/O of everything in the cgroup, or else
+ * of the test and the children it waited for, are reported along with
+ * the elapsed time.
+ *
+ * 4. The test's output is scanned as it is copied out.  Under valgrind,
+ * a nonzero ERROR SUMMARY fails the test, and leaks and the lines
+ * valgrind/valgrind-split.pl picks out as errors are counted.  Each test
+ * ends with a summary record for scripts, e.g.
+ *  alarum: summary status=fail exit=0 signal=0 timeout=0 elapsed=12 cpu=3.45 maxrss=123456 io=789 vgerrors=2 vgerrorlines=3 vgleakbytes=48 vgleakblocks=1 command='...'
+ * whose keys may grow but are never renamed.
+ *
  * Copyright 2008, Google (Dan Kegel)
  * Copyright 2011, Dan Kegel
  * License: LGPL
  */
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
+
+#include "../patchwatcher/alarmlib.h"
 
-pid_t child_pid;
+const char alarm_name[] = "alarum";
 
 /* a real implementation would not have a limit on commandline length */
 #define MAXARGS 1000
 
 char *newargv[MAXARGS];
 
+/* Lines valgrind/valgrind-split.pl's is_error() picks out */
+static const char *error_patterns[] = {
+    "uninitialised", "Unhandled exception:", "Invalid read", "Invalid write",
+    "Invalid free", "Source and destination overlap", "Mismatched free",
+    "unaddressable byte", "vex x86", "Warning: invalid file descriptor",
+    "impossible", "INTERNAL ERROR", "are definitely",
+};
+static const size_t error_patterns_len = sizeof(error_patterns) / sizeof(error_patterns[0]);
+#define NOT_AN_ERROR "Warning: invalid file descriptor -1 in syscall close"
+
+/* What scanning the log found */
+struct scan {
+    long long vgerrors;     /* sum of the ERROR SUMMARY counts */
+    long long vgleakbytes;  /* sum of the bytes definitely lost */
+    long long vgleakblocks;
+    int vgerrorlines;       /* lines is_error() would pick out */
+    struct iovec *iov;      /* a "]] " prefix and a line, for each line */
+    int niov;
+    int maxiov;
+};
+
+/* Parse a number as valgrind prints it, with thousands separators */
+static long long vgNumber(const char *p, const char *end, const char **next)
+{
+    long long n = 0;
+
+    for (; p < end && ((*p >= '0' && *p <= '9') || *p == ','); p++)
+        if (*p != ',')
+            n = n * 10 + (*p - '0');
+    if (next)
+        *next = p;
+    return n;
+}
+
+/* Note what valgrind said on the line from p to end */
+static void scanValgrindLine(const char *p, const char *end, struct scan *scan)
+{
+    const char *q;
+    size_t i;
+
+    /* ==123== ERROR SUMMARY: 2 errors from 2 contexts */
+    q = memmem(p, end - p, "ERROR SUMMARY: ", 15);
+    if (q && memmem(p, q - p, "==", 2))
+        scan->vgerrors += vgNumber(q + 15, end, NULL);
+
+    /* ==123==    definitely lost: 48 bytes in 1 blocks */
+    q = memmem(p, end - p, "definitely lost: ", 17);
+    if (q) {
+        scan->vgleakbytes += vgNumber(q + 17, end, &q);
+        q = memmem(q, end - q, " bytes in ", 10);
+        if (q)
+            scan->vgleakblocks += vgNumber(q + 10, end, NULL);
+    }
+
+    for (i = 0; i < error_patterns_len; i++) {
+        if (memmem(p, end - p, error_patterns[i], strlen(error_patterns[i]))) {
+            if (!memmem(p, end - p, NOT_AN_ERROR, strlen(NOT_AN_ERROR)))
+                scan->vgerrorlines++;
+            break;
+        }
+    }
+}
+
+/* Go through the log once, line by line, noting what valgrind said if
+ * it ran, and gathering the lines for writev() each behind an empty
+ * prefix, which can be made "]] " once we know the test failed.  Room is
+ * left at the end of scan->iov for a few more.  Returns 0 if out of
+ * memory. */
+static int scanLog(char *data, size_t len, int valgrind, struct scan *scan)
+{
+    char *p, *end, *eol;
+    struct iovec *iov;
+
+    memset(scan, 0, sizeof(*scan));
+    for (p = data, end = data + len; p < end; p = eol) {
+        eol = memchr(p, '\n', end - p);
+        eol = eol ? eol + 1 : end;
+        if (valgrind)
+            scanValgrindLine(p, eol, scan);
+
+        if (scan->niov + 2 + 4 > scan->maxiov) {
+            scan->maxiov = scan->maxiov ? scan->maxiov * 2 : 256;
+            iov = realloc(scan->iov, scan->maxiov * sizeof(*iov));
+            if (!iov)
+                return 0;
+            scan->iov = iov;
+        }
+        scan->iov[scan->niov].iov_base = "]] ";
+        scan->iov[scan->niov++].iov_len = 0;
+        scan->iov[scan->niov].iov_base = p;
+        scan->iov[scan->niov++].iov_len = eol - p;
+    }
+    if (!scan->iov) {
+        scan->maxiov = 4;
+        scan->iov = malloc(scan->maxiov * sizeof(*scan->iov));
+        if (!scan->iov)
+            return 0;
+    }
+    return 1;
+}
+
+int timedout;
+
 static void handler(int x)
 {
     fflush(stdout);
     printf("]] alarum: Timeout!  Killing child %s.\n", newargv[0]);
     fflush(stdout);
-    /* TODO: This probably won't kill grandchildren.  Do we want to create a process group? */
-    kill(child_pid, SIGKILL);
+    killChild();
+    timedout = 1;
 }
 
 /* Extract test id (module:filename) from commandline, return true if ok */
@@ -96,13 +228,23 @@ int main(int argc, char **argv)
     int i;
     int waitresult;
     int ret;
-    int logfd;
-    FILE *logfp;
-    char logfilename[1024];
-#define MYBUFLEN 128000
-    static char buf[MYBUFLEN];
+    int pipefds[2];
+    sigset_t sigchld;
+    int sigfd;
+    struct log log;
+    char *data;
+    size_t len;
+    struct scan scan;
+    struct iovec *iov;
+    int niov;
+    char summary[7000];
+    char buf[5000];
+    char status[6000];
     time_t t0, t1;
     int valgrinderr;
+    int failed;
+    struct rusage ru;
+    struct usage usage;
 
     if (argc < 3) {
         fprintf(stderr, "Usage: alarum timeout-in-seconds command ...\n");
@@ -119,77 +261,71 @@ int main(int argc, char **argv)
         newargv[newargc] = argv[newargc+2];
     newargv[newargc] = NULL;
 
-    /* Redirect child's output and stderr to a temporary file ... */
-    sprintf(logfilename, "%d.tmplog", getpid());
-    logfd = open(logfilename, O_RDWR|O_CREAT, 0660);
-    if (logfd == -1) {
-        perror(logfilename);
+    /* Redirect child's output and stderr to a pipe ... */
+    if (pipe(pipefds) == -1) {
+        perror("pipe");
         exit(1);
     }
+    logInit(&log);
 
+    createCgroup();
+    /* The child's exit is read from sigfd while its output is read */
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    sigfd = signalfd(-1, &sigchld, SFD_CLOEXEC);
     time(&t0);
 
     /* Run test */
     child_pid = fork();
     if (child_pid == 0) {
         /* child */
+        sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
         /* Finish redirecting */
-        dup2(logfd, 1);
-        dup2(logfd, 2);
-        /* TODO: Do we want to make this its own process group for ease of killing grandchildren? */
+        dup2(pipefds[1], 1);
+        dup2(pipefds[1], 2);
+        close(pipefds[0]);
+        close(pipefds[1]);
+        enterCgroup();
         execvp(newargv[0], newargv);
         /* notreached */
         perror(newargv[0]);
         exit(1);
     }
 
-    /* Wait timeout seconds for it to finish */
+    /* so the timeout can kill the group even before the child is in it */
+    setpgid(child_pid, child_pid);
+
+    /* Wait timeout seconds for it to finish, keeping its output */
+    close(pipefds[1]);
     signal(SIGALRM, handler);
+    catchInterrupts();
     alarm(timeout);
+    readOutput(pipefds[0], sigfd, &log);
+    if (sigfd != -1)
+        close(sigfd);
+    sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
     waitresult = 0;
-    while ((ret = wait(&waitresult)) == -1 && errno == EINTR)
+    memset(&ru, 0, sizeof(ru));
+    while ((ret = wait4(child_pid, &waitresult, 0, &ru)) == -1 && errno == EINTR)
         ;
+    alarm(0);
     time(&t1);
+    if ((timedout || interrupted) && cgroup_dir[0])
+        killCgroup();
+    getUsage(&ru, &usage);
+    removeCgroup();
+    exitIfInterrupted();
 
-    if (close(logfd)) {
-        perror("closing log fd");
-        exit(1);
-    }
+    data = logData(&log, &len);
 
-    logfp = fopen(logfilename, "r");
-    if (!logfp) {
-        perror(logfilename);
+    /* Check for valgrind errors, and line the output up for writing */
+    if (!scanLog(data, len, strstr(newargv[0], "valgrind") != NULL, &scan)) {
+        perror("malloc");
         exit(1);
     }
-
-    /* Check for valgrind errors */
-    valgrinderr = 0;
-    if (strstr(newargv[0], "valgrind")) {
-        char grepcmd[5000];
-        int status;
-        /* ok, a real programm would use regcomp()/regexec(), but I'm lazy */
-        sprintf(grepcmd, "grep -q '==.*ERROR SUMMARY: [1-9]' %s", logfilename);
-        status = system(grepcmd);
-        if (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            valgrinderr = 1;
-        }
-    }
-
-    /* Get an exclusive lock so logs don't get mixed together */
-    int loglockfd = open("log.lock", O_RDWR|O_CREAT, 0600);
-    if (loglockfd != -1) 
-       flock(loglockfd, LOCK_EX);
-
-    /* Copy the temporary file to stdout, line by line, prepending error status if needed */
-    while (fgets(buf, MYBUFLEN, logfp)) {
-        if (valgrinderr || !WIFEXITED(waitresult) || (WEXITSTATUS(waitresult) != 0)) {
-            printf("]] ");
-        }
-        fputs(buf, stdout);
-    }
-    fclose(logfp);
-
-    remove(logfilename);
+    valgrinderr = scan.vgerrors > 0;
+    failed = valgrinderr || !WIFEXITED(waitresult) || (WEXITSTATUS(waitresult) != 0);
 
     /* Report status to stdout in a way that's easy to grep */
     buf[0] = 0;
@@ -198,16 +334,43 @@ int main(int argc, char **argv)
         strcat(buf, " ");
     }
     if (!WIFEXITED(waitresult))
-        printf("]] alarum: fail: terminated abnormally, command '%s'\n", buf);
+        sprintf(status, "]] alarum: fail: terminated abnormally, command '%s'\n", buf);
     else if (WEXITSTATUS(waitresult) != 0)
-        printf("]] alarum: fail: exit status %d, command '%s'\n", WEXITSTATUS(waitresult), buf);
+        sprintf(status, "]] alarum: fail: exit status %d, command '%s'\n", WEXITSTATUS(waitresult), buf);
     else if (valgrinderr)
-        printf("]] alarum: fail: valgrind errors, command '%s'\n", buf);
+        sprintf(status, "]] alarum: fail: valgrind errors, command '%s'\n", buf);
     else
-        printf("alarum: elapsed time %d seconds, command '%s'\n", (int) (t1 - t0), buf);
+        sprintf(status, "alarum: elapsed time %d seconds, cpu %.2f seconds, max rss %ld KB, io %lld KB, command '%s'\n",
+                (int) (t1 - t0), usage.cpu, usage.maxrss, usage.io / 1024, buf);
+    sprintf(summary, "alarum: summary status=%s exit=%d signal=%d timeout=%d elapsed=%d cpu=%.2f maxrss=%ld io=%lld"
+            " vgerrors=%lld vgerrorlines=%d vgleakbytes=%lld vgleakblocks=%lld command='%s'\n",
+            failed ? "fail" : "ok",
+            WIFEXITED(waitresult) ? WEXITSTATUS(waitresult) : 0,
+            WIFSIGNALED(waitresult) ? WTERMSIG(waitresult) : 0,
+            timedout, (int) (t1 - t0), usage.cpu, usage.maxrss, usage.io / 1024,
+            scan.vgerrors, scan.vgerrorlines, scan.vgleakbytes, scan.vgleakblocks, buf);
 
-    if (loglockfd != -1) 
-       flock(loglockfd, LOCK_UN);
+    /* Prepend error status to each line if needed, or else write the
+     * log as it is, then the status lines */
+    iov = scan.iov;
+    niov = scan.niov;
+    if (failed) {
+        for (i = 0; i < niov; i += 2)
+            iov[i].iov_len = 3;
+    } else {
+        iov[0].iov_base = data;
+        iov[0].iov_len = len;
+        niov = 1;
+    }
+    iov[niov].iov_base = status;
+    iov[niov++].iov_len = strlen(status);
+    iov[niov].iov_base = summary;
+    iov[niov++].iov_len = strlen(summary);
+
+    fflush(stdout);
+    writeLog(iov, niov);
+    free(iov);
+    logFree(&log);
 
     /* Finally, exit with test program's exit code, or 99 if crashed, or 98 if valgrind error */
     if (!WIFEXITED(waitresult))
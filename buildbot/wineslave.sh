@@ -330,7 +330,7 @@ start_slave() {
     rm -f $TOP/sandbox/bin/*.patch
     cp $SRC/*-ignore-*.patch $TOP/sandbox/bin
     cp $SRC/*-placate-*.patch $TOP/sandbox/bin
-    gcc $SRC/alarum.c -o $TOP/sandbox/bin/alarum
+    gcc $SRC/alarum.c $SRC/../patchwatcher/alarmlib.c -o $TOP/sandbox/bin/alarum
 
     buildslave start $VIRTUAL_ENV/slave
     )
@@ -15,7 +15,7 @@
  * If the test crashes, prints the message
  *  alarm: Terminated abnormally.
  *
- * 2. If the test's name is not on the whitelist (see below),
+ * 2. If the test may touch the video mode (see resources below),
  * compares the screens graphics mode before and after the test.
  * If they are not identical, prints the message
  *  alarm: video mode changed!  Was %d, now %d.
@@ -24,46 +24,82 @@
  *
  * If the test is being run inside "make -jN":
  *
- * 3. The test's stdout and stderr are saved to a temporary file,
- * and when the test is done, the test ID the
- * temporary file's contents are output all at once.
+ * 3. The test's stdout and stderr are captured through a pipe into
+ * memory (past a few megabytes, into an unlinked temporary file),
+ * and when the test is done, the test ID and the output are output
+ * all at once.  A collector process started by the first test to finish
+ * writes them, so that tests finishing together do not wait for each
+ * other; see writeLog() in alarmlib.c.
  * This helps prevent interdigitating of results from tests being 
  * run in parallel.
  *
- * 4. If the test's name is not in the whitelist,
- * takes an exclusive lock on the file "alarm.lock" while the test executes.  
- * This helps prevent spurious test failures due to tests being
- * run in parallel.
+ * 4. Takes an exclusive lock on each resource the test needs to itself
+ * while it executes, so tests that need the same resource run one at
+ * a time while the others run alongside them.  The resources are
+ *  display    windows, focus and clipboard of the X display
+ *  cursor     the location of the cursor, events sent via the cursor
+ *  port       fixed port numbers
+ *  videomode  the screen's video mode
+ * and each has a lock file $ALARM_LOCKDIR/alarm-UID.RESOURCE.lock
+ * ($ALARM_LOCKDIR defaults to /tmp), shared by all tests of the run
+ * whatever directory they run in.  The display, cursor and videomode
+ * belong to an X display, so their lock files are named
+ * alarm-UID.RESOURCE-DISPLAY.lock after $DISPLAY, and runs on different
+ * displays do not wait for each other.  Locks are taken in the order above,
+ * so tests cannot deadlock waiting for each other.  How long the test
+ * waited for each lock is logged as
+ *  alarm: resource wait display=0.00s videomode=12.34s
+ * which shows where the run loses its parallelism.
+ *
+ * 5. The test runs in a process group of its own, and in a cgroup of
+ * its own when the cgroup v2 hierarchy is writable by us, so a timeout,
+ * or a SIGINT, SIGTERM or SIGHUP sent to us, kills everything the test
+ * started, not just the test.  The exception is a wineserver the test
+ * started, which leaves the process group with setsid() and which the
+ * tests after it share: it is moved out of the cgroup and left running.
+ * What the test used is logged as
+ *  alarm: usage cpu 1.23 seconds, max rss 4567 KB, io 89 KB
+ * counting everything in the cgroup, or else the test and the children
+ * it waited for.
  *
- * The whitelist referred to above is a list of tests known to
- * run well in parallel, e.g. that don't do any of the following things:
- *  mess with the screen's video mode
- *  depend on the location of the cursor
- *  send events via the cursor
- *  bind to a fixed port number
+ * The whitelist below is a list of tests known to run well in parallel,
+ * needing none of the resources.  The resource table below it declares
+ * what other tests need, by test ID or by module; tests on neither list
+ * are assumed to need all resources, so they run one at a time.
  *
  * Copyright 2008, Google (Dan Kegel)
  * License: LGPL
  */
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
-pid_t child_pid;
+#include "alarmlib.h"
+
+const char alarm_name[] = "alarm";
+
+int timedout;
 
 static void handler(int x)
 {
     fprintf(stderr, "alarm: Timeout!  Killing child.\n");
-    /* TODO: This probably won't kill grandchildren.  Do we want to create a process group? */
-    kill(child_pid, SIGKILL);
-    exit(1);
+    killChild();
+    timedout = 1;
 }
 
 /* a real implementation would not have a limit on commandline length */
@@ -336,6 +372,152 @@ static int inWhitelist(const char *testid)
          sizeof(whitelist[0]), (compar)mystrcmp) != NULL;
 }
 
+/* Resources a test may need to itself; locked in this order */
+enum { RES_DISPLAY, RES_CURSOR, RES_PORT, RES_VIDEOMODE, NRES };
+#define DISPLAY   (1 << RES_DISPLAY)
+#define CURSOR    (1 << RES_CURSOR)
+#define PORT      (1 << RES_PORT)
+#define VIDEOMODE (1 << RES_VIDEOMODE)
+#define ALLRES    ((1 << NRES) - 1)
+/* the resources that belong to an X display, rather than the machine */
+#define PERDISPLAY (DISPLAY | CURSOR | VIDEOMODE)
+
+static const char *resource_names[NRES] = {
+    "display", "cursor", "port", "videomode"
+};
+
+/*
+ * Resources needed by tests that are not on the whitelist.  An entry
+ * ending in ':' covers all tests of its module that have no entry of
+ * their own.  A test that fails only when run alongside others gets an
+ * entry naming what it clashed over; one missing here is not wrong,
+ * just slow, as it gets all resources.
+ */
+static const struct {
+    const char *testid;
+    int resources;
+} resource_table[] = {
+    { "comctl32:",          DISPLAY },
+    { "comdlg32:",          DISPLAY },
+    { "d3d8:",              DISPLAY|VIDEOMODE },
+    { "d3d9:",              DISPLAY|VIDEOMODE },
+    { "ddraw:",             DISPLAY|VIDEOMODE },
+    { "dinput:",            DISPLAY|CURSOR },
+    { "dinput8:",           DISPLAY|CURSOR },
+    { "dxgi:",              DISPLAY|VIDEOMODE },
+    { "gdi32:",             DISPLAY },
+    { "gdiplus:",           DISPLAY },
+    { "imm32:",             DISPLAY },
+    { "mshtml:",            DISPLAY|PORT },
+    { "ole32:",             DISPLAY },
+    { "oleaut32:",          DISPLAY },
+    { "opengl32:",          DISPLAY|VIDEOMODE },
+    { "riched20:",          DISPLAY|CURSOR },
+    { "riched32:",          DISPLAY|CURSOR },
+    { "rpcrt4:",            PORT },
+    { "shdocvw:",           DISPLAY|PORT },
+    { "shell32:",           DISPLAY },
+    { "urlmon:",            PORT },
+    { "user32:",            DISPLAY|CURSOR },
+    { "user32:monitor",     DISPLAY|VIDEOMODE },
+    { "user32:sysparams",   DISPLAY|CURSOR|VIDEOMODE },
+    { "wininet:",           PORT },
+    { "winhttp:",           PORT },
+    { "winmm:",             DISPLAY },
+    { "ws2_32:",            PORT },
+};
+static const size_t resource_table_len = sizeof(resource_table) / sizeof(resource_table[0]);
+
+/* Return the resources the given test needs to itself */
+static int getResources(const char *testid)
+{
+    const char *colon = strchr(testid, ':');
+    size_t i;
+    int resources = -1;
+
+    if (inWhitelist(testid))
+        return 0;
+    for (i = 0; i < resource_table_len; i++) {
+        const char *entry = resource_table[i].testid;
+        size_t len = strlen(entry);
+
+        if (!strcmp(entry, testid))
+            return resource_table[i].resources;
+        if (colon && entry[len-1] == ':' && len == (size_t)(colon - testid + 1)
+            && !strncmp(entry, testid, len))
+            resources = resource_table[i].resources;
+    }
+    return resources == -1 ? ALLRES : resources;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Lock the given resources, in order, and put a report of how long
+ * each took in buf.  Return the length of the report, or 0 if no
+ * resource was needed. */
+static int lockResources(int resources, int lockfds[NRES], char *buf)
+{
+    const char *lockdir = getenv("ALARM_LOCKDIR");
+    const char *display = getenv("DISPLAY");
+    char lockfilename[1024];
+    char displayname[256];
+    char *p;
+    double t0;
+    int n = 0;
+    int r;
+
+    if (!lockdir || !*lockdir)
+        lockdir = "/tmp";
+    /* ":0" and ":0.1" are the same display; a path as in macOS's
+     * DISPLAY would make directories */
+    snprintf(displayname, sizeof(displayname), "%s", display ? display : "");
+    p = strrchr(displayname, ':');
+    if (p && (p = strchr(p, '.')) != NULL)
+        *p = 0;
+    for (p = displayname; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    for (r = 0; r < NRES; r++) {
+        lockfds[r] = -1;
+        if (!(resources & (1 << r)))
+            continue;
+        if (n == 0)
+            n = sprintf(buf, "alarm: resource wait");
+
+        if (((1 << r) & PERDISPLAY) && displayname[0])
+            snprintf(lockfilename, sizeof(lockfilename), "%s/alarm-%d.%s-%s.lock",
+                     lockdir, (int) getuid(), resource_names[r], displayname);
+        else
+            snprintf(lockfilename, sizeof(lockfilename), "%s/alarm-%d.%s.lock",
+                     lockdir, (int) getuid(), resource_names[r]);
+        t0 = now();
+        lockfds[r] = open(lockfilename, O_RDWR|O_CREAT, 0600);
+        if (lockfds[r] != -1)
+            while (flock(lockfds[r], LOCK_EX) == -1 && errno == EINTR)
+                ;
+        n += sprintf(buf + n, " %s=%.2fs", resource_names[r], now() - t0);
+    }
+    if (n)
+        n += sprintf(buf + n, "\n");
+    return n;
+}
+
+static void unlockResources(int lockfds[NRES])
+{
+    int r;
+
+    for (r = NRES - 1; r >= 0; r--)
+        if (lockfds[r] != -1) {
+            flock(lockfds[r], LOCK_UN);
+            close(lockfds[r]);
+        }
+}
+
 static int isParallelRun(void)
 {
     char *makeflags = getenv("MAKEFLAGS");
@@ -371,10 +553,23 @@ int main(int argc, char **argv)
     int waitresult;
     int ret;
     char testid[64];
-    int lockfd, logfd;
-    char logfilename[1024];
-    int notWhitelisted;
+    int lockfds[NRES], logfd;
+    int pipefds[2];
+    sigset_t sigchld;
+    int sigfd;
+    struct log log;
+    char *data;
+    size_t len;
+    struct iovec iov[3];
+    char header[128];
+    char waitreport[256];
+    int waitreportlen;
+    int resources;
     int origVideoMode;
+    struct rusage ru;
+    struct usage usage;
+    char usagereport[256];
+    int usagereportlen;
 
     if (argc < 3) {
         fprintf(stderr, "Usage: alarm timeout-in-seconds command ...\n");
@@ -390,106 +585,132 @@ int main(int argc, char **argv)
     for (newargc=0; newargc < argc-2 && newargc < MAXARGS-1; newargc++)
         newargv[newargc] = argv[newargc+2];
     newargv[newargc] = NULL;
-    notWhitelisted = getTestID(newargc,newargv,testid) && !inWhitelist(testid);
+    resources = getTestID(newargc,newargv,testid) ? getResources(testid) : 0;
 
-    origVideoMode = 0;
-    if (notWhitelisted)
-        origVideoMode = getVideoMode();
-
-    lockfd = -1;
     logfd = -1;
+    for (i = 0; i < NRES; i++)
+        lockfds[i] = -1;
     if (isParallelRun()) {
-        /* Get an exclusive lock, if needed */
-        if (notWhitelisted) {
-            lockfd = open("alarm.lock", O_RDWR|O_CREAT, 0600);
-            if (lockfd != -1) 
-               flock(lockfd, LOCK_EX);
-        }
+        /* Get exclusive locks on the resources needed */
+        waitreportlen = lockResources(resources, lockfds, waitreport);
 
-	/* Redirect child's output and stderr to a temporary file ... */
-	sprintf(logfilename, "%s.tmplog", testid);
-        logfd = open(logfilename, O_RDWR|O_CREAT, 0660);
+	/* Redirect child's output and stderr to a pipe ... */
+        if (pipe(pipefds) == 0)
+            logfd = pipefds[0];
     }
+    logInit(&log);
+    if (logfd != -1 && waitreportlen)
+        logAppend(&log, waitreport, waitreportlen);
+
+    /* Only check the video mode while nobody else may change it */
+    origVideoMode = 0;
+    if (resources & VIDEOMODE)
+        origVideoMode = getVideoMode();
 
     /* Run test */
+    createCgroup();
+    /* The child's exit is read from sigfd while its output is read */
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, NULL);
+    sigfd = signalfd(-1, &sigchld, SFD_CLOEXEC);
     child_pid = fork();
     if (child_pid == 0) {
         /* child */
+        sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
         if (logfd > -1) {
 	    /* Finish redirecting */
-            dup2(logfd, 1);
-            dup2(logfd, 2);
+            dup2(pipefds[1], 1);
+            dup2(pipefds[1], 2);
+            close(pipefds[0]);
+            close(pipefds[1]);
         }
-        /* TODO: Do we want to make this its own process group for ease of killing grandchildren? */
+        enterCgroup();
         execvp(newargv[0], newargv);
         /* notreached */
         perror(newargv[0]);
         exit(1);
     }
 
-    /* Wait timeout seconds for it to finish */
+    /* so the timeout can kill the group even before the child is in it */
+    setpgid(child_pid, child_pid);
+
+    /* Wait timeout seconds for it to finish, keeping its output */
     signal(SIGALRM, handler);
+    catchInterrupts();
     alarm(timeout);
+    if (logfd != -1) {
+        close(pipefds[1]);
+        readOutput(logfd, sigfd, &log);
+    }
+    if (sigfd != -1)
+        close(sigfd);
+    sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
     waitresult = 0;
-    while ((ret = wait(&waitresult)) == -1 && errno == EINTR)
+    memset(&ru, 0, sizeof(ru));
+    while ((ret = wait4(child_pid, &waitresult, 0, &ru)) == -1 && errno == EINTR)
         ;
-
-    if (logfd != -1 && lseek(logfd, 0, SEEK_CUR) != 0) {
-#define MYBUFLEN 128000
-	static char buf[MYBUFLEN];
-	int n;
-
-        /* Get an exclusive lock so logs don't get mixed together */
-	int loglockfd = open("log.lock", O_RDWR|O_CREAT, 0600);
-	if (loglockfd != -1) 
-	   flock(loglockfd, LOCK_EX);
-
+    alarm(0);
+    if ((timedout || interrupted) && cgroup_dir[0])
+        killCgroup();
+    getUsage(&ru, &usage);
+    removeCgroup();
+    exitIfInterrupted();
+
+    /* Log what the test used, after its output */
+    usagereportlen = sprintf(usagereport,
+        "alarm: usage cpu %.2f seconds, max rss %ld KB, io %lld KB\n",
+        usage.cpu, usage.maxrss, usage.io / 1024);
+    if (logfd != -1)
+        logAppend(&log, usagereport, usagereportlen);
+    else
+        fputs(usagereport, stdout);
+
+    if (logfd != -1) {
         /* Print the test id, so log postprocessors
          * know what test this log is for.
          * (In non-parallel runs, make outputs the command nicely,
          * but in parallel runs, that's too far back, some other
          * test's commandline might have been printed in the meantime.)
+         * Then the log, all in one piece.
          */
-        n = sprintf(buf, "alarm: runtest %s log:\n", testid);
-        write(1, buf, n);
-
-	/* Copy the temporary file to stdout */
-        lseek(logfd, 0, SEEK_SET);
-	while ((n = read(logfd, buf, MYBUFLEN)) > 0)
-	    write(1, buf, n);
-	close(logfd);
-
-	remove(logfilename);
-
-        n = sprintf(buf, "alarm: log end\n");
-        write(1, buf, n);
-
-	if (loglockfd != -1) 
-	   flock(loglockfd, LOCK_UN);
-    }
-
-    /* Release exclusive lock, if taken */
-    if (lockfd != -1)
-        flock(lockfd, LOCK_UN);
-
-    /* Report crashes */
-    if (!WIFEXITED(waitresult)) {
-        printf("alarm: Terminated abnormally\n");
-        exit(99);
+        data = logData(&log, &len);
+        iov[0].iov_base = header;
+        iov[0].iov_len = sprintf(header, "alarm: runtest %s log:\n", testid);
+        iov[1].iov_base = data;
+        iov[1].iov_len = len;
+        iov[2].iov_base = "alarm: log end\n";
+        iov[2].iov_len = strlen(iov[2].iov_base);
+        fflush(stdout);
+        writeLog(iov, 3);
     }
+    logFree(&log);
 
     /* Verify video mode was restored */
-    if (notWhitelisted) {
+    if (resources & VIDEOMODE) {
         int videoMode = getVideoMode();
         if (videoMode != origVideoMode) {
 	    printf("alarm: video mode changed! was %d, now %d\n",
                    origVideoMode, videoMode);
             /* and restore */
             system("xrandr -s 0");
+            unlockResources(lockfds);
             exit(1);
         }
     }
 
+    /* Release exclusive locks, if taken */
+    unlockResources(lockfds);
+
+    if (timedout)
+        exit(1);
+
+    /* Report crashes */
+    if (!WIFEXITED(waitresult)) {
+        printf("alarm: Terminated abnormally\n");
+        exit(99);
+    }
+
     /* Finally, exit with test program's exit code */
     return WEXITSTATUS(waitresult);
 }
@@ -0,0 +1,722 @@
+/* What alarm and buildbot/alarum share: running the test in a cgroup of
+ * its own, measuring what it used, and capturing its output and writing
+ * it out whole through a collector process.  See the comment at the top
+ * of alarm.c.
+ *
+ * Copyright 2008, Google (Dan Kegel)
+ * License: LGPL
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "alarmlib.h"
+
+pid_t child_pid;
+
+/* The cgroup the child runs in, or "" if it has none, and the one we
+ * were started in */
+char cgroup_dir[1040];
+static char parent_cgroup_dir[1024];
+
+/* Make a cgroup for the child below our own, if we can */
+void createCgroup(void)
+{
+    char line[1024];
+    char procs[1100];
+    const char *root;
+    FILE *fp;
+    size_t len;
+
+    cgroup_dir[0] = 0;
+    /* hybrid systems mount cgroup v2 below the v1 controllers */
+    root = "/sys/fs/cgroup";
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK))
+        root = "/sys/fs/cgroup/unified";
+    fp = fopen("/proc/self/cgroup", "r");
+    if (!fp)
+        return;
+    parent_cgroup_dir[0] = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        /* the cgroup v2 hierarchy is the one with id 0 */
+        if (strncmp(line, "0::", 3))
+            continue;
+        len = strlen(line);
+        if (len && line[len-1] == '\n')
+            line[len-1] = 0;
+        /* a path too long for us is as good as none */
+        if (snprintf(parent_cgroup_dir, sizeof(parent_cgroup_dir), "%s%s",
+                     root, line + 3) >= (int) sizeof(parent_cgroup_dir))
+            parent_cgroup_dir[0] = 0;
+    }
+    fclose(fp);
+
+    /* moving processes needs write access to the common parent */
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", parent_cgroup_dir);
+    if (!parent_cgroup_dir[0] || access(procs, W_OK))
+        return;
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "%s/%s-%d",
+             parent_cgroup_dir, alarm_name, (int) getpid());
+    if (mkdir(cgroup_dir, 0755) == -1) {
+        cgroup_dir[0] = 0;
+        return;
+    }
+}
+
+/* Called in the child: leave our process group and cgroup for the
+ * child's own */
+void enterCgroup(void)
+{
+    char procs[1100];
+    int fd;
+
+    setpgid(0, 0);
+    if (!cgroup_dir[0])
+        return;
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", cgroup_dir);
+    fd = open(procs, O_WRONLY);
+    if (fd != -1) {
+        write(fd, "0\n", 2);
+        close(fd);
+    }
+}
+
+/* Kill the child and its process group.  Safe in a signal handler.
+ * What left the group is killed by killCgroup() once the child is gone. */
+void killChild(void)
+{
+    kill(-child_pid, SIGKILL);
+    kill(child_pid, SIGKILL);
+}
+
+/* The signal that interrupted us, or 0 */
+volatile sig_atomic_t interrupted;
+
+static void interruptHandler(int sig)
+{
+    killChild();
+    interrupted = sig;
+}
+
+/* Ctrl-C or a killed make does not reach the test in its process group
+ * of its own, so kill the test and everything it started ourselves.
+ * Call once the child is forked, as killChild() needs its pid. */
+void catchInterrupts(void)
+{
+    signal(SIGINT, interruptHandler);
+    signal(SIGTERM, interruptHandler);
+    signal(SIGHUP, interruptHandler);
+}
+
+/* Once the test is cleaned up, die of the signal that interrupted us,
+ * so whoever sent it sees it worked */
+void exitIfInterrupted(void)
+{
+    if (!interrupted)
+        return;
+    signal(interrupted, SIG_DFL);
+    raise(interrupted);
+    _exit(128 + interrupted);
+}
+
+/* Read the pids in the child's cgroup into pids[]; return how many */
+static int readCgroupProcs(pid_t *pids, int maxpids)
+{
+    char procs[1100];
+    FILE *fp;
+    int n = 0;
+    int pid;
+
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", cgroup_dir);
+    fp = fopen(procs, "r");
+    if (!fp)
+        return 0;
+    while (n < maxpids && fscanf(fp, "%d", &pid) == 1)
+        pids[n++] = pid;
+    fclose(fp);
+    return n;
+}
+
+/* Move pids[0..n-1] to the cgroup we were started in; return 0 if one
+ * of them could not be moved */
+static int moveToParent(const pid_t *pids, int n)
+{
+    char procs[1100];
+    char buf[32];
+    int fd, i, len;
+
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", parent_cgroup_dir);
+    fd = open(procs, O_WRONLY);
+    if (fd == -1)
+        return 0;
+    for (i = 0; i < n; i++) {
+        len = sprintf(buf, "%d\n", (int) pids[i]);
+        /* ESRCH only means it exited in the meantime */
+        if (write(fd, buf, len) != len && errno != ESRCH)
+            break;
+    }
+    close(fd);
+    return i == n;
+}
+
+static int isWineserver(pid_t pid)
+{
+    char path[64];
+    char comm[32];
+    int fd, len;
+
+    sprintf(path, "/proc/%d/comm", (int) pid);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    len = read(fd, comm, sizeof(comm) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    comm[len] = 0;
+    /* wineserver, or wineserver64 where both are installed */
+    return strncmp(comm, "wineserver", 10) == 0;
+}
+
+/* Kill what is left in the child's cgroup, except a wineserver the test
+ * started: the tests after it share that, so it goes back to our cgroup
+ * to serve them, as removeCgroup() would have moved it anyway. */
+void killCgroup(void)
+{
+    pid_t pids[256], spared[256];
+    char path[1100];
+    int tries, fd, i, n, nspared;
+
+    if (!cgroup_dir[0])
+        return;
+    snprintf(path, sizeof(path), "%s/cgroup.kill", cgroup_dir);
+    for (tries = 0; tries < 10; tries++) {
+        n = readCgroupProcs(pids, 256);
+        if (n == 0)
+            return;
+        for (i = nspared = 0; i < n; i++) {
+            if (isWineserver(pids[i])) {
+                spared[nspared++] = pids[i];
+                pids[i] = 0;
+            }
+        }
+        moveToParent(spared, nspared);
+        /* all at once, so nothing forks away, where the kernel can */
+        fd = open(path, O_WRONLY);
+        if (fd != -1) {
+            write(fd, "1", 1);
+            close(fd);
+        }
+        for (i = 0; i < n; i++)
+            if (pids[i])
+                kill(pids[i], SIGKILL);
+        usleep(10000);
+    }
+}
+
+/* Move what the test left running back to our cgroup, and remove the
+ * child's.  Processes that fork while they are moved take more rounds,
+ * as many as killCgroup() allows; a process that cannot be moved leaves
+ * the cgroup behind. */
+void removeCgroup(void)
+{
+    pid_t pids[256];
+    int tries, n;
+
+    if (!cgroup_dir[0])
+        return;
+    for (tries = 0; tries < 10; tries++) {
+        n = readCgroupProcs(pids, 256);
+        if (n == 0 || !moveToParent(pids, n))
+            break;
+    }
+    rmdir(cgroup_dir);
+}
+
+/* Get the usage of the child from its cgroup where it has the numbers,
+ * else from what wait4() said */
+void getUsage(const struct rusage *ru, struct usage *u)
+{
+    char path[1100];
+    char line[256];
+    FILE *fp;
+    long long n, r, w;
+    char *p;
+
+    u->cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+           + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    u->maxrss = ru->ru_maxrss;
+    u->io = (long long) (ru->ru_inblock + ru->ru_oublock) * 512;
+    if (!cgroup_dir[0])
+        return;
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", cgroup_dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp))
+            if (sscanf(line, "usage_usec %lld", &n) == 1)
+                u->cpu = n / 1e6;
+        fclose(fp);
+    }
+
+    /* only there if the memory and io controllers are enabled for us */
+    snprintf(path, sizeof(path), "%s/memory.peak", cgroup_dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        if (fscanf(fp, "%lld", &n) == 1)
+            u->maxrss = (long) (n / 1024);
+        fclose(fp);
+    }
+    snprintf(path, sizeof(path), "%s/io.stat", cgroup_dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        r = w = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            if ((p = strstr(line, "rbytes=")) != NULL)
+                r += atoll(p + 7);
+            if ((p = strstr(line, "wbytes=")) != NULL)
+                w += atoll(p + 7);
+        }
+        u->io = r + w;
+        fclose(fp);
+    }
+}
+
+/* The test's output is read from a pipe into memory.  Only output past
+ * LOG_SPILL bytes goes to disk, into an unlinked temporary file, so the
+ * usual small log never touches the filesystem. */
+void logInit(struct log *log)
+{
+    memset(log, 0, sizeof(*log));
+    log->spillfd = -1;
+}
+
+/* Move the buffered output to the spill file; return 0 on failure */
+static int logSpill(struct log *log)
+{
+    char name[1024];
+    const char *dir;
+    ssize_t n;
+    size_t done;
+
+    if (log->spillfd == -1) {
+        dir = getenv("TMPDIR");
+        snprintf(name, sizeof(name), "%s/%s-XXXXXX",
+                 dir ? dir : "/tmp", alarm_name);
+        log->spillfd = mkstemp(name);
+        if (log->spillfd == -1)
+            return 0;
+        unlink(name);
+    }
+    for (done = 0; done < log->len; done += n) {
+        n = write(log->spillfd, log->buf + done, log->len - done);
+        if (n == -1 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            break;
+    }
+    /* keep only what did not make it, so a retry goes on from there */
+    log->spilled += done;
+    log->len -= done;
+    memmove(log->buf, log->buf + done, log->len);
+    return log->len == 0;
+}
+
+/* Append len bytes to the log; return 0 if out of memory */
+int logAppend(struct log *log, const char *data, size_t len)
+{
+    size_t max;
+    char *buf;
+
+    /* if the spill fails, keep it all in memory */
+    if (log->len && log->len + len > LOG_SPILL)
+        logSpill(log);
+    if (log->len + len > log->max) {
+        max = log->max ? log->max : 65536;
+        while (max < log->len + len)
+            max *= 2;
+        buf = realloc(log->buf, max);
+        if (!buf)
+            return 0;
+        log->buf = buf;
+        log->max = max;
+    }
+    memcpy(log->buf + log->len, data, len);
+    log->len += len;
+    return 1;
+}
+
+/* Return the whole log as one block of memory, mapping the spilled part
+ * back in; *lenp gets its length */
+char *logData(struct log *log, size_t *lenp)
+{
+    void *map;
+
+    *lenp = log->len;
+    if (log->spillfd == -1)
+        return log->buf;
+    if (!logSpill(log)) {
+        perror("spilling log");
+        return log->buf;
+    }
+    map = mmap(NULL, log->spilled, PROT_READ, MAP_PRIVATE, log->spillfd, 0);
+    if (map == MAP_FAILED) {
+        perror("mapping log");
+        *lenp = 0;
+        return log->buf;
+    }
+    log->map = map;
+    *lenp = log->spilled;
+    return log->map;
+}
+
+void logFree(struct log *log)
+{
+    if (log->map)
+        munmap(log->map, log->spilled);
+    if (log->spillfd != -1)
+        close(log->spillfd);
+    free(log->buf);
+    logInit(log);
+}
+
+/* Whether the child has exited, leaving it to be waited for */
+static int childExited(void)
+{
+    siginfo_t info;
+
+    info.si_pid = 0;
+    return waitid(P_PID, child_pid, &info, WEXITED|WNOHANG|WNOWAIT) == 0 &&
+           info.si_pid != 0;
+}
+
+/* Read the child's output from fd into log until the child exits, then
+ * whatever it left in the pipe.  Processes the test started, such as
+ * wineserver, may hold the pipe open long after, so the end of the pipe
+ * cannot be waited for.  sigfd is a signalfd for SIGCHLD, or -1 if there
+ * is none, in which case the child is looked for every second. */
+void readOutput(int fd, int sigfd, struct log *log)
+{
+    static char chunk[65536];
+    struct signalfd_siginfo si;
+    struct pollfd pfds[2];
+    ssize_t n;
+
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sigfd;
+    pfds[1].events = POLLIN;
+    for (;;) {
+        pfds[0].revents = pfds[1].revents = 0;
+        n = poll(pfds, sigfd != -1 ? 2 : 1, sigfd != -1 ? -1 : 1000);
+        if (n == -1 && errno != EINTR)
+            break;
+        if (pfds[0].revents) {
+            n = read(fd, chunk, sizeof(chunk));
+            if (n > 0)
+                logAppend(log, chunk, n);
+            else if (n == 0 || errno != EINTR)
+                break;
+            if (n > 0 && !pfds[1].revents)
+                continue;
+        }
+        /* SIGCHLD, SIGALRM or a second without output */
+        if (pfds[1].revents)
+            read(sigfd, &si, sizeof(si));
+        if (childExited())
+            break;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        logAppend(log, chunk, n);
+    close(fd);
+}
+
+/* writev() all of iov[0..n-1] to fd, however many calls it takes */
+static int writeAll(int fd, struct iovec *iov, int n)
+{
+    ssize_t done;
+
+    while (n > 0) {
+        done = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+        if (done == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && done >= (ssize_t) iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/* Finished tests hand their logs to a collector process, which writes
+ * each one whole to stdout as it arrives, so that tests don't queue up
+ * behind each other's output on a lock.  The collector listens on a Unix
+ * socket named after the device and inode of stdout, so each run gets
+ * its own, in the lock directory.  The first test to find none starts
+ * it, and it exits as soon as no log is on its way; clients that stall
+ * for COLLECTOR_IDLE seconds are dropped and write their own.  If all
+ * else fails, a lock on log.lock keeps the logs apart as before.
+ */
+#define COLLECTOR_IDLE 5
+#define COLLECTOR_CLIENTS 64
+
+/* Put the name of the collector's socket, or of the lock guarding its
+ * start, in buf; return 0 if it would be too long */
+static int collectorPath(char *buf, size_t len, const char *suffix)
+{
+    const char *lockdir = getenv("ALARM_LOCKDIR");
+    struct sockaddr_un sun;
+    struct stat st;
+
+    if (!lockdir || !*lockdir)
+        lockdir = "/tmp";
+    if (fstat(1, &st) == -1)
+        return 0;
+    return snprintf(buf, len, "%s/%s-%d.log-%lx-%lx.%s", lockdir,
+                    alarm_name, (int) getuid(), (unsigned long) st.st_dev,
+                    (unsigned long) st.st_ino, suffix) < (int) sizeof(sun.sun_path);
+}
+
+static int connectCollector(const char *sockpath)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, sockpath);
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serve clients on listenfd until idle.  Runs in its own process. */
+static void runCollector(int listenfd, const char *sockpath, const char *lockpath)
+{
+    struct stat st, ours;
+    struct pollfd pfds[COLLECTOR_CLIENTS + 1];
+    struct log logs[COLLECTOR_CLIENTS];
+    static char chunk[65536];
+    struct iovec iov;
+    int nclients = 0;
+    int closing = 0;
+    int lockfd = -1;
+    int fd, i, n;
+    long maxfd;
+    size_t len;
+
+    /* keep only stdout and the socket; nobody reads our stderr */
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    alarm(0);
+    setsid();
+    chdir("/");
+    fd = open("/dev/null", O_RDWR);
+    if (fd != -1) {
+        dup2(fd, 0);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+    maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd == -1)
+        maxfd = 1024;
+    for (fd = 3; fd < maxfd; fd++)
+        if (fd != listenfd)
+            close(fd);
+    fcntl(listenfd, F_SETFL, O_NONBLOCK);
+    if (stat(sockpath, &ours) == -1)
+        memset(&ours, 0, sizeof(ours));
+    pfds[0].fd = listenfd;
+    pfds[0].events = POLLIN;
+
+    for (;;) {
+        /* pfds[1..nclients] are the clients, logs[] their logs so far */
+        pfds[0].events = nclients < COLLECTOR_CLIENTS ? POLLIN : 0;
+        n = poll(pfds, nclients + 1, closing && !nclients ? 0 : COLLECTOR_IDLE * 1000);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (closing && !nclients)
+                break;
+            /* Nobody came, or the clients stalled: drop them, they will
+             * write their logs themselves */
+            for (i = 0; i < nclients; i++) {
+                close(pfds[i + 1].fd);
+                logFree(&logs[i]);
+            }
+            nclients = 0;
+            pfds[0].revents = 0;
+        }
+
+        for (i = nclients - 1; i >= 0; i--) {
+            if (!pfds[i + 1].revents)
+                continue;
+            n = read(pfds[i + 1].fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                logAppend(&logs[i], chunk, n);
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            /* The whole log is in: write it, and only then tell the
+             * client, whose exit may be taken to mean its log is out */
+            if (n == 0) {
+                iov.iov_base = logData(&logs[i], &len);
+                iov.iov_len = len;
+                if (writeAll(1, &iov, 1) == 0)
+                    write(pfds[i + 1].fd, "1", 1);
+            }
+            close(pfds[i + 1].fd);
+            logFree(&logs[i]);
+            nclients--;
+            pfds[i + 1] = pfds[nclients + 1];
+            logs[i] = logs[nclients];
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            while (nclients < COLLECTOR_CLIENTS &&
+                   (fd = accept(listenfd, NULL, NULL)) != -1) {
+                pfds[nclients + 1].fd = fd;
+                pfds[nclients + 1].events = POLLIN;
+                pfds[nclients + 1].revents = 0;
+                logInit(&logs[nclients]);
+                nclients++;
+            }
+        }
+
+        if (!closing && !nclients) {
+            /* No log is on its way: take the socket away under the lock,
+             * so a test starts a new collector instead of connecting to
+             * this one, then serve whoever already connected */
+            lockfd = open(lockpath, O_RDWR|O_CREAT, 0600);
+            if (lockfd != -1)
+                flock(lockfd, LOCK_EX);
+            if (stat(sockpath, &st) == 0 && st.st_ino == ours.st_ino &&
+                st.st_dev == ours.st_dev)
+                unlink(sockpath);
+            closing = 1;
+        }
+    }
+    close(listenfd);
+    if (lockfd != -1)
+        close(lockfd);
+}
+
+/* Connect to the collector for our stdout, starting it if there is
+ * none; return -1 if neither works */
+static int startCollector(void)
+{
+    char sockpath[1024], lockpath[1024];
+    struct sockaddr_un sun;
+    int fd, lockfd, listenfd;
+    pid_t pid;
+
+    if (!collectorPath(sockpath, sizeof(sockpath), "sock") ||
+        !collectorPath(lockpath, sizeof(lockpath), "lock"))
+        return -1;
+    fd = connectCollector(sockpath);
+    if (fd != -1)
+        return fd;
+
+    /* Only one test may start it; the others wait, then connect */
+    lockfd = open(lockpath, O_RDWR|O_CREAT, 0600);
+    if (lockfd == -1)
+        return -1;
+    while (flock(lockfd, LOCK_EX) == -1 && errno == EINTR)
+        ;
+    fd = connectCollector(sockpath);
+    if (fd == -1) {
+        unlink(sockpath);
+        listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, sockpath);
+        if (listenfd != -1 &&
+            bind(listenfd, (struct sockaddr *) &sun, sizeof(sun)) == 0 &&
+            listen(listenfd, 128) == 0) {
+            pid = fork();
+            if (pid == 0) {
+                runCollector(listenfd, sockpath, lockpath);
+                _exit(0);
+            }
+            if (pid == -1)
+                unlink(sockpath);
+        }
+        if (listenfd != -1)
+            close(listenfd);
+        fd = connectCollector(sockpath);
+    }
+    flock(lockfd, LOCK_UN);
+    close(lockfd);
+    return fd;
+}
+
+/* Hand the log to the collector; return 0 if it did not take it */
+static int sendLog(const struct iovec *iov, int niov)
+{
+    struct iovec *copy;
+    char ack;
+    int fd, ret = 0;
+
+    fd = startCollector();
+    if (fd == -1)
+        return 0;
+    /* writeAll() uses up the iovecs, and we may need them again */
+    copy = malloc(niov * sizeof(*copy));
+    if (copy) {
+        memcpy(copy, iov, niov * sizeof(*copy));
+        if (writeAll(fd, copy, niov) == 0 && shutdown(fd, SHUT_WR) == 0)
+            while ((ret = read(fd, &ack, 1)) == -1 && errno == EINTR)
+                ;
+        free(copy);
+    }
+    close(fd);
+    return ret == 1;
+}
+
+/* Write the log to stdout without mixing it up with other tests' */
+void writeLog(struct iovec *iov, int niov)
+{
+    int loglockfd;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (sendLog(iov, niov))
+        return;
+
+    /* Get an exclusive lock so logs don't get mixed together */
+    loglockfd = open("log.lock", O_RDWR|O_CREAT, 0600);
+    if (loglockfd != -1)
+        flock(loglockfd, LOCK_EX);
+    writeAll(1, iov, niov);
+    if (loglockfd != -1) {
+        flock(loglockfd, LOCK_UN);
+        close(loglockfd);
+    }
+}
@@ -0,0 +1,62 @@
+/* What alarm and buildbot/alarum share; see alarmlib.c
+ *
+ * Copyright 2008, Google (Dan Kegel)
+ * License: LGPL
+ */
+
+#ifndef ALARMLIB_H
+#define ALARMLIB_H
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+/* Defined by each tool: names its cgroups, spill files and collector */
+extern const char alarm_name[];
+
+extern pid_t child_pid;
+extern char cgroup_dir[1040];
+
+void createCgroup(void);
+void enterCgroup(void);
+void killChild(void);
+void killCgroup(void);
+void removeCgroup(void);
+
+extern volatile sig_atomic_t interrupted;
+void catchInterrupts(void);
+void exitIfInterrupted(void);
+
+/* What the test used */
+struct usage {
+    double cpu;             /* seconds */
+    long maxrss;            /* KB */
+    long long io;           /* bytes */
+};
+
+void getUsage(const struct rusage *ru, struct usage *u);
+
+/* The test's output is read from a pipe into memory.  Only output past
+ * LOG_SPILL bytes goes to disk, into an unlinked temporary file, so the
+ * usual small log never touches the filesystem. */
+#define LOG_SPILL (4 * 1024 * 1024)
+
+struct log {
+    char *buf;              /* output not spilled */
+    size_t len;
+    size_t max;
+    int spillfd;            /* -1 until the output outgrows LOG_SPILL */
+    size_t spilled;         /* bytes in spillfd, which come before buf */
+    char *map;              /* spillfd mapped by logData() */
+};
+
+void logInit(struct log *log);
+int logAppend(struct log *log, const char *data, size_t len);
+char *logData(struct log *log, size_t *lenp);
+void logFree(struct log *log);
+
+void readOutput(int fd, int sigfd, struct log *log);
+void writeLog(struct iovec *iov, int niov);
+
+#endif
@@ -115,7 +115,7 @@ retest_wine()
 
 initialize_tree()
 {
-    test -x $TOOLS/alarm || gcc $TOOLS/alarm.c -o $TOOLS/alarm
+    test -x $TOOLS/alarm || gcc $TOOLS/alarm.c $TOOLS/alarmlib.c -o $TOOLS/alarm
 
     rm -rf $WORK
     mkdir -p $WORK
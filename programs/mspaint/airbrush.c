@@ -0,0 +1,175 @@
+/*
+ *  Paint (airbrush.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Airbrush tool.
+ *
+ * The spray lays down dots at a fixed rate for as long as the button is
+ * held, however often it gets the chance to: each call works out from the
+ * performance counter how many dots have come due since the last one and
+ * keeps the fraction for the next.  The dots land evenly within a disc,
+ * picked from a table of the offsets inside it by a small xorshift
+ * generator, and are written straight into the bits of the image.
+ */
+
+#include <windows.h>
+
+#include "main.h"
+
+/* dots per second, as a percentage of the pixels in the disc */
+#define AIRBRUSH_COVERAGE   150
+/* a stall longer than this is not made up for */
+#define AIRBRUSH_MAX_LAG    250
+
+static struct
+{
+    INT         nRadius;        /* of the offsets in aptOffsets */
+    INT         cOffsets;
+    POINT      *aptOffsets;
+    DWORD       dwRandom;       /* xorshift state, never 0 */
+    LONGLONG    llLast;         /* performance counter at the last spray */
+    LONGLONG    llOwed;         /* dots due, times the counter frequency */
+    LONGLONG    llFrequency;
+} airbrush;
+
+static DWORD AirBrush_Random(VOID)
+{
+    DWORD dw = airbrush.dwRandom;
+
+    dw ^= dw << 13;
+    dw ^= dw >> 17;
+    dw ^= dw << 5;
+    airbrush.dwRandom = dw;
+    return dw;
+}
+
+/* Lists the offsets within nRadius of the center */
+static BOOL AirBrush_InitOffsets(INT nRadius)
+{
+    POINT *apt;
+    INT x, y, c;
+
+    if (airbrush.aptOffsets != NULL && airbrush.nRadius == nRadius)
+        return TRUE;
+
+    apt = HeapAlloc(GetProcessHeap(), 0,
+                    (2 * nRadius + 1) * (2 * nRadius + 1) * sizeof(POINT));
+    if (apt == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    c = 0;
+    for (y = -nRadius; y <= nRadius; y++)
+    {
+        for (x = -nRadius; x <= nRadius; x++)
+        {
+            if (x * x + y * y <= nRadius * nRadius)
+            {
+                apt[c].x = x;
+                apt[c].y = y;
+                c++;
+            }
+        }
+    }
+
+    HeapFree(GetProcessHeap(), 0, airbrush.aptOffsets);
+    airbrush.aptOffsets = apt;
+    airbrush.cOffsets = c;
+    airbrush.nRadius = nRadius;
+    return TRUE;
+}
+
+/* Starts a spray of radius nRadius; nothing is due until time passes */
+BOOL AirBrush_Begin(INT nRadius)
+{
+    LARGE_INTEGER li;
+
+    if (!AirBrush_InitOffsets(max(nRadius, 0)))
+        return FALSE;
+
+    QueryPerformanceFrequency(&li);
+    airbrush.llFrequency = max(li.QuadPart, 1);
+    QueryPerformanceCounter(&li);
+    airbrush.llLast = li.QuadPart;
+    airbrush.llOwed = 0;
+    if (airbrush.dwRandom == 0)
+        airbrush.dwRandom = GetTickCount() | 1;
+    return TRUE;
+}
+
+/* Sprays the dots that have come due around pt of the 24 or 32 bpp image
+ * ppx in color rgb.  *prcChanged gets the box of the dots, which is empty
+ * if there were none; it is always within nRadius of pt as given to
+ * AirBrush_Begin.  Returns the number of dots. */
+INT AirBrush_Spray(const BM_PIXELS *ppx, POINT pt, COLORREF rgb,
+                   RECT *prcChanged)
+{
+    LARGE_INTEGER li;
+    LONGLONG llElapsed;
+    INT cDots, i, x, y, cbPixel = ppx->wBitCount / 8;
+    const POINT *pptOffset;
+    BYTE ab[3];
+    LPBYTE pb;
+
+    SetRectEmpty(prcChanged);
+    if (airbrush.aptOffsets == NULL ||
+        (ppx->wBitCount != 24 && ppx->wBitCount != 32))
+        return 0;
+
+    QueryPerformanceCounter(&li);
+    llElapsed = li.QuadPart - airbrush.llLast;
+    airbrush.llLast = li.QuadPart;
+    llElapsed = min(max(llElapsed, 0),
+                    airbrush.llFrequency * AIRBRUSH_MAX_LAG / 1000);
+
+    airbrush.llOwed += llElapsed * airbrush.cOffsets * AIRBRUSH_COVERAGE / 100;
+    cDots = (INT)(airbrush.llOwed / airbrush.llFrequency);
+    airbrush.llOwed %= airbrush.llFrequency;
+    if (cDots == 0)
+        return 0;
+
+    ab[0] = GetBValue(rgb);
+    ab[1] = GetGValue(rgb);
+    ab[2] = GetRValue(rgb);
+    prcChanged->left = prcChanged->top = MAXLONG;
+    prcChanged->right = prcChanged->bottom = -MAXLONG;
+    for (i = 0; i < cDots; i++)
+    {
+        pptOffset = &airbrush.aptOffsets[AirBrush_Random() % airbrush.cOffsets];
+        x = pt.x + pptOffset->x;
+        y = pt.y + pptOffset->y;
+        if (x < 0 || y < 0 || x >= ppx->cx || y >= ppx->cy)
+            continue;
+
+        pb = BM_ScanLine(ppx, y) + x * cbPixel;
+        pb[0] = ab[0];
+        pb[1] = ab[1];
+        pb[2] = ab[2];
+        prcChanged->left = min(prcChanged->left, x);
+        prcChanged->top = min(prcChanged->top, y);
+        prcChanged->right = max(prcChanged->right, x + 1);
+        prcChanged->bottom = max(prcChanged->bottom, y + 1);
+    }
+    if (prcChanged->left > prcChanged->right)
+        SetRectEmpty(prcChanged);
+    return cDots;
+}
@@ -0,0 +1,625 @@
+/*
+ *  Paint (batch.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * "mspaint /batch [operations] input output" loads input, applies the
+ * operations in the order they are given and saves the result as output.
+ * No window is created.  If the file name of input has wildcards, output
+ * is a directory that receives the results under their own names, and the
+ * files are shared out among threads, one per processor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include <shellapi.h>
+#include <shlwapi.h>
+
+#include "main.h"
+
+#define BATCH_MAX_THREADS   64
+
+typedef enum
+{
+    BATCH_HFLIP,
+    BATCH_VFLIP,
+    BATCH_ROTATE,
+    BATCH_STRETCH,
+    BATCH_SKEW,
+    BATCH_PIXELOP,
+    BATCH_RESIZE,
+    BATCH_FILL
+} BATCH_OPERATION;
+
+typedef struct
+{
+    BATCH_OPERATION iOp;
+    INT     an[4];      /* the numbers after the colon */
+    BOOL    fPercent;   /* BATCH_STRETCH: an[0] and an[1] are percentages */
+} BATCH_OP;
+
+typedef struct
+{
+    BATCH_OP   *aOps;
+    INT         cOps;
+    LPWSTR     *apszFiles;      /* file names found in szInputDir */
+    INT         cFiles;
+    WCHAR       szInputDir[MAX_PATH];
+    LPCWSTR     pszOutput;
+    BOOL        fOutputDir;
+    LONG        iNext;          /* the next file a thread may take */
+    LONG        cFailed;
+} BATCH;
+
+static const char szUsage[] =
+    "usage: mspaint /batch [operations] input output\n"
+    "\n"
+    "operations, applied in the order given:\n"
+    "  /hflip, /vflip            flip horizontally or vertically\n"
+    "  /rotate:90|180|270        rotate by that many degrees\n"
+    "  /stretch:cx,cy            stretch to cx by cy pixels; with % after\n"
+    "                            each number, to that percentage\n"
+    "  /skew:x,y                 skew by x and y degrees (-89 to 89)\n"
+    "  /invert                   invert the colors\n"
+    "  /grayscale                turn the colors into grays\n"
+    "  /threshold:n              make grays from n up white, the rest black\n"
+    "  /adjust:b,c               change brightness and contrast by b and c\n"
+    "                            percent\n"
+    "  /swaprb                   swap red and blue\n"
+    "  /resize:cx,cy             change the size as Attributes does\n"
+    "  /fill:x,y,rrggbb[,tol]    flood fill from (x, y) with a color\n"
+    "options:\n"
+    "  /filter:box|bilinear|bicubic|lanczos3   filter for /stretch\n"
+    "  /png:0-9                  compression effort for PNG files\n"
+    "\n"
+    "Wildcards in the file name of input make output a directory.\n";
+
+/* Reads a number in base nBase at *ppsz, moving *ppsz past it */
+static BOOL Batch_ParseNumber(LPCWSTR *ppsz, INT nBase, INT *pn)
+{
+    LPCWSTR psz = *ppsz;
+    BOOL fNegative = FALSE;
+    INT n = 0, nDigit;
+
+    if (*psz == '-')
+    {
+        fNegative = TRUE;
+        psz++;
+    }
+    for (;;)
+    {
+        if (*psz >= '0' && *psz <= '9')
+            nDigit = *psz - '0';
+        else if (*psz >= 'a' && *psz <= 'f')
+            nDigit = *psz - 'a' + 10;
+        else if (*psz >= 'A' && *psz <= 'F')
+            nDigit = *psz - 'A' + 10;
+        else
+            break;
+        if (nDigit >= nBase || n > (MAXLONG - nDigit) / nBase)
+            return FALSE;
+        n = n * nBase + nDigit;
+        psz++;
+    }
+    if (psz == *ppsz + fNegative)
+        return FALSE;
+
+    *pn = fNegative ? -n : n;
+    *ppsz = psz;
+    return TRUE;
+}
+
+/* Skips the comma or 'x' between two numbers */
+static BOOL Batch_ParseSeparator(LPCWSTR *ppsz)
+{
+    if (**ppsz != ',' && **ppsz != 'x' && **ppsz != 'X')
+        return FALSE;
+    (*ppsz)++;
+    return TRUE;
+}
+
+/* Parses the operation or option in pszArg, which starts after its '/'.
+ * An operation goes into *pOp and sets *pfOp; an option changes the
+ * Globals instead. */
+static BOOL Batch_ParseArg(LPCWSTR pszArg, BATCH_OP *pOp, BOOL *pfOp)
+{
+    static const WCHAR hflipW[] = {'h','f','l','i','p',0};
+    static const WCHAR vflipW[] = {'v','f','l','i','p',0};
+    static const WCHAR rotateW[] = {'r','o','t','a','t','e',0};
+    static const WCHAR stretchW[] = {'s','t','r','e','t','c','h',0};
+    static const WCHAR skewW[] = {'s','k','e','w',0};
+    static const WCHAR invertW[] = {'i','n','v','e','r','t',0};
+    static const WCHAR grayscaleW[] = {'g','r','a','y','s','c','a','l','e',0};
+    static const WCHAR thresholdW[] = {'t','h','r','e','s','h','o','l','d',0};
+    static const WCHAR adjustW[] = {'a','d','j','u','s','t',0};
+    static const WCHAR swaprbW[] = {'s','w','a','p','r','b',0};
+    static const WCHAR resizeW[] = {'r','e','s','i','z','e',0};
+    static const WCHAR fillW[] = {'f','i','l','l',0};
+    static const WCHAR filterW[] = {'f','i','l','t','e','r',0};
+    static const WCHAR pngW[] = {'p','n','g',0};
+    static const WCHAR boxW[] = {'b','o','x',0};
+    static const WCHAR bilinearW[] = {'b','i','l','i','n','e','a','r',0};
+    static const WCHAR bicubicW[] = {'b','i','c','u','b','i','c',0};
+    static const WCHAR lanczos3W[] = {'l','a','n','c','z','o','s','3',0};
+    static const LPCWSTR apszFilter[] = {boxW, bilinearW, bicubicW, lanczos3W};
+    WCHAR szName[16];
+    LPCWSTR psz;
+    INT cch, i;
+
+    /* the name goes up to the colon, if any */
+    psz = pszArg;
+    while (*psz && *psz != ':')
+        psz++;
+    cch = psz - pszArg;
+    if (cch >= sizeof(szName) / sizeof(szName[0]))
+        return FALSE;
+    CopyMemory(szName, pszArg, cch * sizeof(WCHAR));
+    szName[cch] = 0;
+    if (*psz == ':')
+        psz++;
+
+    ZeroMemory(pOp, sizeof(*pOp));
+    *pfOp = TRUE;
+    if (!lstrcmpiW(szName, hflipW) || !lstrcmpiW(szName, vflipW))
+    {
+        pOp->iOp = !lstrcmpiW(szName, hflipW) ? BATCH_HFLIP : BATCH_VFLIP;
+        return *psz == 0;
+    }
+    if (!lstrcmpiW(szName, invertW) || !lstrcmpiW(szName, grayscaleW) ||
+        !lstrcmpiW(szName, swaprbW))
+    {
+        /* an[0] is the PIXELOP, an[1] and an[2] its parameters */
+        pOp->iOp = BATCH_PIXELOP;
+        pOp->an[0] = !lstrcmpiW(szName, invertW) ? PIXELOP_INVERT :
+                     !lstrcmpiW(szName, grayscaleW) ? PIXELOP_GRAYSCALE :
+                     PIXELOP_SWAP_RED_BLUE;
+        return *psz == 0;
+    }
+    if (!lstrcmpiW(szName, thresholdW))
+    {
+        pOp->iOp = BATCH_PIXELOP;
+        pOp->an[0] = PIXELOP_THRESHOLD;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[1]) || *psz != 0)
+            return FALSE;
+        return pOp->an[1] >= 0 && pOp->an[1] <= 256;
+    }
+    if (!lstrcmpiW(szName, adjustW))
+    {
+        pOp->iOp = BATCH_PIXELOP;
+        pOp->an[0] = PIXELOP_BRIGHTNESS_CONTRAST;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[1]) ||
+            !Batch_ParseSeparator(&psz) ||
+            !Batch_ParseNumber(&psz, 10, &pOp->an[2]) || *psz != 0)
+            return FALSE;
+        return pOp->an[1] >= -100 && pOp->an[1] <= 100 &&
+               pOp->an[2] >= -100 && pOp->an[2] <= 100;
+    }
+    if (!lstrcmpiW(szName, rotateW))
+    {
+        pOp->iOp = BATCH_ROTATE;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[0]) || *psz != 0)
+            return FALSE;
+        pOp->an[0] = (pOp->an[0] % 360 + 360) % 360;
+        return pOp->an[0] % 90 == 0;
+    }
+    if (!lstrcmpiW(szName, stretchW))
+    {
+        pOp->iOp = BATCH_STRETCH;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[0]))
+            return FALSE;
+        if (*psz == '%')
+        {
+            pOp->fPercent = TRUE;
+            psz++;
+        }
+        if (*psz == 0 && pOp->fPercent)
+            pOp->an[1] = pOp->an[0];
+        else if (!Batch_ParseSeparator(&psz) ||
+                 !Batch_ParseNumber(&psz, 10, &pOp->an[1]) ||
+                 *psz != (pOp->fPercent ? '%' : 0) ||
+                 (pOp->fPercent && *++psz != 0))
+            return FALSE;
+        return pOp->an[0] > 0 && pOp->an[1] > 0;
+    }
+    if (!lstrcmpiW(szName, skewW))
+    {
+        pOp->iOp = BATCH_SKEW;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[0]) ||
+            (*psz != 0 && (!Batch_ParseSeparator(&psz) ||
+                           !Batch_ParseNumber(&psz, 10, &pOp->an[1]))) ||
+            *psz != 0)
+            return FALSE;
+        return pOp->an[0] >= -89 && pOp->an[0] <= 89 &&
+               pOp->an[1] >= -89 && pOp->an[1] <= 89;
+    }
+    if (!lstrcmpiW(szName, resizeW))
+    {
+        pOp->iOp = BATCH_RESIZE;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[0]) ||
+            !Batch_ParseSeparator(&psz) ||
+            !Batch_ParseNumber(&psz, 10, &pOp->an[1]) || *psz != 0)
+            return FALSE;
+        return pOp->an[0] > 0 && pOp->an[1] > 0;
+    }
+    if (!lstrcmpiW(szName, fillW))
+    {
+        /* x, y, the color as rrggbb, then the tolerance */
+        pOp->iOp = BATCH_FILL;
+        if (!Batch_ParseNumber(&psz, 10, &pOp->an[0]) || *psz++ != ',' ||
+            !Batch_ParseNumber(&psz, 10, &pOp->an[1]) || *psz++ != ',' ||
+            !Batch_ParseNumber(&psz, 16, &pOp->an[2]) ||
+            (*psz != 0 && (*psz++ != ',' ||
+                           !Batch_ParseNumber(&psz, 10, &pOp->an[3]))) ||
+            *psz != 0)
+            return FALSE;
+        pOp->an[2] = RGB((pOp->an[2] >> 16) & 0xFF, (pOp->an[2] >> 8) & 0xFF,
+                         pOp->an[2] & 0xFF);
+        return pOp->an[3] >= 0 && pOp->an[3] <= 255;
+    }
+
+    *pfOp = FALSE;
+    if (!lstrcmpiW(szName, filterW))
+    {
+        for (i = RESAMPLE_BOX; i <= RESAMPLE_LANCZOS3; i++)
+        {
+            if (!lstrcmpiW(psz, apszFilter[i]))
+            {
+                Globals.iStretchFilter = i;
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    if (!lstrcmpiW(szName, pngW))
+    {
+        if (!Batch_ParseNumber(&psz, 10, &i) || *psz != 0 || i < 0 || i > 9)
+            return FALSE;
+        Globals.nPngEffort = i;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Applies pOp to *phbm, which is replaced if the operation makes a new
+ * bitmap.  *phbm is a 24 or 32 bpp DIB section before and after.  Fills
+ * work in pArena, which belongs to the calling thread. */
+static BOOL Batch_Apply(const BATCH_OP *pOp, HBITMAP *phbm,
+                        FILL_ARENA *pArena)
+{
+    HBITMAP hbmNew = NULL;
+    BM_PIXELS px;
+    RECT rc;
+    SIZE siz, sizNew;
+
+    if (!BM_GetPixels(*phbm, &px))
+        return FALSE;
+    siz.cx = px.cx;
+    siz.cy = px.cy;
+
+    switch (pOp->iOp)
+    {
+    case BATCH_HFLIP:
+        hbmNew = BM_CreateHFliped(NULL, *phbm, siz);
+        break;
+
+    case BATCH_VFLIP:
+        hbmNew = BM_CreateVFliped(NULL, *phbm, siz);
+        break;
+
+    case BATCH_ROTATE:
+        if (pOp->an[0] == 0)
+            return TRUE;
+        if (pOp->an[0] == 180)
+            return BM_Rotate180Degree(*phbm);
+        if (pOp->an[0] == 90)
+            hbmNew = BM_CreateRotated90Degree(NULL, *phbm, siz);
+        else
+            hbmNew = BM_CreateRotated270Degree(NULL, *phbm, siz);
+        break;
+
+    case BATCH_STRETCH:
+        if (pOp->fPercent)
+        {
+            sizNew.cx = max(MulDiv(siz.cx, pOp->an[0], 100), 1);
+            sizNew.cy = max(MulDiv(siz.cy, pOp->an[1], 100), 1);
+        }
+        else
+        {
+            sizNew.cx = pOp->an[0];
+            sizNew.cy = pOp->an[1];
+        }
+        if (sizNew.cx == siz.cx && sizNew.cy == siz.cy)
+            return TRUE;
+        hbmNew = BM_CreateStretched(NULL, sizNew, *phbm, siz);
+        break;
+
+    case BATCH_SKEW:
+        if (pOp->an[0] == 0 && pOp->an[1] == 0)
+            return TRUE;
+        hbmNew = BM_CreateSkewed(*phbm, pOp->an[0], pOp->an[1],
+                                 Globals.rgbBack);
+        break;
+
+    case BATCH_PIXELOP:
+        return BM_PixelOp(&px, NULL, pOp->an[0], pOp->an[1], pOp->an[2]) >= 0;
+
+    case BATCH_RESIZE:
+        sizNew.cx = pOp->an[0];
+        sizNew.cy = pOp->an[1];
+        hbmNew = BM_CreateResized(NULL, sizNew, *phbm, siz);
+        break;
+
+    case BATCH_FILL:
+        if (pOp->an[0] < 0 || pOp->an[0] >= siz.cx ||
+            pOp->an[1] < 0 || pOp->an[1] >= siz.cy)
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        return BM_FloodFill(&px, pOp->an[0], pOp->an[1], pOp->an[2],
+                            pOp->an[3], NULL, &rc, pArena);
+    }
+
+    if (hbmNew == NULL)
+        return FALSE;
+    DeleteObject(*phbm);
+    *phbm = hbmNew;
+    return TRUE;
+}
+
+/* Converts psz for printing into the cch bytes at pszBuf */
+static LPSTR Batch_ToAnsi(LPCWSTR psz, LPSTR pszBuf, INT cch)
+{
+    if (!WideCharToMultiByte(CP_ACP, 0, psz, -1, pszBuf, cch, NULL, NULL))
+        pszBuf[0] = 0;
+    return pszBuf;
+}
+
+static VOID Batch_PrintError(LPCWSTR pszFile, DWORD dwError)
+{
+    CHAR szFileA[MAX_PATH * 2], szMsgA[MAX_STRING_LEN * 2];
+    WCHAR szMsg[MAX_STRING_LEN];
+
+    szMsg[0] = 0;
+    if ((LONG)dwError > 0)
+        FormatMessageW(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+                       NULL, dwError, 0, szMsg, MAX_STRING_LEN, NULL);
+    else if ((LONG)dwError < 0)
+        LoadStringW(Globals.hInstance, -(LONG)dwError, szMsg, MAX_STRING_LEN);
+    printf("%s: failed: %s\n", Batch_ToAnsi(pszFile, szFileA, sizeof(szFileA)),
+           Batch_ToAnsi(szMsg, szMsgA, sizeof(szMsgA)));
+}
+
+/* Loads pszInput, applies the operations and saves it as pszOutput */
+static BOOL Batch_ProcessFile(const BATCH *pBatch, LPCWSTR pszInput,
+                              LPCWSTR pszOutput, FILL_ARENA *pArena)
+{
+    CHAR szInputA[MAX_PATH * 2], szOutputA[MAX_PATH * 2];
+    HBITMAP hbm, hbmDIB;
+    BM_PIXELS px;
+    BITMAP bm;
+    SIZE siz;
+    INT i;
+    BOOL f;
+
+    hbm = BM_Load(pszInput);
+    if (hbm == NULL)
+    {
+        Batch_PrintError(pszInput, GetLastError());
+        return FALSE;
+    }
+
+    /* the operations work on the bits at 24 or 32 bpp */
+    f = TRUE;
+    if (!BM_GetPixels(hbm, &px) ||
+        (px.wBitCount != 24 && px.wBitCount != 32))
+    {
+        f = GetObjectW(hbm, sizeof(BITMAP), &bm) != 0;
+        if (f)
+        {
+            siz.cx = bm.bmWidth;
+            siz.cy = bm.bmHeight;
+            hbmDIB = BM_CreateResized(NULL, siz, hbm, siz);
+            f = hbmDIB != NULL;
+            if (f)
+            {
+                DeleteObject(hbm);
+                hbm = hbmDIB;
+            }
+        }
+    }
+
+    for (i = 0; f && i < pBatch->cOps; i++)
+        f = Batch_Apply(&pBatch->aOps[i], &hbm, pArena);
+    if (f)
+        f = BM_Save(pszOutput, hbm);
+
+    if (f)
+        printf("%s -> %s\n", Batch_ToAnsi(pszInput, szInputA, sizeof(szInputA)),
+               Batch_ToAnsi(pszOutput, szOutputA, sizeof(szOutputA)));
+    else
+        Batch_PrintError(pszInput, GetLastError());
+    DeleteObject(hbm);
+    return f;
+}
+
+static DWORD WINAPI Batch_ThreadProc(LPVOID pParam)
+{
+    BATCH *pBatch = pParam;
+    WCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+    FILL_ARENA arena;
+    LONG i;
+
+    ZeroMemory(&arena, sizeof(arena));
+    while ((i = InterlockedIncrement(&pBatch->iNext) - 1) < pBatch->cFiles)
+    {
+        lstrcpyW(szInput, pBatch->szInputDir);
+        lstrcatW(szInput, pBatch->apszFiles[i]);
+        if (pBatch->fOutputDir)
+        {
+            lstrcpyW(szOutput, pBatch->pszOutput);
+            PathAddBackslashW(szOutput);
+            lstrcatW(szOutput, pBatch->apszFiles[i]);
+        }
+        else
+            lstrcpyW(szOutput, pBatch->pszOutput);
+
+        if (!Batch_ProcessFile(pBatch, szInput, szOutput, &arena))
+            InterlockedIncrement(&pBatch->cFailed);
+    }
+    Fill_FreeArena(&arena);
+    return 0;
+}
+
+/* Fills in the files of pBatch from pszInput, with or without wildcards */
+static BOOL Batch_FindFiles(BATCH *pBatch, LPCWSTR pszInput)
+{
+    WIN32_FIND_DATAW fd;
+    HANDLE hFind;
+    LPWSTR *apszNew;
+    LPCWSTR pszName;
+    INT cAlloc = 0;
+
+    if (lstrlenW(pszInput) >= MAX_PATH)
+        return FALSE;
+    pszName = PathFindFileNameW(pszInput);
+    lstrcpynW(pBatch->szInputDir, pszInput, pszName - pszInput + 1);
+
+    hFind = FindFirstFileW(pszInput, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return FALSE;
+    do
+    {
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        if (lstrlenW(pBatch->szInputDir) + lstrlenW(fd.cFileName) >= MAX_PATH)
+            continue;
+
+        if (pBatch->cFiles == cAlloc)
+        {
+            cAlloc = cAlloc ? cAlloc * 2 : 64;
+            if (pBatch->apszFiles == NULL)
+                apszNew = HeapAlloc(GetProcessHeap(), 0,
+                                    cAlloc * sizeof(LPWSTR));
+            else
+                apszNew = HeapReAlloc(GetProcessHeap(), 0, pBatch->apszFiles,
+                                      cAlloc * sizeof(LPWSTR));
+            if (apszNew == NULL)
+                break;
+            pBatch->apszFiles = apszNew;
+        }
+        pBatch->apszFiles[pBatch->cFiles] =
+            HeapAlloc(GetProcessHeap(), 0,
+                      (lstrlenW(fd.cFileName) + 1) * sizeof(WCHAR));
+        if (pBatch->apszFiles[pBatch->cFiles] == NULL)
+            break;
+        lstrcpyW(pBatch->apszFiles[pBatch->cFiles++], fd.cFileName);
+    } while (FindNextFileW(hFind, &fd));
+    FindClose(hFind);
+    return TRUE;
+}
+
+/* Runs the batch described by the whole command line pszCmdLine, whose
+ * second argument is /batch.  Returns 0 if every file was done, 1 if some
+ * failed and 2 if the command line is wrong. */
+INT Batch_Main(LPCWSTR pszCmdLine)
+{
+    CHAR szArgA[MAX_PATH * 2];
+    HANDLE ahThreads[BATCH_MAX_THREADS];
+    SYSTEM_INFO si;
+    BATCH batch;
+    LPWSTR *argv;
+    INT argc, i, cThreads;
+    BOOL fOp, fWildcards;
+    static const WCHAR wildcardsW[] = {'*','?',0};
+
+    argv = CommandLineToArgvW(pszCmdLine, &argc);
+    if (argv == NULL)
+        return 2;
+
+    ZeroMemory(&batch, sizeof(batch));
+    batch.aOps = HeapAlloc(GetProcessHeap(), 0, argc * sizeof(BATCH_OP));
+    if (batch.aOps == NULL)
+    {
+        LocalFree(argv);
+        return 2;
+    }
+
+    /* the program and /batch, the options and operations, then two files */
+    for (i = 2; i < argc - 2; i++)
+    {
+        if ((argv[i][0] != '/' && argv[i][0] != '-') ||
+            !Batch_ParseArg(argv[i] + 1, &batch.aOps[batch.cOps], &fOp))
+        {
+            printf("bad operation: %s\n\n",
+                   Batch_ToAnsi(argv[i], szArgA, sizeof(szArgA)));
+            break;
+        }
+        if (fOp)
+            batch.cOps++;
+    }
+    if (argc < 4 || i < argc - 2)
+    {
+        fputs(szUsage, stdout);
+        HeapFree(GetProcessHeap(), 0, batch.aOps);
+        LocalFree(argv);
+        return 2;
+    }
+
+    fWildcards = StrPBrkW(PathFindFileNameW(argv[argc - 2]),
+                          wildcardsW) != NULL;
+    batch.pszOutput = argv[argc - 1];
+    batch.fOutputDir = fWildcards || PathIsDirectoryW(batch.pszOutput);
+    if (fWildcards)
+        CreateDirectoryW(batch.pszOutput, NULL);
+    if (!Batch_FindFiles(&batch, argv[argc - 2]) || batch.cFiles == 0)
+    {
+        printf("%s: no such file\n",
+               Batch_ToAnsi(argv[argc - 2], szArgA, sizeof(szArgA)));
+        batch.cFailed = 1;
+    }
+
+    GetSystemInfo(&si);
+    cThreads = min((INT)si.dwNumberOfProcessors, BATCH_MAX_THREADS);
+    cThreads = max(min(cThreads, batch.cFiles), 1);
+    for (i = 1; i < cThreads; i++)
+        ahThreads[i] = CreateThread(NULL, 0, Batch_ThreadProc, &batch, 0, NULL);
+    Batch_ThreadProc(&batch);
+    for (i = 1; i < cThreads; i++)
+    {
+        if (ahThreads[i] != NULL)
+        {
+            WaitForSingleObject(ahThreads[i], INFINITE);
+            CloseHandle(ahThreads[i]);
+        }
+    }
+
+    if (batch.cFiles > 1)
+        printf("%d of %d files done\n", batch.cFiles - (INT)batch.cFailed,
+               batch.cFiles);
+
+    for (i = 0; i < batch.cFiles; i++)
+        HeapFree(GetProcessHeap(), 0, batch.apszFiles[i]);
+    HeapFree(GetProcessHeap(), 0, batch.apszFiles);
+    HeapFree(GetProcessHeap(), 0, batch.aOps);
+    LocalFree(argv);
+    return batch.cFailed ? 1 : 0;
+}
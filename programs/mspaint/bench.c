@@ -0,0 +1,700 @@
+/*
+ *  Paint (bench.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * "mspaint /benchmark [name]" times the drawing kernels on synthetic
+ * images and prints the results to stdout.  No window is created.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "main.h"
+
+static double Bench_Now(VOID)
+{
+    LARGE_INTEGER li, liFreq;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&li);
+    return (double)li.QuadPart * 1000.0 / (double)liFreq.QuadPart;
+}
+
+/* Creates a 24 bpp image filled with a pattern that defeats any run-length
+ * shortcut */
+static HBITMAP Bench_CreateImage(SIZE siz)
+{
+    HBITMAP hbm;
+    BM_PIXELS px;
+    LPBYTE pb;
+    INT x, y;
+
+    hbm = BM_Create(siz);
+    if (hbm == NULL || !BM_GetPixels(hbm, &px))
+        return hbm;
+    for (y = 0; y < px.cy; y++)
+    {
+        pb = BM_ScanLine(&px, y);
+        for (x = 0; x < px.cx; x++)
+        {
+            *pb++ = (BYTE)(x * 7 + y);
+            *pb++ = (BYTE)(x ^ y);
+            *pb++ = (BYTE)(y * 3 - x);
+        }
+    }
+    return hbm;
+}
+
+/* Repaint of a 1280x1024 canvas showing the middle of a 4000x3000 image */
+static VOID Bench_Zoom(VOID)
+{
+    static const INT anZoom[] = {1, 2, 4, 6, 8};
+    static const INT cFrames = 50;
+    HBITMAP hbmImage, hbmCanvas;
+    BM_PIXELS pxImage, pxCanvas;
+    HDC hMemDC1, hMemDC2;
+    HGDIOBJ hbmOld1, hbmOld2;
+    SIZE sizImage, sizCanvas;
+    RECT rc;
+    INT i, j, xOrg, yOrg;
+    double t0, t1, t2;
+
+    sizImage.cx = 4000;
+    sizImage.cy = 3000;
+    sizCanvas.cx = 1280;
+    sizCanvas.cy = 1024;
+    hbmImage = Bench_CreateImage(sizImage);
+    hbmCanvas = BM_Create32(sizCanvas);
+    if (hbmImage == NULL || hbmCanvas == NULL ||
+        !BM_GetPixels(hbmImage, &pxImage) ||
+        !BM_GetPixels(hbmCanvas, &pxCanvas))
+    {
+        printf("zoom: out of memory\n");
+        if (hbmImage != NULL) DeleteObject(hbmImage);
+        if (hbmCanvas != NULL) DeleteObject(hbmCanvas);
+        return;
+    }
+
+    hMemDC1 = CreateCompatibleDC(NULL);
+    hMemDC2 = CreateCompatibleDC(NULL);
+    hbmOld1 = SelectObject(hMemDC1, hbmCanvas);
+    hbmOld2 = SelectObject(hMemDC2, hbmImage);
+    SetStretchBltMode(hMemDC1, COLORONCOLOR);
+    SetRect(&rc, 0, 0, sizCanvas.cx, sizCanvas.cy);
+
+    printf("zoom: %dx%d image, %dx%d canvas, ms per repaint\n",
+           sizImage.cx, sizImage.cy, sizCanvas.cx, sizCanvas.cy);
+    printf("zoom  StretchBlt  BM_ZoomBlt  BM_ZoomBlt+grid\n");
+    for (i = 0; i < sizeof(anZoom) / sizeof(anZoom[0]); i++)
+    {
+        xOrg = -(sizImage.cx * anZoom[i] - sizCanvas.cx) / 2;
+        yOrg = -(sizImage.cy * anZoom[i] - sizCanvas.cy) / 2;
+
+        t0 = Bench_Now();
+        for (j = 0; j < cFrames; j++)
+        {
+            StretchBlt(hMemDC1, xOrg, yOrg, sizImage.cx * anZoom[i],
+                       sizImage.cy * anZoom[i], hMemDC2, 0, 0,
+                       sizImage.cx, sizImage.cy, SRCCOPY);
+        }
+        GdiFlush();
+        t1 = Bench_Now();
+        for (j = 0; j < cFrames; j++)
+            BM_ZoomBlt(&pxCanvas, &rc, xOrg, yOrg, &pxImage, anZoom[i], FALSE);
+        t2 = Bench_Now();
+        printf("%4d  %10.3f  %10.3f", anZoom[i], (t1 - t0) / cFrames,
+               (t2 - t1) / cFrames);
+
+        t1 = Bench_Now();
+        for (j = 0; j < cFrames; j++)
+            BM_ZoomBlt(&pxCanvas, &rc, xOrg, yOrg, &pxImage, anZoom[i], TRUE);
+        t2 = Bench_Now();
+        printf("  %15.3f\n", (t2 - t1) / cFrames);
+    }
+
+    SelectObject(hMemDC1, hbmOld1);
+    SelectObject(hMemDC2, hbmOld2);
+    DeleteDC(hMemDC1);
+    DeleteDC(hMemDC2);
+    DeleteObject(hbmImage);
+    DeleteObject(hbmCanvas);
+}
+
+/* Paints px white, or, with fMaze, into one corridor winding through walls
+ * every other column that are open alternately at the top and the bottom */
+static VOID Bench_PaintFillImage(BM_PIXELS *ppx, BOOL fMaze)
+{
+    LPBYTE pb;
+    INT x, y;
+    BYTE b;
+
+    for (y = 0; y < ppx->cy; y++)
+    {
+        pb = BM_ScanLine(ppx, y);
+        for (x = 0; x < ppx->cx; x++)
+        {
+            b = (fMaze && (x & 1) && y != ((x & 2) ? ppx->cy - 1 : 0)) ?
+                0 : 255;
+            *pb++ = b;
+            *pb++ = b;
+            *pb++ = b;
+        }
+    }
+}
+
+/* Filling a 4000x3000 image, all white or one 1-pixel wide serpentine */
+static VOID Bench_Fill(VOID)
+{
+    static const INT cRuns = 5;
+    HBITMAP hbm;
+    BM_PIXELS px;
+    HDC hMemDC;
+    HGDIOBJ hbmOld, hbrOld;
+    FILL_ARENA arena;
+    SIZE siz;
+    RECT rc;
+    INT i, iMaze;
+    double tGDI, tFill, t0;
+
+    siz.cx = 4000;
+    siz.cy = 3000;
+    hbm = BM_Create(siz);
+    if (hbm == NULL || !BM_GetPixels(hbm, &px))
+    {
+        printf("fill: out of memory\n");
+        if (hbm != NULL) DeleteObject(hbm);
+        return;
+    }
+
+    hMemDC = CreateCompatibleDC(NULL);
+    hbmOld = SelectObject(hMemDC, hbm);
+    hbrOld = SelectObject(hMemDC, GetStockObject(BLACK_BRUSH));
+
+    ZeroMemory(&arena, sizeof(arena));
+    printf("fill: %dx%d image, ms per fill\n", siz.cx, siz.cy);
+    printf("image   ExtFloodFill  BM_FloodFill\n");
+    for (iMaze = 0; iMaze < 2; iMaze++)
+    {
+        tGDI = tFill = 0;
+        for (i = 0; i < cRuns; i++)
+        {
+            Bench_PaintFillImage(&px, iMaze);
+            t0 = Bench_Now();
+            ExtFloodFill(hMemDC, 0, 0, RGB(255, 255, 255), FLOODFILLSURFACE);
+            GdiFlush();
+            tGDI += Bench_Now() - t0;
+
+            Bench_PaintFillImage(&px, iMaze);
+            t0 = Bench_Now();
+            BM_FloodFill(&px, 0, 0, RGB(0, 0, 0), 0, NULL, &rc, &arena);
+            tFill += Bench_Now() - t0;
+        }
+        printf("%-6s  %12.3f  %12.3f\n", iMaze ? "maze" : "plain",
+               tGDI / cRuns, tFill / cRuns);
+    }
+
+    Fill_FreeArena(&arena);
+
+    SelectObject(hMemDC, hbrOld);
+    SelectObject(hMemDC, hbmOld);
+    DeleteDC(hMemDC);
+    DeleteObject(hbm);
+}
+
+/* One point of a brush stroke the way it used to be drawn, with new GDI
+ * objects for every point */
+static VOID CALLBACK Bench_BrushDDAProc(INT x, INT y, LPARAM lParam)
+{
+    static const struct
+    {
+        BYTE    bShape;     /* 'e'llipse, 'r'ectangle, 'l'ine or 'p'ixel */
+        CHAR    dx0, dy0, dx1, dy1;
+    } aShapes[12] =
+    {
+        {'e', -3, -3, 4, 4}, {'e', -2, -2, 2, 2}, {'p', 0, 0, 0, 0},
+        {'r', -4, -4, 4, 4}, {'r', -2, -2, 3, 3}, {'r', -1, -1, 1, 1},
+        {'l', 4, -4, -4, 4}, {'l', 2, -2, -3, 3}, {'l', 1, -1, -1, 1},
+        {'l', -4, -4, 4, 4}, {'l', -2, -2, 3, 3}, {'l', -1, -1, 1, 1},
+    };
+    HDC hMemDC = (HDC)lParam;
+    HPEN hPen;
+    HBRUSH hbr;
+    HGDIOBJ hpenOld, hbrOld;
+    INT i = Globals.iBrushType;
+
+    hPen = CreatePen(PS_SOLID, 0, RGB(0, 0, 0));
+    hbr = CreateSolidBrush(RGB(0, 0, 0));
+    hpenOld = SelectObject(hMemDC, hPen);
+    hbrOld = SelectObject(hMemDC, hbr);
+    switch (aShapes[i].bShape)
+    {
+    case 'e':
+        Ellipse(hMemDC, x + aShapes[i].dx0, y + aShapes[i].dy0,
+                x + aShapes[i].dx1, y + aShapes[i].dy1);
+        break;
+    case 'r':
+        Rectangle(hMemDC, x + aShapes[i].dx0, y + aShapes[i].dy0,
+                  x + aShapes[i].dx1, y + aShapes[i].dy1);
+        break;
+    case 'l':
+        MoveToEx(hMemDC, x + aShapes[i].dx0, y + aShapes[i].dy0, NULL);
+        LineTo(hMemDC, x + aShapes[i].dx1, y + aShapes[i].dy1);
+        break;
+    default:
+        SetPixel(hMemDC, x, y, RGB(0, 0, 0));
+        break;
+    }
+    SelectObject(hMemDC, hpenOld);
+    SelectObject(hMemDC, hbrOld);
+    DeleteObject(hPen);
+    DeleteObject(hbr);
+}
+
+/* A 2000-segment brush stroke wandering over a 4000x3000 image, with each
+ * brush type */
+static VOID Bench_Brush(VOID)
+{
+    static const INT cSegments = 2000;
+    HBITMAP hbm;
+    BM_PIXELS px;
+    HDC hMemDC;
+    HGDIOBJ hbmOld;
+    SIZE siz;
+    POINT pt0, pt1;
+    INT i, j, cPoints, iBrushTypeOld;
+    DWORD dwSeed;
+    double t0, t1, t2;
+
+    siz.cx = 4000;
+    siz.cy = 3000;
+    hbm = Bench_CreateImage(siz);
+    if (hbm == NULL || !BM_GetPixels(hbm, &px))
+    {
+        printf("brush: out of memory\n");
+        if (hbm != NULL) DeleteObject(hbm);
+        return;
+    }
+
+    hMemDC = CreateCompatibleDC(NULL);
+    hbmOld = SelectObject(hMemDC, hbm);
+    iBrushTypeOld = Globals.iBrushType;
+
+    printf("brush: %dx%d image, %d segments, ms per stroke\n",
+           siz.cx, siz.cy, cSegments);
+    printf("type  LineDDA+GDI  BM_BrushLine  points/ms\n");
+    for (i = 0; i < 12; i++)
+    {
+        Globals.iBrushType = i;
+
+        dwSeed = 1;
+        pt0.x = siz.cx / 2;
+        pt0.y = siz.cy / 2;
+        t0 = Bench_Now();
+        for (j = 0; j < cSegments; j++)
+        {
+            dwSeed = dwSeed * 1103515245 + 12345;
+            pt1.x = pt0.x + (INT)((dwSeed >> 8) % 61) - 30;
+            pt1.y = pt0.y + (INT)((dwSeed >> 20) % 61) - 30;
+            LineDDA(pt0.x, pt0.y, pt1.x, pt1.y, Bench_BrushDDAProc,
+                    (LPARAM)hMemDC);
+            pt0 = pt1;
+        }
+        GdiFlush();
+        t1 = Bench_Now();
+
+        dwSeed = 1;
+        pt0.x = siz.cx / 2;
+        pt0.y = siz.cy / 2;
+        cPoints = 0;
+        for (j = 0; j < cSegments; j++)
+        {
+            dwSeed = dwSeed * 1103515245 + 12345;
+            pt1.x = pt0.x + (INT)((dwSeed >> 8) % 61) - 30;
+            pt1.y = pt0.y + (INT)((dwSeed >> 20) % 61) - 30;
+            BM_BrushLine(&px, i, pt0, pt1, RGB(0, 0, 0));
+            cPoints += max(abs(pt1.x - pt0.x), abs(pt1.y - pt0.y)) + 1;
+            pt0 = pt1;
+        }
+        t2 = Bench_Now();
+        printf("%4d  %11.3f  %12.3f  %9.0f\n", i, t1 - t0, t2 - t1,
+               cPoints / max(t2 - t1, 0.001));
+    }
+
+    Globals.iBrushType = iBrushTypeOld;
+    SelectObject(hMemDC, hbmOld);
+    DeleteDC(hMemDC);
+    DeleteObject(hbm);
+}
+
+/* Saving and loading a 2000x1500 image as BMP and as PNG at a few levels
+ * of compression effort, through files in the temporary directory */
+static VOID Bench_Png(VOID)
+{
+    static const WCHAR bmpFileW[] = {'b','e','n','c','h','.','b','m','p',0};
+    static const WCHAR pngFileW[] = {'b','e','n','c','h','.','p','n','g',0};
+    static const INT anEffort[] = {-1, 0, 1, 6, 9};
+    WCHAR szFile[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    HBITMAP hbm, hbmLoaded;
+    SIZE siz;
+    INT i, nEffortOld = Globals.nPngEffort;
+    double t0, tSave, tLoad;
+    BOOL f;
+
+    siz.cx = 2000;
+    siz.cy = 1500;
+    hbm = Bench_CreateImage(siz);
+    if (hbm == NULL)
+    {
+        printf("png: out of memory\n");
+        return;
+    }
+
+    printf("png: %dx%d image\n", siz.cx, siz.cy);
+    printf("format  save ms  load ms       bytes\n");
+    for (i = 0; i < sizeof(anEffort) / sizeof(anEffort[0]); i++)
+    {
+        GetTempPathW(MAX_PATH, szFile);
+        lstrcatW(szFile, anEffort[i] < 0 ? bmpFileW : pngFileW);
+        Globals.nPngEffort = max(anEffort[i], 0);
+
+        t0 = Bench_Now();
+        f = BM_Save(szFile, hbm);
+        tSave = Bench_Now() - t0;
+        t0 = Bench_Now();
+        hbmLoaded = f ? BM_Load(szFile) : NULL;
+        tLoad = Bench_Now() - t0;
+        if (hbmLoaded == NULL ||
+            !GetFileAttributesExW(szFile, GetFileExInfoStandard, &fad))
+        {
+            printf("png: saving or loading failed\n");
+            DeleteFileW(szFile);
+            break;
+        }
+        DeleteObject(hbmLoaded);
+        DeleteFileW(szFile);
+
+        if (anEffort[i] < 0)
+            printf("bmp     ");
+        else
+            printf("png %d   ", anEffort[i]);
+        printf("%7.1f  %7.1f  %10u\n", tSave, tLoad, fad.nFileSizeLow);
+    }
+
+    Globals.nPngEffort = nEffortOld;
+    DeleteObject(hbm);
+}
+
+/* Stretching a 2000x1500 image to half and to double its size with
+ * StretchBlt and with each filter of BM_Resample, and skewing it */
+static VOID Bench_Stretch(VOID)
+{
+    static const INT anPercent[] = {50, 200};
+    HBITMAP hbm, hbmNew;
+    HDC hdc1, hdc2;
+    HGDIOBJ hbm1Old, hbm2Old;
+    BM_PIXELS px, pxNew;
+    SIZE siz, sizNew;
+    INT i, iFilter;
+    double t0, t1;
+
+    siz.cx = 2000;
+    siz.cy = 1500;
+    hbm = Bench_CreateImage(siz);
+    if (hbm == NULL || !BM_GetPixels(hbm, &px))
+    {
+        printf("stretch: out of memory\n");
+        DeleteObject(hbm);
+        return;
+    }
+
+    printf("stretch: %dx%d image, ms per stretch\n", siz.cx, siz.cy);
+    printf("size  StretchBlt       box  bilinear   bicubic  lanczos3\n");
+    hdc1 = CreateCompatibleDC(NULL);
+    hdc2 = CreateCompatibleDC(NULL);
+    for (i = 0; i < sizeof(anPercent) / sizeof(anPercent[0]); i++)
+    {
+        sizNew.cx = MulDiv(siz.cx, anPercent[i], 100);
+        sizNew.cy = MulDiv(siz.cy, anPercent[i], 100);
+        hbmNew = BM_Create(sizNew);
+        if (hbmNew == NULL || !BM_GetPixels(hbmNew, &pxNew))
+        {
+            printf("stretch: out of memory\n");
+            DeleteObject(hbmNew);
+            break;
+        }
+
+        hbm1Old = SelectObject(hdc1, hbm);
+        hbm2Old = SelectObject(hdc2, hbmNew);
+        t0 = Bench_Now();
+        SetStretchBltMode(hdc2, COLORONCOLOR);
+        StretchBlt(hdc2, 0, 0, sizNew.cx, sizNew.cy,
+                   hdc1, 0, 0, siz.cx, siz.cy, SRCCOPY);
+        GdiFlush();
+        t1 = Bench_Now();
+        SelectObject(hdc1, hbm1Old);
+        SelectObject(hdc2, hbm2Old);
+        printf("%3d%%  %10.1f", anPercent[i], t1 - t0);
+
+        for (iFilter = RESAMPLE_BOX; iFilter <= RESAMPLE_LANCZOS3; iFilter++)
+        {
+            t0 = Bench_Now();
+            if (!BM_Resample(&px, &pxNew, iFilter))
+                printf("  %8s", "failed");
+            else
+                printf("  %8.1f", Bench_Now() - t0);
+        }
+        printf("\n");
+        DeleteObject(hbmNew);
+    }
+    DeleteDC(hdc1);
+    DeleteDC(hdc2);
+
+    sizNew = BM_GetSkewedSize(siz, 20, 10);
+    hbmNew = BM_Create(sizNew);
+    if (hbmNew != NULL && BM_GetPixels(hbmNew, &pxNew))
+    {
+        t0 = Bench_Now();
+        BM_Skew(&px, &pxNew, 20, 10, RGB(255, 255, 255));
+        printf("skew 20/10 degrees: %.1f ms\n", Bench_Now() - t0);
+    }
+    DeleteObject(hbmNew);
+    DeleteObject(hbm);
+}
+
+/* Each per-pixel operation on a 4000x3000 image, against InvertRect */
+static VOID Bench_PixelOp(VOID)
+{
+    static const char * const apszOp[] =
+        {"invert", "grayscale", "brightness/contrast", "threshold", "swap r/b"};
+    HBITMAP hbm;
+    HDC hdc;
+    HGDIOBJ hbmOld;
+    BM_PIXELS px;
+    SIZE siz;
+    RECT rc;
+    INT iOp;
+    double t0, t1;
+
+    siz.cx = 4000;
+    siz.cy = 3000;
+    hbm = Bench_CreateImage(siz);
+    if (hbm == NULL || !BM_GetPixels(hbm, &px))
+    {
+        printf("pixelop: out of memory\n");
+        DeleteObject(hbm);
+        return;
+    }
+
+    printf("pixelop: %dx%d image\n", siz.cx, siz.cy);
+    printf("operation                 ms  megapixels/s\n");
+
+    hdc = CreateCompatibleDC(NULL);
+    hbmOld = SelectObject(hdc, hbm);
+    SetRect(&rc, 0, 0, siz.cx, siz.cy);
+    t0 = Bench_Now();
+    InvertRect(hdc, &rc);
+    GdiFlush();
+    t1 = Bench_Now();
+    SelectObject(hdc, hbmOld);
+    DeleteDC(hdc);
+    printf("%-20s  %6.1f  %12.0f\n", "InvertRect", t1 - t0,
+           siz.cx * siz.cy / 1000.0 / max(t1 - t0, 0.001));
+
+    for (iOp = PIXELOP_INVERT; iOp <= PIXELOP_SWAP_RED_BLUE; iOp++)
+    {
+        t0 = Bench_Now();
+        BM_PixelOp(&px, NULL, iOp, 20, 20);
+        t1 = Bench_Now();
+        printf("%-20s  %6.1f  %12.0f\n", apszOp[iOp], t1 - t0,
+               siz.cx * siz.cy / 1000.0 / max(t1 - t0, 0.001));
+    }
+    DeleteObject(hbm);
+}
+
+/* Puts one large image over another in each mode, and through BitBlt for
+ * comparison */
+static VOID Bench_Blend(VOID)
+{
+    static const char * const apszMode[] = {"opaque", "color key", "alpha"};
+    HBITMAP hbmDst, hbmSrc;
+    HDC hdcDst, hdcSrc;
+    HGDIOBJ hbmOldDst, hbmOldSrc;
+    BM_PIXELS pxDst, pxSrc;
+    SIZE siz;
+    INT iMode, y;
+    double t0, t1;
+
+    siz.cx = 4000;
+    siz.cy = 3000;
+    hbmDst = Bench_CreateImage(siz);
+    hbmSrc = BM_Create32(siz);
+    if (hbmDst == NULL || hbmSrc == NULL || !BM_GetPixels(hbmDst, &pxDst) ||
+        !BM_GetPixels(hbmSrc, &pxSrc))
+    {
+        printf("blend: out of memory\n");
+        DeleteObject(hbmDst);
+        DeleteObject(hbmSrc);
+        return;
+    }
+    /* every row a different gray, with itself as alpha */
+    for (y = 0; y < siz.cy; y++)
+        memset(BM_ScanLine(&pxSrc, y), y & 0xFF, siz.cx * 4);
+
+    printf("blend: %dx%d image\n", siz.cx, siz.cy);
+    printf("mode                      ms  megapixels/s\n");
+
+    hdcDst = CreateCompatibleDC(NULL);
+    hdcSrc = CreateCompatibleDC(NULL);
+    hbmOldDst = SelectObject(hdcDst, hbmDst);
+    hbmOldSrc = SelectObject(hdcSrc, hbmSrc);
+    t0 = Bench_Now();
+    BitBlt(hdcDst, 0, 0, siz.cx, siz.cy, hdcSrc, 0, 0, SRCCOPY);
+    GdiFlush();
+    t1 = Bench_Now();
+    SelectObject(hdcSrc, hbmOldSrc);
+    SelectObject(hdcDst, hbmOldDst);
+    DeleteDC(hdcSrc);
+    DeleteDC(hdcDst);
+    printf("%-20s  %6.1f  %12.0f\n", "BitBlt", t1 - t0,
+           siz.cx * siz.cy / 1000.0 / max(t1 - t0, 0.001));
+
+    for (iMode = BLEND_OPAQUE; iMode <= BLEND_ALPHA; iMode++)
+    {
+        t0 = Bench_Now();
+        BM_Blend(&pxDst, 0, 0, &pxSrc, iMode, RGB(0, 0, 0), NULL);
+        t1 = Bench_Now();
+        printf("%-20s  %6.1f  %12.0f\n", apszMode[iMode], t1 - t0,
+               siz.cx * siz.cy / 1000.0 / max(t1 - t0, 0.001));
+    }
+    DeleteObject(hbmDst);
+    DeleteObject(hbmSrc);
+}
+
+/* Fills a polygon of many random vertices by both rules, and through GDI
+ * for comparison */
+static VOID Bench_Polygon(VOID)
+{
+    static const INT acpt[] = {16, 1000, 10000};
+    HBITMAP hbm;
+    HDC hdc;
+    HGDIOBJ hbmOld, hbrOld;
+    BM_PIXELS px;
+    POINT *apt;
+    SIZE siz;
+    INT i, j;
+    double t0, t1, t2, t3;
+
+    siz.cx = 2000;
+    siz.cy = 2000;
+    hbm = Bench_CreateImage(siz);
+    apt = HeapAlloc(GetProcessHeap(), 0, 10000 * sizeof(POINT));
+    if (hbm == NULL || apt == NULL || !BM_GetPixels(hbm, &px))
+    {
+        printf("polygon: out of memory\n");
+        HeapFree(GetProcessHeap(), 0, apt);
+        DeleteObject(hbm);
+        return;
+    }
+
+    printf("polygon: %dx%d image\n", siz.cx, siz.cy);
+    printf("vertices  alternate ms  winding ms  GDI ms\n");
+
+    hdc = CreateCompatibleDC(NULL);
+    hbmOld = SelectObject(hdc, hbm);
+    hbrOld = SelectObject(hdc, GetStockObject(GRAY_BRUSH));
+    SelectObject(hdc, GetStockObject(NULL_PEN));
+    srand(1);
+    for (i = 0; i < sizeof(acpt) / sizeof(acpt[0]); i++)
+    {
+        for (j = 0; j < acpt[i]; j++)
+        {
+            apt[j].x = rand() % siz.cx;
+            apt[j].y = rand() % siz.cy;
+        }
+
+        t0 = Bench_Now();
+        BM_FillPolygon(&px, apt, acpt[i], ALTERNATE, RGB(255, 0, 0), NULL);
+        t1 = Bench_Now();
+        BM_FillPolygon(&px, apt, acpt[i], WINDING, RGB(0, 0, 255), NULL);
+        t2 = Bench_Now();
+        SetPolyFillMode(hdc, ALTERNATE);
+        Polygon(hdc, apt, acpt[i]);
+        GdiFlush();
+        t3 = Bench_Now();
+        printf("%8d  %12.1f  %10.1f  %6.1f\n", acpt[i], t1 - t0, t2 - t1,
+               t3 - t2);
+    }
+    SelectObject(hdc, hbrOld);
+    SelectObject(hdc, hbmOld);
+    DeleteDC(hdc);
+    HeapFree(GetProcessHeap(), 0, apt);
+    DeleteObject(hbm);
+}
+
+static const WCHAR blendW[] = {'b','l','e','n','d',0};
+static const WCHAR brushW[] = {'b','r','u','s','h',0};
+static const WCHAR fillW[] = {'f','i','l','l',0};
+static const WCHAR pixelopW[] = {'p','i','x','e','l','o','p',0};
+static const WCHAR pngW[] = {'p','n','g',0};
+static const WCHAR polygonW[] = {'p','o','l','y','g','o','n',0};
+static const WCHAR stretchW[] = {'s','t','r','e','t','c','h',0};
+static const WCHAR zoomW[] = {'z','o','o','m',0};
+
+static const struct
+{
+    LPCWSTR pszName;
+    VOID (*pfn)(VOID);
+} aBench[] =
+{
+    {blendW, Bench_Blend},
+    {brushW, Bench_Brush},
+    {fillW, Bench_Fill},
+    {pixelopW, Bench_PixelOp},
+    {pngW, Bench_Png},
+    {polygonW, Bench_Polygon},
+    {stretchW, Bench_Stretch},
+    {zoomW, Bench_Zoom},
+};
+
+/* Runs the benchmark named pszName, or all of them if it is empty */
+INT Bench_Main(LPCWSTR pszName)
+{
+    INT i;
+    BOOL fFound = FALSE;
+
+    for (i = 0; i < sizeof(aBench) / sizeof(aBench[0]); i++)
+    {
+        if (*pszName == 0 || !lstrcmpiW(pszName, aBench[i].pszName))
+        {
+            aBench[i].pfn();
+            fFound = TRUE;
+        }
+    }
+    if (!fFound)
+    {
+        printf("unknown benchmark\n");
+        return 1;
+    }
+    fflush(stdout);
+    return 0;
+}
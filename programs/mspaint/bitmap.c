@@ -19,7 +19,10 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
+#include <string.h>
 #include <windows.h>
+
+#include "main.h"
 #include "resource.h"
 
 #define  WIDTHBYTES(x)  (((x) + 31) / 32 * 4)
@@ -30,211 +33,469 @@ typedef struct tagBITMAPINFOEX
     RGBQUAD          bmiColors[256];
 } BITMAPINFOEX, FAR * LPBITMAPINFOEX;
 
-HBITMAP BM_Load(LPCWSTR pszFileName)
+static HBITMAP BM_CreateDIB(SIZE siz, WORD wBitCount)
 {
-    HANDLE hFile;
-    BITMAPFILEHEADER bf;
-    BITMAPINFOEX bi;
-    DWORD cb, cbImage;
-    DWORD dwError;
-    LPVOID pBits, pBits2;
-    HDC hDC, hMemDC;
-    HBITMAP hbm;
-#ifndef LR_LOADREALSIZE
-#define LR_LOADREALSIZE 128
-#endif
-    hbm = (HBITMAP)LoadImageW(NULL, pszFileName, IMAGE_BITMAP, 0, 0,
-        LR_LOADFROMFILE | LR_LOADREALSIZE | LR_CREATEDIBSECTION);
-    if (hbm != NULL)
-        return hbm;
+    BITMAPINFO bi;
+    VOID *pBits;
+    ZeroMemory(&bi.bmiHeader, sizeof(BITMAPINFOHEADER));
+    bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bi.bmiHeader.biWidth = siz.cx;
+    bi.bmiHeader.biHeight = -siz.cy;
+    bi.bmiHeader.biPlanes = 1;
+    bi.bmiHeader.biBitCount = wBitCount;
+    bi.bmiHeader.biCompression = BI_RGB;
+    return CreateDIBSection(NULL, &bi, DIB_RGB_COLORS, &pBits, NULL, 0);
+}
 
-    hFile = CreateFileW(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
-                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE)
-        return NULL;
+/*
+ * BMP reader.
+ *
+ * The file is mapped into memory and decoded in one pass, row by row,
+ * straight into the bits of a new DIB section: 32 bpp images stay 32 bpp,
+ * everything else becomes 24 bpp.  Only the DIB section is allocated, so
+ * at no time does the image exist twice in memory.
+ */
+
+#define BMP_WORD(pb)   ((WORD)((pb)[0] | ((pb)[1] << 8)))
+#define BMP_DWORD(pb)  ((DWORD)((pb)[0] | ((pb)[1] << 8) | ((pb)[2] << 16) | \
+                                ((DWORD)(pb)[3] << 24)))
 
-    if (!ReadFile(hFile, &bf, sizeof(BITMAPFILEHEADER), &cb, NULL))
+/* One channel of a 16 or 32 bpp pixel: mask, then shift down to at most
+ * 8 bits and look the value up */
+typedef struct
+{
+    DWORD   dwMask;
+    INT     nShift;
+    BYTE    abValue[256];
+} BMP_CHANNEL;
+
+typedef struct
+{
+    const BYTE *pbFile;
+    DWORD       cbFile;
+    LONG        cx;
+    LONG        cy;
+    BOOL        fTopDown;
+    WORD        wBitCount;
+    DWORD       dwCompression;
+    BMP_CHANNEL aChannels[4];       /* blue, green, red, alpha */
+    RGBQUAD     aColors[256];
+    const BYTE *pbBits;
+    DWORD       cbBits;
+} BMP_FILE;
+
+static VOID BMP_SetChannel(BMP_CHANNEL *pChannel, DWORD dwMask)
+{
+    DWORD dwMax, i;
+    INT nBits;
+
+    pChannel->dwMask = dwMask;
+    pChannel->nShift = 0;
+    ZeroMemory(pChannel->abValue, sizeof(pChannel->abValue));
+    if (dwMask == 0)
+        return;
+
+    while (!(dwMask & 1))
     {
-        dwError = GetLastError();
-        CloseHandle(NULL);
-        SetLastError(dwError);
-        return NULL;
+        dwMask >>= 1;
+        pChannel->nShift++;
+    }
+    for (nBits = 0; dwMask != 0; dwMask >>= 1)
+        nBits++;
+    if (nBits > 8)
+    {
+        pChannel->nShift += nBits - 8;
+        nBits = 8;
     }
+    dwMax = (1 << nBits) - 1;
+    for (i = 0; i <= dwMax; i++)
+        pChannel->abValue[i] = (BYTE)((i * 255 + dwMax / 2) / dwMax);
+}
 
-    pBits = NULL;
-    dwError = 0;
-    if (bf.bfType == 0x4D42 && bf.bfReserved1 == 0 && bf.bfReserved2 == 0 &&
-        bf.bfSize > bf.bfOffBits && bf.bfOffBits > sizeof(BITMAPFILEHEADER) &&
-        bf.bfOffBits <= sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOEX))
+static BYTE BMP_GetChannel(const BMP_CHANNEL *pChannel, DWORD dw)
+{
+    return pChannel->abValue[((dw & pChannel->dwMask) >> pChannel->nShift) & 0xFF];
+}
+
+/* Reads the headers of the mapped file pbf->pbFile.  Returns 0, or
+ * ERROR_NOT_SUPPORTED for compressions only GDI knows about, or
+ * -STRING_INVALID_BM. */
+static DWORD BMP_ReadHeaders(BMP_FILE *pbf)
+{
+    const BYTE *pb = pbf->pbFile;
+    DWORD cbHeader, dwOffBits, dwOffColors, cColors, cbColor, i;
+    LONG cy;
+
+    if (pbf->cbFile < sizeof(BITMAPFILEHEADER) + 12 || BMP_WORD(pb) != 0x4D42)
+        return -STRING_INVALID_BM;
+    dwOffBits = BMP_DWORD(pb + 10);
+    cbHeader = BMP_DWORD(pb + sizeof(BITMAPFILEHEADER));
+    if (cbHeader > pbf->cbFile - sizeof(BITMAPFILEHEADER))
+        return -STRING_INVALID_BM;
+    pb += sizeof(BITMAPFILEHEADER);
+
+    if (cbHeader == sizeof(BITMAPCOREHEADER))
+    {
+        pbf->cx = BMP_WORD(pb + 4);
+        cy = BMP_WORD(pb + 6);
+        pbf->wBitCount = BMP_WORD(pb + 10);
+        pbf->dwCompression = BI_RGB;
+        cColors = 0;
+        cbColor = sizeof(RGBTRIPLE);
+    }
+    else if (cbHeader >= sizeof(BITMAPINFOHEADER))
     {
-        cbImage = bf.bfSize - bf.bfOffBits;
-        pBits = HeapAlloc(GetProcessHeap(), 0, cbImage);
-        if (pBits != NULL)
+        pbf->cx = (LONG)BMP_DWORD(pb + 4);
+        cy = (LONG)BMP_DWORD(pb + 8);
+        pbf->wBitCount = BMP_WORD(pb + 14);
+        pbf->dwCompression = BMP_DWORD(pb + 16);
+        cColors = BMP_DWORD(pb + 32);
+        cbColor = sizeof(RGBQUAD);
+    }
+    else
+        return -STRING_INVALID_BM;
+
+    pbf->fTopDown = (cy < 0);
+    pbf->cy = pbf->fTopDown ? -cy : cy;
+    if (pbf->cx <= 0 || pbf->cx > 0x1000000 || pbf->cy <= 0 ||
+        pbf->cy > 0x1000000)
+        return -STRING_INVALID_BM;
+
+    switch (pbf->dwCompression)
+    {
+    case BI_RGB:
+        if (pbf->wBitCount != 1 && pbf->wBitCount != 4 &&
+            pbf->wBitCount != 8 && pbf->wBitCount != 16 &&
+            pbf->wBitCount != 24 && pbf->wBitCount != 32)
+            return -STRING_INVALID_BM;
+        break;
+    case BI_RLE8:
+    case BI_RLE4:
+        if (pbf->wBitCount != (pbf->dwCompression == BI_RLE8 ? 8 : 4) ||
+            pbf->fTopDown)
+            return -STRING_INVALID_BM;
+        break;
+    case BI_BITFIELDS:
+        if (pbf->wBitCount != 16 && pbf->wBitCount != 32)
+            return -STRING_INVALID_BM;
+        break;
+    default:
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    /* masks follow a BITMAPINFOHEADER, or are part of the larger headers */
+    dwOffColors = sizeof(BITMAPFILEHEADER) + cbHeader;
+    if (pbf->wBitCount == 16)
+    {
+        BMP_SetChannel(&pbf->aChannels[0], 0x001F);
+        BMP_SetChannel(&pbf->aChannels[1], 0x03E0);
+        BMP_SetChannel(&pbf->aChannels[2], 0x7C00);
+        BMP_SetChannel(&pbf->aChannels[3], 0);
+    }
+    else
+    {
+        BMP_SetChannel(&pbf->aChannels[0], 0x000000FF);
+        BMP_SetChannel(&pbf->aChannels[1], 0x0000FF00);
+        BMP_SetChannel(&pbf->aChannels[2], 0x00FF0000);
+        BMP_SetChannel(&pbf->aChannels[3], 0xFF000000);
+    }
+    if (pbf->dwCompression == BI_BITFIELDS)
+    {
+        if (cbHeader == sizeof(BITMAPINFOHEADER))
+            dwOffColors += 3 * sizeof(DWORD);
+        if (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) +
+            3 * sizeof(DWORD) > pbf->cbFile)
+            return -STRING_INVALID_BM;
+        BMP_SetChannel(&pbf->aChannels[0], BMP_DWORD(pb + 48));
+        BMP_SetChannel(&pbf->aChannels[1], BMP_DWORD(pb + 44));
+        BMP_SetChannel(&pbf->aChannels[2], BMP_DWORD(pb + 40));
+        BMP_SetChannel(&pbf->aChannels[3],
+                       cbHeader >= 56 ? BMP_DWORD(pb + 52) : 0);
+    }
+
+    ZeroMemory(pbf->aColors, sizeof(pbf->aColors));
+    if (pbf->wBitCount <= 8)
+    {
+        if (cColors == 0 || cColors > (1U << pbf->wBitCount))
+            cColors = 1 << pbf->wBitCount;
+        if (dwOffColors > pbf->cbFile ||
+            cColors * cbColor > pbf->cbFile - dwOffColors)
+            return -STRING_INVALID_BM;
+        pb = pbf->pbFile + dwOffColors;
+        for (i = 0; i < cColors; i++, pb += cbColor)
         {
-            if (ReadFile(hFile, &bi, bf.bfOffBits -
-                         sizeof(BITMAPFILEHEADER), &cb, NULL) &&
-                ReadFile(hFile, pBits, cbImage, &cb, NULL))
-            {
-                ;
-            }
-            else
-            {
-                dwError = GetLastError();
-                HeapFree(GetProcessHeap(), 0, pBits);
-                pBits = NULL;
-            }
+            pbf->aColors[i].rgbBlue = pb[0];
+            pbf->aColors[i].rgbGreen = pb[1];
+            pbf->aColors[i].rgbRed = pb[2];
         }
-        else
-            dwError = GetLastError();
     }
-    else
-        dwError = -STRING_INVALID_BM;
 
-    CloseHandle(hFile);
+    if (dwOffBits >= pbf->cbFile)
+        return -STRING_INVALID_BM;
+    pbf->pbBits = pbf->pbFile + dwOffBits;
+    pbf->cbBits = pbf->cbFile - dwOffBits;
+    return 0;
+}
 
-    if (pBits == NULL)
+static VOID BMP_DecodeRow(const BMP_FILE *pbf, const BYTE *pbSrc, LPBYTE pbDst)
+{
+    const RGBQUAD *pColor;
+    DWORD dw;
+    INT x, cbPixel = pbf->wBitCount / 8;
+
+    switch (pbf->wBitCount)
     {
-        SetLastError(dwError);
-        return NULL;
+    case 1:
+    case 4:
+    case 8:
+        for (x = 0; x < pbf->cx; x++)
+        {
+            if (pbf->wBitCount == 8)
+                pColor = &pbf->aColors[pbSrc[x]];
+            else if (pbf->wBitCount == 4)
+                pColor = &pbf->aColors[(pbSrc[x / 2] >> ((~x & 1) * 4)) & 15];
+            else
+                pColor = &pbf->aColors[(pbSrc[x / 8] >> (~x & 7)) & 1];
+            *pbDst++ = pColor->rgbBlue;
+            *pbDst++ = pColor->rgbGreen;
+            *pbDst++ = pColor->rgbRed;
+        }
+        break;
+
+    case 24:
+        memcpy(pbDst, pbSrc, pbf->cx * 3);
+        break;
+
+    default:
+        if (pbf->wBitCount == 32 && pbf->dwCompression == BI_RGB)
+        {
+            memcpy(pbDst, pbSrc, pbf->cx * 4);
+            break;
+        }
+        for (x = 0; x < pbf->cx; x++, pbSrc += cbPixel)
+        {
+            dw = (cbPixel == 2) ? BMP_WORD(pbSrc) : BMP_DWORD(pbSrc);
+            *pbDst++ = BMP_GetChannel(&pbf->aChannels[0], dw);
+            *pbDst++ = BMP_GetChannel(&pbf->aChannels[1], dw);
+            *pbDst++ = BMP_GetChannel(&pbf->aChannels[2], dw);
+            if (cbPixel == 4)
+                *pbDst++ = BMP_GetChannel(&pbf->aChannels[3], dw);
+        }
+        break;
     }
+}
 
-    hbm = NULL;
-    dwError = 0;
-    hDC = GetDC(NULL);
-    if (hDC != NULL)
+static VOID BMP_PutIndex(const BMP_FILE *pbf, BM_PIXELS *ppx, LONG x, LONG y,
+                         BYTE bIndex)
+{
+    const RGBQUAD *pColor = &pbf->aColors[bIndex];
+    LPBYTE pb;
+
+    if (x < 0 || x >= ppx->cx || y < 0 || y >= ppx->cy)
+        return;
+    pb = BM_ScanLine(ppx, y) + x * 3;
+    pb[0] = pColor->rgbBlue;
+    pb[1] = pColor->rgbGreen;
+    pb[2] = pColor->rgbRed;
+}
+
+/* Decodes RLE8 or RLE4 data.  Pixels the data skips stay black. */
+static BOOL BMP_DecodeRLE(const BMP_FILE *pbf, BM_PIXELS *ppx)
+{
+    const BYTE *pb = pbf->pbBits, *pbEnd = pbf->pbBits + pbf->cbBits;
+    BOOL fRLE8 = (pbf->dwCompression == BI_RLE8);
+    LONG x = 0, y = pbf->cy - 1;
+    INT i, n, cb;
+
+    while (y >= 0 && pbEnd - pb >= 2)
     {
-        hMemDC = CreateCompatibleDC(hDC);
-        if (hMemDC != NULL)
+        n = pb[0];
+        if (n != 0)
         {
-            hbm = CreateDIBSection(hMemDC, (BITMAPINFO*)&bi, DIB_RGB_COLORS,
-                                   &pBits2, NULL, 0);
-            if (hbm != NULL)
+            /* a run, alternating two colors with RLE4 */
+            for (i = 0; i < n; i++, x++)
             {
-                if (SetDIBits(hMemDC, hbm, 0, abs(bi.bmiHeader.biHeight),
-                              pBits, (BITMAPINFO*)&bi, DIB_RGB_COLORS))
-                {
-                    ;
-                }
-                else
-                {
-                    dwError = GetLastError();
-                    DeleteObject(hbm);
-                    hbm = NULL;
-                }
+                BMP_PutIndex(pbf, ppx, x, y, fRLE8 ? pb[1] :
+                             (i & 1) ? (pb[1] & 15) : (pb[1] >> 4));
             }
-            else
-                dwError = GetLastError();
+            pb += 2;
+            continue;
+        }
 
-            DeleteDC(hMemDC);
+        n = pb[1];
+        pb += 2;
+        switch (n)
+        {
+        case 0:     /* end of line */
+            x = 0;
+            y--;
+            break;
+
+        case 1:     /* end of bitmap */
+            return TRUE;
+
+        case 2:     /* delta */
+            if (pbEnd - pb < 2)
+                return FALSE;
+            x += pb[0];
+            y -= pb[1];
+            pb += 2;
+            break;
+
+        default:    /* absolute, padded to a word */
+            cb = fRLE8 ? n : (n + 1) / 2;
+            if (pbEnd - pb < cb)
+                return FALSE;
+            for (i = 0; i < n; i++, x++)
+            {
+                BMP_PutIndex(pbf, ppx, x, y, fRLE8 ? pb[i] :
+                             (i & 1) ? (pb[i / 2] & 15) : (pb[i / 2] >> 4));
+            }
+            pb += (cb + 1) & ~1;
+            break;
         }
-        else
-            dwError = GetLastError();
+    }
+    return TRUE;
+}
 
-        ReleaseDC(NULL, hDC);
+/* Creates the DIB section for pbf and decodes the pixels into it */
+static HBITMAP BMP_Decode(const BMP_FILE *pbf)
+{
+    HBITMAP hbm;
+    BM_PIXELS px;
+    SIZE siz;
+    DWORD cbRow;
+    LONG y;
+
+    cbRow = WIDTHBYTES(pbf->cx * pbf->wBitCount);
+    if (pbf->dwCompression != BI_RLE8 && pbf->dwCompression != BI_RLE4 &&
+        (ULONGLONG)cbRow * (pbf->cy - 1) + (pbf->cx * pbf->wBitCount + 7) / 8 >
+        pbf->cbBits)
+    {
+        SetLastError(-STRING_INVALID_BM);
+        return NULL;
     }
-    else
-        dwError = GetLastError();
 
-    HeapFree(GetProcessHeap(), 0, pBits);
-    SetLastError(dwError);
+    siz.cx = pbf->cx;
+    siz.cy = pbf->cy;
+    hbm = BM_CreateDIB(siz, pbf->wBitCount == 32 ? 32 : 24);
+    if (hbm == NULL)
+        return NULL;
+    if (!BM_GetPixels(hbm, &px))
+    {
+        DeleteObject(hbm);
+        return NULL;
+    }
 
+    if (pbf->dwCompression == BI_RLE8 || pbf->dwCompression == BI_RLE4)
+    {
+        if (!BMP_DecodeRLE(pbf, &px))
+        {
+            DeleteObject(hbm);
+            SetLastError(-STRING_INVALID_BM);
+            return NULL;
+        }
+        return hbm;
+    }
+
+    for (y = 0; y < pbf->cy; y++)
+    {
+        BMP_DecodeRow(pbf, pbf->pbBits + y * cbRow,
+                      BM_ScanLine(&px, pbf->fTopDown ? y : pbf->cy - 1 - y));
+    }
     return hbm;
 }
 
-BOOL BM_Save(LPCWSTR pszFileName, HBITMAP hbm)
+HBITMAP BM_Load(LPCWSTR pszFileName)
 {
-    BOOL f;
-    DWORD dwError;
-    BITMAPFILEHEADER bf;
-    BITMAPINFOEX bi;
-    DWORD cb;
-    DWORD cColors, cbColors;
-    HDC hDC;
-    HANDLE hFile;
-    LPVOID pBits;
-    BITMAP bm;
-    BITMAPINFOHEADER *pbmih = &bi.bmiHeader;
-
-    if (!GetObjectW(hbm, sizeof(BITMAP), &bm))
-        return FALSE;
-
-    ZeroMemory(pbmih, sizeof(BITMAPINFOHEADER));
-    pbmih->biSize             = sizeof(BITMAPINFOHEADER);
-    pbmih->biWidth            = bm.bmWidth;
-    pbmih->biHeight           = bm.bmHeight;
-    pbmih->biPlanes           = 1;
-    pbmih->biBitCount         = bm.bmBitsPixel;
-    pbmih->biCompression      = BI_RGB;
-    pbmih->biSizeImage        = bm.bmWidthBytes * bm.bmHeight;
+    HANDLE hFile, hMapping;
+    BMP_FILE bf;
+    LPVOID pv;
+    DWORD dwError, dwSizeHigh;
+    HBITMAP hbm;
+#ifndef LR_LOADREALSIZE
+#define LR_LOADREALSIZE 128
+#endif
 
-    if (bm.bmBitsPixel < 16)
-        cColors = 1 << bm.bmBitsPixel;
-    else
-        cColors = 0;
-    cbColors = cColors * sizeof(RGBQUAD);
+    hFile = CreateFileW(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
 
-    bf.bfType = 0x4d42;
-    bf.bfReserved1 = 0;
-    bf.bfReserved2 = 0;
-    cb = sizeof(BITMAPFILEHEADER) + pbmih->biSize + cbColors;
-    bf.bfOffBits = cb;
-    bf.bfSize = cb + pbmih->biSizeImage;
+    bf.cbFile = GetFileSize(hFile, &dwSizeHigh);
+    if (bf.cbFile == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+    {
+        dwError = GetLastError();
+        CloseHandle(hFile);
+        SetLastError(dwError);
+        return NULL;
+    }
+    if (dwSizeHigh != 0 || bf.cbFile == 0)
+    {
+        CloseHandle(hFile);
+        SetLastError(-STRING_INVALID_BM);
+        return NULL;
+    }
 
-    pBits = HeapAlloc(GetProcessHeap(), 0, pbmih->biSizeImage);
-    if (pBits == NULL)
-        return FALSE;
+    /* the view keeps the file open */
+    hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    dwError = GetLastError();
+    CloseHandle(hFile);
+    if (hMapping == NULL)
+    {
+        SetLastError(dwError);
+        return NULL;
+    }
+    pv = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    dwError = GetLastError();
+    CloseHandle(hMapping);
+    if (pv == NULL)
+    {
+        SetLastError(dwError);
+        return NULL;
+    }
 
-    f = FALSE;
-    dwError = 0;
-    hDC = GetDC(NULL);
-    if (hDC != NULL)
+    hbm = NULL;
+    bf.pbFile = pv;
+    if (PNG_IsPng(bf.pbFile, bf.cbFile))
+    {
+        hbm = PNG_Decode(bf.pbFile, bf.cbFile);
+        dwError = (hbm == NULL) ? GetLastError() : 0;
+    }
+    else
     {
-        if (GetDIBits(hDC, hbm, 0, bm.bmHeight, pBits, (BITMAPINFO*)&bi,
-            DIB_RGB_COLORS))
+        dwError = BMP_ReadHeaders(&bf);
+        if (dwError == 0)
         {
-            hFile = CreateFileW(pszFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
-                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL |
-                               FILE_FLAG_WRITE_THROUGH, NULL);
-            if (hFile != INVALID_HANDLE_VALUE)
-            {
-                f = WriteFile(hFile, &bf, sizeof(BITMAPFILEHEADER), &cb, NULL) &&
-                    WriteFile(hFile, &bi, sizeof(BITMAPINFOHEADER), &cb, NULL) &&
-                    WriteFile(hFile, &bi.bmiColors, cbColors, &cb, NULL) &&
-                    WriteFile(hFile, pBits, pbmih->biSizeImage, &cb, NULL);
-                if (!f)
-                    dwError = GetLastError();
-                CloseHandle(hFile);
-
-                if (!f)
-                    DeleteFileW(pszFileName);
-            }
-            else
+            hbm = BMP_Decode(&bf);
+            if (hbm == NULL)
                 dwError = GetLastError();
         }
-        else
-            dwError = GetLastError();
-        ReleaseDC(NULL, hDC);
     }
-    else
-        dwError = GetLastError();
+    UnmapViewOfFile(pv);
+
+    if (dwError == ERROR_NOT_SUPPORTED)
+    {
+        /* JPEG or PNG inside a BMP: leave it to GDI */
+        hbm = (HBITMAP)LoadImageW(NULL, pszFileName, IMAGE_BITMAP, 0, 0,
+            LR_LOADFROMFILE | LR_LOADREALSIZE | LR_CREATEDIBSECTION);
+        if (hbm == NULL)
+            dwError = -STRING_INVALID_BM;
+    }
 
-    HeapFree(GetProcessHeap(), 0, pBits);
     SetLastError(dwError);
-    return f;
+    return hbm;
 }
 
 HBITMAP BM_Create(SIZE siz)
 {
-    BITMAPINFO bi;
-    VOID *pBits;
-    ZeroMemory(&bi.bmiHeader, sizeof(BITMAPINFOHEADER));
-    bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bi.bmiHeader.biWidth = siz.cx;
-    bi.bmiHeader.biHeight = -siz.cy;
-    bi.bmiHeader.biPlanes = 1;
-    bi.bmiHeader.biBitCount = 24;
-    bi.bmiHeader.biCompression = BI_RGB;
-    return CreateDIBSection(NULL, &bi, DIB_RGB_COLORS, &pBits, NULL, 0);
+    return BM_CreateDIB(siz, 24);
+}
+
+/* 32 bpp, for buffers written a pixel at a time with aligned stores */
+HBITMAP BM_Create32(SIZE siz)
+{
+    return BM_CreateDIB(siz, 32);
 }
 
 HBITMAP BM_CreateResized(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz)
@@ -283,11 +544,215 @@ HBITMAP BM_CreateResized(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz)
     return hbmNew;
 }
 
+/* Writes the file in chunks of this size */
+#define BM_SAVE_CHUNK   (256 * 1024)
+
+/* Writes the header, color table and rows of the DIB section ppx, bottom
+ * row first, through a buffer of BM_SAVE_CHUNK bytes */
+static BOOL BM_WriteDIB(HANDLE hFile, HBITMAP hbm, const BM_PIXELS *ppx,
+                        BM_PROGRESSPROC pfnProgress, LPARAM lParam)
+{
+    BITMAPFILEHEADER bf;
+    BITMAPINFOHEADER bmih;
+    RGBQUAD aColors[256];
+    DWORD cColors, cbRow, cbUsed, cb;
+    HDC hMemDC;
+    HGDIOBJ hbmOld;
+    LPBYTE pbBuffer;
+    LONG y;
+    BOOL f;
+
+    cColors = 0;
+    if (ppx->wBitCount <= 8)
+    {
+        hMemDC = CreateCompatibleDC(NULL);
+        if (hMemDC == NULL)
+            return FALSE;
+        hbmOld = SelectObject(hMemDC, hbm);
+        cColors = GetDIBColorTable(hMemDC, 0, 1 << ppx->wBitCount, aColors);
+        SelectObject(hMemDC, hbmOld);
+        DeleteDC(hMemDC);
+    }
+
+    cbRow = WIDTHBYTES(ppx->cx * ppx->wBitCount);
+    ZeroMemory(&bmih, sizeof(BITMAPINFOHEADER));
+    bmih.biSize         = sizeof(BITMAPINFOHEADER);
+    bmih.biWidth        = ppx->cx;
+    bmih.biHeight       = ppx->cy;
+    bmih.biPlanes       = 1;
+    bmih.biBitCount     = ppx->wBitCount;
+    bmih.biCompression  = BI_RGB;
+    bmih.biSizeImage    = cbRow * ppx->cy;
+    bmih.biClrUsed      = cColors;
+
+    bf.bfType = 0x4d42;
+    bf.bfReserved1 = 0;
+    bf.bfReserved2 = 0;
+    bf.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) +
+                   cColors * sizeof(RGBQUAD);
+    bf.bfSize = bf.bfOffBits + bmih.biSizeImage;
+
+    pbBuffer = HeapAlloc(GetProcessHeap(), 0, max(BM_SAVE_CHUNK, cbRow));
+    if (pbBuffer == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    memcpy(pbBuffer, &bf, sizeof(BITMAPFILEHEADER));
+    cbUsed = sizeof(BITMAPFILEHEADER);
+    memcpy(pbBuffer + cbUsed, &bmih, sizeof(BITMAPINFOHEADER));
+    cbUsed += sizeof(BITMAPINFOHEADER);
+    memcpy(pbBuffer + cbUsed, aColors, cColors * sizeof(RGBQUAD));
+    cbUsed += cColors * sizeof(RGBQUAD);
+
+    f = TRUE;
+    for (y = ppx->cy - 1; y >= 0 && f; y--)
+    {
+        if (cbUsed + cbRow > max(BM_SAVE_CHUNK, cbRow))
+        {
+            f = WriteFile(hFile, pbBuffer, cbUsed, &cb, NULL);
+            cbUsed = 0;
+            if (pfnProgress != NULL)
+                pfnProgress((ppx->cy - 1 - y) * 100 / ppx->cy, lParam);
+        }
+        memcpy(pbBuffer + cbUsed, BM_ScanLine(ppx, y), cbRow);
+        cbUsed += cbRow;
+    }
+    if (f && cbUsed != 0)
+        f = WriteFile(hFile, pbBuffer, cbUsed, &cb, NULL);
+    if (f && pfnProgress != NULL)
+        pfnProgress(100, lParam);
+
+    HeapFree(GetProcessHeap(), 0, pbBuffer);
+    return f;
+}
+
+/* Saves hbm as a PNG file if pszFileName ends in .png, as a BMP file
+ * otherwise.  The rows are streamed from the DIB section to a
+ * temporary file next to pszFileName, which replaces it only once it has
+ * been written completely; a failed save leaves the old file alone.
+ * pfnProgress, if given, is called with the percentage written so far. */
+BOOL BM_SaveEx(LPCWSTR pszFileName, HBITMAP hbm, BM_PROGRESSPROC pfnProgress,
+               LPARAM lParam)
+{
+    static const WCHAR prefixW[] = {'p','n','t',0};
+    static const WCHAR pngW[] = {'.','p','n','g',0};
+    WCHAR szDir[MAX_PATH], szTemp[MAX_PATH];
+    LPWSTR pszName;
+    INT cch;
+    HBITMAP hbmDIB;
+    BM_PIXELS px;
+    HANDLE hFile;
+    BITMAP bm;
+    SIZE siz;
+    DWORD dwError;
+    BOOL f, fPng;
+
+    cch = lstrlenW(pszFileName);
+    fPng = cch >= 4 && !lstrcmpiW(pszFileName + cch - 4, pngW);
+
+    /* a device dependent bitmap has no bits to stream from, and PNG files
+     * are written from 24 or 32 bpp */
+    hbmDIB = NULL;
+    if (!BM_GetPixels(hbm, &px) || (fPng && px.wBitCount < 24))
+    {
+        if (!GetObjectW(hbm, sizeof(BITMAP), &bm))
+            return FALSE;
+        siz.cx = bm.bmWidth;
+        siz.cy = bm.bmHeight;
+        hbmDIB = BM_CreateResized(NULL, siz, hbm, siz);
+        if (hbmDIB == NULL)
+            return FALSE;
+        if (!BM_GetPixels(hbmDIB, &px))
+        {
+            dwError = GetLastError();
+            DeleteObject(hbmDIB);
+            SetLastError(dwError);
+            return FALSE;
+        }
+        hbm = hbmDIB;
+    }
+
+    f = FALSE;
+    if (GetFullPathNameW(pszFileName, MAX_PATH, szDir, &pszName) &&
+        pszName != NULL)
+    {
+        *pszName = 0;
+        if (GetTempFileNameW(szDir, prefixW, 0, szTemp))
+        {
+            hFile = CreateFileW(szTemp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                                NULL);
+            if (hFile != INVALID_HANDLE_VALUE)
+            {
+                if (fPng)
+                    f = PNG_Write(hFile, &px, Globals.nPngEffort, pfnProgress,
+                                  lParam);
+                else
+                    f = BM_WriteDIB(hFile, hbm, &px, pfnProgress, lParam);
+                f = f && FlushFileBuffers(hFile);
+                dwError = GetLastError();
+                CloseHandle(hFile);
+                if (f)
+                {
+                    f = MoveFileExW(szTemp, pszFileName,
+                                    MOVEFILE_REPLACE_EXISTING |
+                                    MOVEFILE_WRITE_THROUGH);
+                    dwError = GetLastError();
+                }
+            }
+            else
+                dwError = GetLastError();
+            if (!f)
+                DeleteFileW(szTemp);
+        }
+        else
+            dwError = GetLastError();
+    }
+    else
+        dwError = GetLastError();
+
+    if (hbmDIB != NULL)
+        DeleteObject(hbmDIB);
+    SetLastError(f ? 0 : dwError);
+    return f;
+}
+
+BOOL BM_Save(LPCWSTR pszFileName, HBITMAP hbm)
+{
+    return BM_SaveEx(pszFileName, hbm, NULL, 0);
+}
+
+/* Stretches the siz part of hbm to sizNew, with the filter of
+ * Globals.iStretchFilter if hbm is a 24 or 32 bpp DIB section, into a
+ * bitmap of the same depth */
 HBITMAP BM_CreateStretched(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz)
 {
     DWORD dwError;
     HDC hDC, hdcMem1, hdcMem2;
     HBITMAP hbmNew, hbmOld1, hbmOld2;
+    BM_PIXELS pxSrc, pxDst;
+
+    if (BM_GetPixels(hbm, &pxSrc) &&
+        (pxSrc.wBitCount == 24 || pxSrc.wBitCount == 32) &&
+        siz.cx <= pxSrc.cx && siz.cy <= pxSrc.cy)
+    {
+        hbmNew = BM_CreateDIB(sizNew, pxSrc.wBitCount);
+        if (hbmNew == NULL)
+            return NULL;
+        pxSrc.cx = siz.cx;
+        pxSrc.cy = siz.cy;
+        if (!BM_GetPixels(hbmNew, &pxDst) ||
+            !BM_Resample(&pxSrc, &pxDst, Globals.iStretchFilter))
+        {
+            dwError = GetLastError();
+            DeleteObject(hbmNew);
+            SetLastError(dwError);
+            return NULL;
+        }
+        return hbmNew;
+    }
 
     hbmNew = BM_Create(sizNew);
     if (hbmNew != NULL)
@@ -324,6 +789,59 @@ HBITMAP BM_CreateStretched(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz)
     return hbmNew;
 }
 
+/* Skews hbm as BM_Skew does, into a new bitmap of the size it needs and of
+ * the depth of hbm if that is 24 or 32 bpp */
+HBITMAP BM_CreateSkewed(HBITMAP hbm, INT nDegreeX, INT nDegreeY,
+                        COLORREF rgbBack)
+{
+    HBITMAP hbmNew, hbmDIB;
+    BM_PIXELS pxSrc, pxDst;
+    DWORD dwError;
+    BITMAP bm;
+    SIZE siz;
+
+    if (!GetObjectW(hbm, sizeof(BITMAP), &bm))
+        return NULL;
+    siz.cx = bm.bmWidth;
+    siz.cy = bm.bmHeight;
+
+    /* BM_Skew needs the bits at 24 or 32 bpp */
+    hbmDIB = NULL;
+    if (!BM_GetPixels(hbm, &pxSrc) ||
+        (pxSrc.wBitCount != 24 && pxSrc.wBitCount != 32))
+    {
+        hbmDIB = BM_CreateResized(NULL, siz, hbm, siz);
+        if (hbmDIB == NULL || !BM_GetPixels(hbmDIB, &pxSrc))
+        {
+            dwError = GetLastError();
+            if (hbmDIB != NULL)
+                DeleteObject(hbmDIB);
+            SetLastError(dwError);
+            return NULL;
+        }
+    }
+
+    hbmNew = BM_CreateDIB(BM_GetSkewedSize(siz, nDegreeX, nDegreeY),
+                          pxSrc.wBitCount);
+    if (hbmNew != NULL &&
+        (!BM_GetPixels(hbmNew, &pxDst) ||
+         !BM_Skew(&pxSrc, &pxDst, nDegreeX, nDegreeY, rgbBack)))
+    {
+        dwError = GetLastError();
+        DeleteObject(hbmNew);
+        SetLastError(dwError);
+        hbmNew = NULL;
+    }
+
+    if (hbmDIB != NULL)
+    {
+        dwError = GetLastError();
+        DeleteObject(hbmDIB);
+        SetLastError(dwError);
+    }
+    return hbmNew;
+}
+
 HBITMAP BM_CreateHFliped(HWND hWnd, HBITMAP hbm, SIZE siz)
 {
     DWORD dwError;
@@ -404,137 +922,335 @@ HBITMAP BM_CreateVFliped(HWND hWnd, HBITMAP hbm, SIZE siz)
     return hbmNew;
 }
 
-HBITMAP BM_CreateXYSwaped(HWND hWnd, HBITMAP hbm, SIZE siz)
+/* Tile edge, in pixels, of the blocked transpose.  32 rows of 32 pixels
+ * keep both the source and the destination tile in L1. */
+#define BM_TILE 32
+
+BOOL BM_GetPixels(HBITMAP hbm, BM_PIXELS *ppx)
 {
+    DIBSECTION ds;
+
+    if (hbm == NULL ||
+        GetObjectW(hbm, sizeof(DIBSECTION), &ds) != sizeof(DIBSECTION) ||
+        ds.dsBm.bmBits == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /* GDI may still have drawing queued for this bitmap */
+    GdiFlush();
+
+    ppx->cx = ds.dsBm.bmWidth;
+    ppx->cy = ds.dsBm.bmHeight;
+    ppx->wBitCount = ds.dsBm.bmBitsPixel;
+    ppx->cbStride = WIDTHBYTES(ppx->cx * ppx->wBitCount);
+    if (ds.dsBmih.biHeight < 0)
+    {
+        ppx->pBits = (LPBYTE)ds.dsBm.bmBits;
+    }
+    else
+    {
+        /* bottom-up: start at the last scanline and walk backwards */
+        ppx->pBits = (LPBYTE)ds.dsBm.bmBits + (ppx->cy - 1) * ppx->cbStride;
+        ppx->cbStride = -ppx->cbStride;
+    }
+    return TRUE;
+}
+
+/* Returns a 24 or 32 bpp DIB section of size siz with the contents of hbm,
+ * and fills in *ppx for it.  That is hbm itself if it already qualifies, so
+ * a 32 bpp image keeps its alpha, otherwise a 24 bpp copy which the caller
+ * has to delete. */
+static HBITMAP BM_GetDIB(HWND hWnd, HBITMAP hbm, SIZE siz, BM_PIXELS *ppx)
+{
+    HBITMAP hbmNew;
     DWORD dwError;
-    HDC hDC, hdcMem1, hdcMem2;
-    HBITMAP hbmNew, hbmOld1, hbmOld2;
-    INT x, y;
-    SIZE siz2;
-    siz2.cx = siz.cy;
-    siz2.cy = siz.cx;
 
-    hbmNew = BM_Create(siz2);
-    if (hbmNew != NULL)
+    if (BM_GetPixels(hbm, ppx) &&
+        (ppx->wBitCount == 24 || ppx->wBitCount == 32) &&
+        ppx->cx == siz.cx && ppx->cy == siz.cy)
+        return hbm;
+
+    hbmNew = BM_CreateResized(hWnd, siz, hbm, siz);
+    if (hbmNew != NULL && !BM_GetPixels(hbmNew, ppx))
     {
-        dwError = 0;
-        hDC = GetDC(hWnd);
-        hdcMem1 = CreateCompatibleDC(hDC);
-        if (hdcMem1 != NULL)
-        {
-            hbmOld1 = SelectObject(hdcMem1, hbmNew);
+        dwError = GetLastError();
+        DeleteObject(hbmNew);
+        SetLastError(dwError);
+        hbmNew = NULL;
+    }
+    return hbmNew;
+}
 
-            hdcMem2 = CreateCompatibleDC(hDC);
-            if (hdcMem2 != NULL)
-            {
-                hbmOld2 = SelectObject(hdcMem2, hbm);
+/* dst(x, y) = src(y, x), walked in BM_TILE x BM_TILE blocks.  fFlipX
+ * mirrors the result horizontally and fFlipY vertically, which turns the
+ * transpose into a 90 or 270 degree rotation in the same pass.  Both are
+ * 24 or both 32 bpp. */
+static VOID BM_TransposeBits(const BM_PIXELS *ppxSrc, const BM_PIXELS *ppxDst,
+                             BOOL fFlipX, BOOL fFlipY)
+{
+    INT x0, y0, x1, y1, x, y, xSrc, ySrc, cbPixel;
+    LONG cbStep;
+    LPBYTE pbSrc, pbDst;
 
-                for (y = 0; y < siz2.cy; y++)
+    cbPixel = ppxSrc->wBitCount / 8;
+
+    cbStep = fFlipX ? -ppxSrc->cbStride : ppxSrc->cbStride;
+    for (y0 = 0; y0 < ppxDst->cy; y0 += BM_TILE)
+    {
+        y1 = min(y0 + BM_TILE, ppxDst->cy);
+        for (x0 = 0; x0 < ppxDst->cx; x0 += BM_TILE)
+        {
+            x1 = min(x0 + BM_TILE, ppxDst->cx);
+            ySrc = fFlipX ? ppxDst->cx - 1 - x0 : x0;
+            for (y = y0; y < y1; y++)
+            {
+                xSrc = fFlipY ? ppxDst->cy - 1 - y : y;
+                pbSrc = BM_ScanLine(ppxSrc, ySrc) + xSrc * cbPixel;
+                pbDst = BM_ScanLine(ppxDst, y) + x0 * cbPixel;
+                if (cbPixel == 4)
                 {
-                    for (x = 0; x < siz2.cx; x++)
+                    for (x = x0; x < x1; x++)
                     {
-                        SetPixel(hdcMem1, x, y, GetPixel(hdcMem2, y, x));
+                        *(DWORD *)pbDst = *(const DWORD *)pbSrc;
+                        pbDst += 4;
+                        pbSrc += cbStep;
                     }
+                    continue;
+                }
+                for (x = x0; x < x1; x++)
+                {
+                    pbDst[0] = pbSrc[0];
+                    pbDst[1] = pbSrc[1];
+                    pbDst[2] = pbSrc[2];
+                    pbDst += 3;
+                    pbSrc += cbStep;
                 }
-
-                SelectObject(hdcMem2, hbmOld2);
-                DeleteDC(hdcMem2);
             }
-            else
-                dwError = GetLastError();
-            SelectObject(hdcMem1, hbmOld1);
-
-            DeleteDC(hdcMem1);
         }
-        else
-            dwError = GetLastError();
-        ReleaseDC(hWnd, hDC);
-        SetLastError(dwError);
     }
-
-    return hbmNew;
 }
 
-HBITMAP BM_CreateRotated90Degree(HWND hWnd, HBITMAP hbm, SIZE siz)
+static HBITMAP BM_CreateTransposed(HWND hWnd, HBITMAP hbm, SIZE siz,
+                                   BOOL fFlipX, BOOL fFlipY)
 {
     DWORD dwError;
-    HBITMAP hbmNew1, hbmNew2;
+    HBITMAP hbmSrc, hbmNew;
+    BM_PIXELS pxSrc, pxDst;
     SIZE siz2;
     siz2.cx = siz.cy;
     siz2.cy = siz.cx;
-    hbmNew1 = BM_CreateXYSwaped(hWnd, hbm, siz);
-    hbmNew2 = NULL;
-    if (hbmNew1 != NULL)
+
+    hbmSrc = BM_GetDIB(hWnd, hbm, siz, &pxSrc);
+    if (hbmSrc == NULL)
+        return NULL;
+
+    dwError = 0;
+    hbmNew = BM_CreateDIB(siz2, pxSrc.wBitCount);
+    if (hbmNew != NULL && BM_GetPixels(hbmNew, &pxDst))
+        BM_TransposeBits(&pxSrc, &pxDst, fFlipX, fFlipY);
+    else
     {
-        dwError = 0;
-        hbmNew2 = BM_CreateHFliped(hWnd, hbmNew1, siz2);
-        if (hbmNew2 == NULL)
-            dwError = GetLastError();
-        DeleteObject(hbmNew1);
-        SetLastError(dwError);
+        dwError = GetLastError();
+        if (hbmNew != NULL)
+            DeleteObject(hbmNew);
+        hbmNew = NULL;
+    }
+
+    if (hbmSrc != hbm)
+        DeleteObject(hbmSrc);
+    SetLastError(dwError);
+    return hbmNew;
+}
+
+HBITMAP BM_CreateXYSwaped(HWND hWnd, HBITMAP hbm, SIZE siz)
+{
+    return BM_CreateTransposed(hWnd, hbm, siz, FALSE, FALSE);
+}
+
+HBITMAP BM_CreateRotated90Degree(HWND hWnd, HBITMAP hbm, SIZE siz)
+{
+    return BM_CreateTransposed(hWnd, hbm, siz, TRUE, FALSE);
+}
+
+/* dst(x, y) = src(cx - 1 - x, cy - 1 - y), both 24 or both 32 bpp */
+static VOID BM_Rotate180Bits(const BM_PIXELS *ppxSrc, const BM_PIXELS *ppxDst)
+{
+    INT x, y, cbPixel;
+    LPBYTE pbSrc, pbDst;
+
+    cbPixel = ppxSrc->wBitCount / 8;
+    for (y = 0; y < ppxDst->cy; y++)
+    {
+        pbSrc = BM_ScanLine(ppxSrc, ppxSrc->cy - 1 - y) +
+                (ppxSrc->cx - 1) * cbPixel;
+        pbDst = BM_ScanLine(ppxDst, y);
+        if (cbPixel == 4)
+        {
+            for (x = 0; x < ppxDst->cx; x++)
+                ((DWORD *)pbDst)[x] = ((const DWORD *)pbSrc)[-x];
+            continue;
+        }
+        for (x = 0; x < ppxDst->cx; x++)
+        {
+            pbDst[0] = pbSrc[0];
+            pbDst[1] = pbSrc[1];
+            pbDst[2] = pbSrc[2];
+            pbDst += 3;
+            pbSrc -= 3;
+        }
     }
-    return hbmNew2;
 }
 
 HBITMAP BM_CreateRotated180Degree(HWND hWnd, HBITMAP hbm, SIZE siz)
 {
     DWORD dwError;
-    HBITMAP hbmNew1, hbmNew2;
-    hbmNew1 = BM_CreateHFliped(hWnd, hbm, siz);
-    hbmNew2 = NULL;
-    if (hbmNew1 != NULL)
+    HBITMAP hbmSrc, hbmNew;
+    BM_PIXELS pxSrc, pxDst;
+
+    hbmSrc = BM_GetDIB(hWnd, hbm, siz, &pxSrc);
+    if (hbmSrc == NULL)
+        return NULL;
+
+    dwError = 0;
+    hbmNew = BM_CreateDIB(siz, pxSrc.wBitCount);
+    if (hbmNew != NULL && BM_GetPixels(hbmNew, &pxDst))
+        BM_Rotate180Bits(&pxSrc, &pxDst);
+    else
     {
-        dwError = 0;
-        hbmNew2 = BM_CreateVFliped(hWnd, hbmNew1, siz);
-        if (hbmNew2 == NULL)
-            dwError = GetLastError();
-        DeleteObject(hbmNew1);
-        SetLastError(dwError);
+        dwError = GetLastError();
+        if (hbmNew != NULL)
+            DeleteObject(hbmNew);
+        hbmNew = NULL;
     }
-    return hbmNew2;
+
+    if (hbmSrc != hbm)
+        DeleteObject(hbmSrc);
+    SetLastError(dwError);
+    return hbmNew;
 }
 
-HBITMAP BM_CreateRotated270Degree(HWND hWnd, HBITMAP hbm, SIZE siz)
+/* Rotates a 24 or 32 bpp DIB section by 180 degrees in place by swapping
+ * each pixel with its mirror image.  Returns FALSE, without touching hbm,
+ * for any other kind of bitmap. */
+BOOL BM_Rotate180Degree(HBITMAP hbm)
 {
-    DWORD dwError;
-    HBITMAP hbmNew1, hbmNew2;
-    hbmNew1 = BM_CreateHFliped(hWnd, hbm, siz);
-    hbmNew2 = NULL;
-    if (hbmNew1 != NULL)
+    BM_PIXELS px;
+    INT x, y, cx;
+    LPBYTE pb1, pb2;
+    DWORD dw;
+    BYTE b;
+
+    if (!BM_GetPixels(hbm, &px) || (px.wBitCount != 24 && px.wBitCount != 32))
+        return FALSE;
+
+    for (y = 0; y <= (px.cy - 1) / 2; y++)
     {
-        dwError = 0;
-        hbmNew2 = BM_CreateXYSwaped(hWnd, hbmNew1, siz);
-        if (hbmNew2 == NULL)
-            dwError = GetLastError();
-        DeleteObject(hbmNew1);
-        SetLastError(dwError);
+        /* the middle row of an odd height is only swapped with itself */
+        cx = (y == px.cy - 1 - y) ? px.cx / 2 : px.cx;
+        pb1 = BM_ScanLine(&px, y);
+        pb2 = BM_ScanLine(&px, px.cy - 1 - y) +
+              (px.cx - 1) * (px.wBitCount / 8);
+        if (px.wBitCount == 32)
+        {
+            for (x = 0; x < cx; x++)
+            {
+                dw = ((DWORD *)pb1)[x];
+                ((DWORD *)pb1)[x] = ((DWORD *)pb2)[-x];
+                ((DWORD *)pb2)[-x] = dw;
+            }
+            continue;
+        }
+        for (x = 0; x < cx; x++)
+        {
+            b = pb1[0]; pb1[0] = pb2[0]; pb2[0] = b;
+            b = pb1[1]; pb1[1] = pb2[1]; pb2[1] = b;
+            b = pb1[2]; pb1[2] = pb2[2]; pb2[2] = b;
+            pb1 += 3;
+            pb2 -= 3;
+        }
     }
-    return hbmNew2;
+    return TRUE;
+}
+
+HBITMAP BM_CreateRotated270Degree(HWND hWnd, HBITMAP hbm, SIZE siz)
+{
+    return BM_CreateTransposed(hWnd, hbm, siz, FALSE, TRUE);
 }
 
-HBITMAP BM_Copy(HBITMAP hbm)
+/* Copies the part *prc of the 24 or 32 bpp DIB section hbm into a new one
+ * of the same depth, reading only the rows it covers.  What lies outside
+ * hbm is left black. */
+HBITMAP BM_CopyRect(HBITMAP hbm, const RECT *prc)
 {
-    HBITMAP ret;
-    
-    ret = CopyImage(hbm, IMAGE_BITMAP, 0, 0, LR_COPYRETURNORG);
-    return ret;
+    BM_PIXELS pxSrc, pxDst;
+    HBITMAP hbmNew;
+    RECT rc;
+    SIZE siz;
+    INT cbPixel;
+    LONG y;
+
+    if (!BM_GetPixels(hbm, &pxSrc) ||
+        (pxSrc.wBitCount != 24 && pxSrc.wBitCount != 32))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    siz.cx = prc->right - prc->left;
+    siz.cy = prc->bottom - prc->top;
+    hbmNew = BM_CreateDIB(siz, pxSrc.wBitCount);
+    if (hbmNew == NULL || !BM_GetPixels(hbmNew, &pxDst))
+        return hbmNew;
+
+    cbPixel = pxSrc.wBitCount / 8;
+    rc.left = max(prc->left, 0);
+    rc.top = max(prc->top, 0);
+    rc.right = min(prc->right, pxSrc.cx);
+    rc.bottom = min(prc->bottom, pxSrc.cy);
+    for (y = rc.top; y < rc.bottom && rc.left < rc.right; y++)
+        memcpy(BM_ScanLine(&pxDst, y - prc->top) + (rc.left - prc->left) * cbPixel,
+               BM_ScanLine(&pxSrc, y) + rc.left * cbPixel,
+               (rc.right - rc.left) * cbPixel);
+    return hbmNew;
 }
 
+/* Packs hbm as CF_DIB data: a bottom-up DIB written straight into the
+ * returned global memory, which is not zeroed first */
 HGLOBAL BM_Pack(HBITMAP hbm)
 {
-    BOOL f;
-    DWORD dwError;
+    BITMAPINFOHEADER *pbmih;
+    BM_PIXELS px;
     HGLOBAL hPack;
-    BITMAPINFOEX bi;
-    DWORD cb, cbPack, cColors, cbColors;
+    DWORD dwError, cbRow, cbHeader, cColors;
     HDC hDC;
-    LPVOID pPack, pBits;
+    LPBYTE pPack;
     BITMAP bm;
-    BITMAPINFOHEADER *pbmih = &bi.bmiHeader;
+    LONG y;
+    BOOL f;
 
     if (!GetObjectW(hbm, sizeof(BITMAP), &bm))
-        return FALSE;
+        return NULL;
 
+    cColors = (bm.bmBitsPixel < 16) ? 1 << bm.bmBitsPixel : 0;
+    cbHeader = sizeof(BITMAPINFOHEADER) + cColors * sizeof(RGBQUAD);
+    cbRow = WIDTHBYTES(bm.bmWidth * bm.bmBitsPixel);
+
+    hPack = GlobalAlloc(GMEM_DDESHARE | GMEM_MOVEABLE,
+                        cbHeader + cbRow * bm.bmHeight);
+    if (hPack == NULL)
+        return NULL;
+    pPack = GlobalLock(hPack);
+    if (pPack == NULL)
+    {
+        dwError = GetLastError();
+        GlobalFree(hPack);
+        SetLastError(dwError);
+        return NULL;
+    }
+
+    pbmih = (BITMAPINFOHEADER *)pPack;
     ZeroMemory(pbmih, sizeof(BITMAPINFOHEADER));
     pbmih->biSize             = sizeof(BITMAPINFOHEADER);
     pbmih->biWidth            = bm.bmWidth;
@@ -542,46 +1258,35 @@ HGLOBAL BM_Pack(HBITMAP hbm)
     pbmih->biPlanes           = 1;
     pbmih->biBitCount         = bm.bmBitsPixel;
     pbmih->biCompression      = BI_RGB;
-    pbmih->biSizeImage        = bm.bmWidthBytes * bm.bmHeight;
-
-    if (bm.bmBitsPixel < 16)
-        cColors = 1 << bm.bmBitsPixel;
-    else
-        cColors = 0;
-    cbColors = cColors * sizeof(RGBQUAD);
-
-    cb = pbmih->biSize + cbColors;
-    cbPack = cb + pbmih->biSizeImage;
-
-    hPack = GlobalAlloc(GMEM_DDESHARE|GHND, cbPack);
-    pPack = GlobalLock(hPack);
-    if (pPack == NULL)
-        return NULL;
+    pbmih->biSizeImage        = cbRow * bm.bmHeight;
 
     f = FALSE;
     dwError = 0;
-    pBits = HeapAlloc(GetProcessHeap(), 0, pbmih->biSizeImage);
-    if (pBits != NULL)
+    if (BM_GetPixels(hbm, &px) && (px.wBitCount == 24 || px.wBitCount == 32))
     {
+        /* the rows of the DIB section, bottom one first */
+        for (y = 0; y < px.cy; y++)
+        {
+            CopyMemory(pPack + cbHeader + (px.cy - 1 - y) * cbRow,
+                       BM_ScanLine(&px, y), cbRow);
+        }
+        f = TRUE;
+    }
+    else
+    {
+        /* GetDIBits fills in the color table and converts the rows */
         hDC = GetDC(NULL);
         if (hDC != NULL)
         {
-            if (GetDIBits(hDC, hbm, 0, bm.bmHeight, pBits, (BITMAPINFO*)&bi,
-                DIB_RGB_COLORS))
-            {
-                CopyMemory(pPack, &bi, sizeof(BITMAPINFOHEADER));
-                CopyMemory((LPBYTE)pPack + sizeof(BITMAPINFOHEADER), &bi.bmiColors, cbColors);
-                CopyMemory((LPBYTE)pPack + cb, pBits, pbmih->biSizeImage);
+            if (GetDIBits(hDC, hbm, 0, bm.bmHeight, pPack + cbHeader,
+                          (BITMAPINFO*)pbmih, DIB_RGB_COLORS))
                 f = TRUE;
-            }
             else
                 dwError = GetLastError();
             ReleaseDC(NULL, hDC);
         }
         else
             dwError = GetLastError();
-
-        HeapFree(GetProcessHeap(), 0, pBits);
     }
 
     GlobalUnlock(hPack);
@@ -595,72 +1300,59 @@ HGLOBAL BM_Pack(HBITMAP hbm)
     return hPack;
 }
 
+/* Creates a DIB section from the CF_DIB data hPack, copying the bits out of
+ * the global memory once */
 HBITMAP BM_Unpack(HGLOBAL hPack)
 {
+    const BITMAPINFOHEADER *pbmih;
     HBITMAP hbm;
-    DWORD dwError;
-    BITMAPINFOEX bi;
-    DWORD cb, cColors, cbColors;
-    HDC hDC, hMemDC;
-    LPVOID pPack, pBits;
-    BITMAPINFOHEADER *pbmih = &bi.bmiHeader;
+    DWORD dwError, cColors, cbHeader;
+    ULONGLONG cbImage;
+    SIZE_T cbPack;
+    LPBYTE pPack;
+    LPVOID pBits;
 
+    cbPack = GlobalSize(hPack);
     pPack = GlobalLock(hPack);
     if (pPack == NULL)
         return NULL;
 
-    CopyMemory(pbmih, pPack, sizeof(BITMAPINFOHEADER));
-    pbmih->biSizeImage = WIDTHBYTES(pbmih->biWidth * pbmih->biBitCount) *
-                         abs(pbmih->biHeight);
-    if (pbmih->biClrUsed != 0)
-        cColors = pbmih->biClrUsed;
-    else if (pbmih->biBitCount < 16)
-        cColors = 1 << pbmih->biBitCount;
-    else
-        cColors = 0;
-
-    cbColors = cColors * sizeof(RGBQUAD);
-    cb = pbmih->biSize + cbColors;
-    CopyMemory(&bi, pPack, cb);
-
     hbm = NULL;
-    dwError = 0;
-    hDC = GetDC(NULL);
-    if (hDC != NULL)
+    dwError = -STRING_INVALID_BM;
+    pbmih = (const BITMAPINFOHEADER *)pPack;
+    if (cbPack >= sizeof(BITMAPINFOHEADER) &&
+        pbmih->biSize >= sizeof(BITMAPINFOHEADER) && pbmih->biSize < cbPack &&
+        pbmih->biWidth > 0 && pbmih->biHeight != 0 &&
+        (pbmih->biCompression == BI_RGB ||
+         pbmih->biCompression == BI_BITFIELDS))
     {
-        hMemDC = CreateCompatibleDC(hDC);
-        if (hMemDC != NULL)
+        if (pbmih->biClrUsed != 0)
+            cColors = min(pbmih->biClrUsed, 256);
+        else if (pbmih->biBitCount < 16)
+            cColors = 1 << pbmih->biBitCount;
+        else
+            cColors = 0;
+        cbHeader = pbmih->biSize + cColors * sizeof(RGBQUAD);
+        if (pbmih->biCompression == BI_BITFIELDS &&
+            pbmih->biSize == sizeof(BITMAPINFOHEADER))
+            cbHeader += 3 * sizeof(DWORD);
+
+        cbImage = (ULONGLONG)WIDTHBYTES((ULONGLONG)pbmih->biWidth *
+                                        pbmih->biBitCount) *
+                  abs(pbmih->biHeight);
+        if (cbHeader + cbImage <= cbPack)
         {
-            hbm = CreateDIBSection(hMemDC, (BITMAPINFO*)&bi, DIB_RGB_COLORS,
-                                   &pBits, NULL, 0);
+            /* the same header gives the DIB section the same layout */
+            hbm = CreateDIBSection(NULL, (const BITMAPINFO*)pPack,
+                                   DIB_RGB_COLORS, &pBits, NULL, 0);
             if (hbm != NULL)
-            {
-                CopyMemory(pBits, (LPBYTE)pPack + cb, pbmih->biSizeImage);
-
-                if (SetDIBits(hMemDC, hbm, 0, abs(bi.bmiHeader.biHeight),
-                              pBits, (BITMAPINFO*)&bi, DIB_RGB_COLORS))
-                {
-                    ;
-                }
-                else
-                {
-                    dwError = GetLastError();
-                    DeleteObject(hbm);
-                    hbm = NULL;
-                }
-            }
+                CopyMemory(pBits, pPack + cbHeader, (SIZE_T)cbImage);
             else
                 dwError = GetLastError();
-
-            DeleteDC(hMemDC);
         }
-        else
-            dwError = GetLastError();
     }
-    else
-        dwError = GetLastError();
 
     GlobalUnlock(hPack);
-    SetLastError(dwError);
+    SetLastError(hbm != NULL ? 0 : dwError);
     return hbm;
 }
@@ -0,0 +1,216 @@
+/*
+ *  Paint (blend.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Putting one 24 or 32 bpp DIB over another, as the floating selection is
+ * put over the image: copied as it is, with the pixels of a key color left
+ * out, or mixed by the alpha of its own pixels.  Only the part within a
+ * clipping rectangle is touched, so that a repaint costs what it shows.
+ * Like the pixel operations, each mode is a kernel over a run of pixels
+ * of a row.  Between two 32 bpp images, the usual case on screen, the
+ * kernels take four pixels at a time with SSE2.
+ */
+
+#include <string.h>
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "main.h"
+
+typedef VOID (*BLEND_KERNEL)(LPBYTE pbDst, INT cbDstPixel, const BYTE *pbSrc,
+                             INT cbSrcPixel, INT cPixels, COLORREF rgbKey);
+
+static VOID Blend_Opaque(LPBYTE pbDst, INT cbDstPixel, const BYTE *pbSrc,
+                         INT cbSrcPixel, INT cPixels, COLORREF rgbKey)
+{
+    INT i = 0;
+
+    if (cbDstPixel == 3 && cbSrcPixel == 3)
+    {
+        memcpy(pbDst, pbSrc, cPixels * cbDstPixel);
+        return;
+    }
+#ifdef __SSE2__
+    if (cbDstPixel == 4 && cbSrcPixel == 4)
+    {
+        const __m128i vAlpha = _mm_set1_epi32(0xFF000000);
+        for (; i + 4 <= cPixels; i += 4, pbDst += 16, pbSrc += 16)
+        {
+            __m128i vSrc = _mm_loadu_si128((const __m128i *)pbSrc);
+            __m128i vDst = _mm_loadu_si128((const __m128i *)pbDst);
+            _mm_storeu_si128((__m128i *)pbDst,
+                             _mm_or_si128(_mm_andnot_si128(vAlpha, vSrc),
+                                          _mm_and_si128(vAlpha, vDst)));
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pbDst += cbDstPixel, pbSrc += cbSrcPixel)
+    {
+        pbDst[0] = pbSrc[0];
+        pbDst[1] = pbSrc[1];
+        pbDst[2] = pbSrc[2];
+    }
+}
+
+static VOID Blend_ColorKey(LPBYTE pbDst, INT cbDstPixel, const BYTE *pbSrc,
+                           INT cbSrcPixel, INT cPixels, COLORREF rgbKey)
+{
+    BYTE b = GetBValue(rgbKey), g = GetGValue(rgbKey), r = GetRValue(rgbKey);
+    INT i = 0;
+
+#ifdef __SSE2__
+    if (cbDstPixel == 4 && cbSrcPixel == 4)
+    {
+        const __m128i vAlpha = _mm_set1_epi32(0xFF000000);
+        const __m128i vKey = _mm_set1_epi32(b | (g << 8) | (r << 16));
+        for (; i + 4 <= cPixels; i += 4, pbDst += 16, pbSrc += 16)
+        {
+            __m128i vSrc = _mm_andnot_si128(vAlpha,
+                _mm_loadu_si128((const __m128i *)pbSrc));
+            __m128i vDst = _mm_loadu_si128((const __m128i *)pbDst);
+            /* the key pixels, and the alpha of all, come from vDst */
+            __m128i vKeep = _mm_or_si128(_mm_cmpeq_epi32(vSrc, vKey), vAlpha);
+            _mm_storeu_si128((__m128i *)pbDst,
+                             _mm_or_si128(_mm_andnot_si128(vKeep, vSrc),
+                                          _mm_and_si128(vKeep, vDst)));
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pbDst += cbDstPixel, pbSrc += cbSrcPixel)
+    {
+        if (pbSrc[0] == b && pbSrc[1] == g && pbSrc[2] == r)
+            continue;
+        pbDst[0] = pbSrc[0];
+        pbDst[1] = pbSrc[1];
+        pbDst[2] = pbSrc[2];
+    }
+}
+
+/* x * a / 255 rounded to the nearest integer, without dividing: with
+ * t = x * a + 128 it is (t + (t >> 8)) >> 8, exact for x and a up to 255 */
+#define BLEND_MUL(x, a) ((((x) * (a) + 128) + (((x) * (a) + 128) >> 8)) >> 8)
+
+#ifdef __SSE2__
+/* BLEND_MUL of the eight WORDs of vX and vA.  t stays below 65536. */
+static __m128i Blend_Mul8(__m128i vX, __m128i vA)
+{
+    __m128i vT = _mm_add_epi16(_mm_mullo_epi16(vX, vA), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(vT, _mm_srli_epi16(vT, 8)), 8);
+}
+
+/* Blend_Alpha of two 32 bpp pixels widened to WORDs */
+static __m128i Blend_Alpha2(__m128i vSrc, __m128i vDst)
+{
+    __m128i vA = _mm_shufflehi_epi16(_mm_shufflelo_epi16(vSrc,
+                                     _MM_SHUFFLE(3, 3, 3, 3)),
+                                     _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_add_epi16(Blend_Mul8(vSrc, vA),
+                         Blend_Mul8(vDst, _mm_sub_epi16(_mm_set1_epi16(255),
+                                                        vA)));
+}
+#endif
+
+static VOID Blend_Alpha(LPBYTE pbDst, INT cbDstPixel, const BYTE *pbSrc,
+                        INT cbSrcPixel, INT cPixels, COLORREF rgbKey)
+{
+    INT i = 0, a;
+
+#ifdef __SSE2__
+    if (cbDstPixel == 4)
+    {
+        const __m128i vZero = _mm_setzero_si128();
+        const __m128i vAlpha = _mm_set1_epi32(0xFF000000);
+        for (; i + 4 <= cPixels; i += 4, pbDst += 16, pbSrc += 16)
+        {
+            __m128i vSrc = _mm_loadu_si128((const __m128i *)pbSrc);
+            __m128i vDst = _mm_loadu_si128((const __m128i *)pbDst);
+            /* the two products of a channel never sum to more than 255 */
+            __m128i v = _mm_packus_epi16(
+                Blend_Alpha2(_mm_unpacklo_epi8(vSrc, vZero),
+                             _mm_unpacklo_epi8(vDst, vZero)),
+                Blend_Alpha2(_mm_unpackhi_epi8(vSrc, vZero),
+                             _mm_unpackhi_epi8(vDst, vZero)));
+            _mm_storeu_si128((__m128i *)pbDst,
+                             _mm_or_si128(_mm_andnot_si128(vAlpha, v),
+                                          _mm_and_si128(vAlpha, vDst)));
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pbDst += cbDstPixel, pbSrc += 4)
+    {
+        a = pbSrc[3];
+        pbDst[0] = (BYTE)(BLEND_MUL(pbSrc[0], a) + BLEND_MUL(pbDst[0], 255 - a));
+        pbDst[1] = (BYTE)(BLEND_MUL(pbSrc[1], a) + BLEND_MUL(pbDst[1], 255 - a));
+        pbDst[2] = (BYTE)(BLEND_MUL(pbSrc[2], a) + BLEND_MUL(pbDst[2], 255 - a));
+    }
+}
+
+/* Puts the 24 or 32 bpp image ppxSrc over the 24 or 32 bpp image ppxDst
+ * with its upper left corner at (xDst, yDst), the way iMode says:
+ *   BLEND_OPAQUE    every pixel is copied
+ *   BLEND_COLORKEY  the pixels of color rgbKey are left out
+ *   BLEND_ALPHA     each pixel is mixed in by its alpha byte, which
+ *                   ppxSrc must be 32 bpp to have
+ * Only the pixels of ppxDst within prcClip, if it is not NULL, change.
+ * Alpha bytes of ppxDst are left alone.  Returns FALSE with the last
+ * error set if the parameters are bad. */
+BOOL BM_Blend(BM_PIXELS *ppxDst, INT xDst, INT yDst, const BM_PIXELS *ppxSrc,
+              INT iMode, COLORREF rgbKey, const RECT *prcClip)
+{
+    static const BLEND_KERNEL apfnKernel[] =
+    {
+        Blend_Opaque,       /* BLEND_OPAQUE */
+        Blend_ColorKey,     /* BLEND_COLORKEY */
+        Blend_Alpha         /* BLEND_ALPHA */
+    };
+    INT cbDstPixel = ppxDst->wBitCount / 8, cbSrcPixel = ppxSrc->wBitCount / 8;
+    INT y;
+    RECT rc;
+
+    if ((ppxDst->wBitCount != 24 && ppxDst->wBitCount != 32) ||
+        (ppxSrc->wBitCount != 24 && ppxSrc->wBitCount != 32) ||
+        iMode < BLEND_OPAQUE || iMode > BLEND_ALPHA ||
+        (iMode == BLEND_ALPHA && ppxSrc->wBitCount != 32))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    SetRect(&rc, max(xDst, 0), max(yDst, 0),
+            min(xDst + ppxSrc->cx, ppxDst->cx),
+            min(yDst + ppxSrc->cy, ppxDst->cy));
+    if (prcClip != NULL)
+        IntersectRect(&rc, &rc, prcClip);
+    if (IsRectEmpty(&rc))
+        return TRUE;
+
+    for (y = rc.top; y < rc.bottom; y++)
+    {
+        apfnKernel[iMode](BM_ScanLine(ppxDst, y) + rc.left * cbDstPixel,
+                          cbDstPixel,
+                          BM_ScanLine(ppxSrc, y - yDst) +
+                          (rc.left - xDst) * cbSrcPixel,
+                          cbSrcPixel, rc.right - rc.left, rgbKey);
+    }
+    return TRUE;
+}
@@ -0,0 +1,244 @@
+/*
+ *  Paint (brush.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Brush tool.
+ *
+ * Each of the twelve brush shapes is a stamp of one span per row.  A
+ * stroke collects the spans of the stamp at every point of its line,
+ * sorts them, merges those that overlap and writes each pixel once,
+ * straight into the bits of the image.
+ */
+
+#include <stdlib.h>
+#include <windows.h>
+
+#include "main.h"
+
+#define BRUSH_MAX_ROWS 8
+
+typedef struct
+{
+    INT     dy;                     /* first row, relative to the point */
+    INT     cRows;
+    INT     adx0[BRUSH_MAX_ROWS];   /* span of each row, inclusive */
+    INT     adx1[BRUSH_MAX_ROWS];
+} BRUSH_STAMP;
+
+/* The pixels the GDI calls of the old DrawBrush used to set, in the order
+ * of the brush type selector */
+static const BRUSH_STAMP aStamps[12] =
+{
+    /* Ellipse(x - 3, y - 3, x + 4, y + 4) */
+    {-3, 7, {-1, -2, -3, -3, -3, -2, -1}, {1, 2, 3, 3, 3, 2, 1}},
+    /* Ellipse(x - 2, y - 2, x + 2, y + 2) */
+    {-2, 4, {-1, -2, -2, -1}, {0, 1, 1, 0}},
+    /* SetPixel(x, y) */
+    {0, 1, {0}, {0}},
+    /* Rectangle(x - 4, y - 4, x + 4, y + 4) */
+    {-4, 8, {-4, -4, -4, -4, -4, -4, -4, -4}, {3, 3, 3, 3, 3, 3, 3, 3}},
+    /* Rectangle(x - 2, y - 2, x + 3, y + 3) */
+    {-2, 5, {-2, -2, -2, -2, -2}, {2, 2, 2, 2, 2}},
+    /* Rectangle(x - 1, y - 1, x + 1, y + 1) */
+    {-1, 2, {-1, -1}, {0, 0}},
+    /* line from (x + 4, y - 4) to (x - 4, y + 4) */
+    {-4, 8, {4, 3, 2, 1, 0, -1, -2, -3}, {4, 3, 2, 1, 0, -1, -2, -3}},
+    /* line from (x + 2, y - 2) to (x - 3, y + 3) */
+    {-2, 5, {2, 1, 0, -1, -2}, {2, 1, 0, -1, -2}},
+    /* line from (x + 1, y - 1) to (x - 1, y + 1) */
+    {-1, 2, {1, 0}, {1, 0}},
+    /* line from (x - 4, y - 4) to (x + 4, y + 4) */
+    {-4, 8, {-4, -3, -2, -1, 0, 1, 2, 3}, {-4, -3, -2, -1, 0, 1, 2, 3}},
+    /* line from (x - 2, y - 2) to (x + 3, y + 3) */
+    {-2, 5, {-2, -1, 0, 1, 2}, {-2, -1, 0, 1, 2}},
+    /* line from (x - 1, y - 1) to (x + 1, y + 1) */
+    {-1, 2, {-1, 0}, {-1, 0}},
+};
+
+typedef struct
+{
+    INT     y;
+    INT     x0;
+    INT     x1;         /* inclusive */
+} BRUSH_SPAN;
+
+static BRUSH_SPAN *pSpans;      /* kept from one stroke to the next */
+static INT cMaxSpans;
+
+static int Brush_CompareSpans(const void *p1, const void *p2)
+{
+    const BRUSH_SPAN *ps1 = p1, *ps2 = p2;
+
+    if (ps1->y != ps2->y)
+        return ps1->y < ps2->y ? -1 : 1;
+    if (ps1->x0 != ps2->x0)
+        return ps1->x0 < ps2->x0 ? -1 : 1;
+    return 0;
+}
+
+/* Appends the spans of pStamp at (x, y) that are inside the image */
+static INT Brush_AddStamp(const BM_PIXELS *ppx, const BRUSH_STAMP *pStamp,
+                          INT x, INT y, BRUSH_SPAN *pSpan)
+{
+    INT i, yRow, x0, x1, cSpans = 0;
+
+    for (i = 0; i < pStamp->cRows; i++)
+    {
+        yRow = y + pStamp->dy + i;
+        if (yRow < 0 || yRow >= ppx->cy)
+            continue;
+        x0 = max(x + pStamp->adx0[i], 0);
+        x1 = min(x + pStamp->adx1[i], ppx->cx - 1);
+        if (x0 > x1)
+            continue;
+        pSpan[cSpans].y = yRow;
+        pSpan[cSpans].x0 = x0;
+        pSpan[cSpans].x1 = x1;
+        cSpans++;
+    }
+    return cSpans;
+}
+
+static VOID Brush_FillSpan(BM_PIXELS *ppx, const BRUSH_SPAN *pSpan,
+                           const BYTE *ab)
+{
+    LPBYTE pb = BM_ScanLine(ppx, pSpan->y);
+    DWORD *pdw, dw;
+    INT x;
+
+    if (ppx->wBitCount == 32)
+    {
+        dw = ab[0] | (ab[1] << 8) | (ab[2] << 16);
+        pdw = (DWORD *)pb + pSpan->x0;
+        for (x = pSpan->x0; x <= pSpan->x1; x++, pdw++)
+            *pdw = (*pdw & 0xFF000000) | dw;
+    }
+    else
+    {
+        pb += pSpan->x0 * 3;
+        for (x = pSpan->x0; x <= pSpan->x1; x++)
+        {
+            *pb++ = ab[0];
+            *pb++ = ab[1];
+            *pb++ = ab[2];
+        }
+    }
+}
+
+/* Stamps brush iBrushType in color rgb at every point of the line from pt0
+ * to pt1, both included, of the 24 or 32 bpp image ppx.  The points are
+ * those LineDDA goes through.  The alpha of 32 bpp pixels is left as it
+ * was. */
+BOOL BM_BrushLine(BM_PIXELS *ppx, INT iBrushType, POINT pt0, POINT pt1,
+                  COLORREF rgb)
+{
+    const BRUSH_STAMP *pStamp;
+    BRUSH_SPAN *pNew, span;
+    BYTE ab[3];
+    INT dx, dy, xAdd, yAdd, nErr, cPoints, cSpans, i;
+
+    if ((ppx->wBitCount != 24 && ppx->wBitCount != 32) ||
+        iBrushType < 0 || iBrushType >= sizeof(aStamps) / sizeof(aStamps[0]))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    pStamp = &aStamps[iBrushType];
+
+    dx = abs(pt1.x - pt0.x);
+    dy = abs(pt1.y - pt0.y);
+    xAdd = (pt0.x < pt1.x) ? 1 : -1;
+    yAdd = (pt0.y < pt1.y) ? 1 : -1;
+    cPoints = max(dx, dy) + 1;
+    if (cPoints * pStamp->cRows > cMaxSpans)
+    {
+        i = max(cPoints * pStamp->cRows, 256);
+        if (pSpans == NULL)
+            pNew = HeapAlloc(GetProcessHeap(), 0, i * sizeof(BRUSH_SPAN));
+        else
+            pNew = HeapReAlloc(GetProcessHeap(), 0, pSpans,
+                               i * sizeof(BRUSH_SPAN));
+        if (pNew == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        pSpans = pNew;
+        cMaxSpans = i;
+    }
+
+    /* the same steps as LineDDA, plus the end point */
+    cSpans = 0;
+    if (dx > dy)
+    {
+        nErr = 2 * dy - dx;
+        for (i = 0; i < cPoints; i++)
+        {
+            cSpans += Brush_AddStamp(ppx, pStamp, pt0.x, pt0.y, pSpans + cSpans);
+            if (nErr > 0)
+            {
+                pt0.y += yAdd;
+                nErr += 2 * (dy - dx);
+            }
+            else
+                nErr += 2 * dy;
+            pt0.x += xAdd;
+        }
+    }
+    else
+    {
+        nErr = 2 * dx - dy;
+        for (i = 0; i < cPoints; i++)
+        {
+            cSpans += Brush_AddStamp(ppx, pStamp, pt0.x, pt0.y, pSpans + cSpans);
+            if (nErr > 0)
+            {
+                pt0.x += xAdd;
+                nErr += 2 * (dx - dy);
+            }
+            else
+                nErr += 2 * dx;
+            pt0.y += yAdd;
+        }
+    }
+    if (cSpans == 0)
+        return TRUE;
+
+    /* write each pixel once, however many stamps cover it */
+    if (cSpans > 1)
+        qsort(pSpans, cSpans, sizeof(BRUSH_SPAN), Brush_CompareSpans);
+    ab[0] = GetBValue(rgb);
+    ab[1] = GetGValue(rgb);
+    ab[2] = GetRValue(rgb);
+    span = pSpans[0];
+    for (i = 1; i < cSpans; i++)
+    {
+        if (pSpans[i].y == span.y && pSpans[i].x0 <= span.x1 + 1)
+            span.x1 = max(span.x1, pSpans[i].x1);
+        else
+        {
+            Brush_FillSpan(ppx, &span, ab);
+            span = pSpans[i];
+        }
+    }
+    Brush_FillSpan(ppx, &span, ab);
+    return TRUE;
+}
@@ -29,6 +29,9 @@
 
 static const WCHAR empty[] = {0};
 
+/* the buffers of the fill tool, kept from one fill to the next */
+static FILL_ARENA arenaFill;
+
 VOID CanvasToImage(POINT *ppt)
 {
     ppt->x = (ppt->x + Globals.xScrollPos - 4) / Globals.nZoom;
@@ -81,52 +84,15 @@ VOID Regularize(POINT pt0, LPPOINT ppt1)
     ppt1->y = pt0.y + sgn(ppt1->y - pt0.y) * m;
 }
 
+/* A copy of the selected part of the image.  The floating selection has
+ * to be a DIB section that GDI can draw, so it is a copy of the selected
+ * rows alone rather than of tiles. */
 HBITMAP Selection_CreateBitmap(VOID)
 {
-    HDC hDC, hMemDC1, hMemDC2;
-    HGDIOBJ hbmOld1, hbmOld2;
-    HBITMAP hbmNew;
-    SIZE siz;
-
-    hbmNew = NULL;
-    hDC = GetDC(Globals.hCanvasWnd);
-    if (hDC != NULL)
-    {
-        hMemDC1 = CreateCompatibleDC(hDC);
-        if (hMemDC1 != NULL)
-        {
-            hbmOld1 = SelectObject(hMemDC1, Globals.hbmImage);
-            hMemDC2 = CreateCompatibleDC(hDC);
-            if (hMemDC2 != NULL)
-            {
-                siz.cx = Globals.pt1.x - Globals.pt0.x;
-                siz.cy = Globals.pt1.y - Globals.pt0.y;
-                hbmNew = BM_Create(siz);
-                if (hbmNew != NULL)
-                {
-                    hbmOld2 = SelectObject(hMemDC2, hbmNew);
-                    BitBlt(hMemDC2, 0, 0, siz.cx, siz.cy,
-                           hMemDC1, Globals.pt0.x, Globals.pt0.y,
-                           SRCCOPY);
-                    SelectObject(hMemDC1, hbmOld2);
-                }
-                DeleteDC(hMemDC2);
-            }
-            SelectObject(hMemDC1, hbmOld1);
-        }
-        ReleaseDC(Globals.hCanvasWnd, hDC);
-    }
-
-    return hbmNew;
-}
+    RECT rc;
 
-VOID PrepareForUndo(VOID)
-{
-    Globals.fCanUndo = TRUE;
-    if (Globals.hbmImageUndo != NULL)
-        DeleteObject(Globals.hbmImageUndo);
-    Globals.hbmImageUndo = BM_Copy(Globals.hbmImage);
-    Globals.sizImageUndo = Globals.sizImage;
+    SetRect(&rc, Globals.pt0.x, Globals.pt0.y, Globals.pt1.x, Globals.pt1.y);
+    return BM_CopyRect(Globals.hbmImage, &rc);
 }
 
 VOID Selection_TakeOff(VOID)
@@ -138,6 +104,8 @@ VOID Selection_TakeOff(VOID)
 
     if (Globals.fSelect && Globals.hbmSelect == NULL)
     {
+        /* what is left behind is drawn over, which can be undone */
+        Undo_Begin();
         hbmNew = Selection_CreateBitmap();
         hDC = GetDC(Globals.hCanvasWnd);
         if (hDC != NULL)
@@ -145,6 +113,7 @@ VOID Selection_TakeOff(VOID)
             hMemDC1 = CreateCompatibleDC(hDC);
             if (hMemDC1 != NULL)
             {
+                Undo_Touch((RECT*)&Globals.pt0);
                 hbmOld1 = SelectObject(hMemDC1, Globals.hbmImage);
                 hbr = CreateSolidBrush(Globals.rgbBack);
                 FillRect(hMemDC1, (RECT*)&Globals.pt0, hbr);
@@ -156,9 +125,31 @@ VOID Selection_TakeOff(VOID)
             ReleaseDC(Globals.hCanvasWnd, hDC);
         }
         Globals.hbmSelect = hbmNew;
+        Globals.fSelectInStep = TRUE;
     }
 }
 
+/* Puts the floating selection over the DIB section hbm, leaving out the
+ * background color if the selection is drawn transparent, and touching
+ * only what lies within prcClip if it is not NULL.  Returns FALSE if
+ * either bitmap is not a DIB section we can blend. */
+static BOOL Selection_Blend(HBITMAP hbm, const RECT *prcClip)
+{
+    BM_PIXELS pxDst, pxSrc;
+    RECT rc;
+
+    if (!BM_GetPixels(hbm, &pxDst) || !BM_GetPixels(Globals.hbmSelect, &pxSrc))
+        return FALSE;
+
+    rc = *(RECT*)&Globals.pt0;
+    if (prcClip != NULL)
+        IntersectRect(&rc, &rc, prcClip);
+    GdiFlush();
+    return BM_Blend(&pxDst, Globals.pt0.x, Globals.pt0.y, &pxSrc,
+                    Globals.fTransparent ? BLEND_COLORKEY : BLEND_OPAQUE,
+                    Globals.rgbBack, &rc);
+}
+
 VOID Selection_Land(VOID)
 {
     HDC hDC, hMemDC1, hMemDC2;
@@ -166,12 +157,18 @@ VOID Selection_Land(VOID)
 
     if (Globals.fSelect && Globals.hbmSelect)
     {
+        /* a pasted selection changes the image only now; one taken off
+         * lands in the step that took it off */
+        if (!Globals.fSelectInStep)
+            Undo_Begin();
         hDC = GetDC(Globals.hCanvasWnd);
         hMemDC1 = CreateCompatibleDC(hDC);
         if (hMemDC1 != NULL)
         {
+            Undo_Touch((RECT*)&Globals.pt0);
             hbmOld1 = SelectObject(hMemDC1, Globals.hbmImage);
-            hMemDC2 = CreateCompatibleDC(hDC);
+            hMemDC2 = Selection_Blend(Globals.hbmImage, NULL) ? NULL :
+                      CreateCompatibleDC(hDC);
             if (hMemDC2 != NULL)
             {
                 hbmOld2 = SelectObject(hMemDC2, Globals.hbmSelect);
@@ -188,102 +185,59 @@ VOID Selection_Land(VOID)
         ReleaseDC(Globals.hCanvasWnd, hDC);
         DeleteObject(Globals.hbmSelect);
         Globals.hbmSelect = NULL;
+        Globals.fSelectInStep = FALSE;
     }
     Globals.fSelect = FALSE;
 }
 
-VOID DrawBrush(HDC hMemDC, INT x, INT y, COLORREF rgb)
+/* Computes the bounding box of a stroke from pt0 to pt1 drawn with a pen
+ * or brush that reaches nRadius pixels beyond its center line */
+static VOID GetStrokeRect(RECT *prc, POINT pt0, POINT pt1, INT nRadius)
 {
-    switch (Globals.iBrushType)
-    {
-    case 0:
-        Ellipse(hMemDC, x - 3, y - 3, x + 4, y + 4);
-        break;
-
-    case 1:
-        Ellipse(hMemDC, x - 2, y - 2, x + 2, y + 2);
-        break;
-
-    case 2:
-        SetPixel(hMemDC, x, y, rgb);
-        break;
-
-    case 3:
-        Rectangle(hMemDC, x - 4, y - 4, x + 4, y + 4);
-        break;
-
-    case 4:
-        Rectangle(hMemDC, x - 2, y - 2, x + 3, y + 3);
-        break;
-
-    case 5:
-        Rectangle(hMemDC, x - 1, y - 1, x + 1, y + 1);
-        break;
-
-    case 6:
-        MoveToEx(hMemDC, x + 4, y - 4, NULL);
-        LineTo(hMemDC, x - 4, y + 4);
-        break;
-
-    case 7:
-        MoveToEx(hMemDC, x + 2, y - 2, NULL);
-        LineTo(hMemDC, x - 3, y + 3);
-        break;
-
-    case 8:
-        MoveToEx(hMemDC, x + 1, y - 1, NULL);
-        LineTo(hMemDC, x - 1, y + 1);
-        break;
-
-    case 9:
-        MoveToEx(hMemDC, x - 4, y - 4, NULL);
-        LineTo(hMemDC, x + 4, y + 4);
-        break;
+    prc->left = min(pt0.x, pt1.x) - nRadius;
+    prc->top = min(pt0.y, pt1.y) - nRadius;
+    prc->right = max(pt0.x, pt1.x) + nRadius + 1;
+    prc->bottom = max(pt0.y, pt1.y) + nRadius + 1;
+}
 
-    case 10:
-        MoveToEx(hMemDC, x - 2, y - 2, NULL);
-        LineTo(hMemDC, x + 3, y + 3);
-        break;
+/* Draws the polygon being made, skipping the runs of edges that are
+ * clipped away, so that moving its last vertex costs the same however
+ * many there are */
+static VOID Canvas_DrawPolyline(HDC hDC)
+{
+    RECT rcClip, rc;
+    INT i, iFirst = -1;
 
-    case 11:
-        MoveToEx(hMemDC, x - 1, y - 1, NULL);
-        LineTo(hMemDC, x + 1, y + 1);
-        break;
+    if (GetClipBox(hDC, &rcClip) == ERROR)
+        return;
+    for (i = 1; i < Globals.cPolyline; i++)
+    {
+        GetStrokeRect(&rc, Globals.pPolyline[i - 1], Globals.pPolyline[i], 1);
+        if (IntersectRect(&rc, &rc, &rcClip))
+        {
+            if (iFirst < 0)
+                iFirst = i - 1;
+        }
+        else if (iFirst >= 0)
+        {
+            Polyline(hDC, &Globals.pPolyline[iFirst], i - iFirst);
+            iFirst = -1;
+        }
     }
+    if (iFirst >= 0)
+        Polyline(hDC, &Globals.pPolyline[iFirst], i - iFirst);
 }
 
-VOID CALLBACK ForeBrushDDAProc(INT x, INT y, LPARAM lParam)
+/* Paints the brush stroke from pt0 to pt1 into hbm */
+static VOID Canvas_BrushLine(HBITMAP hbm, POINT pt0, POINT pt1, COLORREF rgb)
 {
-    HBRUSH hbr;
-    HPEN hPen;
-    HGDIOBJ hbrOld, hpenOld;
-    HDC hMemDC = (HDC)lParam;
-    hPen = CreatePen(PS_SOLID, 0, Globals.rgbFore);
-    hbr = CreateSolidBrush(Globals.rgbFore);
-    hpenOld = SelectObject(hMemDC, hPen);
-    hbrOld = SelectObject(hMemDC, hbr);
-    DrawBrush(hMemDC, x, y, Globals.rgbFore);
-    SelectObject(hMemDC, hpenOld);
-    SelectObject(hMemDC, hbrOld);
-    DeleteObject(hPen);
-    DeleteObject(hbr);
-}
+    BM_PIXELS px;
 
-VOID CALLBACK BackBrushDDAProc(INT x, INT y, LPARAM lParam)
-{
-    HBRUSH hbr;
-    HPEN hPen;
-    HGDIOBJ hbrOld, hpenOld;
-    HDC hMemDC = (HDC)lParam;
-    hPen = CreatePen(PS_SOLID, 0, Globals.rgbBack);
-    hbr = CreateSolidBrush(Globals.rgbBack);
-    hpenOld = SelectObject(hMemDC, hPen);
-    hbrOld = SelectObject(hMemDC, hbr);
-    DrawBrush(hMemDC, x, y, Globals.rgbBack);
-    SelectObject(hMemDC, hpenOld);
-    SelectObject(hMemDC, hbrOld);
-    DeleteObject(hPen);
-    DeleteObject(hbr);
+    if (BM_GetPixels(hbm, &px))
+    {
+        GdiFlush();
+        BM_BrushLine(&px, Globals.iBrushType, pt0, pt1, rgb);
+    }
 }
 
 VOID Canvas_DrawBuffer(HDC hDC)
@@ -292,11 +246,18 @@ VOID Canvas_DrawBuffer(HDC hDC)
     HPEN hPen;
     HBRUSH hbr;
     HGDIOBJ hbmOld, hpenOld, hbrOld;
+    RECT rc;
 
     switch(Globals.iToolSelect)
     {
     case TOOL_BOXSELECT:
-        hMemDC = CreateCompatibleDC(hDC);
+        hMemDC = NULL;
+        if (Globals.hbmSelect != NULL &&
+            (GetClipBox(hDC, &rc) == ERROR ||
+             !Selection_Blend(GetCurrentObject(hDC, OBJ_BITMAP), &rc)))
+        {
+            hMemDC = CreateCompatibleDC(hDC);
+        }
         if (hMemDC != NULL)
         {
             hbmOld = SelectObject(hMemDC, Globals.hbmSelect);
@@ -357,7 +318,7 @@ VOID Canvas_DrawBuffer(HDC hDC)
         break;
 
     case TOOL_POLYGON:
-        Polyline(hDC, Globals.pPolyline, Globals.cPolyline);
+        Canvas_DrawPolyline(hDC);
         break;
 
     case TOOL_LINE:
@@ -373,10 +334,9 @@ VOID Canvas_DrawBuffer(HDC hDC)
         break;
 
     case TOOL_BRUSH:
-        if (Globals.fSwapColor)
-            BackBrushDDAProc(Globals.pt0.x, Globals.pt0.y, (LPARAM)hDC);
-        else
-            ForeBrushDDAProc(Globals.pt0.x, Globals.pt0.y, (LPARAM)hDC);
+        Canvas_BrushLine(GetCurrentObject(hDC, OBJ_BITMAP), Globals.pt0,
+                         Globals.pt0, Globals.fSwapColor ?
+                         Globals.rgbBack : Globals.rgbFore);
         break;
 
     case TOOL_BOX:
@@ -513,90 +473,239 @@ VOID Canvas_DrawBuffer(HDC hDC)
     }
 }
 
-VOID Canvas_OnPaint(HWND hWnd, HDC hDC)
+/* Invalidates the canvas area that shows the image rectangle *prc */
+VOID Canvas_InvalidateImageRect(HWND hWnd, const RECT *prc)
+{
+    RECT rc;
+
+    if (IsRectEmpty(prc))
+        return;
+
+    rc.left = prc->left * Globals.nZoom + 4 - Globals.xScrollPos;
+    rc.top = prc->top * Globals.nZoom + 4 - Globals.yScrollPos;
+    rc.right = prc->right * Globals.nZoom + 4 - Globals.xScrollPos;
+    rc.bottom = prc->bottom * Globals.nZoom + 4 - Globals.yScrollPos;
+    InvalidateRect(hWnd, &rc, FALSE);
+}
+
+static VOID Canvas_InvalidateStroke(HWND hWnd, POINT pt0, POINT pt1, INT nRadius)
+{
+    RECT rc;
+
+    GetStrokeRect(&rc, pt0, pt1, nRadius);
+    Canvas_InvalidateImageRect(hWnd, &rc);
+}
+
+/* Saves what a stroke is about to draw over for undo */
+static VOID Canvas_TouchStroke(POINT pt0, POINT pt1, INT nRadius)
+{
+    RECT rc;
+
+    GetStrokeRect(&rc, pt0, pt1, nRadius);
+    Undo_Touch(&rc);
+}
+
+/* Sprays the airbrush dots that are due around pt and shows them */
+static VOID Canvas_AirBrush(HWND hWnd, POINT pt, COLORREF rgb)
+{
+    BM_PIXELS px;
+    RECT rc;
+
+    if (!BM_GetPixels(Globals.hbmImage, &px))
+        return;
+    Canvas_TouchStroke(pt, pt, Globals.nAirBrushRadius);
+    GdiFlush();
+    if (AirBrush_Spray(&px, pt, rgb, &rc) != 0 && !IsRectEmpty(&rc))
+    {
+        Globals.fModified = TRUE;
+        Canvas_InvalidateImageRect(hWnd, &rc);
+    }
+}
+
+/* Moves the rubber band edge of the polygon to pt */
+static VOID Canvas_MovePolylineEnd(HWND hWnd, POINT pt)
+{
+    POINT *ppt;
+
+    if (Globals.cPolyline < 2)
+        return;
+    ppt = &Globals.pPolyline[Globals.cPolyline - 1];
+    Canvas_InvalidateStroke(hWnd, ppt[-1], ppt[0], 1);
+    ppt[0] = pt;
+    Canvas_InvalidateStroke(hWnd, ppt[-1], ppt[0], 1);
+}
+
+/* image area covered by the tool preview on screen */
+static RECT rcPreview;
+
+/* Moves the tool preview to the image rectangle *prc (NULL to remove it),
+ * invalidating both the old and the new place */
+static VOID Canvas_InvalidatePreview(HWND hWnd, const RECT *prc)
+{
+    Canvas_InvalidateImageRect(hWnd, &rcPreview);
+    if (prc != NULL)
+    {
+        rcPreview = *prc;
+        NormalizeRect(&rcPreview);
+        Canvas_InvalidateImageRect(hWnd, &rcPreview);
+    }
+    else
+        SetRectEmpty(&rcPreview);
+}
+
+/* Same as Canvas_InvalidatePreview for a preview spanning pt0 to pt1 */
+static VOID Canvas_InvalidatePreview2(HWND hWnd, POINT pt0, POINT pt1,
+                                      INT nRadius)
+{
+    RECT rc;
+
+    GetStrokeRect(&rc, pt0, pt1, nRadius);
+    Canvas_InvalidatePreview(hWnd, &rc);
+}
+
+/* Invalidates the floating selection and the marquee around it */
+static VOID Canvas_InvalidateSelection(HWND hWnd)
+{
+    RECT rc;
+
+    rc = *(RECT*)&Globals.pt0;
+    NormalizeRect(&rc);
+    InflateRect(&rc, 1, 1);
+    Canvas_InvalidateImageRect(hWnd, &rc);
+}
+
+/* The bezier curve stays within the bounding box of its control points */
+static VOID GetCurveRect(RECT *prc)
+{
+    prc->left = min(min(Globals.pt0.x, Globals.pt1.x),
+                    min(Globals.pt2.x, Globals.pt3.x)) - Globals.nLineWidth;
+    prc->top = min(min(Globals.pt0.y, Globals.pt1.y),
+                   min(Globals.pt2.y, Globals.pt3.y)) - Globals.nLineWidth;
+    prc->right = max(max(Globals.pt0.x, Globals.pt1.x),
+                     max(Globals.pt2.x, Globals.pt3.x)) + Globals.nLineWidth + 1;
+    prc->bottom = max(max(Globals.pt0.y, Globals.pt1.y),
+                      max(Globals.pt2.y, Globals.pt3.y)) + Globals.nLineWidth + 1;
+}
+
+/* Invalidates the bezier preview */
+static VOID Canvas_InvalidateCurve(HWND hWnd)
+{
+    RECT rc;
+
+    GetCurveRect(&rc);
+    Canvas_InvalidatePreview(hWnd, &rc);
+}
+
+/* Makes sure hbmBuffer is a 24 bpp DIB at least as large as the image */
+static BOOL Canvas_PrepareBuffer(VOID)
+{
+    BM_PIXELS px;
+
+    if (Globals.hbmBuffer != NULL && BM_GetPixels(Globals.hbmBuffer, &px) &&
+        px.wBitCount == 24 && px.cx >= Globals.sizImage.cx &&
+        px.cy >= Globals.sizImage.cy)
+        return TRUE;
+
+    if (Globals.hbmBuffer != NULL)
+        DeleteObject(Globals.hbmBuffer);
+    Globals.hbmBuffer = BM_Create(Globals.sizImage);
+    return Globals.hbmBuffer != NULL;
+}
+
+/* Repaints the part of the canvas in prcPaint (client coordinates).
+ * Only the image pixels behind that area are composed, stretched and
+ * gridded, so the work and the buffers depend on the window size, not
+ * on the image size times the zoom factor. */
+VOID Canvas_OnPaint(HWND hWnd, HDC hDC, const RECT *prcPaint)
 {
     HBRUSH hbr;
     HGDIOBJ hbmOld1, hbmOld2, hpenOld, hbrOld;
     HDC hMemDC1, hMemDC2;
-    RECT rc;
-    INT x, y;
+    RECT rc, rcImage, rcZoom;
+    BM_PIXELS pxBuffer, pxCanvas;
+    INT x, y, cx, cy;
 
     SetWindowOrgEx(hDC, Globals.xScrollPos, Globals.yScrollPos, NULL);
 
+    /* the image pixels visible in prcPaint */
+    x = prcPaint->left + Globals.xScrollPos - 4;
+    y = prcPaint->top + Globals.yScrollPos - 4;
+    rcImage.left = (x > 0) ? x / Globals.nZoom : 0;
+    rcImage.top = (y > 0) ? y / Globals.nZoom : 0;
+    x = prcPaint->right + Globals.xScrollPos - 4;
+    y = prcPaint->bottom + Globals.yScrollPos - 4;
+    rcImage.right = (x > 0) ? (x + Globals.nZoom - 1) / Globals.nZoom : 0;
+    rcImage.bottom = (y > 0) ? (y + Globals.nZoom - 1) / Globals.nZoom : 0;
+    if (rcImage.right > Globals.sizImage.cx)
+        rcImage.right = Globals.sizImage.cx;
+    if (rcImage.bottom > Globals.sizImage.cy)
+        rcImage.bottom = Globals.sizImage.cy;
+    cx = rcImage.right - rcImage.left;
+    cy = rcImage.bottom - rcImage.top;
+
     hMemDC1 = CreateCompatibleDC(hDC);
     if (hMemDC1 != NULL)
     {
         hMemDC2 = CreateCompatibleDC(hDC);
         if (hMemDC2 != NULL)
         {
-            hbmOld1 = SelectObject(hMemDC1, Globals.hbmImage);
-            hbmOld2 = SelectObject(hMemDC2, Globals.hbmBuffer);
-            BitBlt(hMemDC2, 0, 0, Globals.sizImage.cx, Globals.sizImage.cy,
-                   hMemDC1, 0, 0, SRCCOPY);
-            SelectObject(hMemDC1, hbmOld1);
-            Canvas_DrawBuffer(hMemDC2);
-
-            /* FIXME: speed up by smaller buffer */
-            hbmOld1 = SelectObject(hMemDC1, Globals.hbmZoomBuffer);
-            SetStretchBltMode(hDC, COLORONCOLOR);
-            StretchBlt(hMemDC1, 0, 0, Globals.sizImage.cx * Globals.nZoom,
-                       Globals.sizImage.cy * Globals.nZoom, hMemDC2,
-                       0, 0, Globals.sizImage.cx, Globals.sizImage.cy, SRCCOPY);
-            SelectObject(hMemDC2, hbmOld2);
-
-            if (Globals.fShowGrid && Globals.nZoom >= 3)
-            {
-                LOGBRUSH lb;
-                HPEN hPen1, hPen2;
-                hPen1 = CreatePen(PS_SOLID, 1, RGB(192, 192, 192));
-                hpenOld = SelectObject(hMemDC1, hPen1);
-                for (x = 0; x < Globals.sizImage.cx; x++)
-                {
-                    MoveToEx(hMemDC1, x * Globals.nZoom, 0, NULL);
-                    LineTo(hMemDC1, x * Globals.nZoom,
-                           Globals.sizImage.cy * Globals.nZoom);
-                }
-                for (y = 0; y < Globals.sizImage.cy; y++)
-                {
-                    MoveToEx(hMemDC1, 0, y * Globals.nZoom, NULL);
-                    LineTo(hMemDC1, Globals.sizImage.cx * Globals.nZoom,
-                           y * Globals.nZoom);
-                }
-                lb.lbColor = RGB(128, 128, 128);
-                lb.lbStyle = BS_SOLID;
-                hPen2 = ExtCreatePen(PS_COSMETIC|PS_ALTERNATE|PS_ENDCAP_SQUARE|PS_JOIN_BEVEL, 1, &lb, 0, NULL);
-                SelectObject(hMemDC1, hPen2);
-                for (x = 0; x < Globals.sizImage.cx; x++)
-                {
-                    MoveToEx(hMemDC1, x * Globals.nZoom, 0, NULL);
-                    LineTo(hMemDC1, x * Globals.nZoom,
-                           Globals.sizImage.cy * Globals.nZoom);
-                }
-                for (y = 0; y < Globals.sizImage.cy; y++)
-                {
-                    MoveToEx(hMemDC1, 0, y * Globals.nZoom, NULL);
-                    LineTo(hMemDC1, Globals.sizImage.cx * Globals.nZoom,
-                           y * Globals.nZoom);
-                }
-                SelectObject(hMemDC1, hpenOld);
-                DeleteObject(hPen1);
-                DeleteObject(hPen2);
-            }
-
             if (GetSysColor(COLOR_3DFACE) == RGB(0, 0, 0))
                 hbr = CreateSolidBrush(RGB(0, 0, 0));
             else
                 hbr = CreateSolidBrush(RGB(123, 125, 123));
 
             hbmOld2 = SelectObject(hMemDC2, Globals.hbmCanvasBuffer);
-            GetClientRect(hWnd, &rc);
-            FillRect(hMemDC2, &rc, hbr);
+            FillRect(hMemDC2, prcPaint, hbr);
             DeleteObject(hbr);
-            BitBlt(hMemDC2, 4 - Globals.xScrollPos, 4 - Globals.yScrollPos,
-                   Globals.sizImage.cx * Globals.nZoom,
-                   Globals.sizImage.cy * Globals.nZoom,
-                   hMemDC1, 0, 0, SRCCOPY);
-            SelectObject(hMemDC1, hbmOld1);
+            SelectObject(hMemDC2, hbmOld2);
+
+            if (cx > 0 && cy > 0 && Canvas_PrepareBuffer())
+            {
+                hbmOld1 = SelectObject(hMemDC1, Globals.hbmImage);
+                hbmOld2 = SelectObject(hMemDC2, Globals.hbmBuffer);
+                BitBlt(hMemDC2, rcImage.left, rcImage.top, cx, cy,
+                       hMemDC1, rcImage.left, rcImage.top, SRCCOPY);
+                SelectObject(hMemDC1, hbmOld1);
+
+                /* tool previews outside rcImage were not asked for */
+                IntersectClipRect(hMemDC2, rcImage.left, rcImage.top,
+                                  rcImage.right, rcImage.bottom);
+                Canvas_DrawBuffer(hMemDC2);
+                SelectClipRgn(hMemDC2, NULL);
+
+                SelectObject(hMemDC2, hbmOld2);
+
+                /* zoom straight into the client-sized canvas buffer */
+                rcZoom.left = 4 - Globals.xScrollPos + rcImage.left * Globals.nZoom;
+                rcZoom.top = 4 - Globals.yScrollPos + rcImage.top * Globals.nZoom;
+                rcZoom.right = rcZoom.left + cx * Globals.nZoom;
+                rcZoom.bottom = rcZoom.top + cy * Globals.nZoom;
+                IntersectRect(&rcZoom, &rcZoom, prcPaint);
+                rc.left = rc.top = 0;
+                rc.right = Globals.sizCanvas.cx;
+                rc.bottom = Globals.sizCanvas.cy;
+                IntersectRect(&rcZoom, &rcZoom, &rc);
+                if (!BM_GetPixels(Globals.hbmBuffer, &pxBuffer) ||
+                    !BM_GetPixels(Globals.hbmCanvasBuffer, &pxCanvas) ||
+                    !BM_ZoomBlt(&pxCanvas, &rcZoom, 4 - Globals.xScrollPos,
+                                4 - Globals.yScrollPos, &pxBuffer,
+                                Globals.nZoom,
+                                Globals.fShowGrid && Globals.nZoom >= 3))
+                {
+                    /* not a DIB we can write to: let GDI do it, gridless */
+                    hbmOld1 = SelectObject(hMemDC1, Globals.hbmCanvasBuffer);
+                    hbmOld2 = SelectObject(hMemDC2, Globals.hbmBuffer);
+                    SetStretchBltMode(hMemDC1, COLORONCOLOR);
+                    StretchBlt(hMemDC1,
+                               4 - Globals.xScrollPos + rcImage.left * Globals.nZoom,
+                               4 - Globals.yScrollPos + rcImage.top * Globals.nZoom,
+                               cx * Globals.nZoom, cy * Globals.nZoom, hMemDC2,
+                               rcImage.left, rcImage.top, cx, cy, SRCCOPY);
+                    SelectObject(hMemDC2, hbmOld2);
+                    SelectObject(hMemDC1, hbmOld1);
+                }
+            }
+            hbmOld2 = SelectObject(hMemDC2, Globals.hbmCanvasBuffer);
 
             if (Globals.fSelect && Globals.mode == MODE_NORMAL)
             {
@@ -617,11 +726,15 @@ VOID Canvas_OnPaint(HWND hWnd, HDC hDC)
                 DeleteObject(hPen);
             }
 
-            BitBlt(hDC, Globals.xScrollPos, Globals.yScrollPos,
-                   Globals.sizCanvas.cx, Globals.sizCanvas.cy,
-                   hMemDC2, 0, 0, SRCCOPY);
+            BitBlt(hDC, prcPaint->left + Globals.xScrollPos,
+                   prcPaint->top + Globals.yScrollPos,
+                   prcPaint->right - prcPaint->left,
+                   prcPaint->bottom - prcPaint->top,
+                   hMemDC2, prcPaint->left, prcPaint->top, SRCCOPY);
             SelectObject(hMemDC2, hbmOld2);
+            DeleteDC(hMemDC2);
         }
+        DeleteDC(hMemDC1);
     }
 
     if (!Globals.fSelect)
@@ -677,8 +790,9 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
     POINT pt, pt0;
     RECT rc;
     HDC hDC, hMemDC;
-    HGDIOBJ hbmOld, hbrOld;
+    HGDIOBJ hbmOld;
     HBRUSH hbr;
+    BM_PIXELS px;
     pt.x = x;
     pt.y = y;
 
@@ -762,10 +876,7 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
             Globals.iToolSelect = Globals.iToolPrev;
             Globals.iToolClicking = -1;
             Globals.ipt = 0;
-            if (Globals.pPolyline != NULL)
-                HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
-            Globals.pPolyline = NULL;
-            Globals.cPolyline = 0;
+            Polyline_Free();
             InvalidateRect(Globals.hToolBox, NULL, TRUE);
             UpdateWindow(Globals.hToolBox);
 
@@ -808,9 +919,8 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                         NormalizeRect((RECT*)&Globals.pt0);
                         Globals.pt2.x = pt.x - Globals.pt0.x;
                         Globals.pt2.y = pt.y - Globals.pt0.y;
-                        PrepareForUndo();
                         Selection_TakeOff();
-                        InvalidateRect(hWnd, NULL, TRUE);
+                        Canvas_InvalidateSelection(hWnd);
                         UpdateWindow(hWnd);
                     }
                     else
@@ -818,6 +928,7 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                         SetCursor(Globals.hcurCross2);
                         Globals.mode = MODE_CANVAS;
                         SetCapture(hWnd);
+                        Canvas_InvalidateSelection(hWnd);
                         Selection_Land();
                         Globals.fSelect = FALSE;
                         Globals.pt0 = Globals.pt1 = pt;
@@ -841,7 +952,8 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                 SetCapture(hWnd);
                 SetCursor(NULL);
                 CanvasToImage(&pt);
-                PrepareForUndo();
+                Undo_Begin();
+                Canvas_TouchStroke(pt, pt, Globals.nEraserSize / 2);
                 hDC = GetDC(hWnd);
                 if (hDC != NULL)
                 {
@@ -863,6 +975,8 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                     ReleaseDC(hWnd, hDC);
                 }
                 Globals.pt0 = pt;
+                Canvas_InvalidateStroke(hWnd, pt, pt, Globals.nEraserSize / 2);
+                UpdateWindow(hWnd);
             }
             break;
 
@@ -871,47 +985,34 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
             Globals.mode = MODE_CANVAS;
             SetCapture(hWnd);
             CanvasToImage(&pt);
-            PrepareForUndo();
-            hDC = GetDC(hWnd);
-            hMemDC = CreateCompatibleDC(hDC);
-            if (hMemDC != NULL)
-            {
-                hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-                if (fRight)
-                    BackBrushDDAProc(pt.x, pt.y, (LPARAM)hMemDC);
-                else
-                    ForeBrushDDAProc(pt.x, pt.y, (LPARAM)hMemDC);
-                SelectObject(hMemDC, hbmOld);
-                DeleteDC(hMemDC);
-                Globals.fModified = TRUE;
-            }
-            ReleaseDC(hWnd, hDC);
+            Undo_Begin();
+            Canvas_TouchStroke(pt, pt, 5);
+            Canvas_BrushLine(Globals.hbmImage, pt, pt,
+                             fRight ? Globals.rgbBack : Globals.rgbFore);
+            Globals.fModified = TRUE;
             Globals.pt0 = pt;
+            Canvas_InvalidateStroke(hWnd, pt, pt, 5);
+            UpdateWindow(hWnd);
             break;
 
         case TOOL_FILL:
             SetCursor(Globals.hcurFill);
             CanvasToImage(&pt);
-            PrepareForUndo();
-            hDC = GetDC(hWnd);
-            hMemDC = CreateCompatibleDC(hDC);
-            if (hMemDC != NULL)
+            Undo_Begin();
+            if (BM_GetPixels(Globals.hbmImage, &px))
             {
-                hbr = CreateSolidBrush(fRight ? Globals.rgbBack :
-                                              Globals.rgbFore);
-                hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-                hbrOld = SelectObject(hMemDC, hbr);
-                ExtFloodFill(hMemDC, pt.x, pt.y,
-                             GetPixel(hMemDC, pt.x, pt.y),
-                             FLOODFILLSURFACE);
-                SelectObject(hMemDC, hbrOld);
-                SelectObject(hMemDC, hbmOld);
-                DeleteObject(hbr);
-                DeleteDC(hMemDC);
-                Globals.fModified = TRUE;
+                GdiFlush();
+                if (!BM_FloodFill(&px, pt.x, pt.y,
+                                  fRight ? Globals.rgbBack : Globals.rgbFore,
+                                  Globals.nFillTolerance, Undo_Touch, &rc,
+                                  &arenaFill))
+                    ShowLastError();
+                else if (!IsRectEmpty(&rc))
+                {
+                    Globals.fModified = TRUE;
+                    Canvas_InvalidateImageRect(hWnd, &rc);
+                }
             }
-            ReleaseDC(hWnd, hDC);
-            InvalidateRect(hWnd, NULL, FALSE);
             UpdateWindow(hWnd);
             break;
 
@@ -920,7 +1021,8 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
             Globals.mode = MODE_CANVAS;
             SetCapture(hWnd);
             CanvasToImage(&pt);
-            PrepareForUndo();
+            Undo_Begin();
+            Canvas_TouchStroke(pt, pt, 0);
             hDC = GetDC(hWnd);
             hMemDC = CreateCompatibleDC(hDC);
             if (hMemDC != NULL)
@@ -933,7 +1035,7 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                 Globals.fModified = TRUE;
             }
             ReleaseDC(hWnd, hDC);
-            InvalidateRect(hWnd, NULL, FALSE);
+            Canvas_InvalidateStroke(hWnd, pt, pt, 0);
             UpdateWindow(hWnd);
             Globals.pt0 = pt;
             break;
@@ -942,10 +1044,10 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
             SetCursor(Globals.hcurAirBrush);
             Globals.mode = MODE_CANVAS;
             SetCapture(hWnd);
-            PrepareForUndo();
+            Undo_Begin();
+            AirBrush_Begin(Globals.nAirBrushRadius);
             KillTimer(hWnd, Globals.idTimer);
             Globals.idTimer = SetTimer(hWnd, 1, 30, NULL);
-            Globals.fModified = TRUE;
             break;
 
         case TOOL_SPOIT:
@@ -975,24 +1077,15 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
             Globals.mode = MODE_CANVAS;
             SetCapture(hWnd);
             CanvasToImage(&pt);
-            if (Globals.cPolyline == 0)
-            {
-                Globals.cPolyline = 2;
-                Globals.pPolyline = (POINT*)HeapAlloc(GetProcessHeap(), 0,
-                                                      2 * sizeof(POINT));
-
-                Globals.pPolyline[0] = Globals.pPolyline[1] = pt;
-            }
-            else
+            if ((Globals.cPolyline == 0 && !Polyline_Append(pt)) ||
+                !Polyline_Append(pt))
             {
-                DWORD cb;
-                Globals.cPolyline++;
-                cb = Globals.cPolyline * sizeof(POINT);
-                Globals.pPolyline = (POINT*)HeapReAlloc(GetProcessHeap(), 0,
-                                                        Globals.pPolyline, cb);
-                Globals.pPolyline[Globals.cPolyline - 1] = pt;
+                ShowLastError();
+                break;
             }
-            InvalidateRect(hWnd, NULL, FALSE);
+            Canvas_InvalidateStroke(hWnd,
+                                    Globals.pPolyline[Globals.cPolyline - 2],
+                                    pt, 1);
             UpdateWindow(hWnd);
             break;
 
@@ -1020,7 +1113,7 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                 Globals.pt2 = pt;
                 break;
             }
-            InvalidateRect(hWnd, NULL, FALSE);
+            Canvas_InvalidateCurve(hWnd);
             UpdateWindow(hWnd);
             break;
 
@@ -1053,7 +1146,7 @@ VOID Canvas_OnButtonDown(HWND hWnd, INT x, INT y, BOOL fRight)
                 Selection_TakeOff();
                 SetCapture(hWnd);
                 Globals.mode = MODE_SELECTION;
-                InvalidateRect(hWnd, NULL, TRUE);
+                Canvas_InvalidateSelection(hWnd);
                 UpdateWindow(hWnd);
             }
             else
@@ -1176,10 +1269,11 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
             CanvasToImage(&pt);
             ShowPos(pt);
             ShowNoSize();
+            Canvas_InvalidateSelection(hWnd);
             OffsetRect((RECT*)&Globals.pt0,
                        pt.x - Globals.pt0.x - Globals.pt2.x,
                        pt.y - Globals.pt0.y - Globals.pt2.y);
-            InvalidateRect(hWnd, NULL, FALSE);
+            Canvas_InvalidateSelection(hWnd);
             UpdateWindow(hWnd);
             break;
 
@@ -1192,37 +1286,27 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 Globals.pt1 = pt;
                 ShowSize(Globals.pt1.x - Globals.pt0.x,
                          Globals.pt1.y - Globals.pt0.x);
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, Globals.pt0, Globals.pt1, 1);
                 UpdateWindow(hWnd);
                 break;
 
             case TOOL_BRUSH:
                 SetCursor(Globals.hcurCross);
                 CanvasToImage(&pt);
-                hDC = GetDC(hWnd);
-                if (hDC != NULL)
-                {
-                    hMemDC = CreateCompatibleDC(hDC);
-                    if (hMemDC != NULL)
-                    {
-                        HGDIOBJ hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-                        LineDDA(Globals.pt0.x, Globals.pt0.y, pt.x, pt.y,
-                                ForeBrushDDAProc, (LPARAM)hMemDC);
-                        SelectObject(hMemDC, hbmOld);
-                        DeleteDC(hMemDC);
-                    }
-                    ReleaseDC(hWnd, hDC);
-                }
+                Canvas_TouchStroke(Globals.pt0, pt, 5);
+                Canvas_BrushLine(Globals.hbmImage, Globals.pt0, pt,
+                                 Globals.rgbFore);
+                Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, 5);
                 Globals.pt0 = pt;
                 ShowPos(pt);
                 ShowNoSize();
-                InvalidateRect(hWnd, NULL, FALSE);
                 UpdateWindow(hWnd);
                 break;
 
             case TOOL_ERASER:
                 SetCursor(NULL);
                 CanvasToImage(&pt);
+                Canvas_TouchStroke(Globals.pt0, pt, Globals.nEraserSize / 2);
                 hDC = GetDC(hWnd);
                 if (hDC != NULL)
                 {
@@ -1238,18 +1322,18 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                     }
                     ReleaseDC(hWnd, hDC);
                 }
+                Canvas_InvalidateStroke(hWnd, Globals.pt0, pt,
+                                        Globals.nEraserSize / 2);
                 Globals.pt0 = pt;
                 ShowPos(pt);
                 ShowNoSize();
-                InvalidateRect(hWnd, NULL, FALSE);
                 UpdateWindow(hWnd);
                 break;
 
             case TOOL_POLYGON:
                 SetCursor(Globals.hcurCross2);
                 CanvasToImage(&pt);
-                Globals.pPolyline[Globals.cPolyline - 1] = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_MovePolylineEnd(hWnd, pt);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1268,7 +1352,7 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 {
                     Globals.pt2 = pt;
                 }
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidateCurve(hWnd);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1278,7 +1362,8 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 Globals.pt1 = pt;
                 ShowSize(Globals.pt1.x - Globals.pt0.x,
                          Globals.pt1.y - Globals.pt0.y);
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, Globals.pt0, Globals.pt1,
+                                          Globals.nLineWidth);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1290,7 +1375,8 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 Globals.pt1 = pt;
                 ShowSize(Globals.pt1.x - Globals.pt0.x,
                          Globals.pt1.y - Globals.pt0.y);
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, Globals.pt0, Globals.pt1,
+                                          Globals.nLineWidth);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1321,6 +1407,7 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 CanvasToImage(&pt);
                 ShowPos(pt);
                 ShowNoSize();
+                Canvas_TouchStroke(Globals.pt0, pt, 0);
                 hDC = GetDC(hWnd);
                 hMemDC = CreateCompatibleDC(hDC);
                 if (hMemDC != NULL)
@@ -1338,8 +1425,17 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                     Globals.fModified = TRUE;
                 }
                 ReleaseDC(hWnd, hDC);
+                Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, 0);
                 Globals.pt0 = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
+                UpdateWindow(hWnd);
+                break;
+
+            case TOOL_AIRBRUSH:
+                SetCursor(Globals.hcurAirBrush);
+                CanvasToImage(&pt);
+                ShowPos(pt);
+                ShowNoSize();
+                Canvas_AirBrush(hWnd, pt, Globals.rgbFore);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1362,27 +1458,18 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
             case TOOL_BRUSH:
                 SetCursor(Globals.hcurCross);
                 CanvasToImage(&pt);
-                hDC = GetDC(hWnd);
-                hMemDC = CreateCompatibleDC(hDC);
-                if (hMemDC != NULL)
-                {
-                    HGDIOBJ hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-                    LineDDA(Globals.pt0.x, Globals.pt0.y, pt.x, pt.y,
-                            BackBrushDDAProc, (LPARAM)hMemDC);
-                    SelectObject(hMemDC, hbmOld);
-                    DeleteDC(hMemDC);
-                }
-                ReleaseDC(hWnd, hDC);
+                Canvas_TouchStroke(Globals.pt0, pt, 5);
+                Canvas_BrushLine(Globals.hbmImage, Globals.pt0, pt,
+                                 Globals.rgbBack);
+                Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, 5);
                 Globals.pt0 = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
                 UpdateWindow(hWnd);
                 break;
 
             case TOOL_POLYGON:
                 SetCursor(Globals.hcurCross2);
                 CanvasToImage(&pt);
-                Globals.pPolyline[Globals.cPolyline - 1] = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_MovePolylineEnd(hWnd, pt);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1401,7 +1488,7 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 {
                     Globals.pt2 = pt;
                 }
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidateCurve(hWnd);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1412,7 +1499,8 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 SetCursor(Globals.hcurCross2);
                 CanvasToImage(&pt);
                 Globals.pt1 = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, Globals.pt0, Globals.pt1,
+                                          Globals.nLineWidth);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1439,6 +1527,7 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
             case TOOL_PENCIL:
                 SetCursor(Globals.hcurPencil);
                 CanvasToImage(&pt);
+                Canvas_TouchStroke(Globals.pt0, pt, 0);
                 hDC = GetDC(hWnd);
                 hMemDC = CreateCompatibleDC(hDC);
                 if (hMemDC != NULL)
@@ -1456,8 +1545,17 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                     Globals.fModified = TRUE;
                 }
                 ReleaseDC(hWnd, hDC);
+                Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, 0);
                 Globals.pt0 = pt;
-                InvalidateRect(hWnd, NULL, FALSE);
+                UpdateWindow(hWnd);
+                break;
+
+            case TOOL_AIRBRUSH:
+                SetCursor(Globals.hcurAirBrush);
+                CanvasToImage(&pt);
+                ShowPos(pt);
+                ShowNoSize();
+                Canvas_AirBrush(hWnd, pt, Globals.rgbBack);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1540,7 +1638,7 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 Globals.pt0 = pt;
                 ShowPos(pt);
                 ShowNoSize();
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, pt, pt, 5);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1550,7 +1648,8 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
                 Globals.pt0 = pt;
                 ShowPos(pt);
                 ShowNoSize();
-                InvalidateRect(hWnd, NULL, FALSE);
+                Canvas_InvalidatePreview2(hWnd, pt, pt,
+                                          Globals.nEraserSize / 2 + 1);
                 UpdateWindow(hWnd);
                 break;
 
@@ -1600,11 +1699,16 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
             else
             {
                 SetCursor(Globals.hcurArrow);
-                if (Globals.iToolSelect == TOOL_MAGNIFIER || Globals.iToolSelect == TOOL_ERASER)
+                if (Globals.iToolSelect == TOOL_MAGNIFIER)
                 {
                     InvalidateRect(hWnd, NULL, FALSE);
                     UpdateWindow(hWnd);
                 }
+                else if (Globals.iToolSelect == TOOL_ERASER)
+                {
+                    Canvas_InvalidatePreview(hWnd, NULL);
+                    UpdateWindow(hWnd);
+                }
             }
             return;
         }
@@ -1613,8 +1717,11 @@ VOID Canvas_OnMouseMove(HWND hWnd, INT x, INT y, BOOL fLeftDown, BOOL fRightDown
 
 VOID Canvas_Resize(HWND hWnd, SIZE sizNew)
 {
-    HBITMAP hbmNew = BM_CreateResized(hWnd, sizNew, Globals.hbmImage,
-                                       Globals.sizImage);
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    hbmNew = BM_CreateResized(hWnd, sizNew, Globals.hbmImage,
+                              Globals.sizImage);
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1622,14 +1729,6 @@ VOID Canvas_Resize(HWND hWnd, SIZE sizNew)
         Globals.hbmImage = hbmNew;
         Globals.sizImage = sizNew;
 
-        if (Globals.hbmBuffer != NULL)
-            DeleteObject(Globals.hbmBuffer);
-        Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-        if (Globals.hbmZoomBuffer != NULL)
-            DeleteObject(Globals.hbmZoomBuffer);
-        sizNew.cx *= Globals.nZoom;
-        sizNew.cy *= Globals.nZoom;
-        Globals.hbmZoomBuffer = BM_Create(sizNew);
         Globals.fModified = TRUE;
         Globals.xScrollPos = Globals.yScrollPos = 0;
         PostMessageW(hWnd, WM_SIZE, 0, 0);
@@ -1640,14 +1739,30 @@ VOID Canvas_Resize(HWND hWnd, SIZE sizNew)
         ShowLastError();
 }
 
-VOID Selection_Stretch(HWND hWnd, SIZE sizNew)
+/* Stretches the selection to sizNew, then skews it by nSkewX and nSkewY
+ * degrees */
+VOID Selection_StretchSkew(HWND hWnd, SIZE sizNew, INT nSkewX, INT nSkewY)
 {
-    HBITMAP hbmNew;
+    HBITMAP hbmNew, hbmSkewed;
     SIZE siz;
     Selection_TakeOff();
     siz.cx = Globals.pt1.x - Globals.pt0.x;
     siz.cy = Globals.pt1.y - Globals.pt0.y;
-    hbmNew = BM_CreateStretched(hWnd, sizNew, Globals.hbmSelect, siz);
+    if (sizNew.cx == siz.cx && sizNew.cy == siz.cy && nSkewX == 0 &&
+        nSkewY == 0)
+        return;
+
+    hbmNew = Globals.hbmSelect;
+    if (sizNew.cx != siz.cx || sizNew.cy != siz.cy)
+        hbmNew = BM_CreateStretched(hWnd, sizNew, Globals.hbmSelect, siz);
+    if (hbmNew != NULL && (nSkewX != 0 || nSkewY != 0))
+    {
+        hbmSkewed = BM_CreateSkewed(hbmNew, nSkewX, nSkewY, Globals.rgbBack);
+        if (hbmNew != Globals.hbmSelect)
+            DeleteObject(hbmNew);
+        hbmNew = hbmSkewed;
+        sizNew = BM_GetSkewedSize(sizNew, nSkewX, nSkewY);
+    }
     if (hbmNew != NULL)
     {
         if (Globals.hbmSelect != NULL)
@@ -1663,10 +1778,29 @@ VOID Selection_Stretch(HWND hWnd, SIZE sizNew)
         ShowLastError();
 }
 
-VOID Canvas_Stretch(HWND hWnd, SIZE sizNew)
+/* Stretches the image to sizNew, then skews it by nSkewX and nSkewY
+ * degrees */
+VOID Canvas_StretchSkew(HWND hWnd, SIZE sizNew, INT nSkewX, INT nSkewY)
 {
-    HBITMAP hbmNew = BM_CreateStretched(hWnd, sizNew,
-                                         Globals.hbmImage, Globals.sizImage);
+    HBITMAP hbmNew, hbmSkewed;
+
+    if (sizNew.cx == Globals.sizImage.cx && sizNew.cy == Globals.sizImage.cy &&
+        nSkewX == 0 && nSkewY == 0)
+        return;
+
+    Undo_BeginFull();
+    hbmNew = Globals.hbmImage;
+    if (sizNew.cx != Globals.sizImage.cx || sizNew.cy != Globals.sizImage.cy)
+        hbmNew = BM_CreateStretched(hWnd, sizNew,
+                                    Globals.hbmImage, Globals.sizImage);
+    if (hbmNew != NULL && (nSkewX != 0 || nSkewY != 0))
+    {
+        hbmSkewed = BM_CreateSkewed(hbmNew, nSkewX, nSkewY, Globals.rgbBack);
+        if (hbmNew != Globals.hbmImage)
+            DeleteObject(hbmNew);
+        hbmNew = hbmSkewed;
+        sizNew = BM_GetSkewedSize(sizNew, nSkewX, nSkewY);
+    }
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1674,14 +1808,6 @@ VOID Canvas_Stretch(HWND hWnd, SIZE sizNew)
         Globals.hbmImage = hbmNew;
         Globals.sizImage = sizNew;
 
-        if (Globals.hbmBuffer != NULL)
-            DeleteObject(Globals.hbmBuffer);
-        Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-        if (Globals.hbmZoomBuffer != NULL)
-            DeleteObject(Globals.hbmZoomBuffer);
-        sizNew.cx *= Globals.nZoom;
-        sizNew.cy *= Globals.nZoom;
-        Globals.hbmZoomBuffer = BM_Create(sizNew);
         Globals.fModified = TRUE;
         Globals.xScrollPos = Globals.yScrollPos = 0;
         PostMessageW(hWnd, WM_SIZE, 0, 0);
@@ -1715,8 +1841,10 @@ VOID Selection_HFlip(HWND hWnd)
 
 VOID Canvas_HFlip(HWND hWnd)
 {
-    HBITMAP hbmNew = BM_CreateHFliped(hWnd, Globals.hbmImage,
-                                       Globals.sizImage);
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    hbmNew = BM_CreateHFliped(hWnd, Globals.hbmImage, Globals.sizImage);
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1753,8 +1881,11 @@ VOID Selection_VFlip(HWND hWnd)
 
 VOID Canvas_VFlip(HWND hWnd)
 {
-    HBITMAP hbmNew = BM_CreateVFliped(Globals.hCanvasWnd,
-                                       Globals.hbmImage, Globals.sizImage);
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    hbmNew = BM_CreateVFliped(Globals.hCanvasWnd,
+                              Globals.hbmImage, Globals.sizImage);
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1795,8 +1926,11 @@ VOID Selection_Rotate90Degree(HWND hWnd)
 VOID Canvas_Rotate90Degree(HWND hWnd)
 {
     SIZE siz;
-    HBITMAP hbmNew = BM_CreateRotated90Degree(hWnd,
-                     Globals.hbmImage, Globals.sizImage);
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    hbmNew = BM_CreateRotated90Degree(hWnd,
+                                      Globals.hbmImage, Globals.sizImage);
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1805,14 +1939,6 @@ VOID Canvas_Rotate90Degree(HWND hWnd)
         siz.cx = Globals.sizImage.cy;
         siz.cy = Globals.sizImage.cx;
         Globals.sizImage = siz;
-        if (Globals.hbmBuffer != NULL)
-            DeleteObject(Globals.hbmBuffer);
-        Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-        if (Globals.hbmZoomBuffer != NULL)
-            DeleteObject(Globals.hbmZoomBuffer);
-        siz.cx *= Globals.nZoom;
-        siz.cy *= Globals.nZoom;
-        Globals.hbmZoomBuffer = BM_Create(siz);
         Globals.fModified = TRUE;
         Globals.xScrollPos = Globals.yScrollPos = 0;
         PostMessageW(hWnd, WM_SIZE, 0, 0);
@@ -1828,41 +1954,47 @@ VOID Selection_Rotate180Degree(HWND hWnd)
     HBITMAP hbmNew;
     SIZE siz;
     Selection_TakeOff();
-    siz.cx = Globals.pt1.x - Globals.pt0.x;
-    siz.cy = Globals.pt1.y - Globals.pt0.y;
-    hbmNew = BM_CreateRotated180Degree(hWnd,
-                                        Globals.hbmSelect, siz);
-    if (hbmNew != NULL)
+    if (!BM_Rotate180Degree(Globals.hbmSelect))
     {
+        siz.cx = Globals.pt1.x - Globals.pt0.x;
+        siz.cy = Globals.pt1.y - Globals.pt0.y;
+        hbmNew = BM_CreateRotated180Degree(hWnd,
+                                            Globals.hbmSelect, siz);
+        if (hbmNew == NULL)
+        {
+            ShowLastError();
+            return;
+        }
         if (Globals.hbmSelect != NULL)
             DeleteObject(Globals.hbmSelect);
         Globals.hbmSelect = hbmNew;
-        Globals.fModified = TRUE;
-        InvalidateRect(hWnd, NULL, TRUE);
-        UpdateWindow(hWnd);
     }
-    else
-        ShowLastError();
+    Globals.fModified = TRUE;
+    InvalidateRect(hWnd, NULL, TRUE);
+    UpdateWindow(hWnd);
 }
 
 VOID Canvas_Rotate180Degree(HWND hWnd)
 {
-    HBITMAP hbmNew = BM_CreateRotated180Degree(hWnd,
-                     Globals.hbmImage, Globals.sizImage);
-    if (hbmNew != NULL)
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    if (!BM_Rotate180Degree(Globals.hbmImage))
     {
+        hbmNew = BM_CreateRotated180Degree(hWnd,
+                 Globals.hbmImage, Globals.sizImage);
+        if (hbmNew == NULL)
+        {
+            ShowLastError();
+            return;
+        }
         if (Globals.hbmImage != NULL)
             DeleteObject(Globals.hbmImage);
         Globals.hbmImage = hbmNew;
-        if (Globals.hbmBuffer != NULL)
-            DeleteObject(Globals.hbmBuffer);
-        Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-        Globals.fModified = TRUE;
-        InvalidateRect(hWnd, NULL, TRUE);
-        UpdateWindow(hWnd);
     }
-    else
-        ShowLastError();
+    Globals.fModified = TRUE;
+    InvalidateRect(hWnd, NULL, TRUE);
+    UpdateWindow(hWnd);
 }
 
 VOID Selection_Rotate270Degree(HWND hWnd)
@@ -1892,8 +2024,11 @@ VOID Selection_Rotate270Degree(HWND hWnd)
 VOID Canvas_Rotate270Degree(HWND hWnd)
 {
     SIZE siz;
-    HBITMAP hbmNew = BM_CreateRotated270Degree(hWnd,
-                     Globals.hbmImage, Globals.sizImage);
+    HBITMAP hbmNew;
+
+    Undo_BeginFull();
+    hbmNew = BM_CreateRotated270Degree(hWnd,
+                                      Globals.hbmImage, Globals.sizImage);
     if (hbmNew != NULL)
     {
         if (Globals.hbmImage != NULL)
@@ -1902,14 +2037,6 @@ VOID Canvas_Rotate270Degree(HWND hWnd)
         siz.cx = Globals.sizImage.cy;
         siz.cy = Globals.sizImage.cx;
         Globals.sizImage = siz;
-        if (Globals.hbmBuffer != NULL)
-            DeleteObject(Globals.hbmBuffer);
-        Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-        if (Globals.hbmZoomBuffer != NULL)
-            DeleteObject(Globals.hbmZoomBuffer);
-        siz.cx *= Globals.nZoom;
-        siz.cy *= Globals.nZoom;
-        Globals.hbmZoomBuffer = BM_Create(siz);
         Globals.fModified = TRUE;
         Globals.xScrollPos = Globals.yScrollPos = 0;
         PostMessageW(hWnd, WM_SIZE, 0, 0);
@@ -1941,55 +2068,55 @@ VOID Canvas_OnButtonDblClk(HWND hWnd, INT x, INT y, BOOL fRight)
                 HPEN hPen;
                 HBRUSH hbr;
                 HGDIOBJ hpenOld, hbrOld, hbmOld;
-                hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-                if (fRight)
+                COLORREF rgbPen, rgbFill;
+                BM_PIXELS px;
+                RECT rc;
+                INT i;
+
+                Undo_Begin();
+                if (Globals.cPolyline > 0)
                 {
-                    switch (Globals.iFillStyle)
+                    rc.left = rc.right = Globals.pPolyline[0].x;
+                    rc.top = rc.bottom = Globals.pPolyline[0].y;
+                    for (i = 1; i < Globals.cPolyline; i++)
                     {
-                    case 0:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbBack);
-                        hbr = (HBRUSH)GetStockObject(NULL_BRUSH);
-                        break;
-
-                    case 1:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbBack);
-                        hbr = CreateSolidBrush(Globals.rgbFore);
-                        break;
-
-                    default:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbBack);
-                        hbr = CreateSolidBrush(Globals.rgbBack);
-                        break;
+                        rc.left = min(rc.left, Globals.pPolyline[i].x);
+                        rc.top = min(rc.top, Globals.pPolyline[i].y);
+                        rc.right = max(rc.right, Globals.pPolyline[i].x);
+                        rc.bottom = max(rc.bottom, Globals.pPolyline[i].y);
                     }
+                    rc.left -= Globals.nLineWidth;
+                    rc.top -= Globals.nLineWidth;
+                    rc.right += Globals.nLineWidth + 1;
+                    rc.bottom += Globals.nLineWidth + 1;
+                    Undo_Touch(&rc);
                 }
+
+                /* the inside goes straight into the bits, the outline
+                 * over it through GDI */
+                rgbPen = fRight ? Globals.rgbBack : Globals.rgbFore;
+                if (Globals.iFillStyle == 1)
+                    rgbFill = fRight ? Globals.rgbFore : Globals.rgbBack;
                 else
+                    rgbFill = rgbPen;
+                hbr = (HBRUSH)GetStockObject(NULL_BRUSH);
+                if (Globals.iFillStyle != 0)
                 {
-                    switch (Globals.iFillStyle)
+                    GdiFlush();
+                    if (!BM_GetPixels(Globals.hbmImage, &px) ||
+                        !BM_FillPolygon(&px, Globals.pPolyline,
+                                        Globals.cPolyline,
+                                        Globals.iPolyFillMode, rgbFill, NULL))
                     {
-                    case 0:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbFore);
-                        hbr = (HBRUSH)GetStockObject(NULL_BRUSH);
-                        break;
-
-                    case 1:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbFore);
-                        hbr = CreateSolidBrush(Globals.rgbBack);
-                        break;
-
-                    default:
-                        hPen = CreatePen(PS_SOLID, Globals.nLineWidth,
-                                         Globals.rgbFore);
-                        hbr = CreateSolidBrush(Globals.rgbFore);
-                        break;
+                        hbr = CreateSolidBrush(rgbFill);
                     }
                 }
+
+                hbmOld = SelectObject(hMemDC, Globals.hbmImage);
+                hPen = CreatePen(PS_SOLID, Globals.nLineWidth, rgbPen);
                 hpenOld = SelectObject(hMemDC, hPen);
                 hbrOld = SelectObject(hMemDC, hbr);
+                SetPolyFillMode(hMemDC, Globals.iPolyFillMode);
                 Polygon(hMemDC, Globals.pPolyline, Globals.cPolyline);
                 SelectObject(hMemDC, hpenOld);
                 SelectObject(hMemDC, hbrOld);
@@ -2000,9 +2127,7 @@ VOID Canvas_OnButtonDblClk(HWND hWnd, INT x, INT y, BOOL fRight)
             }
             ReleaseDC(hWnd, hDC);
         }
-        HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
-        Globals.pPolyline = NULL;
-        Globals.cPolyline = 0;
+        Polyline_Free();
         Globals.fModified = TRUE;
         InvalidateRect(hWnd, NULL, FALSE);
         UpdateWindow(hWnd);
@@ -2020,6 +2145,7 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
     POINT pt;
     SIZE siz;
     RECT rc;
+    BOOL fRepaintAll = TRUE;
     pt.x = x;
     pt.y = y;
 
@@ -2027,7 +2153,6 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
     {
     case MODE_RIGHT_EDGE:
         CanvasToImage(&pt);
-        PrepareForUndo();
         Globals.fModified = TRUE;
         siz.cx = pt.x;
         siz.cy = Globals.sizImage.cy;
@@ -2041,7 +2166,6 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
 
     case MODE_DOWN_EDGE:
         CanvasToImage(&pt);
-        PrepareForUndo();
         Globals.fModified = TRUE;
         siz.cx = Globals.sizImage.cx;
         siz.cy = pt.y;
@@ -2055,7 +2179,6 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
 
     case MODE_LOWER_RIGHT_EDGE:
         CanvasToImage(&pt);
-        PrepareForUndo();
         Globals.fModified = TRUE;
         siz.cx = pt.x;
         siz.cy = pt.y;
@@ -2069,11 +2192,16 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
         break;
 
     case MODE_SELECTION:
+        /* only the marquee comes back */
+        fRepaintAll = FALSE;
         ReleaseCapture();
         Globals.mode = MODE_NORMAL;
+        Canvas_InvalidateSelection(hWnd);
         break;
 
     case MODE_CANVAS:
+        /* each tool invalidates what it has drawn */
+        fRepaintAll = FALSE;
         ReleaseCapture();
         Globals.mode = MODE_NORMAL;
         switch (Globals.iToolSelect)
@@ -2089,15 +2217,15 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
             IntersectRect((RECT*)&Globals.pt0, (RECT*)&Globals.pt0, &rc);
             Globals.fSelect = !IsRectEmpty((RECT*)&Globals.pt0);
             Globals.hbmSelect = NULL;
-            InvalidateRect(hWnd, NULL, TRUE);
+            Canvas_InvalidatePreview(hWnd, NULL);
+            Canvas_InvalidateSelection(hWnd);
             UpdateWindow(hWnd);
             break;
 
         case TOOL_POLYGON:
             SetCursor(Globals.hcurCross2);
             CanvasToImage(&pt);
-            Globals.pPolyline[Globals.cPolyline - 1] = pt;
-            InvalidateRect(hWnd, NULL, FALSE);
+            Canvas_MovePolylineEnd(hWnd, pt);
             UpdateWindow(hWnd);
             break;
 
@@ -2118,7 +2246,9 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
             {
                 Globals.pt2 = pt;
                 Globals.ipt = 0;
-                PrepareForUndo();
+                Undo_Begin();
+                GetCurveRect(&rc);
+                Undo_Touch(&rc);
                 hDC = GetDC(hWnd);
                 if (hDC != NULL)
                 {
@@ -2138,13 +2268,13 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
                     }
                     ReleaseDC(hWnd, hDC);
                 }
-                InvalidateRect(hWnd, NULL, FALSE);
-                UpdateWindow(hWnd);
             }
+            Canvas_InvalidateCurve(hWnd);
             break;
 
         case TOOL_PENCIL:
             CanvasToImage(&pt);
+            Canvas_TouchStroke(Globals.pt0, pt, 0);
             hDC = GetDC(hWnd);
             if (hDC != NULL)
             {
@@ -2169,8 +2299,7 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
                 }
                 ReleaseDC(hWnd, hDC);
             }
-            InvalidateRect(hWnd, NULL, FALSE);
-            UpdateWindow(hWnd);
+            Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, 0);
             break;
 
         case TOOL_AIRBRUSH:
@@ -2182,7 +2311,8 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
         case TOOL_ELLIPSE:
         case TOOL_ROUNDRECT:
             CanvasToImage(&pt);
-            PrepareForUndo();
+            Undo_Begin();
+            Canvas_TouchStroke(Globals.pt0, pt, Globals.nLineWidth);
             hDC = GetDC(hWnd);
             if (hDC != NULL)
             {
@@ -2269,6 +2399,8 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
                 }
                 ReleaseDC(hWnd, hDC);
             }
+            Canvas_InvalidatePreview(hWnd, NULL);
+            Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, Globals.nLineWidth);
             SetRectEmpty((RECT*)&Globals.pt0);
             break;
 
@@ -2286,7 +2418,8 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
 
         case TOOL_LINE:
             CanvasToImage(&pt);
-            PrepareForUndo();
+            Undo_Begin();
+            Canvas_TouchStroke(Globals.pt0, pt, Globals.nLineWidth);
             hDC = GetDC(hWnd);
             if (hDC != NULL)
             {
@@ -2309,6 +2442,8 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
                 }
                 ReleaseDC(hWnd, hDC);
             }
+            Canvas_InvalidatePreview(hWnd, NULL);
+            Canvas_InvalidateStroke(hWnd, Globals.pt0, pt, Globals.nLineWidth);
             break;
 
         default:
@@ -2319,10 +2454,25 @@ VOID Canvas_OnButtonUp(HWND hWnd, INT x, INT y, BOOL fRight)
     default:
         break;
     }
-    InvalidateRect(hWnd, NULL, FALSE);
+    if (fRepaintAll)
+        InvalidateRect(hWnd, NULL, FALSE);
     UpdateWindow(hWnd);
 }
 
+/* Ends a stroke in progress as if the button were let go where the cursor
+ * is, stopping the airbrush timer, so nothing draws into the image after
+ * this returns */
+VOID Canvas_EndStroke(HWND hWnd)
+{
+    POINT pt;
+
+    if (Globals.mode != MODE_CANVAS)
+        return;
+    GetCursorPos(&pt);
+    ScreenToClient(hWnd, &pt);
+    Canvas_OnButtonUp(hWnd, pt.x, pt.y, GetKeyState(VK_RBUTTON) < 0);
+}
+
 VOID Canvas_OnSize(HWND hWnd)
 {
     RECT rc;
@@ -2379,11 +2529,38 @@ VOID Canvas_OnSize(HWND hWnd)
             DeleteObject(Globals.hbmCanvasBuffer);
         siz.cx += 50;
         siz.cy += 50;
-        Globals.hbmCanvasBuffer = BM_Create(siz);
+        Globals.hbmCanvasBuffer = BM_Create32(siz);
         Globals.sizCanvas = siz;
     }
 }
 
+/* Returns the rectangles of the update region of hWnd if there are a
+ * few of them, or NULL if painting their bounding box will do */
+static RGNDATA *Canvas_GetUpdateRects(HWND hWnd)
+{
+    RGNDATA *prd = NULL;
+    HRGN hRgn;
+    DWORD cb;
+
+    hRgn = CreateRectRgn(0, 0, 0, 0);
+    if (hRgn == NULL)
+        return NULL;
+    if (GetUpdateRgn(hWnd, hRgn, FALSE) == COMPLEXREGION)
+    {
+        cb = GetRegionData(hRgn, 0, NULL);
+        if (cb != 0)
+            prd = HeapAlloc(GetProcessHeap(), 0, cb);
+        if (prd != NULL &&
+            (GetRegionData(hRgn, cb, prd) == 0 || prd->rdh.nCount > 8))
+        {
+            HeapFree(GetProcessHeap(), 0, prd);
+            prd = NULL;
+        }
+    }
+    DeleteObject(hRgn);
+    return prd;
+}
+
 LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
                                WPARAM wParam, LPARAM lParam)
 {
@@ -2436,10 +2613,7 @@ LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
                 ReleaseCapture();
                 Globals.mode = MODE_NORMAL;
                 Globals.ipt = 0;
-                if (Globals.pPolyline != NULL)
-                    HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
-                Globals.pPolyline = NULL;
-                Globals.cPolyline = 0;
+                Polyline_Free();
                 InvalidateRect(hWnd, NULL, FALSE);
                 UpdateWindow(hWnd);
             }
@@ -2448,34 +2622,14 @@ LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
 
     case WM_TIMER:
     {
-        HDC hDC = GetDC(hWnd);
-        HDC hMemDC = CreateCompatibleDC(hDC);
-        if (hMemDC != NULL)
-        {
-            POINT pt;
-            INT i, j, n;
-            HGDIOBJ hbmOld = SelectObject(hMemDC, Globals.hbmImage);
-            GetCursorPos(&pt);
-            ScreenToClient(hWnd, &pt);
-            CanvasToImage(&pt);
-            ShowPos(pt);
-            ShowNoSize();
-
-            n = Globals.nAirBrushRadius;
-            for (i = 0; i < 5; i++)
-            {
-                j = rand();
-                SetPixelV(hMemDC, pt.x + n / 2 - cos(j) * (rand() % n),
-                          pt.y + n / 2 - sin(j) * (rand() % n),
-                          (GetKeyState(VK_RBUTTON) < 0) ? Globals.rgbBack :
-                          Globals.rgbFore);
-            }
-            Globals.fModified = TRUE;
-            SelectObject(hMemDC, hbmOld);
-            DeleteDC(hMemDC);
-        }
-        ReleaseDC(hWnd, hDC);
-        InvalidateRect(hWnd, NULL, FALSE);
+        POINT pt;
+        GetCursorPos(&pt);
+        ScreenToClient(hWnd, &pt);
+        CanvasToImage(&pt);
+        ShowPos(pt);
+        ShowNoSize();
+        Canvas_AirBrush(hWnd, pt, (GetKeyState(VK_RBUTTON) < 0) ?
+                        Globals.rgbBack : Globals.rgbFore);
         UpdateWindow(hWnd);
         break;
     }
@@ -2483,12 +2637,28 @@ LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
     case WM_PAINT:
     {
         PAINTSTRUCT ps;
-        HDC hDC = BeginPaint(hWnd, &ps);
+        RGNDATA *prd;
+        HDC hDC;
+
+        /* the old and new places of something that moved are painted
+         * each by itself, not as the box around both */
+        prd = Canvas_GetUpdateRects(hWnd);
+        hDC = BeginPaint(hWnd, &ps);
         if (hDC != NULL)
         {
-            Canvas_OnPaint(hWnd, hDC);
+            if (prd != NULL)
+            {
+                RECT *prc = (RECT*)prd->Buffer;
+                DWORD i;
+
+                for (i = 0; i < prd->rdh.nCount; i++)
+                    Canvas_OnPaint(hWnd, hDC, &prc[i]);
+            }
+            else
+                Canvas_OnPaint(hWnd, hDC, &ps.rcPaint);
             EndPaint(hWnd, &ps);
         }
+        HeapFree(GetProcessHeap(), 0, prd);
         break;
     }
 
@@ -2611,6 +2781,19 @@ LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
         }
         break;
 
+    /* the canvas owns the clipboard */
+    case WM_RENDERFORMAT:
+        PAINT_OnRenderFormat((UINT)wParam);
+        break;
+
+    case WM_RENDERALLFORMATS:
+        PAINT_OnRenderAllFormats();
+        break;
+
+    case WM_DESTROYCLIPBOARD:
+        PAINT_OnDestroyClipboard();
+        break;
+
     default:
         return DefWindowProcW(hWnd, uMsg, wParam, lParam);
     }
@@ -0,0 +1,297 @@
+/*
+ *  Paint (fill.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Scanline flood fill working on the bits of a DIB section.
+ *
+ * The region is found first, one horizontal span at a time, and recorded
+ * as a bit per pixel, so that its bounding box can be saved for undo before
+ * anything is drawn.  The seeds waiting to be scanned and the bits live in
+ * a FILL_ARENA that the caller keeps from one fill to the next, one per
+ * thread, as /batch fills on several at once.  The bits are all clear
+ * between fills, and a fill clears again only the rows it marked, so that a
+ * small fill costs little however big the image is.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "main.h"
+
+/* Makes the buffer at *ppv, of *pcb bytes, hold at least cb bytes,
+ * keeping its contents.  With HEAP_ZERO_MEMORY in dwFlags, bytes added
+ * are zero. */
+static BOOL Fill_Reserve(LPVOID *ppv, SIZE_T *pcb, SIZE_T cb, DWORD dwFlags)
+{
+    LPVOID pv;
+
+    if (cb <= *pcb)
+        return TRUE;
+    cb = max(cb, *pcb * 2);
+    if (*ppv == NULL)
+        pv = HeapAlloc(GetProcessHeap(), dwFlags, cb);
+    else
+        pv = HeapReAlloc(GetProcessHeap(), dwFlags, *ppv, cb);
+    if (pv == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    *ppv = pv;
+    *pcb = cb;
+    return TRUE;
+}
+
+VOID Fill_FreeArena(FILL_ARENA *pArena)
+{
+    HeapFree(GetProcessHeap(), 0, pArena->pvSeeds);
+    HeapFree(GetProcessHeap(), 0, pArena->pvVisited);
+    ZeroMemory(pArena, sizeof(FILL_ARENA));
+}
+
+typedef struct
+{
+    const BM_PIXELS *ppx;
+    FILL_ARENA *pArena;
+    INT     cbPixel;
+    BYTE    ab[3];      /* seed color, B G R */
+    INT     nTolerance;
+    LPBYTE  pbVisited;
+    LONG    cbVisitedRow;
+} FILL_STATE;
+
+static BOOL Fill_Inside(const FILL_STATE *ps, INT x, INT y)
+{
+    const BYTE *pb;
+
+    if (ps->pbVisited[y * ps->cbVisitedRow + x / 8] & (1 << (x % 8)))
+        return FALSE;
+    pb = BM_ScanLine(ps->ppx, y) + x * ps->cbPixel;
+    if (ps->nTolerance == 0)
+        return pb[0] == ps->ab[0] && pb[1] == ps->ab[1] && pb[2] == ps->ab[2];
+    return abs(pb[0] - ps->ab[0]) <= ps->nTolerance &&
+           abs(pb[1] - ps->ab[1]) <= ps->nTolerance &&
+           abs(pb[2] - ps->ab[2]) <= ps->nTolerance;
+}
+
+static BOOL Fill_PushSeed(FILL_ARENA *pArena, INT *pcSeeds, INT x, INT y)
+{
+    POINT *ppt;
+
+    if (!Fill_Reserve(&pArena->pvSeeds, &pArena->cbSeeds,
+                      (*pcSeeds + 1) * sizeof(POINT), 0))
+        return FALSE;
+    ppt = (POINT *)pArena->pvSeeds + (*pcSeeds)++;
+    ppt->x = x;
+    ppt->y = y;
+    return TRUE;
+}
+
+/* Pushes a seed for every run of pixels of row y between x0 and x1 that
+ * belong to the region */
+static BOOL Fill_ScanRow(const FILL_STATE *ps, INT *pcSeeds, INT x0, INT x1,
+                         INT y)
+{
+    BOOL fIn = FALSE;
+    INT x;
+
+    if (y < 0 || y >= ps->ppx->cy)
+        return TRUE;
+    for (x = x0; x <= x1; x++)
+    {
+        if (Fill_Inside(ps, x, y))
+        {
+            if (!fIn && !Fill_PushSeed(ps->pArena, pcSeeds, x, y))
+                return FALSE;
+            fIn = TRUE;
+        }
+        else
+            fIn = FALSE;
+    }
+    return TRUE;
+}
+
+/* Finds the 4-connected region around (x, y) whose colors are within
+ * nTolerance of it in every channel, marks it in the visited bits of
+ * pArena and returns
+ * its bounding box.  Even on failure, what was marked lies within *prc. */
+static BOOL Fill_FindRegion(FILL_ARENA *pArena, const BM_PIXELS *ppx, INT x,
+                            INT y, INT nTolerance, RECT *prc)
+{
+    FILL_STATE s;
+    POINT pt;
+    INT cSeeds, x0, x1, i;
+    SIZE_T cbVisited;
+
+    s.ppx = ppx;
+    s.pArena = pArena;
+    s.cbPixel = ppx->wBitCount / 8;
+    memcpy(s.ab, BM_ScanLine(ppx, y) + x * s.cbPixel, 3);
+    s.nTolerance = nTolerance;
+    s.cbVisitedRow = (ppx->cx + 7) / 8;
+    cbVisited = (SIZE_T)s.cbVisitedRow * ppx->cy;
+    SetRectEmpty(prc);
+    if (!Fill_Reserve(&pArena->pvVisited, &pArena->cbVisited, cbVisited,
+                      HEAP_ZERO_MEMORY))
+        return FALSE;
+    s.pbVisited = pArena->pvVisited;
+
+    cSeeds = 0;
+    if (!Fill_PushSeed(pArena, &cSeeds, x, y))
+        return FALSE;
+
+    while (cSeeds > 0)
+    {
+        pt = ((POINT *)pArena->pvSeeds)[--cSeeds];
+        if (!Fill_Inside(&s, pt.x, pt.y))
+            continue;
+
+        for (x0 = pt.x; x0 > 0 && Fill_Inside(&s, x0 - 1, pt.y); x0--)
+            ;
+        for (x1 = pt.x; x1 < ppx->cx - 1 && Fill_Inside(&s, x1 + 1, pt.y); x1++)
+            ;
+
+        for (i = x0; i <= x1; i++)
+            s.pbVisited[pt.y * s.cbVisitedRow + i / 8] |= 1 << (i % 8);
+
+        if (IsRectEmpty(prc))
+            SetRect(prc, x0, pt.y, x1 + 1, pt.y + 1);
+        else
+        {
+            prc->left = min(prc->left, x0);
+            prc->top = min(prc->top, pt.y);
+            prc->right = max(prc->right, x1 + 1);
+            prc->bottom = max(prc->bottom, pt.y + 1);
+        }
+
+        if (!Fill_ScanRow(&s, &cSeeds, x0, x1, pt.y - 1) ||
+            !Fill_ScanRow(&s, &cSeeds, x0, x1, pt.y + 1))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Sets the pixels marked in the visited bits of pArena, within *prc, to
+ * the color ab.  The alpha of 32 bpp pixels is left as it was. */
+static VOID Fill_Paint(const FILL_ARENA *pArena, BM_PIXELS *ppx,
+                       const RECT *prc, const BYTE *ab)
+{
+    LONG cbVisitedRow = (ppx->cx + 7) / 8;
+    const BYTE *pbBits;
+    LPBYTE pb;
+    DWORD dw;
+    INT x, y;
+
+    dw = ab[0] | (ab[1] << 8) | (ab[2] << 16);
+    for (y = prc->top; y < prc->bottom; y++)
+    {
+        pbBits = (const BYTE *)pArena->pvVisited + y * cbVisitedRow;
+        pb = BM_ScanLine(ppx, y);
+        for (x = prc->left; x < prc->right; x++)
+        {
+            if (!(x & 7) && pbBits[x / 8] == 0 && x + 8 <= prc->right)
+            {
+                x += 7;
+                continue;
+            }
+            if (!(pbBits[x / 8] & (1 << (x % 8))))
+                continue;
+            if (ppx->wBitCount == 32)
+                ((DWORD *)pb)[x] = (((DWORD *)pb)[x] & 0xFF000000) | dw;
+            else
+            {
+                pb[x * 3] = ab[0];
+                pb[x * 3 + 1] = ab[1];
+                pb[x * 3 + 2] = ab[2];
+            }
+        }
+    }
+}
+
+/* Clears the visited bits of pArena within *prc, which are all a fill
+ * marks */
+static VOID Fill_ClearVisited(FILL_ARENA *pArena, const BM_PIXELS *ppx,
+                              const RECT *prc)
+{
+    LONG cbVisitedRow = (ppx->cx + 7) / 8;
+    INT y;
+
+    if (IsRectEmpty(prc))
+        return;
+    for (y = prc->top; y < prc->bottom; y++)
+        ZeroMemory((LPBYTE)pArena->pvVisited + y * cbVisitedRow + prc->left / 8,
+                   (prc->right - 1) / 8 - prc->left / 8 + 1);
+}
+
+/* Fills the region of the 24 or 32 bpp image ppx around (x, y) with rgb,
+ * like ExtFloodFill with FLOODFILLSURFACE.  With nTolerance, colors that
+ * differ from the one at (x, y) by up to nTolerance in each channel belong
+ * to the region too.  pfnPrepare, if given, is called with the bounding
+ * box of the region before it is drawn; the box is also returned in
+ * *prcChanged, which is empty if nothing changed.  The fill works in
+ * pArena, or if it is NULL in buffers of its own that it frees. */
+BOOL BM_FloodFill(BM_PIXELS *ppx, INT x, INT y, COLORREF rgb, INT nTolerance,
+                  VOID (*pfnPrepare)(const RECT *prc), RECT *prcChanged,
+                  FILL_ARENA *pArena)
+{
+    FILL_ARENA arena;
+    BYTE ab[3];
+    LPBYTE pb;
+    BOOL f;
+
+    SetRectEmpty(prcChanged);
+    if ((ppx->wBitCount != 24 && ppx->wBitCount != 32) || nTolerance < 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (x < 0 || y < 0 || x >= ppx->cx || y >= ppx->cy)
+        return TRUE;
+
+    ab[0] = GetBValue(rgb);
+    ab[1] = GetGValue(rgb);
+    ab[2] = GetRValue(rgb);
+    pb = BM_ScanLine(ppx, y) + x * (ppx->wBitCount / 8);
+    if (nTolerance == 0 && !memcmp(pb, ab, 3))
+        return TRUE;
+
+    if (pArena == NULL)
+    {
+        ZeroMemory(&arena, sizeof(arena));
+        pArena = &arena;
+    }
+
+    f = Fill_FindRegion(pArena, ppx, x, y, nTolerance, prcChanged);
+    if (f)
+    {
+        if (pfnPrepare != NULL)
+            pfnPrepare(prcChanged);
+        Fill_Paint(pArena, ppx, prcChanged, ab);
+    }
+    Fill_ClearVisited(pArena, ppx, prcChanged);
+    if (!f)
+        SetRectEmpty(prcChanged);
+
+    if (pArena == &arena)
+        Fill_FreeArena(&arena);
+    return f;
+}
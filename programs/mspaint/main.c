@@ -166,11 +166,64 @@ static VOID PAINT_LoadSettingFromRegistry(void)
                                      };
     static const WCHAR BMPHeight[] = {'B','M','P','H','e','i','g','h','t',0};
     static const WCHAR BMPWidth[] = {'B','M','P','W','i','d','t','h',0};
+    static const WCHAR UndoMemory[] = {'U','n','d','o','M','e','m','o','r','y',0};
+    static const WCHAR FillTolerance[] = {'F','i','l','l',
+                                          'T','o','l','e','r','a','n','c','e',0};
+    static const WCHAR PngCompression[] = {'P','n','g','C','o','m','p','r','e',
+                                           's','s','i','o','n',0};
+    static const WCHAR StretchFilter[] = {'S','t','r','e','t','c','h',
+                                          'F','i','l','t','e','r',0};
+    static const WCHAR PolyFillMode[] = {'P','o','l','y','F','i','l','l',
+                                         'M','o','d','e',0};
     if (RegOpenKeyW(HKEY_CURRENT_USER, paint_reg_key, &hkey) == ERROR_SUCCESS)
     {
+        DWORD value;
+
+        /* megabytes the undo history may use */
+        size = sizeof(DWORD);
+        if (RegQueryValueExW(hkey, UndoMemory, 0, NULL, (BYTE*)&value,
+                            &size) == ERROR_SUCCESS && value != 0)
+        {
+            Undo_SetBudget((SIZE_T)value * 1024 * 1024);
+        }
+
+        /* how far colors may differ from the clicked one and still be
+         * flood filled */
+        size = sizeof(DWORD);
+        if (RegQueryValueExW(hkey, FillTolerance, 0, NULL, (BYTE*)&value,
+                            &size) == ERROR_SUCCESS && value <= 255)
+        {
+            Globals.nFillTolerance = (INT)value;
+        }
+
+        /* 0 to 9, trading the time PNG files take to save for their size */
+        size = sizeof(DWORD);
+        if (RegQueryValueExW(hkey, PngCompression, 0, NULL, (BYTE*)&value,
+                            &size) == ERROR_SUCCESS && value <= 9)
+        {
+            Globals.nPngEffort = (INT)value;
+        }
+
+        /* which RESAMPLE filter Stretch uses */
+        size = sizeof(DWORD);
+        if (RegQueryValueExW(hkey, StretchFilter, 0, NULL, (BYTE*)&value,
+                            &size) == ERROR_SUCCESS &&
+            value <= RESAMPLE_LANCZOS3)
+        {
+            Globals.iStretchFilter = (INT)value;
+        }
+
+        /* ALTERNATE or WINDING, for what the polygon tool fills */
+        size = sizeof(DWORD);
+        if (RegQueryValueExW(hkey, PolyFillMode, 0, NULL, (BYTE*)&value,
+                            &size) == ERROR_SUCCESS &&
+            (value == ALTERNATE || value == WINDING))
+        {
+            Globals.iPolyFillMode = (INT)value;
+        }
+
         if (RegOpenKeyW(hkey, view, &hkey2) == ERROR_SUCCESS)
         {
-            DWORD value;
             WINDOWPLACEMENT wndpl;
             size = sizeof(WINDOWPLACEMENT);
             if (RegQueryValueExW(hkey2, placement, 0, NULL, (BYTE*)&wndpl,
@@ -228,9 +281,13 @@ static int PAINT_OnCommand(WPARAM wParam)
     case CMD_FLIP_ROTATE:           PAINT_FlipRotate(); break;
     case CMD_STRETCH_SKEW:          PAINT_StretchSkew(); break;
     case CMD_INVERT_COLORS:         PAINT_InvertColors(); break;
+    case CMD_GRAYSCALE:             PAINT_PixelOp(PIXELOP_GRAYSCALE, 0, 0); break;
+    case CMD_BLACK_AND_WHITE:       PAINT_PixelOp(PIXELOP_THRESHOLD, 128, 0); break;
+    case CMD_BRIGHTNESS_CONTRAST:   PAINT_BrightnessContrast(); break;
+    case CMD_SWAP_RED_BLUE:         PAINT_PixelOp(PIXELOP_SWAP_RED_BLUE, 0, 0); break;
     case CMD_ATTRIBUTES:            PAINT_Attributes(); break;
     case CMD_CLEAR_IMAGE:           PAINT_ClearImage(); break;
-    case CMD_DRAW_OPAQUE:           break;
+    case CMD_DRAW_OPAQUE:           PAINT_DrawOpaque(Globals.fTransparent); break;
     case CMD_CLEAR_SELECTION:       PAINT_ClearSelection(); break;
 
     case CMD_EDIT_COLOR:            PAINT_EditColor(FALSE); break;
@@ -247,12 +304,17 @@ static VOID PAINT_InitData(VOID)
     WCHAR sz[256];
     LPWSTR p = Globals.szFilter;
     static const WCHAR bmp_files[] = { '*','.','b','m','p',0 };
+    static const WCHAR png_files[] = { '*','.','p','n','g',0 };
     static const WCHAR all_files[] = { '*','.','*',0 };
 
     LoadStringW(Globals.hInstance, STRING_BMP_FILES_BMP, p, MAX_STRING_LEN);
     p += lstrlenW(p) + 1;
     lstrcpyW(p, bmp_files);
     p += lstrlenW(p) + 1;
+    LoadStringW(Globals.hInstance, STRING_PNG_FILES, p, MAX_STRING_LEN);
+    p += lstrlenW(p) + 1;
+    lstrcpyW(p, png_files);
+    p += lstrlenW(p) + 1;
     LoadStringW(Globals.hInstance, STRING_ALL_FILES, p, MAX_STRING_LEN);
     p += lstrlenW(p) + 1;
     lstrcpyW(p, all_files);
@@ -271,10 +333,12 @@ static VOID PAINT_InitData(VOID)
 
     Globals.hbmImage = NULL;
     Globals.hbmBuffer = NULL;
-    Globals.hbmZoomBuffer = NULL;
+    Globals.hSaveThread = NULL;
     Globals.hbmCanvasBuffer = NULL;
 
     Globals.hbmSelect = NULL;
+    Globals.fSelectInStep = FALSE;
+    Globals.hbmClipboard = NULL;
     Globals.fSelect = FALSE;
     Globals.fModified = FALSE;
     Globals.sizImage.cx = 100;
@@ -302,6 +366,10 @@ static VOID PAINT_InitData(VOID)
     Globals.nLineWidth = 1;
     Globals.iBrushType = 1;
     Globals.iFillStyle = 0;
+    Globals.nFillTolerance = 0;
+    Globals.nPngEffort = 6;
+    Globals.iStretchFilter = RESAMPLE_BICUBIC;
+    Globals.iPolyFillMode = ALTERNATE;
 
     Globals.nZoom = 1;
     Globals.fShowGrid = FALSE;
@@ -322,6 +390,8 @@ static VOID PAINT_OnInitMenuPopup(HMENU hMenu, int index)
                   IsWindowVisible(Globals.hStatusBar) ? MF_CHECKED : MF_UNCHECKED);
     CheckMenuItem(hMenu, CMD_SHOW_GRID,
                   Globals.fShowGrid ? MF_CHECKED : MF_UNCHECKED);
+    CheckMenuItem(hMenu, CMD_DRAW_OPAQUE,
+                  Globals.fTransparent ? MF_UNCHECKED : MF_CHECKED);
     EnableMenuItem(hMenu, CMD_SHOW_GRID,
                    Globals.nZoom >= 3 ? MF_ENABLED : MF_GRAYED);
     EnableMenuItem(hMenu, CMD_ZOOM_NORMAL,
@@ -331,10 +401,9 @@ static VOID PAINT_OnInitMenuPopup(HMENU hMenu, int index)
     EnableMenuItem(hMenu, CMD_CLEAR_IMAGE,
                    Globals.fSelect ? MF_GRAYED : MF_ENABLED);
     EnableMenuItem(hMenu, CMD_UNDO,
-                   Globals.fCanUndo ? MF_ENABLED : MF_GRAYED);
+                   Undo_CanUndo() ? MF_ENABLED : MF_GRAYED);
     EnableMenuItem(hMenu, CMD_REPEAT,
-                   !Globals.fCanUndo && Globals.hbmImageUndo ?
-                   MF_ENABLED : MF_GRAYED);
+                   Undo_CanRedo() ? MF_ENABLED : MF_GRAYED);
     EnableMenuItem(hMenu, CMD_CUT,
                    Globals.fSelect ? MF_ENABLED : MF_GRAYED);
     EnableMenuItem(hMenu, CMD_COPY,
@@ -771,10 +840,7 @@ void ToolBox_OnLButton(HWND hWnd, int x, int y, BOOL fDown)
                 Globals.iToolSelect = i;
                 Globals.iToolClicking = -1;
                 Globals.ipt = 0;
-                if (Globals.pPolyline != NULL)
-                    HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
-                Globals.pPolyline = NULL;
-                Globals.cPolyline = 0;
+                Polyline_Free();
                 Selection_Land();
                 SetRectEmpty((RECT*)&Globals.pt0);
                 InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
@@ -873,9 +939,7 @@ void ToolBox_OnLButton(HWND hWnd, int x, int y, BOOL fDown)
         rc.bottom = rc.top + (290 - 210) / 2;
         if (PtInRect(&rc, pt))
         {
-            Globals.fTransparent = FALSE;
-            InvalidateRect(hWnd, NULL, TRUE);
-            UpdateWindow(hWnd);
+            PAINT_DrawOpaque(TRUE);
             break;
         }
         rc.left = 6;
@@ -884,10 +948,7 @@ void ToolBox_OnLButton(HWND hWnd, int x, int y, BOOL fDown)
         rc.bottom = rc.top + (290 - 210) / 2;
         if (PtInRect(&rc, pt))
         {
-            Globals.fTransparent = TRUE;
-            NotSupportedYet();
-            InvalidateRect(hWnd, NULL, TRUE);
-            UpdateWindow(hWnd);
+            PAINT_DrawOpaque(FALSE);
             break;
         }
         break;
@@ -1101,9 +1162,8 @@ VOID PAINT_OnDestroy(HWND hWnd)
 {
     if (Globals.hbmImage != NULL) DeleteObject(Globals.hbmImage);
     if (Globals.hbmBuffer != NULL) DeleteObject(Globals.hbmBuffer);
-    if (Globals.hbmZoomBuffer != NULL) DeleteObject(Globals.hbmZoomBuffer);
     if (Globals.hbmCanvasBuffer != NULL) DeleteObject(Globals.hbmCanvasBuffer);
-    if (Globals.hbmImageUndo != NULL) DeleteObject(Globals.hbmImageUndo);
+    Undo_Clear();
     if (Globals.hbmSelect != NULL) DeleteObject(Globals.hbmSelect);
     DestroyCursor(Globals.hcurArrow);
     DestroyCursor(Globals.hcurBDiagonal);
@@ -1119,8 +1179,7 @@ VOID PAINT_OnDestroy(HWND hWnd)
     DestroyCursor(Globals.hcurMove);
     DestroyCursor(Globals.hcurCross2);
     KillTimer(Globals.hCanvasWnd, Globals.idTimer);
-    if (Globals.pPolyline != NULL)
-        HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
+    Polyline_Free();
 }
 
 static LRESULT CALLBACK PaintWndProc(HWND hWnd, UINT uMsg, WPARAM wParam,
@@ -1158,13 +1217,23 @@ static LRESULT CALLBACK PaintWndProc(HWND hWnd, UINT uMsg, WPARAM wParam,
         break;
 
     case WM_KEYDOWN:
+        PAINT_WaitForSave();
         SendMessageW(Globals.hCanvasWnd, uMsg, wParam, lParam);
         break;
 
     case WM_COMMAND:
+        PAINT_WaitForSave();
         PAINT_OnCommand(LOWORD(wParam));
         break;
 
+    case WM_SAVEPROGRESS:
+        PAINT_OnSaveProgress((INT)wParam);
+        break;
+
+    case WM_SAVEDONE:
+        PAINT_OnSaveDone((BOOL)wParam, (DWORD)lParam);
+        break;
+
     case WM_MENUSELECT:
         if ((HIWORD(wParam) & (MF_SYSMENU|MF_POPUP|MF_SEPARATOR)) == 0)
         {
@@ -1421,18 +1490,60 @@ static void HandleCommandLine(LPWSTR cmdline)
     }
 }
 
+/* Returns the rest of the command line after a leading /pszMode option,
+ * such as /benchmark, or NULL if there is none */
+static LPCWSTR GetModeArgs(LPCWSTR cmdline, LPCWSTR pszMode)
+{
+    INT cch = lstrlenW(pszMode);
+    WCHAR delimiter;
+
+    while (*cmdline == ' ') cmdline++;
+    delimiter = (*cmdline == '"' ? '"' : ' ');
+    if (*cmdline == delimiter) cmdline++;
+    while (*cmdline && *cmdline != delimiter) cmdline++;
+    if (*cmdline == delimiter) cmdline++;
+    while (*cmdline == ' ') cmdline++;
+
+    if (*cmdline != '/' && *cmdline != '-')
+        return NULL;
+    cmdline++;
+    if (lstrlenW(cmdline) < cch ||
+        CompareStringW(LOCALE_SYSTEM_DEFAULT, NORM_IGNORECASE, cmdline, cch,
+                       pszMode, cch) != CSTR_EQUAL ||
+        (cmdline[cch] != 0 && cmdline[cch] != ' '))
+        return NULL;
+    cmdline += cch;
+    while (*cmdline == ' ') cmdline++;
+    return cmdline;
+}
+
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pszCmdLine, int nCmdShow)
 {
     MSG        msg;
     HACCEL      hAccel;
     WNDCLASSEXW wcx;
+    LPCWSTR     pszBenchmark;
 
     static const WCHAR className[] = {'P','a','i','n','t',0};
     static const WCHAR winName[]   = {'P','a','i','n','t',0};
+    static const WCHAR benchmarkW[] = {'b','e','n','c','h','m','a','r','k',0};
+    static const WCHAR batchW[] = {'b','a','t','c','h',0};
 
     ZeroMemory(&Globals, sizeof(Globals));
     Globals.hInstance       = hInstance;
 
+    pszBenchmark = GetModeArgs(GetCommandLineW(), benchmarkW);
+    if (pszBenchmark != NULL)
+        return Bench_Main(pszBenchmark);
+
+    /* no windows either, but the settings apply */
+    if (GetModeArgs(GetCommandLineW(), batchW) != NULL)
+    {
+        PAINT_InitData();
+        PAINT_LoadSettingFromRegistry();
+        return Batch_Main(GetCommandLineW());
+    }
+
     ZeroMemory(&wcx, sizeof(wcx));
     wcx.cbSize        = sizeof(wcx);
     wcx.lpfnWndProc   = PaintWndProc;
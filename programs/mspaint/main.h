@@ -23,6 +23,10 @@
 
 #define SIZEOF(a) sizeof(a)/sizeof((a)[0])
 
+/* Posted to the main window by the thread saving the image */
+#define WM_SAVEPROGRESS     (WM_APP + 1)    /* wParam: percent */
+#define WM_SAVEDONE         (WM_APP + 2)    /* wParam: success, lParam: error */
+
 typedef enum
 {
     MODE_NORMAL,
@@ -53,6 +57,33 @@ typedef enum
     TOOL_ROUNDRECT
 } TOOL;
 
+/* Filters for stretching */
+typedef enum
+{
+    RESAMPLE_BOX,
+    RESAMPLE_BILINEAR,
+    RESAMPLE_BICUBIC,
+    RESAMPLE_LANCZOS3
+} RESAMPLE;
+
+/* Operations of BM_PixelOp */
+typedef enum
+{
+    PIXELOP_INVERT,
+    PIXELOP_GRAYSCALE,
+    PIXELOP_BRIGHTNESS_CONTRAST,
+    PIXELOP_THRESHOLD,
+    PIXELOP_SWAP_RED_BLUE
+} PIXELOP;
+
+/* Modes of BM_Blend */
+typedef enum
+{
+    BLEND_OPAQUE,
+    BLEND_COLORKEY,
+    BLEND_ALPHA
+} BLEND;
+
 typedef struct
 {
     HANDLE  hInstance;
@@ -68,17 +99,15 @@ typedef struct
     SIZE    sizCanvas;
     HBITMAP hbmImage;
     HBITMAP hbmBuffer;
-    HBITMAP hbmZoomBuffer;
     HBITMAP hbmCanvasBuffer;
 
-    BOOL    fCanUndo;
-    HBITMAP hbmImageUndo;
-    SIZE    sizImageUndo;
-
     BOOL    fSelect;
     HBITMAP hbmSelect;
+    BOOL    fSelectInStep;  /* hbmSelect was taken off in the newest step */
+    HBITMAP hbmClipboard;   /* copied selection not yet packed */
 
     BOOL    fModified;
+    HANDLE  hSaveThread;    /* while saving in the background */
 
     INT      cColors;
     COLORREF argbColors[28];
@@ -121,6 +150,10 @@ typedef struct
     INT     nLineWidth;
     INT     iBrushType;
     INT     iFillStyle;
+    INT     nFillTolerance;
+    INT     nPngEffort;
+    INT     iStretchFilter;
+    INT     iPolyFillMode;
 
     INT     xScrollPos;
     INT     yScrollPos;
@@ -135,11 +168,101 @@ typedef struct
     COLORREF rgbPrev;
 
     INT     cPolyline;
+    INT     cPolylineMax;   /* POINTs allocated at pPolyline */
     POINT  *pPolyline;
 } PAINT_GLOBALS;
 
 extern PAINT_GLOBALS Globals;
 
+/* Direct view of the bits of a DIB section.  pBits points at the top
+ * scanline and cbStride is negative for bottom-up DIBs, so that row y
+ * always starts at BM_ScanLine(ppx, y). */
+typedef struct
+{
+    INT     cx;
+    INT     cy;
+    WORD    wBitCount;
+    LONG    cbStride;
+    LPBYTE  pBits;
+} BM_PIXELS;
+
+#define BM_ScanLine(ppx, y) ((ppx)->pBits + (LONG)(y) * (ppx)->cbStride)
+
+#define TILE_SIZE 64
+
+/* Immutable, reference counted run-length encoded copy of tile (x, y) of
+ * an image; see tiles.c */
+typedef struct
+{
+    LONG    cRefs;
+    INT     x;          /* in tiles */
+    INT     y;
+    WORD    wBitCount;
+    DWORD   cb;         /* size of ab */
+    BYTE    ab[1];      /* RLE data */
+} TILE;
+
+/* Buffers a flood fill works in, kept by the caller from one fill to the
+ * next.  Each thread needs its own.  Zero it before the first fill and
+ * free it with Fill_FreeArena; see fill.c */
+typedef struct
+{
+    LPVOID  pvSeeds;
+    SIZE_T  cbSeeds;
+    LPVOID  pvVisited;
+    SIZE_T  cbVisited;
+} FILL_ARENA;
+
+/* Called by long operations with how far they got, in percent */
+typedef VOID (*BM_PROGRESSPROC)(INT nPercent, LPARAM lParam);
+
+/* airbrush.c */
+BOOL AirBrush_Begin(INT nRadius);
+INT AirBrush_Spray(const BM_PIXELS *ppx, POINT pt, COLORREF rgb,
+                   RECT *prcChanged);
+
+/* batch.c */
+INT Batch_Main(LPCWSTR pszCmdLine);
+
+/* bench.c */
+INT Bench_Main(LPCWSTR pszName);
+
+/* blend.c */
+BOOL BM_Blend(BM_PIXELS *ppxDst, INT xDst, INT yDst, const BM_PIXELS *ppxSrc,
+              INT iMode, COLORREF rgbKey, const RECT *prcClip);
+
+/* brush.c */
+BOOL BM_BrushLine(BM_PIXELS *ppx, INT iBrushType, POINT pt0, POINT pt1,
+                  COLORREF rgb);
+
+/* fill.c */
+BOOL BM_FloodFill(BM_PIXELS *ppx, INT x, INT y, COLORREF rgb, INT nTolerance,
+                  VOID (*pfnPrepare)(const RECT *prc), RECT *prcChanged,
+                  FILL_ARENA *pArena);
+VOID Fill_FreeArena(FILL_ARENA *pArena);
+
+/* pixelop.c */
+INT BM_PixelOp(const BM_PIXELS *ppx, const RECT *prc, INT iOp, INT nParam1,
+               INT nParam2);
+
+/* polygon.c */
+BOOL Polyline_Append(POINT pt);
+VOID Polyline_Free(VOID);
+BOOL BM_FillPolygon(BM_PIXELS *ppx, const POINT *apt, INT cpt, INT iFillMode,
+                    COLORREF rgb, RECT *prcChanged);
+
+/* png.c */
+BOOL PNG_IsPng(const BYTE *pb, DWORD cb);
+HBITMAP PNG_Decode(const BYTE *pb, DWORD cb);
+BOOL PNG_Write(HANDLE hFile, const BM_PIXELS *ppx, INT nEffort,
+               BM_PROGRESSPROC pfnProgress, LPARAM lParam);
+
+/* resample.c */
+BOOL BM_Resample(const BM_PIXELS *ppxSrc, BM_PIXELS *ppxDst, INT iFilter);
+SIZE BM_GetSkewedSize(SIZE siz, INT nDegreeX, INT nDegreeY);
+BOOL BM_Skew(const BM_PIXELS *ppxSrc, BM_PIXELS *ppxDst, INT nDegreeX,
+             INT nDegreeY, COLORREF rgbBack);
+
 /* main.c */
 VOID SetFileName(LPCWSTR szFileName);
 VOID NotSupportedYet(VOID);
@@ -147,8 +270,10 @@ VOID NotSupportedYet(VOID);
 /* canvas.c */
 LRESULT CALLBACK CanvasWndProc(HWND hWnd, UINT uMsg,
                                WPARAM wParam, LPARAM lParam);
+VOID Canvas_InvalidateImageRect(HWND hWnd, const RECT *prc);
+VOID Canvas_EndStroke(HWND hWnd);
 VOID Canvas_Resize(HWND hWnd, SIZE sizNew);
-VOID Canvas_Stretch(HWND hWnd, SIZE sizNew);
+VOID Canvas_StretchSkew(HWND hWnd, SIZE sizNew, INT nSkewX, INT nSkewY);
 VOID Canvas_HFlip(HWND hWnd);
 VOID Canvas_VFlip(HWND hWnd);
 VOID Canvas_Rotate90Degree(HWND hWnd);
@@ -157,7 +282,7 @@ VOID Canvas_Rotate270Degree(HWND hWnd);
 HBITMAP Selection_CreateBitmap(VOID);
 VOID Selection_TakeOff(VOID);
 VOID Selection_Land(VOID);
-VOID Selection_Stretch(HWND hWnd, SIZE sizNew);
+VOID Selection_StretchSkew(HWND hWnd, SIZE sizNew, INT nSkewX, INT nSkewY);
 VOID Selection_HFlip(HWND hWnd);
 VOID Selection_VFlip(HWND hWnd);
 VOID Selection_Rotate90Degree(HWND hWnd);
@@ -165,16 +290,51 @@ VOID Selection_Rotate180Degree(HWND hWnd);
 VOID Selection_Rotate270Degree(HWND hWnd);
 
 /* bitmap.c */
+BOOL BM_GetPixels(HBITMAP hbm, BM_PIXELS *ppx);
 HBITMAP BM_Load(LPCWSTR pszFileName);
 BOOL BM_Save(LPCWSTR pszFileName, HBITMAP hbm);
+BOOL BM_SaveEx(LPCWSTR pszFileName, HBITMAP hbm, BM_PROGRESSPROC pfnProgress,
+               LPARAM lParam);
 HBITMAP BM_Create(SIZE siz);
+HBITMAP BM_Create32(SIZE siz);
 HBITMAP BM_CreateResized(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz);
 HBITMAP BM_CreateStretched(HWND hWnd, SIZE sizNew, HBITMAP hbm, SIZE siz);
+HBITMAP BM_CreateSkewed(HBITMAP hbm, INT nDegreeX, INT nDegreeY,
+                        COLORREF rgbBack);
 HBITMAP BM_CreateHFliped(HWND hWnd, HBITMAP hbm, SIZE siz);
 HBITMAP BM_CreateVFliped(HWND hWnd, HBITMAP hbm, SIZE siz);
+HBITMAP BM_CreateXYSwaped(HWND hWnd, HBITMAP hbm, SIZE siz);
 HBITMAP BM_CreateRotated90Degree(HWND hWnd, HBITMAP hbm, SIZE siz);
 HBITMAP BM_CreateRotated180Degree(HWND hWnd, HBITMAP hbm, SIZE siz);
 HBITMAP BM_CreateRotated270Degree(HWND hWnd, HBITMAP hbm, SIZE siz);
-HBITMAP BM_Copy(HBITMAP hbm);
+BOOL BM_Rotate180Degree(HBITMAP hbm);
+HBITMAP BM_CopyRect(HBITMAP hbm, const RECT *prc);
 HGLOBAL BM_Pack(HBITMAP hbm);
 HBITMAP BM_Unpack(HGLOBAL hPack);
+
+/* tiles.c */
+VOID Tile_GetRect(const BM_PIXELS *ppx, INT x, INT y, RECT *prc);
+TILE *Tile_Capture(const BM_PIXELS *ppx, INT x, INT y);
+VOID Tile_Draw(const TILE *pTile, BM_PIXELS *ppx);
+VOID Tile_AddRef(TILE *pTile);
+VOID Tile_Release(TILE *pTile);
+SIZE_T Tile_GetSize(const TILE *pTile);
+TILE *Tiles_Get(INT x, INT y);
+VOID Tiles_Put(TILE *pTile);
+VOID Tiles_Invalidate(const RECT *prc);
+VOID Tiles_Reset(VOID);
+
+/* undo.c */
+BOOL Undo_Begin(VOID);
+VOID Undo_BeginFull(VOID);
+VOID Undo_Touch(const RECT *prc);
+BOOL Undo_Undo(VOID);
+BOOL Undo_Redo(VOID);
+BOOL Undo_CanUndo(VOID);
+BOOL Undo_CanRedo(VOID);
+VOID Undo_Clear(VOID);
+VOID Undo_SetBudget(SIZE_T cb);
+
+/* zoom.c */
+BOOL BM_ZoomBlt(BM_PIXELS *ppxDst, const RECT *prcDst, INT xOrg, INT yOrg,
+                const BM_PIXELS *ppxSrc, INT nZoom, BOOL fGrid);
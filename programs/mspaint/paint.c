@@ -150,12 +150,120 @@ BOOL FileExists(LPCWSTR szFileName)
     return (hFile != INVALID_HANDLE_VALUE);
 }
 
+/* Saving runs on a worker thread that streams the rows of hbmImage to the
+ * file and reports back with WM_SAVEPROGRESS and WM_SAVEDONE.  The image
+ * must not change meanwhile, so the windows that draw on it are disabled
+ * and commands wait for the save to finish. */
+typedef struct
+{
+    WCHAR   szFileName[MAX_PATH];
+    HBITMAP hbm;
+    HWND    hwndNotify;
+} SAVE_JOB;
+
+static VOID SaveProgressProc(INT nPercent, LPARAM lParam)
+{
+    PostMessageW((HWND)lParam, WM_SAVEPROGRESS, nPercent, 0);
+}
+
+static DWORD WINAPI SaveThreadProc(LPVOID pParam)
+{
+    SAVE_JOB *pJob = pParam;
+    BOOL f;
+
+    f = BM_SaveEx(pJob->szFileName, pJob->hbm, SaveProgressProc,
+                  (LPARAM)pJob->hwndNotify);
+    PostMessageW(pJob->hwndNotify, WM_SAVEDONE, f, f ? 0 : GetLastError());
+    HeapFree(GetProcessHeap(), 0, pJob);
+    return 0;
+}
+
+static VOID EnableDrawing(BOOL fEnable)
+{
+    EnableWindow(Globals.hCanvasWnd, fEnable);
+    EnableWindow(Globals.hToolBox, fEnable);
+    EnableWindow(Globals.hColorBox, fEnable);
+}
+
+VOID PAINT_OnSaveProgress(INT nPercent)
+{
+    WCHAR szFormat[MAX_STRING_LEN], sz[MAX_STRING_LEN];
+
+    if (Globals.hSaveThread == NULL)
+        return;
+    LoadStringW(Globals.hInstance, STRING_SAVING, szFormat, MAX_STRING_LEN);
+    wsprintfW(sz, szFormat, nPercent);
+    SendMessageW(Globals.hStatusBar, SB_SETTEXTW, 0 | 0, (LPARAM)sz);
+}
+
+VOID PAINT_OnSaveDone(BOOL fSaved, DWORD dwError)
+{
+    WCHAR sz[MAX_STRING_LEN];
+
+    if (Globals.hSaveThread == NULL)
+        return;
+    WaitForSingleObject(Globals.hSaveThread, INFINITE);
+    CloseHandle(Globals.hSaveThread);
+    Globals.hSaveThread = NULL;
+    EnableDrawing(TRUE);
+
+    LoadStringW(Globals.hInstance, STRING_READY, sz, MAX_STRING_LEN);
+    SendMessageW(Globals.hStatusBar, SB_SETTEXTW, 0 | 0, (LPARAM)sz);
+    if (fSaved)
+        Globals.fModified = FALSE;
+    else
+    {
+        SetLastError(dwError);
+        ShowLastError();
+    }
+}
+
+/* Finishes a save running in the background, if any */
+VOID PAINT_WaitForSave(VOID)
+{
+    MSG msg;
+
+    if (Globals.hSaveThread == NULL)
+        return;
+    WaitForSingleObject(Globals.hSaveThread, INFINITE);
+    if (PeekMessageW(&msg, Globals.hMainWnd, WM_SAVEDONE, WM_SAVEDONE,
+                     PM_REMOVE))
+        PAINT_OnSaveDone((BOOL)msg.wParam, (DWORD)msg.lParam);
+    else
+        PAINT_OnSaveDone(FALSE, ERROR_GEN_FAILURE);
+}
+
 static VOID DoSaveFile(VOID)
 {
+    SAVE_JOB *pJob;
+
     /* FIXME: Support different BPP */
-    /* FIXME: Support GIF, JPEG, PNG files */
+    /* FIXME: Support GIF, JPEG files */
+    PAINT_WaitForSave();
+    /* a save by accelerator may come while the airbrush is held down */
+    Canvas_EndStroke(Globals.hCanvasWnd);
+    pJob = HeapAlloc(GetProcessHeap(), 0, sizeof(SAVE_JOB));
+    if (pJob != NULL)
+    {
+        lstrcpynW(pJob->szFileName, Globals.szFileName, MAX_PATH);
+        pJob->hbm = Globals.hbmImage;
+        pJob->hwndNotify = Globals.hMainWnd;
+        Globals.hSaveThread = CreateThread(NULL, 0, SaveThreadProc, pJob, 0,
+                                           NULL);
+        if (Globals.hSaveThread != NULL)
+        {
+            EnableDrawing(FALSE);
+            PAINT_OnSaveProgress(0);
+            return;
+        }
+        HeapFree(GetProcessHeap(), 0, pJob);
+    }
+
+    /* no thread: save right here */
     if (BM_Save(Globals.szFileName, Globals.hbmImage))
         Globals.fModified = FALSE;
+    else
+        ShowLastError();
 }
 
 /**
@@ -168,6 +276,7 @@ BOOL DoCloseFile(void)
     int nResult;
     static const WCHAR empty_strW[] = { 0 };
 
+    PAINT_WaitForSave();
     if (Globals.fModified)
     {
         nResult = AlertFileNotSaved(Globals.szFileName);
@@ -176,6 +285,9 @@ BOOL DoCloseFile(void)
         case IDYES:
             if (!PAINT_FileSave())
                 return FALSE;
+            PAINT_WaitForSave();
+            if (Globals.fModified)
+                return FALSE;
             break;
 
         case IDNO:
@@ -200,6 +312,8 @@ void DoOpenFile(LPCWSTR pszFileName)
     BOOL fEmpty;
     DWORD filesize;
     BITMAP bm;
+    BM_PIXELS px;
+    HBITMAP hbm;
 
     if (!DoCloseFile())
         return;
@@ -210,7 +324,7 @@ void DoOpenFile(LPCWSTR pszFileName)
         return;
     }
 
-    /* FIXME: Support PCX, ICO, GIF, JPEG, PNG files */
+    /* FIXME: Support PCX, ICO, GIF, JPEG files */
     fEmpty = TRUE;
     hFile = CreateFileW(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -229,6 +343,21 @@ void DoOpenFile(LPCWSTR pszFileName)
         GetObjectW(Globals.hbmImage, sizeof(BITMAP), &bm);
         Globals.sizImage.cx = bm.bmWidth;
         Globals.sizImage.cy = bm.bmHeight;
+
+        /* the undo history needs direct access to the pixels */
+        if (Globals.hbmImage != NULL &&
+            (!BM_GetPixels(Globals.hbmImage, &px) ||
+             (px.wBitCount != 24 && px.wBitCount != 32)))
+        {
+            hbm = BM_CreateResized(Globals.hCanvasWnd, Globals.sizImage,
+                                   Globals.hbmImage, Globals.sizImage);
+            if (hbm != NULL)
+            {
+                DeleteObject(Globals.hbmImage);
+                Globals.hbmImage = hbm;
+            }
+        }
+        Undo_Clear();
     }
 
     SetFileName(pszFileName);
@@ -244,7 +373,6 @@ VOID PAINT_FileNew(VOID)
     HDC hDC, hdcMem;
     HGDIOBJ hbmOld;
     RECT rc;
-    SIZE sizZoom;
 
     if (DoCloseFile())
     {
@@ -255,6 +383,7 @@ VOID PAINT_FileNew(VOID)
             if (Globals.hbmImage != NULL)
                 DeleteObject(Globals.hbmImage);
             Globals.hbmImage = BM_Create(Globals.sizImage);
+            Undo_Clear();
 
             hbmOld = SelectObject(hdcMem, Globals.hbmImage);
             rc.left = rc.top = 0;
@@ -263,15 +392,6 @@ VOID PAINT_FileNew(VOID)
             FillRect(hdcMem, &rc, (HBRUSH)GetStockObject(WHITE_BRUSH));
             SelectObject(hdcMem, hbmOld);
 
-            if (Globals.hbmBuffer != NULL)
-                DeleteObject(Globals.hbmBuffer);
-            Globals.hbmBuffer = BM_Copy(Globals.hbmImage);
-
-            if (Globals.hbmZoomBuffer != NULL)
-                DeleteObject(Globals.hbmZoomBuffer);
-            sizZoom.cx = Globals.sizImage.cx * Globals.nZoom;
-            sizZoom.cy = Globals.sizImage.cy * Globals.nZoom;
-            Globals.hbmZoomBuffer = BM_Create(sizZoom);
             DeleteDC(hdcMem);
         }
         ReleaseDC(Globals.hCanvasWnd, hDC);
@@ -318,29 +438,53 @@ BOOL PAINT_FileSave(VOID)
     return TRUE;
 }
 
+static const WCHAR szBmpExt[] = { 'b','m','p',0 };
+static const WCHAR szPngExt[] = { 'p','n','g',0 };
+
+/* Hook of the save dialogs: a name typed without an extension gets .png
+ * while the PNG filter, the second in Globals.szFilter, is chosen, and
+ * .bmp otherwise */
+static UINT_PTR CALLBACK SaveHookProc(HWND hDlg, UINT uMsg, WPARAM wParam,
+                                      LPARAM lParam)
+{
+    const OFNOTIFYW *pNotify = (const OFNOTIFYW *)lParam;
+
+    if (uMsg == WM_NOTIFY && pNotify->hdr.code == CDN_TYPECHANGE)
+        SendMessageW(GetParent(hDlg), CDM_SETDEFEXT, 0,
+                     (LPARAM)(pNotify->lpOFN->nFilterIndex == 2 ? szPngExt :
+                                                                  szBmpExt));
+    return 0;
+}
+
 BOOL PAINT_FileSaveAs(VOID)
 {
     OPENFILENAMEW ofn;
     WCHAR szPath[MAX_PATH];
     WCHAR szDir[MAX_PATH];
-    static const WCHAR szDefaultExt[] = { 'b','m','p',0 };
     static const WCHAR bmp_files[] = { '*','.','b','m','p',0 };
+    static const WCHAR png_files[] = { '*','.','p','n','g',0 };
+    static const WCHAR png_ext[] = { '.','p','n','g',0 };
+    BOOL fPng;
 
     ZeroMemory(&ofn, sizeof(ofn));
 
+    /* start with the type of the file being edited */
+    fPng = !lstrcmpiW(PathFindExtensionW(Globals.szFileName), png_ext);
     GetCurrentDirectoryW(MAX_PATH, szDir);
-    lstrcpyW(szPath, bmp_files);
+    lstrcpyW(szPath, fPng ? png_files : bmp_files);
 
     ofn.lStructSize       = sizeof(OPENFILENAMEW);
     ofn.hwndOwner         = Globals.hMainWnd;
     ofn.hInstance         = Globals.hInstance;
     ofn.lpstrFilter       = Globals.szFilter;
+    ofn.nFilterIndex      = fPng ? 2 : 1;
     ofn.lpstrFile         = szPath;
     ofn.nMaxFile          = MAX_PATH;
     ofn.lpstrInitialDir   = szDir;
     ofn.Flags             = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT |
-                            OFN_HIDEREADONLY;
-    ofn.lpstrDefExt       = szDefaultExt;
+                            OFN_HIDEREADONLY | OFN_EXPLORER | OFN_ENABLEHOOK;
+    ofn.lpstrDefExt       = fPng ? szPngExt : szBmpExt;
+    ofn.lpfnHook          = SaveHookProc;
 
     if (GetSaveFileNameW(&ofn))
     {
@@ -377,76 +521,142 @@ VOID PAINT_FileExit(VOID)
     PostMessageW(Globals.hMainWnd, WM_CLOSE, 0, 0);
 }
 
+/* Shows the image after an undo or redo, which may have resized it */
+static VOID UndoRedoDone(SIZE sizOld)
+{
+    Globals.fSelect = FALSE;
+    if (Globals.hbmSelect != NULL)
+    {
+        DeleteObject(Globals.hbmSelect);
+        Globals.hbmSelect = NULL;
+    }
+    Globals.fModified = TRUE;
+    if (Globals.sizImage.cx != sizOld.cx || Globals.sizImage.cy != sizOld.cy)
+    {
+        Globals.xScrollPos = Globals.yScrollPos = 0;
+        PostMessageW(Globals.hCanvasWnd, WM_SIZE, 0, 0);
+    }
+    InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
+    UpdateWindow(Globals.hCanvasWnd);
+}
+
 VOID PAINT_EditUndo(VOID)
 {
-    HBITMAP hbm;
-    SIZE siz;
+    SIZE siz = Globals.sizImage;
 
-    if (Globals.fCanUndo)
+    if (Undo_CanUndo())
     {
-        hbm = Globals.hbmImage;
-        Globals.hbmImage = Globals.hbmImageUndo;
-        Globals.hbmImageUndo = hbm;
-        Globals.fCanUndo = FALSE;
-        siz = Globals.sizImage;
-        Globals.sizImage = Globals.sizImageUndo;
-        Globals.sizImageUndo = siz;
-        Globals.fSelect = FALSE;
-        if (Globals.hbmSelect != NULL)
-        {
-            DeleteObject(Globals.hbmSelect);
-            Globals.hbmSelect = NULL;
-        }
-        InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
-        UpdateWindow(Globals.hCanvasWnd);
-        Globals.fCanUndo = FALSE;
+        if (Undo_Undo())
+            UndoRedoDone(siz);
+        else
+            ShowLastError();
     }
 }
 
 VOID PAINT_EditRepeat(VOID)
 {
-    HBITMAP hbm;
-    SIZE siz;
+    SIZE siz = Globals.sizImage;
 
-    if (!Globals.fCanUndo && Globals.hbmImageUndo != NULL)
+    if (Undo_CanRedo())
     {
-        hbm = Globals.hbmImage;
-        Globals.hbmImage = Globals.hbmImageUndo;
-        Globals.hbmImageUndo = hbm;
-        Globals.fCanUndo = FALSE;
-        siz = Globals.sizImage;
-        Globals.sizImage = Globals.sizImageUndo;
-        Globals.sizImageUndo = siz;
-        Globals.fSelect = FALSE;
-        if (Globals.hbmSelect != NULL)
+        if (Undo_Redo())
+            UndoRedoDone(siz);
+        else
+            ShowLastError();
+    }
+}
+
+/* Selections of more pixels than this are put on the clipboard by delayed
+ * rendering, and only packed when a program asks for them */
+#define CLIPBOARD_DELAY_PIXELS  (512 * 512)
+
+/* Puts hbm on the clipboard as CF_DIB, taking it over */
+static VOID PutOnClipboard(HBITMAP hbm)
+{
+    HGLOBAL hPack;
+    BITMAP bm;
+
+    if (hbm == NULL || !GetObjectW(hbm, sizeof(BITMAP), &bm))
+    {
+        ShowLastError();
+        return;
+    }
+
+    hPack = NULL;
+    if ((LONGLONG)bm.bmWidth * bm.bmHeight <= CLIPBOARD_DELAY_PIXELS)
+    {
+        hPack = BM_Pack(hbm);
+        DeleteObject(hbm);
+        hbm = NULL;
+        if (hPack == NULL)
         {
-            DeleteObject(Globals.hbmSelect);
-            Globals.hbmSelect = NULL;
+            ShowLastError();
+            return;
         }
-        InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
-        UpdateWindow(Globals.hCanvasWnd);
-        Globals.fCanUndo = TRUE;
+    }
+
+    if (!OpenClipboard(Globals.hCanvasWnd))
+    {
+        if (hbm != NULL)
+            DeleteObject(hbm);
+        else
+            GlobalFree(hPack);
+        return;
+    }
+    /* which frees a bitmap of ours still on it */
+    EmptyClipboard();
+    if (hbm != NULL)
+    {
+        Globals.hbmClipboard = hbm;
+        SetClipboardData(CF_DIB, NULL);
+    }
+    else
+        SetClipboardData(CF_DIB, hPack);
+    CloseClipboard();
+}
+
+/* WM_RENDERFORMAT: packs the selection that was copied by delayed rendering */
+VOID PAINT_OnRenderFormat(UINT uFormat)
+{
+    HGLOBAL hPack;
+
+    if (uFormat != CF_DIB || Globals.hbmClipboard == NULL)
+        return;
+    hPack = BM_Pack(Globals.hbmClipboard);
+    if (hPack != NULL)
+        SetClipboardData(CF_DIB, hPack);
+}
+
+/* WM_RENDERALLFORMATS: the selection stays on the clipboard after exit */
+VOID PAINT_OnRenderAllFormats(VOID)
+{
+    if (Globals.hbmClipboard == NULL || !OpenClipboard(Globals.hCanvasWnd))
+        return;
+    if (GetClipboardOwner() == Globals.hCanvasWnd)
+        PAINT_OnRenderFormat(CF_DIB);
+    CloseClipboard();
+}
+
+/* WM_DESTROYCLIPBOARD */
+VOID PAINT_OnDestroyClipboard(VOID)
+{
+    if (Globals.hbmClipboard != NULL)
+    {
+        DeleteObject(Globals.hbmClipboard);
+        Globals.hbmClipboard = NULL;
     }
 }
 
 VOID PAINT_EditCut(VOID)
 {
     HBITMAP hbm;
-    HGLOBAL hPack;
     if (Globals.fSelect)
     {
         Selection_TakeOff();
         hbm = Globals.hbmSelect;
         Globals.hbmSelect = NULL;
         Globals.fSelect = FALSE;
-        hPack = BM_Pack(hbm);
-        DeleteObject(hbm);
-        if (OpenClipboard(Globals.hCanvasWnd))
-        {
-            EmptyClipboard();
-            SetClipboardData(CF_DIB, hPack);
-            CloseClipboard();
-        }
+        PutOnClipboard(hbm);
         InvalidateRect(Globals.hCanvasWnd, NULL, FALSE);
         UpdateWindow(Globals.hCanvasWnd);
     }
@@ -455,19 +665,11 @@ VOID PAINT_EditCut(VOID)
 VOID PAINT_EditCopy(VOID)
 {
     HBITMAP hbm;
-    HGLOBAL hPack;
 
     if (Globals.fSelect)
     {
         hbm = Selection_CreateBitmap();
-        hPack = BM_Pack(hbm);
-        DeleteObject(hbm);
-        if (OpenClipboard(Globals.hCanvasWnd))
-        {
-            EmptyClipboard();
-            SetClipboardData(CF_DIB, hPack);
-            CloseClipboard();
-        }
+        PutOnClipboard(hbm);
         InvalidateRect(Globals.hCanvasWnd, NULL, FALSE);
         UpdateWindow(Globals.hCanvasWnd);
     }
@@ -481,13 +683,29 @@ VOID PAINT_EditPaste(VOID)
     SIZE siz;
 
     Selection_Land();
-    hPack = NULL;
-    if (OpenClipboard(Globals.hCanvasWnd))
+    hbm = NULL;
+    if (Globals.hbmClipboard != NULL &&
+        GetClipboardOwner() == Globals.hCanvasWnd)
+    {
+        /* our own selection, never packed */
+        GetObjectW(Globals.hbmClipboard, sizeof(BITMAP), &bm);
+        siz.cx = bm.bmWidth;
+        siz.cy = bm.bmHeight;
+        hbm = BM_CreateResized(Globals.hCanvasWnd, siz, Globals.hbmClipboard,
+                               siz);
+    }
+    else if (OpenClipboard(Globals.hCanvasWnd))
     {
         hPack = GetClipboardData(CF_DIB);
+        if (hPack == NULL)
+        {
+            CloseClipboard();
+            return;
+        }
+        hbm = BM_Unpack(hPack);
         CloseClipboard();
     }
-    if (hPack == NULL)
+    else
         return;
 
     Globals.iToolPrev = Globals.iToolSelect;
@@ -495,13 +713,13 @@ VOID PAINT_EditPaste(VOID)
     InvalidateRect(Globals.hToolBox, NULL, TRUE);
     UpdateWindow(Globals.hToolBox);
 
-    hbm = BM_Unpack(hPack);
     if (hbm != NULL)
     {
         Globals.fSelect = TRUE;
         if (Globals.hbmSelect != NULL)
             DeleteObject(Globals.hbmSelect);
         Globals.hbmSelect = hbm;
+        Globals.fSelectInStep = FALSE;
         GetObjectW(Globals.hbmSelect, sizeof(BITMAP), &bm);
         if (Globals.sizImage.cx < bm.bmWidth ||
             Globals.sizImage.cy < bm.bmHeight)
@@ -555,13 +773,9 @@ VOID PAINT_CopyTo(VOID)
     OPENFILENAMEW ofn;
     WCHAR szFileName[MAX_PATH];
     WCHAR szDir[MAX_PATH];
-    BOOL fModified;
-    static const WCHAR szDefaultExt[] = { 'b','m','p',0 };
+    HBITMAP hbm;
     static const WCHAR bmp_files[] = { '*','.','b','m','p',0 };
 
-    fModified = Globals.fModified;
-    Selection_TakeOff();
-
     ZeroMemory(&ofn, sizeof(ofn));
 
     GetCurrentDirectoryW(MAX_PATH, szDir);
@@ -575,18 +789,21 @@ VOID PAINT_CopyTo(VOID)
     ofn.nMaxFile          = MAX_PATH;
     ofn.lpstrInitialDir   = szDir;
     ofn.Flags             = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT |
-                            OFN_HIDEREADONLY;
-    ofn.lpstrDefExt       = szDefaultExt;
+                            OFN_HIDEREADONLY | OFN_EXPLORER | OFN_ENABLEHOOK;
+    ofn.lpstrDefExt       = szBmpExt;
+    ofn.lpfnHook          = SaveHookProc;
 
     if (!GetSaveFileNameW(&ofn))
         return;
 
-    BM_Save(szFileName, Globals.hbmSelect);
-    Selection_Land();
-    Globals.fModified = fModified;
-
-    InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
-    UpdateWindow(Globals.hCanvasWnd);
+    /* save a copy of what is selected, leaving the image alone */
+    if (Globals.hbmSelect != NULL)
+        BM_Save(szFileName, Globals.hbmSelect);
+    else if ((hbm = Selection_CreateBitmap()) != NULL)
+    {
+        BM_Save(szFileName, hbm);
+        DeleteObject(hbm);
+    }
 }
 
 VOID PAINT_PasteFrom(VOID)
@@ -639,6 +856,7 @@ VOID PAINT_PasteFrom(VOID)
         if (Globals.hbmSelect != NULL)
             DeleteObject(Globals.hbmSelect);
         Globals.hbmSelect = hbm;
+        Globals.fSelectInStep = FALSE;
         GetObjectW(hbm, sizeof(BITMAP), &bm);
 
         if (Globals.sizImage.cx < bm.bmWidth ||
@@ -738,35 +956,21 @@ VOID PAINT_StatusBar(VOID)
 
 VOID PAINT_Zoom(INT nZoom)
 {
-    SIZE siz;
     Globals.nZoom = nZoom;
     Globals.xScrollPos = Globals.yScrollPos = 0;
     PostMessageW(Globals.hCanvasWnd, WM_SIZE, 0, 0);
 
-    if (Globals.hbmZoomBuffer != NULL)
-        DeleteObject(Globals.hbmZoomBuffer);
-    siz.cx = Globals.nZoom * Globals.sizImage.cx;
-    siz.cy = Globals.nZoom * Globals.sizImage.cy;
-    Globals.hbmZoomBuffer = BM_Create(siz);
-
     InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
     UpdateWindow(Globals.hCanvasWnd);
 }
 
 VOID PAINT_Zoom2(INT x, INT y, INT nZoom)
 {
-    SIZE siz;
     Globals.nZoom = nZoom;
     Globals.xScrollPos = x * nZoom;
     Globals.yScrollPos = y * nZoom;
     PostMessageW(Globals.hCanvasWnd, WM_SIZE, 0, 0);
 
-    if (Globals.hbmZoomBuffer != NULL)
-        DeleteObject(Globals.hbmZoomBuffer);
-    siz.cx = Globals.nZoom * Globals.sizImage.cx;
-    siz.cy = Globals.nZoom * Globals.sizImage.cy;
-    Globals.hbmZoomBuffer = BM_Create(siz);
-
     InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
     UpdateWindow(Globals.hCanvasWnd);
 }
@@ -778,42 +982,100 @@ VOID PAINT_ShowGrid(VOID)
     UpdateWindow(Globals.hCanvasWnd);
 }
 
-VOID PAINT_InvertColors(VOID)
+/* Chooses whether the background color of the selection covers what is
+ * under it or lets it show through */
+VOID PAINT_DrawOpaque(BOOL fOpaque)
 {
-    HDC hDC, hdcMem;
-    HGDIOBJ hbmOld;
+    Globals.fTransparent = !fOpaque;
+    InvalidateRect(Globals.hToolBox, NULL, TRUE);
+    UpdateWindow(Globals.hToolBox);
+    if (Globals.fSelect)
+    {
+        InvalidateRect(Globals.hCanvasWnd, NULL, FALSE);
+        UpdateWindow(Globals.hCanvasWnd);
+    }
+}
+
+/* Applies PIXELOP iOp to the selection, or else to the whole image, and
+ * shows in the status bar how fast it went */
+VOID PAINT_PixelOp(INT iOp, INT nParam1, INT nParam2)
+{
+    WCHAR szFormat[MAX_STRING_LEN], sz[MAX_STRING_LEN];
+    LARGE_INTEGER liStart, liEnd, liFreq;
+    DWORD dwMicroseconds;
+    HBITMAP hbm;
+    BM_PIXELS px;
+    SIZE siz;
     RECT rc;
-    hDC = GetDC(Globals.hCanvasWnd);
-    hdcMem = CreateCompatibleDC(hDC);
-    if (hdcMem != NULL)
+    INT cPixels;
+
+    /* a floating selection is not part of the image, so only changes to
+     * the image itself open an undo step, and only once they are sure */
+    if (Globals.fSelect)
     {
-        if (Globals.fSelect)
+        Selection_TakeOff();
+        if (Globals.hbmSelect == NULL)
+            return;
+
+        /* a pasted selection may be in any format */
+        if (!BM_GetPixels(Globals.hbmSelect, &px) ||
+            (px.wBitCount != 24 && px.wBitCount != 32))
         {
-            Selection_TakeOff();
-            hbmOld = SelectObject(hdcMem, Globals.hbmSelect);
-            rc.left = rc.top = 0;
-            rc.right = Globals.sizImage.cx;
-            rc.bottom = Globals.sizImage.cy;
-            InvertRect(hdcMem, &rc);
-            SelectObject(hdcMem, hbmOld);
+            siz.cx = Globals.pt1.x - Globals.pt0.x;
+            siz.cy = Globals.pt1.y - Globals.pt0.y;
+            hbm = BM_CreateResized(Globals.hCanvasWnd, siz, Globals.hbmSelect,
+                                   siz);
+            if (hbm == NULL || !BM_GetPixels(hbm, &px))
+            {
+                ShowLastError();
+                if (hbm != NULL)
+                    DeleteObject(hbm);
+                return;
+            }
+            DeleteObject(Globals.hbmSelect);
+            Globals.hbmSelect = hbm;
         }
-        else
+    }
+    else
+    {
+        if (!BM_GetPixels(Globals.hbmImage, &px))
         {
-            hbmOld = SelectObject(hdcMem, Globals.hbmImage);
-            rc.left = rc.top = 0;
-            rc.right = Globals.sizImage.cx;
-            rc.bottom = Globals.sizImage.cy;
-            InvertRect(hdcMem, &rc);
-            SelectObject(hdcMem, hbmOld);
+            ShowLastError();
+            return;
         }
-        DeleteDC(hdcMem);
+        SetRect(&rc, 0, 0, px.cx, px.cy);
+        Undo_Begin();
+        Undo_Touch(&rc);
     }
-    ReleaseDC(Globals.hCanvasWnd, hDC);
+
+    QueryPerformanceCounter(&liStart);
+    cPixels = BM_PixelOp(&px, NULL, iOp, nParam1, nParam2);
+    QueryPerformanceCounter(&liEnd);
+    if (cPixels < 0)
+    {
+        ShowLastError();
+        return;
+    }
+
+    QueryPerformanceFrequency(&liFreq);
+    dwMicroseconds = (DWORD)((liEnd.QuadPart - liStart.QuadPart) * 1000000 /
+                             liFreq.QuadPart);
+    LoadStringW(Globals.hInstance, STRING_PIXELOP_SPEED, szFormat,
+                MAX_STRING_LEN);
+    wsprintfW(sz, szFormat, cPixels, dwMicroseconds / 1000,
+              dwMicroseconds % 1000, cPixels / max(dwMicroseconds, 1));
+    SendMessageW(Globals.hStatusBar, SB_SETTEXTW, 0 | 0, (LPARAM)sz);
+
     Globals.fModified = TRUE;
     InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
     UpdateWindow(Globals.hCanvasWnd);
 }
 
+VOID PAINT_InvertColors(VOID)
+{
+    PAINT_PixelOp(PIXELOP_INVERT, 0, 0);
+}
+
 VOID PAINT_ClearImage(VOID)
 {
     HDC hDC, hdcMem;
@@ -827,6 +1089,8 @@ VOID PAINT_ClearImage(VOID)
         rc.left = rc.top = 0;
         rc.right = Globals.sizImage.cx;
         rc.bottom = Globals.sizImage.cy;
+        Undo_Begin();
+        Undo_Touch(&rc);
         hbr = CreateSolidBrush(Globals.rgbBack);
         FillRect(hdcMem, &rc, hbr);
         DeleteObject(hbr);
@@ -842,7 +1106,6 @@ VOID PAINT_ClearImage(VOID)
 BOOL CALLBACK ZoomDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
     WCHAR sz[32];
-    SIZE siz;
     static const WCHAR format[] = {'%','d','0','0','%','%',0};
 
     switch (uMsg)
@@ -870,11 +1133,6 @@ BOOL CALLBACK ZoomDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             else if (IsDlgButtonChecked(hDlg, rad4) & 1)    Globals.nZoom = 6;
             else if (IsDlgButtonChecked(hDlg, rad5) & 1)    Globals.nZoom = 8;
 
-            siz.cx = Globals.nZoom * Globals.sizImage.cx;
-            siz.cy = Globals.nZoom * Globals.sizImage.cy;
-            if (Globals.hbmZoomBuffer != NULL)
-                DeleteObject(Globals.hbmZoomBuffer);
-            Globals.hbmZoomBuffer = BM_Create(siz);
             EndDialog(hDlg, IDOK);
             break;
 
@@ -896,61 +1154,74 @@ VOID PAINT_ZoomCustom(VOID)
     }
 }
 
+/* Reads the integer in control id of hDlg, which must be from nMin to
+ * nMax; otherwise complains with string idsError and selects the text */
+static BOOL GetDlgItemIntInRange(HWND hDlg, INT id, INT nMin, INT nMax,
+                                 UINT idsError, INT *pn)
+{
+    WCHAR sz[MAX_STRING_LEN];
+    BOOL fTranslated;
+
+    *pn = (INT)GetDlgItemInt(hDlg, id, &fTranslated, nMin < 0);
+    if (fTranslated && *pn >= nMin && *pn <= nMax)
+        return TRUE;
+
+    LoadStringW(Globals.hInstance, idsError, sz, MAX_STRING_LEN);
+    MessageBeep(MB_ICONERROR);
+    MessageBoxW(hDlg, sz, NULL, MB_OK|MB_ICONERROR);
+    SendDlgItemMessageW(hDlg, id, EM_SETSEL, 0, -1);
+    SetFocus(GetDlgItem(hDlg, id));
+    return FALSE;
+}
+
 BOOL CALLBACK
 StretchSkewDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
-    INT cxPercent, cyPercent;
-    BOOL fTranslated;
+    INT cxPercent, cyPercent, nSkewX, nSkewY;
     SIZE sizNew;
     static const WCHAR sz100[] = {'1','0','0',0};
+    static const WCHAR sz0[] = {'0',0};
     switch (uMsg)
     {
     case WM_INITDIALOG:
         SetDlgItemTextW(hDlg, edt1, sz100);
         SetDlgItemTextW(hDlg, edt2, sz100);
+        SetDlgItemTextW(hDlg, edt3, sz0);
+        SetDlgItemTextW(hDlg, edt4, sz0);
         return TRUE;
 
     case WM_COMMAND:
         switch (LOWORD(wParam))
         {
         case IDOK:
-            cxPercent = GetDlgItemInt(hDlg, edt1, &fTranslated, FALSE);
-            if (!fTranslated || cxPercent <= 0)
-            {
-                WCHAR sz[MAX_STRING_LEN];
-                LoadStringW(Globals.hInstance, STRING_POSITIVE_INT, sz,
-                           MAX_STRING_LEN);
-                MessageBeep(MB_ICONERROR);
-                MessageBoxW(hDlg, sz, NULL, MB_OK|MB_ICONERROR);
-                SendDlgItemMessageW(hDlg, edt1, EM_SETSEL, 0, -1);
-                SetFocus(GetDlgItem(hDlg, edt1));
+            if (!GetDlgItemIntInRange(hDlg, edt1, 1, MAXLONG,
+                                      STRING_POSITIVE_INT, &cxPercent) ||
+                !GetDlgItemIntInRange(hDlg, edt2, 1, MAXLONG,
+                                      STRING_POSITIVE_INT, &cyPercent) ||
+                !GetDlgItemIntInRange(hDlg, edt3, -89, 89,
+                                      STRING_SKEW_ANGLE, &nSkewX) ||
+                !GetDlgItemIntInRange(hDlg, edt4, -89, 89,
+                                      STRING_SKEW_ANGLE, &nSkewY))
                 break;
-            }
-            cyPercent = GetDlgItemInt(hDlg, edt2, &fTranslated, FALSE);
-            if (!fTranslated || cyPercent <= 0)
-            {
-                WCHAR sz[MAX_STRING_LEN];
-                LoadStringW(Globals.hInstance, STRING_POSITIVE_INT, sz,
-                           MAX_STRING_LEN);
-                MessageBeep(MB_ICONERROR);
-                MessageBoxW(hDlg, sz, NULL, MB_OK|MB_ICONERROR);
-                SendDlgItemMessageW(hDlg, edt2, EM_SETSEL, 0, -1);
-                SetFocus(GetDlgItem(hDlg, edt2));
-                break;
-            }
+
             if (Globals.fSelect)
             {
-                sizNew.cx = MulDiv(Globals.pt1.x - Globals.pt0.x + 1, cxPercent,
+                sizNew.cx = MulDiv(Globals.pt1.x - Globals.pt0.x, cxPercent,
                                    100);
-                sizNew.cy = MulDiv(Globals.pt1.y - Globals.pt0.y + 1, cyPercent,
+                sizNew.cy = MulDiv(Globals.pt1.y - Globals.pt0.y, cyPercent,
                                    100);
-                Selection_Stretch(Globals.hCanvasWnd, sizNew);
+                sizNew.cx = max(sizNew.cx, 1);
+                sizNew.cy = max(sizNew.cy, 1);
+                Selection_StretchSkew(Globals.hCanvasWnd, sizNew, nSkewX,
+                                      nSkewY);
             }
             else
             {
                 sizNew.cx = MulDiv(Globals.sizImage.cx, cxPercent, 100);
                 sizNew.cy = MulDiv(Globals.sizImage.cy, cyPercent, 100);
-                Canvas_Stretch(Globals.hCanvasWnd, sizNew);
+                sizNew.cx = max(sizNew.cx, 1);
+                sizNew.cy = max(sizNew.cy, 1);
+                Canvas_StretchSkew(Globals.hCanvasWnd, sizNew, nSkewX, nSkewY);
             }
 
             EndDialog(hDlg, IDOK);
@@ -975,6 +1246,49 @@ VOID PAINT_StretchSkew(VOID)
     }
 }
 
+BOOL CALLBACK
+BrightnessContrastDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    INT nBrightness, nContrast;
+    static const WCHAR sz0[] = {'0',0};
+    switch (uMsg)
+    {
+    case WM_INITDIALOG:
+        SetDlgItemTextW(hDlg, edt1, sz0);
+        SetDlgItemTextW(hDlg, edt2, sz0);
+        return TRUE;
+
+    case WM_COMMAND:
+        switch (LOWORD(wParam))
+        {
+        case IDOK:
+            if (!GetDlgItemIntInRange(hDlg, edt1, -100, 100,
+                                      STRING_PERCENT_RANGE, &nBrightness) ||
+                !GetDlgItemIntInRange(hDlg, edt2, -100, 100,
+                                      STRING_PERCENT_RANGE, &nContrast))
+                break;
+
+            EndDialog(hDlg, IDOK);
+            if (nBrightness != 0 || nContrast != 0)
+                PAINT_PixelOp(PIXELOP_BRIGHTNESS_CONTRAST, nBrightness,
+                              nContrast);
+            break;
+
+        case IDCANCEL:
+            EndDialog(hDlg, IDCANCEL);
+            break;
+        }
+        break;
+    }
+    return FALSE;
+}
+
+VOID PAINT_BrightnessContrast(VOID)
+{
+    DialogBoxW(Globals.hInstance, (LPCWSTR)IDD_BRIGHTNESS_CONTRAST,
+               Globals.hMainWnd, (DLGPROC)BrightnessContrastDlgProc);
+}
+
 BOOL CALLBACK
 AttributesDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
@@ -1125,6 +1439,8 @@ VOID PAINT_Attributes(VOID)
 BOOL CALLBACK
 FlipRotateDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
+    INT nResult;
+
     switch (uMsg)
     {
     case WM_INITDIALOG:
@@ -1149,46 +1465,24 @@ FlipRotateDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
             break;
 
         case IDOK:
+            /* The dialog only picks the operation, PAINT_FlipRotate
+             * applies it once the dialog is gone. */
+            nResult = IDCANCEL;
             if (IsDlgButtonChecked(hDlg, rad1) & 1)
-            {
-                if (Globals.fSelect)
-                    Selection_HFlip(Globals.hCanvasWnd);
-                else
-                    Canvas_HFlip(Globals.hCanvasWnd);
-            }
+                nResult = rad1;
             else if (IsDlgButtonChecked(hDlg, rad2) & 1)
-            {
-                if (Globals.fSelect)
-                    Selection_VFlip(Globals.hCanvasWnd);
-                else
-                    Canvas_VFlip(Globals.hCanvasWnd);
-            }
+                nResult = rad2;
             else if (IsDlgButtonChecked(hDlg, rad3) & 1)
             {
                 if (IsDlgButtonChecked(hDlg, rad4) & 1)
-                {
-                    if (Globals.fSelect)
-                        Selection_Rotate90Degree(Globals.hCanvasWnd);
-                    else
-                        Canvas_Rotate90Degree(Globals.hCanvasWnd);
-                }
+                    nResult = rad4;
                 else if (IsDlgButtonChecked(hDlg, rad5) & 1)
-                {
-                    if (Globals.fSelect)
-                        Selection_Rotate180Degree(Globals.hCanvasWnd);
-                    else
-                        Canvas_Rotate180Degree(Globals.hCanvasWnd);
-                }
+                    nResult = rad5;
                 else if (IsDlgButtonChecked(hDlg, rad6) & 1)
-                {
-                    if (Globals.fSelect)
-                        Selection_Rotate270Degree(Globals.hCanvasWnd);
-                    else
-                        Canvas_Rotate270Degree(Globals.hCanvasWnd);
-                }
+                    nResult = rad6;
             }
 
-            EndDialog(hDlg, IDOK);
+            EndDialog(hDlg, nResult);
             break;
 
         case IDCANCEL:
@@ -1202,12 +1496,56 @@ FlipRotateDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 VOID PAINT_FlipRotate(VOID)
 {
-    if (DialogBoxW(Globals.hInstance, (LPCWSTR)IDD_FLIP_ROTATE,
-                  Globals.hMainWnd, (DLGPROC)FlipRotateDlgProc) == IDOK)
+    HCURSOR hcurOld;
+    INT_PTR nResult;
+
+    nResult = DialogBoxW(Globals.hInstance, (LPCWSTR)IDD_FLIP_ROTATE,
+                         Globals.hMainWnd, (DLGPROC)FlipRotateDlgProc);
+    if (nResult != rad1 && nResult != rad2 && nResult != rad4 &&
+        nResult != rad5 && nResult != rad6)
+        return;
+
+    /* Each operation below is a single pass over the bits which also
+     * repaints the canvas once it has been committed. */
+    hcurOld = SetCursor(LoadCursorW(NULL, (LPCWSTR)IDC_WAIT));
+    switch (nResult)
     {
-        InvalidateRect(Globals.hCanvasWnd, NULL, TRUE);
-        UpdateWindow(Globals.hCanvasWnd);
+    case rad1:
+        if (Globals.fSelect)
+            Selection_HFlip(Globals.hCanvasWnd);
+        else
+            Canvas_HFlip(Globals.hCanvasWnd);
+        break;
+
+    case rad2:
+        if (Globals.fSelect)
+            Selection_VFlip(Globals.hCanvasWnd);
+        else
+            Canvas_VFlip(Globals.hCanvasWnd);
+        break;
+
+    case rad4:
+        if (Globals.fSelect)
+            Selection_Rotate90Degree(Globals.hCanvasWnd);
+        else
+            Canvas_Rotate90Degree(Globals.hCanvasWnd);
+        break;
+
+    case rad5:
+        if (Globals.fSelect)
+            Selection_Rotate180Degree(Globals.hCanvasWnd);
+        else
+            Canvas_Rotate180Degree(Globals.hCanvasWnd);
+        break;
+
+    case rad6:
+        if (Globals.fSelect)
+            Selection_Rotate270Degree(Globals.hCanvasWnd);
+        else
+            Canvas_Rotate270Degree(Globals.hCanvasWnd);
+        break;
     }
+    SetCursor(hcurOld);
 }
 
 VOID PAINT_EditColor(BOOL fBack)
@@ -23,6 +23,9 @@ VOID PAINT_FileNew(VOID);
 VOID PAINT_FileOpen(VOID);
 BOOL PAINT_FileSave(VOID);
 BOOL PAINT_FileSaveAs(VOID);
+VOID PAINT_OnSaveProgress(INT nPercent);
+VOID PAINT_OnSaveDone(BOOL fSaved, DWORD dwError);
+VOID PAINT_WaitForSave(VOID);
 VOID PAINT_FilePrintPreview(VOID);
 VOID PAINT_FilePrint(VOID);
 VOID PAINT_FilePageSetup(VOID);
@@ -36,6 +39,9 @@ VOID PAINT_EditRepeat(VOID);
 VOID PAINT_EditCut(VOID);
 VOID PAINT_EditCopy(VOID);
 VOID PAINT_EditPaste(VOID);
+VOID PAINT_OnRenderFormat(UINT uFormat);
+VOID PAINT_OnRenderAllFormats(VOID);
+VOID PAINT_OnDestroyClipboard(VOID);
 VOID PAINT_EditDelete(VOID);
 VOID PAINT_EditSelectAll(VOID);
 VOID PAINT_CopyTo(VOID);
@@ -53,11 +59,14 @@ VOID PAINT_StatusBar(VOID);
 VOID PAINT_Zoom(INT nZoom);
 VOID PAINT_Zoom2(INT x, INT y, INT nZoom);
 VOID PAINT_ShowGrid(VOID);
+VOID PAINT_DrawOpaque(BOOL fOpaque);
 VOID PAINT_ZoomCustom(VOID);
 
 VOID PAINT_FlipRotate(VOID);
 VOID PAINT_StretchSkew(VOID);
 VOID PAINT_InvertColors(VOID);
+VOID PAINT_PixelOp(INT iOp, INT nParam1, INT nParam2);
+VOID PAINT_BrightnessContrast(VOID);
 VOID PAINT_Attributes(VOID);
 VOID PAINT_ClearImage(VOID);
 
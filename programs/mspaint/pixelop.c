@@ -0,0 +1,271 @@
+/*
+ *  Paint (pixelop.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Operations that change every pixel by itself, on the bits of a 24 or
+ * 32 bpp DIB section.  Each one is a kernel that handles a run of pixels
+ * within a row.  With SSE2 the kernels do four pixels at a time where they
+ * can; the lookup table of brightness and contrast cannot be done that way
+ * and stays scalar.  Alpha bytes are left alone.
+ */
+
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "main.h"
+
+typedef struct
+{
+    BYTE    abLut[256];     /* PIXELOP_BRIGHTNESS_CONTRAST */
+    INT     nThreshold;     /* PIXELOP_THRESHOLD */
+} PIXELOP_PARAMS;
+
+typedef VOID (*PIXELOP_KERNEL)(LPBYTE pb, INT cPixels, INT cbPixel,
+                               const PIXELOP_PARAMS *pParams);
+
+static VOID PixelOp_Invert(LPBYTE pb, INT cPixels, INT cbPixel,
+                           const PIXELOP_PARAMS *pParams)
+{
+    DWORD *pdw = (DWORD *)pb;
+    INT i = 0, cb = cPixels * cbPixel;
+
+#ifdef __SSE2__
+    {
+        /* the same bytes flip at every 16 byte step of either pixel size */
+        __m128i vMask = cbPixel == 4 ? _mm_set1_epi32(0x00FFFFFF) :
+                                       _mm_set1_epi32(-1);
+        for (; i + 16 <= cb; i += 16)
+            _mm_storeu_si128((__m128i *)(pb + i),
+                _mm_xor_si128(_mm_loadu_si128((const __m128i *)(pb + i)),
+                              vMask));
+    }
+#endif
+    if (cbPixel == 4)
+    {
+        for (i /= 4; i < cPixels; i++)
+            pdw[i] ^= 0x00FFFFFF;
+    }
+    else
+    {
+        for (; i < cb; i++)
+            pb[i] ^= 0xFF;
+    }
+}
+
+/* Rec. 601 luma in 8 bit fixed point */
+#define PIXELOP_LUMA(pb) (((pb)[0] * 29 + (pb)[1] * 150 + (pb)[2] * 77 + 128) >> 8)
+
+#ifdef __SSE2__
+/* PIXELOP_LUMA of the four 32 bpp pixels v, one in each DWORD */
+static __m128i PixelOp_Luma4(__m128i v)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vWeights = _mm_set_epi16(0, 77, 150, 29, 0, 77, 150, 29);
+    __m128i vLo, vHi;
+
+    /* blue and green, then red and alpha, are summed in pairs of DWORDs */
+    vLo = _mm_madd_epi16(_mm_unpacklo_epi8(v, vZero), vWeights);
+    vHi = _mm_madd_epi16(_mm_unpackhi_epi8(v, vZero), vWeights);
+    vLo = _mm_add_epi32(vLo, _mm_srli_epi64(vLo, 32));
+    vHi = _mm_add_epi32(vHi, _mm_srli_epi64(vHi, 32));
+    v = _mm_unpacklo_epi64(_mm_shuffle_epi32(vLo, _MM_SHUFFLE(3, 3, 2, 0)),
+                           _mm_shuffle_epi32(vHi, _MM_SHUFFLE(3, 3, 2, 0)));
+    return _mm_srli_epi32(_mm_add_epi32(v, _mm_set1_epi32(128)), 8);
+}
+
+/* The gray of each byte of v below 256, with the alpha of vAlpha */
+static __m128i PixelOp_Gray4(__m128i v, __m128i vAlpha)
+{
+    v = _mm_or_si128(v, _mm_or_si128(_mm_slli_epi32(v, 8),
+                                     _mm_slli_epi32(v, 16)));
+    return _mm_or_si128(v, _mm_and_si128(vAlpha, _mm_set1_epi32(0xFF000000)));
+}
+#endif
+
+static VOID PixelOp_Grayscale(LPBYTE pb, INT cPixels, INT cbPixel,
+                              const PIXELOP_PARAMS *pParams)
+{
+    INT i = 0;
+    BYTE b;
+
+#ifdef __SSE2__
+    if (cbPixel == 4)
+    {
+        for (; i + 4 <= cPixels; i += 4, pb += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)pb);
+            _mm_storeu_si128((__m128i *)pb,
+                             PixelOp_Gray4(PixelOp_Luma4(v), v));
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pb += cbPixel)
+    {
+        b = (BYTE)PIXELOP_LUMA(pb);
+        pb[0] = pb[1] = pb[2] = b;
+    }
+}
+
+static VOID PixelOp_Lut(LPBYTE pb, INT cPixels, INT cbPixel,
+                        const PIXELOP_PARAMS *pParams)
+{
+    INT i;
+
+    if (cbPixel == 3)
+    {
+        for (i = 0; i < cPixels * 3; i++)
+            pb[i] = pParams->abLut[pb[i]];
+    }
+    else
+    {
+        for (i = 0; i < cPixels; i++, pb += 4)
+        {
+            pb[0] = pParams->abLut[pb[0]];
+            pb[1] = pParams->abLut[pb[1]];
+            pb[2] = pParams->abLut[pb[2]];
+        }
+    }
+}
+
+static VOID PixelOp_Threshold(LPBYTE pb, INT cPixels, INT cbPixel,
+                              const PIXELOP_PARAMS *pParams)
+{
+    INT i = 0;
+    BYTE b;
+
+#ifdef __SSE2__
+    if (cbPixel == 4)
+    {
+        __m128i vThreshold = _mm_set1_epi32(pParams->nThreshold);
+        for (; i + 4 <= cPixels; i += 4, pb += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)pb);
+            __m128i vBelow = _mm_cmplt_epi32(PixelOp_Luma4(v), vThreshold);
+            _mm_storeu_si128((__m128i *)pb,
+                PixelOp_Gray4(_mm_andnot_si128(vBelow, _mm_set1_epi32(0xFF)),
+                              v));
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pb += cbPixel)
+    {
+        b = (PIXELOP_LUMA(pb) >= pParams->nThreshold) ? 0xFF : 0;
+        pb[0] = pb[1] = pb[2] = b;
+    }
+}
+
+static VOID PixelOp_SwapRedBlue(LPBYTE pb, INT cPixels, INT cbPixel,
+                                const PIXELOP_PARAMS *pParams)
+{
+    INT i = 0;
+    BYTE b;
+
+#ifdef __SSE2__
+    if (cbPixel == 4)
+    {
+        const __m128i vKeep = _mm_set1_epi32(0xFF00FF00);
+        const __m128i vLow = _mm_set1_epi32(0x000000FF);
+        for (; i + 4 <= cPixels; i += 4, pb += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)pb);
+            v = _mm_or_si128(_mm_and_si128(v, vKeep),
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), vLow),
+                                 _mm_slli_epi32(_mm_and_si128(v, vLow), 16)));
+            _mm_storeu_si128((__m128i *)pb, v);
+        }
+    }
+#endif
+    for (; i < cPixels; i++, pb += cbPixel)
+    {
+        b = pb[0];
+        pb[0] = pb[2];
+        pb[2] = b;
+    }
+}
+
+/* out = (in - 128) * (100 + nContrast) / 100 + 128 + nBrightness * 255 / 100,
+ * both from -100 to 100 */
+static VOID PixelOp_InitLut(BYTE *abLut, INT nBrightness, INT nContrast)
+{
+    INT i, n;
+
+    for (i = 0; i < 256; i++)
+    {
+        n = (i - 128) * (100 + nContrast) / 100 + 128 + nBrightness * 255 / 100;
+        abLut[i] = (BYTE)min(max(n, 0), 255);
+    }
+}
+
+/* Applies PIXELOP iOp to the part of the 24 or 32 bpp image ppx within
+ * prc, or all of it if prc is NULL.  The meaning of nParam1 and nParam2
+ * depends on the operation:
+ *   PIXELOP_BRIGHTNESS_CONTRAST  brightness and contrast, -100 to 100
+ *   PIXELOP_THRESHOLD            grays from nParam1 up turn white, the
+ *                                rest black
+ * Returns the number of pixels changed, or -1 with the last error set. */
+INT BM_PixelOp(const BM_PIXELS *ppx, const RECT *prc, INT iOp, INT nParam1,
+               INT nParam2)
+{
+    static const PIXELOP_KERNEL apfnKernel[] =
+    {
+        PixelOp_Invert,         /* PIXELOP_INVERT */
+        PixelOp_Grayscale,      /* PIXELOP_GRAYSCALE */
+        PixelOp_Lut,            /* PIXELOP_BRIGHTNESS_CONTRAST */
+        PixelOp_Threshold,      /* PIXELOP_THRESHOLD */
+        PixelOp_SwapRedBlue     /* PIXELOP_SWAP_RED_BLUE */
+    };
+    PIXELOP_PARAMS params;
+    INT cbPixel = ppx->wBitCount / 8, y;
+    RECT rc;
+
+    if ((ppx->wBitCount != 24 && ppx->wBitCount != 32) ||
+        iOp < PIXELOP_INVERT || iOp > PIXELOP_SWAP_RED_BLUE ||
+        (iOp == PIXELOP_BRIGHTNESS_CONTRAST &&
+         (nParam1 < -100 || nParam1 > 100 || nParam2 < -100 || nParam2 > 100)))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return -1;
+    }
+
+    SetRect(&rc, 0, 0, ppx->cx, ppx->cy);
+    if (prc != NULL)
+    {
+        rc.left = max(prc->left, 0);
+        rc.top = max(prc->top, 0);
+        rc.right = min(prc->right, ppx->cx);
+        rc.bottom = min(prc->bottom, ppx->cy);
+    }
+    if (rc.left >= rc.right || rc.top >= rc.bottom)
+        return 0;
+
+    if (iOp == PIXELOP_BRIGHTNESS_CONTRAST)
+        PixelOp_InitLut(params.abLut, nParam1, nParam2);
+    params.nThreshold = nParam1;
+
+    for (y = rc.top; y < rc.bottom; y++)
+    {
+        apfnKernel[iOp](BM_ScanLine(ppx, y) + rc.left * cbPixel,
+                        rc.right - rc.left, cbPixel, &params);
+    }
+    return (rc.right - rc.left) * (rc.bottom - rc.top);
+}
@@ -0,0 +1,1690 @@
+/*
+ *  Paint (png.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * PNG reader and writer.
+ *
+ * Both work a row at a time against the bits of a DIB section.  The reader
+ * inflates the image data through a 64 KB window and unfilters each row
+ * into the DIB as soon as it is complete; the writer filters each DIB row
+ * and deflates it straight into IDAT chunks.  Besides the image, only a
+ * few rows and the deflate window are ever held in memory.
+ *
+ * The writer writes each deflate block stored, with the fixed Huffman codes
+ * or with codes of its own, whichever is smallest, after an LZ77 search
+ * whose depth is set by the compression effort, 0 to 9.  With SSE2 the Sub,
+ * Up and Average filters and the cost of each filtered row take 16 bytes
+ * at a time.  Paeth stays scalar, and so do the unfilters other than Up,
+ * in which each byte depends on the one decoded just before it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "main.h"
+#include "resource.h"
+
+#define PNG_DWORD(pb)   (((DWORD)(pb)[0] << 24) | ((pb)[1] << 16) | \
+                         ((pb)[2] << 8) | (pb)[3])
+#define PNG_WORD(pb)    (((pb)[0] << 8) | (pb)[1])
+
+static const BYTE abSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+/* base and extra bits of the deflate length codes 257..285 */
+static const WORD awLengthBase[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE abLengthExtra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/* base and extra bits of the distance codes 0..29 */
+static const WORD awDistBase[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const BYTE abDistExtra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* order of the code length code lengths in a dynamic block header */
+static const BYTE abCodeLengthOrder[19] =
+{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Adam7 passes: first column and row, then column and row steps */
+static const BYTE abPasses[7][4] =
+{
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+
+static DWORD adwCrcTable[256];
+static LONG fCrcTableReady;
+
+static DWORD PNG_Crc(DWORD dwCrc, const BYTE *pb, DWORD cb)
+{
+    DWORD dw;
+    INT i, j;
+
+    /* /batch threads getting here together all write the same table, and
+     * none uses it before it has written all of it */
+    if (!fCrcTableReady)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            dw = i;
+            for (j = 0; j < 8; j++)
+                dw = (dw & 1) ? 0xEDB88320 ^ (dw >> 1) : dw >> 1;
+            adwCrcTable[i] = dw;
+        }
+        InterlockedExchange(&fCrcTableReady, TRUE);
+    }
+
+    dwCrc = ~dwCrc;
+    while (cb-- > 0)
+        dwCrc = adwCrcTable[(dwCrc ^ *pb++) & 0xFF] ^ (dwCrc >> 8);
+    return ~dwCrc;
+}
+
+static DWORD PNG_Adler(DWORD dwAdler, const BYTE *pb, DWORD cb)
+{
+    DWORD s1 = dwAdler & 0xFFFF, s2 = dwAdler >> 16, n;
+
+    while (cb > 0)
+    {
+        /* the largest n for which s2 cannot overflow */
+        n = min(cb, 5552);
+        cb -= n;
+        while (n-- > 0)
+        {
+            s1 += *pb++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+static BYTE PNG_Paeth(BYTE a, BYTE b, BYTE c)
+{
+    INT pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/***********************************************************************
+ * Reading
+ */
+
+#define INFLATE_WINDOW  0x10000     /* output ring, twice the history */
+#define INFLATE_FLUSH   0x4000      /* output handed on in pieces this big */
+#define HUFF_BITS       15
+
+typedef struct
+{
+    /* the file and the IDAT data being read */
+    const BYTE *pbFile;
+    const BYTE *pbFileEnd;
+    const BYTE *pb;
+    const BYTE *pbChunkEnd;
+    INT         cPadding;       /* zero bytes made up after the data */
+    DWORD       dwBits;
+    INT         cBits;
+
+    WORD        awLitLen[1 << HUFF_BITS];   /* symbol << 4 | code length */
+    WORD        awDist[1 << HUFF_BITS];
+
+    BYTE        abWindow[INFLATE_WINDOW];
+    DWORD       iOut;           /* bytes inflated so far */
+    DWORD       iFlushed;       /* bytes handed to the row decoder */
+    DWORD       cbExtra;        /* bytes inflated past the last row */
+    DWORD       dwAdler;
+
+    /* image */
+    LONG        cx;
+    LONG        cy;
+    BYTE        bDepth;
+    BYTE        bColorType;
+    BYTE        bInterlace;
+    INT         cChannels;
+    INT         cbFilterPixel;  /* distance to the left byte when filtering */
+    RGBQUAD     aPalette[256];  /* with the alpha of tRNS in rgbReserved */
+    BOOL        fTransparent;   /* has a tRNS chunk */
+    WORD        awKey[3];       /* the transparent gray or RGB of tRNS */
+    BM_PIXELS   px;
+
+    /* current row */
+    INT         iPass;
+    LONG        cxPass;
+    LONG        cyPass;
+    LONG        yPass;
+    DWORD       cbRow;          /* without the filter byte */
+    DWORD       iRowByte;
+    LPBYTE      pbRow;          /* filter byte, then the row */
+    LPBYTE      pbPrev;
+    BOOL        fDone;
+} PNG_READER;
+
+static BYTE Inflate_NextByte(PNG_READER *pr)
+{
+    const BYTE *pb;
+    DWORD cb;
+
+    while (pr->pb == pr->pbChunkEnd)
+    {
+        /* continue in the next IDAT chunk, past the CRC of this one */
+        pb = pr->pbChunkEnd + 4;
+        if (pr->pbFileEnd - pb < 8 || memcmp(pb + 4, "IDAT", 4) ||
+            (cb = PNG_DWORD(pb)) > (DWORD)(pr->pbFileEnd - pb - 8))
+        {
+            pr->cPadding++;
+            return 0;
+        }
+        pr->pb = pb + 8;
+        pr->pbChunkEnd = pr->pb + cb;
+    }
+    return *pr->pb++;
+}
+
+static VOID Inflate_Need(PNG_READER *pr, INT n)
+{
+    while (pr->cBits < n)
+    {
+        pr->dwBits |= (DWORD)Inflate_NextByte(pr) << pr->cBits;
+        pr->cBits += 8;
+    }
+}
+
+static DWORD Inflate_Bits(PNG_READER *pr, INT n)
+{
+    DWORD dw;
+
+    if (n == 0)
+        return 0;
+    Inflate_Need(pr, n);
+    dw = pr->dwBits & ((1 << n) - 1);
+    pr->dwBits >>= n;
+    pr->cBits -= n;
+    return dw;
+}
+
+/* Builds the lookup table of a canonical Huffman code from its code
+ * lengths.  Returns FALSE if the lengths are over-subscribed. */
+static BOOL Inflate_BuildTable(WORD *pwTable, const BYTE *abLengths, INT cSymbols)
+{
+    INT acCount[HUFF_BITS + 1], aNext[HUFF_BITS + 1];
+    INT i, nCode, nLeft, nLen, nRev, j;
+
+    memset(acCount, 0, sizeof(acCount));
+    for (i = 0; i < cSymbols; i++)
+        acCount[abLengths[i]]++;
+    acCount[0] = 0;
+
+    nLeft = 1;
+    for (i = 1; i <= HUFF_BITS; i++)
+    {
+        nLeft = nLeft * 2 - acCount[i];
+        if (nLeft < 0)
+            return FALSE;
+    }
+
+    nCode = 0;
+    for (i = 1; i <= HUFF_BITS; i++)
+    {
+        nCode = (nCode + acCount[i - 1]) << 1;
+        aNext[i] = nCode;
+    }
+
+    /* entries no code leads to stay 0, which is an invalid length */
+    memset(pwTable, 0, sizeof(WORD) << HUFF_BITS);
+    for (i = 0; i < cSymbols; i++)
+    {
+        nLen = abLengths[i];
+        if (nLen == 0)
+            continue;
+        nCode = aNext[nLen]++;
+        for (nRev = 0, j = 0; j < nLen; j++)
+            nRev |= ((nCode >> j) & 1) << (nLen - 1 - j);
+        for (j = nRev; j < (1 << HUFF_BITS); j += 1 << nLen)
+            pwTable[j] = (WORD)((i << 4) | nLen);
+    }
+    return TRUE;
+}
+
+static INT Inflate_Decode(PNG_READER *pr, const WORD *pwTable)
+{
+    WORD w;
+
+    Inflate_Need(pr, HUFF_BITS);
+    w = pwTable[pr->dwBits & ((1 << HUFF_BITS) - 1)];
+    if ((w & 15) == 0)
+        return -1;
+    pr->dwBits >>= w & 15;
+    pr->cBits -= w & 15;
+    return w >> 4;
+}
+
+static BOOL Inflate_FixedTables(PNG_READER *pr)
+{
+    BYTE abLengths[288 + 32];
+    INT i;
+
+    for (i = 0; i < 144; i++) abLengths[i] = 8;
+    for (; i < 256; i++) abLengths[i] = 9;
+    for (; i < 280; i++) abLengths[i] = 7;
+    for (; i < 288; i++) abLengths[i] = 8;
+    for (; i < 288 + 32; i++) abLengths[i] = 5;
+    return Inflate_BuildTable(pr->awLitLen, abLengths, 288) &&
+           Inflate_BuildTable(pr->awDist, abLengths + 288, 32);
+}
+
+static BOOL Inflate_DynamicTables(PNG_READER *pr)
+{
+    BYTE abLengths[286 + 32], abCodeLengths[19];
+    INT cLitLen, cDist, cCodeLengths, i, n, nSym, nRepeat;
+    BYTE bRepeat;
+
+    cLitLen = Inflate_Bits(pr, 5) + 257;
+    cDist = Inflate_Bits(pr, 5) + 1;
+    cCodeLengths = Inflate_Bits(pr, 4) + 4;
+    if (cLitLen > 286 || cDist > 30)
+        return FALSE;
+
+    memset(abCodeLengths, 0, sizeof(abCodeLengths));
+    for (i = 0; i < cCodeLengths; i++)
+        abCodeLengths[abCodeLengthOrder[i]] = (BYTE)Inflate_Bits(pr, 3);
+    if (!Inflate_BuildTable(pr->awLitLen, abCodeLengths, 19))
+        return FALSE;
+
+    n = cLitLen + cDist;
+    for (i = 0; i < n; )
+    {
+        nSym = Inflate_Decode(pr, pr->awLitLen);
+        if (nSym < 0)
+            return FALSE;
+        if (nSym < 16)
+        {
+            abLengths[i++] = (BYTE)nSym;
+            continue;
+        }
+        if (nSym == 16)
+        {
+            if (i == 0)
+                return FALSE;
+            bRepeat = abLengths[i - 1];
+            nRepeat = 3 + Inflate_Bits(pr, 2);
+        }
+        else
+        {
+            bRepeat = 0;
+            nRepeat = (nSym == 17) ? 3 + Inflate_Bits(pr, 3) :
+                                     11 + Inflate_Bits(pr, 7);
+        }
+        if (i + nRepeat > n)
+            return FALSE;
+        while (nRepeat-- > 0)
+            abLengths[i++] = bRepeat;
+    }
+
+    return abLengths[256] != 0 &&
+           Inflate_BuildTable(pr->awLitLen, abLengths, cLitLen) &&
+           Inflate_BuildTable(pr->awDist, abLengths + cLitLen, cDist);
+}
+
+static VOID PNG_StartPass(PNG_READER *pr);
+static BOOL PNG_AddBytes(PNG_READER *pr, const BYTE *pb, DWORD cb);
+
+/* Hands the bytes inflated since the last flush to the row decoder */
+static BOOL Inflate_Flush(PNG_READER *pr)
+{
+    DWORD i = pr->iFlushed & (INFLATE_WINDOW - 1);
+    DWORD cb = pr->iOut - pr->iFlushed, cbFirst;
+
+    cbFirst = min(cb, INFLATE_WINDOW - i);
+    pr->iFlushed = pr->iOut;
+    pr->dwAdler = PNG_Adler(pr->dwAdler, pr->abWindow + i, cbFirst);
+    pr->dwAdler = PNG_Adler(pr->dwAdler, pr->abWindow, cb - cbFirst);
+    return PNG_AddBytes(pr, pr->abWindow + i, cbFirst) &&
+           PNG_AddBytes(pr, pr->abWindow, cb - cbFirst);
+}
+
+static BOOL Inflate_Put(PNG_READER *pr, BYTE b)
+{
+    pr->abWindow[pr->iOut++ & (INFLATE_WINDOW - 1)] = b;
+    if (pr->iOut - pr->iFlushed >= INFLATE_FLUSH)
+        return Inflate_Flush(pr);
+    return TRUE;
+}
+
+/* Inflates the zlib stream of the IDAT chunks into the rows of the image */
+static BOOL Inflate_Run(PNG_READER *pr)
+{
+    BOOL fFinal;
+    DWORD dwLen, dwDist, dwAdler, i;
+    INT nSym;
+    BYTE b, bFlags;
+
+    /* zlib header: deflate, and no preset dictionary */
+    b = Inflate_NextByte(pr);
+    bFlags = Inflate_NextByte(pr);
+    if ((b & 15) != 8 || ((b << 8) | bFlags) % 31 != 0 || (bFlags & 0x20))
+        return FALSE;
+
+    do
+    {
+        fFinal = Inflate_Bits(pr, 1);
+        switch (Inflate_Bits(pr, 2))
+        {
+        case 0:
+            /* stored, from the next byte boundary */
+            Inflate_Bits(pr, pr->cBits & 7);
+            dwLen = Inflate_Bits(pr, 16);
+            if ((Inflate_Bits(pr, 16) ^ dwLen) != 0xFFFF)
+                return FALSE;
+            while (dwLen-- > 0 && pr->cPadding <= 4)
+            {
+                if (!Inflate_Put(pr, (BYTE)Inflate_Bits(pr, 8)))
+                    return FALSE;
+            }
+            break;
+
+        case 1:
+            if (!Inflate_FixedTables(pr))
+                return FALSE;
+            goto huffman;
+
+        case 2:
+            if (!Inflate_DynamicTables(pr))
+                return FALSE;
+        huffman:
+            while (pr->cPadding <= 4)
+            {
+                nSym = Inflate_Decode(pr, pr->awLitLen);
+                if (nSym < 0 || nSym > 285)
+                    return FALSE;
+                if (nSym < 256)
+                {
+                    if (!Inflate_Put(pr, (BYTE)nSym))
+                        return FALSE;
+                    continue;
+                }
+                if (nSym == 256)
+                    break;
+
+                nSym -= 257;
+                dwLen = awLengthBase[nSym] + Inflate_Bits(pr, abLengthExtra[nSym]);
+                nSym = Inflate_Decode(pr, pr->awDist);
+                if (nSym < 0 || nSym > 29)
+                    return FALSE;
+                dwDist = awDistBase[nSym] + Inflate_Bits(pr, abDistExtra[nSym]);
+                if (dwDist > pr->iOut)
+                    return FALSE;
+                for (i = 0; i < dwLen; i++)
+                {
+                    b = pr->abWindow[(pr->iOut - dwDist) & (INFLATE_WINDOW - 1)];
+                    if (!Inflate_Put(pr, b))
+                        return FALSE;
+                }
+            }
+            break;
+
+        default:
+            return FALSE;
+        }
+
+        /* a few bytes past the end can be peeked at, but never used */
+        if (pr->cPadding * 8 - pr->cBits > 0)
+            return FALSE;
+    } while (!fFinal);
+
+    /* the Adler-32 of the inflated data, from the next byte boundary */
+    Inflate_Bits(pr, pr->cBits & 7);
+    dwAdler = 0;
+    for (i = 0; i < 4; i++)
+        dwAdler = (dwAdler << 8) | Inflate_Bits(pr, 8);
+    if (pr->cPadding * 8 - pr->cBits > 0)
+        return FALSE;
+
+    return Inflate_Flush(pr) && pr->fDone && dwAdler == pr->dwAdler;
+}
+
+static VOID PNG_StartPass(PNG_READER *pr)
+{
+    const BYTE *pbPass;
+
+    for (;;)
+    {
+        if (pr->bInterlace)
+        {
+            if (pr->iPass >= 7)
+            {
+                pr->fDone = TRUE;
+                return;
+            }
+            pbPass = abPasses[pr->iPass];
+            pr->cxPass = (pr->cx - pbPass[0] + pbPass[2] - 1) / pbPass[2];
+            pr->cyPass = (pr->cy - pbPass[1] + pbPass[3] - 1) / pbPass[3];
+        }
+        else
+        {
+            if (pr->iPass >= 1)
+            {
+                pr->fDone = TRUE;
+                return;
+            }
+            pr->cxPass = pr->cx;
+            pr->cyPass = pr->cy;
+        }
+        if (pr->cxPass > 0 && pr->cyPass > 0)
+            break;
+        pr->iPass++;
+    }
+
+    pr->yPass = 0;
+    pr->cbRow = (pr->cxPass * pr->cChannels * pr->bDepth + 7) / 8;
+    pr->iRowByte = 0;
+    memset(pr->pbPrev, 0, pr->cbRow + 1);
+}
+
+static VOID PNG_Unfilter(BYTE bFilter, LPBYTE pb, const BYTE *pbPrev, DWORD cb,
+                         INT n)
+{
+    DWORD i;
+
+    switch (bFilter)
+    {
+    case 1:
+        for (i = n; i < cb; i++)
+            pb[i] += pb[i - n];
+        break;
+
+    case 2:
+        i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= cb; i += 16)
+            _mm_storeu_si128((__m128i *)(pb + i),
+                _mm_add_epi8(_mm_loadu_si128((const __m128i *)(pb + i)),
+                             _mm_loadu_si128((const __m128i *)(pbPrev + i))));
+#endif
+        for (; i < cb; i++)
+            pb[i] += pbPrev[i];
+        break;
+
+    case 3:
+        for (i = 0; i < n && i < cb; i++)
+            pb[i] += pbPrev[i] >> 1;
+        for (; i < cb; i++)
+            pb[i] += (pb[i - n] + pbPrev[i]) >> 1;
+        break;
+
+    case 4:
+        for (i = 0; i < n && i < cb; i++)
+            pb[i] += pbPrev[i];
+        for (; i < cb; i++)
+            pb[i] += PNG_Paeth(pb[i - n], pbPrev[i], pbPrev[i - n]);
+        break;
+    }
+}
+
+/* Sample i of a row of 1, 2 or 4 bit samples */
+static BYTE PNG_GetSample(const PNG_READER *pr, const BYTE *pb, LONG i)
+{
+    INT nBit = i * pr->bDepth;
+
+    return (pb[nBit / 8] >> (8 - pr->bDepth - nBit % 8)) &
+           ((1 << pr->bDepth) - 1);
+}
+
+/* The whole value of sample i of a row, for comparing with tRNS */
+static WORD PNG_GetValue(const PNG_READER *pr, const BYTE *pb, LONG i)
+{
+    if (pr->bDepth < 8)
+        return PNG_GetSample(pr, pb, i);
+    if (pr->bDepth == 8)
+        return pb[i];
+    return PNG_WORD(pb + i * 2);
+}
+
+/* Stores the unfiltered row pb of the current pass in the image */
+static VOID PNG_StoreRow(PNG_READER *pr, const BYTE *pb)
+{
+    const RGBQUAD *pColor;
+    LONG i, x, y, dx;
+    INT cbSample = (pr->bDepth == 16) ? 2 : 1, cbOut = pr->px.wBitCount / 8;
+    LPBYTE pbOut;
+    BYTE bGray;
+    BOOL fKey;
+
+    if (pr->bInterlace)
+    {
+        x = abPasses[pr->iPass][0];
+        y = abPasses[pr->iPass][1] + pr->yPass * abPasses[pr->iPass][3];
+        dx = abPasses[pr->iPass][2];
+    }
+    else
+    {
+        x = 0;
+        y = pr->yPass;
+        dx = 1;
+    }
+    pbOut = BM_ScanLine(&pr->px, y) + x * cbOut;
+
+    /* the common case first */
+    if (pr->bDepth == 8 && (pr->bColorType == 6 ||
+        (pr->bColorType == 2 && !pr->fTransparent)) && dx == 1)
+    {
+        for (i = 0; i < pr->cxPass; i++, pb += pr->cChannels, pbOut += cbOut)
+        {
+            pbOut[0] = pb[2];
+            pbOut[1] = pb[1];
+            pbOut[2] = pb[0];
+            if (cbOut == 4)
+                pbOut[3] = pb[3];
+        }
+        return;
+    }
+
+    for (i = 0; i < pr->cxPass; i++, pbOut += dx * cbOut)
+    {
+        switch (pr->bColorType)
+        {
+        case 0:     /* gray */
+        case 4:     /* gray and alpha */
+            if (pr->bDepth < 8)
+                bGray = PNG_GetSample(pr, pb, i) * 255 / ((1 << pr->bDepth) - 1);
+            else
+                bGray = pb[i * pr->cChannels * cbSample];
+            pbOut[0] = pbOut[1] = pbOut[2] = bGray;
+            if (pr->bColorType == 4)
+                pbOut[3] = pb[(i * pr->cChannels + 1) * cbSample];
+            else if (cbOut == 4)
+                pbOut[3] = (PNG_GetValue(pr, pb, i) == pr->awKey[0]) ? 0 : 0xFF;
+            break;
+
+        case 3:     /* palette */
+            pColor = &pr->aPalette[pr->bDepth < 8 ? PNG_GetSample(pr, pb, i) : pb[i]];
+            pbOut[0] = pColor->rgbBlue;
+            pbOut[1] = pColor->rgbGreen;
+            pbOut[2] = pColor->rgbRed;
+            if (cbOut == 4)
+                pbOut[3] = pColor->rgbReserved;
+            break;
+
+        default:    /* RGB, with alpha if 6 */
+            pbOut[0] = pb[(i * pr->cChannels + 2) * cbSample];
+            pbOut[1] = pb[(i * pr->cChannels + 1) * cbSample];
+            pbOut[2] = pb[(i * pr->cChannels) * cbSample];
+            if (pr->bColorType == 6)
+                pbOut[3] = pb[(i * pr->cChannels + 3) * cbSample];
+            else if (cbOut == 4)
+            {
+                fKey = PNG_GetValue(pr, pb, i * 3) == pr->awKey[0] &&
+                       PNG_GetValue(pr, pb, i * 3 + 1) == pr->awKey[1] &&
+                       PNG_GetValue(pr, pb, i * 3 + 2) == pr->awKey[2];
+                pbOut[3] = fKey ? 0 : 0xFF;
+            }
+            break;
+        }
+    }
+}
+
+/* Collects inflated bytes into rows, and stores each complete row */
+static BOOL PNG_AddBytes(PNG_READER *pr, const BYTE *pb, DWORD cb)
+{
+    DWORD n;
+    LPBYTE pbSwap;
+
+    if (pr->fDone)
+    {
+        /* tolerate a little data past the last row, as libpng does */
+        pr->cbExtra += cb;
+        return pr->cbExtra <= INFLATE_WINDOW;
+    }
+
+    while (cb > 0 && !pr->fDone)
+    {
+        n = min(cb, pr->cbRow + 1 - pr->iRowByte);
+        memcpy(pr->pbRow + pr->iRowByte, pb, n);
+        pr->iRowByte += n;
+        pb += n;
+        cb -= n;
+        if (pr->iRowByte < pr->cbRow + 1)
+            break;
+
+        if (pr->pbRow[0] > 4)
+            return FALSE;
+        PNG_Unfilter(pr->pbRow[0], pr->pbRow + 1, pr->pbPrev + 1, pr->cbRow,
+                     pr->cbFilterPixel);
+        PNG_StoreRow(pr, pr->pbRow + 1);
+
+        pbSwap = pr->pbPrev;
+        pr->pbPrev = pr->pbRow;
+        pr->pbRow = pbSwap;
+        pr->iRowByte = 0;
+        if (++pr->yPass == pr->cyPass)
+        {
+            pr->iPass++;
+            PNG_StartPass(pr);
+        }
+    }
+    return TRUE;
+}
+
+BOOL PNG_IsPng(const BYTE *pb, DWORD cb)
+{
+    return cb >= sizeof(abSignature) && !memcmp(pb, abSignature, sizeof(abSignature));
+}
+
+/* Reads the IHDR, PLTE and tRNS chunks, finds the first IDAT and checks
+ * the CRC of every chunk up to IEND */
+static BOOL PNG_ReadHeaders(PNG_READER *pr)
+{
+    const BYTE *pb = pr->pbFile + sizeof(abSignature);
+    DWORD cb, i;
+    BOOL fHeader = FALSE;
+
+    for (i = 0; i < 256; i++)
+        pr->aPalette[i].rgbReserved = 0xFF;
+
+    while (pr->pbFileEnd - pb >= 12)
+    {
+        cb = PNG_DWORD(pb);
+        if (cb > (DWORD)(pr->pbFileEnd - pb - 12) ||
+            PNG_Crc(0, pb + 4, 4 + cb) != PNG_DWORD(pb + 8 + cb))
+            return FALSE;
+
+        if (!memcmp(pb + 4, "IHDR", 4))
+        {
+            if (cb < 13)
+                return FALSE;
+            pr->cx = PNG_DWORD(pb + 8);
+            pr->cy = PNG_DWORD(pb + 12);
+            pr->bDepth = pb[16];
+            pr->bColorType = pb[17];
+            pr->bInterlace = pb[20];
+            if (pr->cx <= 0 || pr->cx > 0x1000000 || pr->cy <= 0 ||
+                pr->cy > 0x1000000 || pb[18] != 0 || pb[19] != 0 ||
+                pr->bInterlace > 1)
+                return FALSE;
+            switch (pr->bColorType)
+            {
+            case 0: pr->cChannels = 1; break;
+            case 2: pr->cChannels = 3; break;
+            case 3: pr->cChannels = 1; break;
+            case 4: pr->cChannels = 2; break;
+            case 6: pr->cChannels = 4; break;
+            default: return FALSE;
+            }
+            if ((pr->bDepth != 1 && pr->bDepth != 2 && pr->bDepth != 4 &&
+                 pr->bDepth != 8 && pr->bDepth != 16) ||
+                (pr->bColorType == 3 && pr->bDepth == 16) ||
+                (pr->bColorType != 0 && pr->bColorType != 3 && pr->bDepth < 8))
+                return FALSE;
+            pr->cbFilterPixel = max(pr->cChannels * pr->bDepth / 8, 1);
+            fHeader = TRUE;
+        }
+        else if (!memcmp(pb + 4, "PLTE", 4))
+        {
+            for (i = 0; i < cb / 3 && i < 256; i++)
+            {
+                pr->aPalette[i].rgbRed = pb[8 + i * 3];
+                pr->aPalette[i].rgbGreen = pb[8 + i * 3 + 1];
+                pr->aPalette[i].rgbBlue = pb[8 + i * 3 + 2];
+            }
+        }
+        else if (!memcmp(pb + 4, "tRNS", 4) && fHeader && pr->pb == NULL)
+        {
+            switch (pr->bColorType)
+            {
+            case 0:
+                pr->fTransparent = cb >= 2;
+                if (pr->fTransparent)
+                    pr->awKey[0] = PNG_WORD(pb + 8);
+                break;
+            case 2:
+                pr->fTransparent = cb >= 6;
+                for (i = 0; i < 3 && pr->fTransparent; i++)
+                    pr->awKey[i] = PNG_WORD(pb + 8 + i * 2);
+                break;
+            case 3:
+                pr->fTransparent = TRUE;
+                for (i = 0; i < cb && i < 256; i++)
+                    pr->aPalette[i].rgbReserved = pb[8 + i];
+                break;
+            }
+        }
+        else if (!memcmp(pb + 4, "IDAT", 4))
+        {
+            if (!fHeader)
+                return FALSE;
+            if (pr->pb == NULL)
+            {
+                pr->pb = pb + 8;
+                pr->pbChunkEnd = pr->pb + cb;
+            }
+        }
+        else if (!memcmp(pb + 4, "IEND", 4))
+            break;
+        pb += 12 + cb;
+    }
+    return pr->pb != NULL;
+}
+
+/* Decodes the PNG file pb of cb bytes into a new DIB section: 32 bpp with
+ * the alpha channel if it has one or a tRNS chunk, 24 bpp otherwise */
+HBITMAP PNG_Decode(const BYTE *pb, DWORD cb)
+{
+    PNG_READER *pr;
+    HBITMAP hbm = NULL;
+    SIZE siz;
+    DWORD cbRowMax;
+    BOOL f;
+
+    pr = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PNG_READER));
+    if (pr == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    pr->pbFile = pb;
+    pr->pbFileEnd = pb + cb;
+
+    f = FALSE;
+    if (PNG_IsPng(pb, cb) && PNG_ReadHeaders(pr))
+    {
+        siz.cx = pr->cx;
+        siz.cy = pr->cy;
+        hbm = ((pr->bColorType & 4) || pr->fTransparent) ? BM_Create32(siz) :
+                                                           BM_Create(siz);
+        cbRowMax = ((DWORD)pr->cx * pr->cChannels * pr->bDepth + 7) / 8 + 1;
+        pr->pbRow = HeapAlloc(GetProcessHeap(), 0, cbRowMax);
+        pr->pbPrev = HeapAlloc(GetProcessHeap(), 0, cbRowMax);
+        if (hbm == NULL || pr->pbRow == NULL || pr->pbPrev == NULL ||
+            !BM_GetPixels(hbm, &pr->px))
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        else
+        {
+            pr->dwAdler = 1;
+            PNG_StartPass(pr);
+            f = Inflate_Run(pr);
+            if (!f)
+                SetLastError(-STRING_INVALID_BM);
+        }
+        HeapFree(GetProcessHeap(), 0, pr->pbRow);
+        HeapFree(GetProcessHeap(), 0, pr->pbPrev);
+    }
+    else
+        SetLastError(-STRING_INVALID_BM);
+
+    HeapFree(GetProcessHeap(), 0, pr);
+    if (!f && hbm != NULL)
+    {
+        DeleteObject(hbm);
+        hbm = NULL;
+    }
+    return hbm;
+}
+
+/***********************************************************************
+ * Writing
+ */
+
+#define DEFLATE_HISTORY     0x8000
+#define DEFLATE_BUFFER      (2 * DEFLATE_HISTORY)
+#define DEFLATE_LOOKAHEAD   (258 + 3 + 1)
+#define DEFLATE_HASH_BITS   15
+#define DEFLATE_SYMBOLS     0x4000      /* literals and matches in a block */
+#define PNG_IDAT_SIZE       0x10000
+
+typedef struct
+{
+    HANDLE      hFile;
+    BOOL        fError;
+    INT         nEffort;
+    INT         cMaxChain;
+
+    /* bits not yet written, and the IDAT chunk being filled */
+    DWORD       dwBits;
+    INT         cBits;
+    DWORD       cbOut;
+    BYTE        abOut[8 + PNG_IDAT_SIZE];
+
+    /* uncompressed data: up to DEFLATE_HISTORY bytes already compressed,
+     * then those waiting to be */
+    DWORD       dwAdler;
+    DWORD       cbBuffer;
+    DWORD       iPos;
+    INT         aHead[1 << DEFLATE_HASH_BITS];
+    INT         aPrev[DEFLATE_HISTORY];
+    BYTE        abBuffer[DEFLATE_BUFFER];
+
+    /* the block being gathered, from abBuffer[iBlockStart] up to iPos:
+     * symbol i is the literal awSymLen[i] if awSymDist[i] is 0, otherwise
+     * a match of that length and distance */
+    DWORD       iBlockStart;
+    INT         cSymbols;
+    WORD        awSymLen[DEFLATE_SYMBOLS];
+    WORD        awSymDist[DEFLATE_SYMBOLS];
+    BYTE        abLengthCode[256];      /* match length - 3 to code - 257 */
+
+    /* the Huffman codes of the block being written, bit-reversed, and
+     * their lengths */
+    WORD        awLitCode[288];
+    BYTE        abLitLen[288];
+    WORD        awDistCode[30];
+    BYTE        abDistLen[30];
+} PNG_WRITER;
+
+static VOID PNG_WriteChunk(PNG_WRITER *pw, const char *pszType, LPBYTE pb,
+                           DWORD cb)
+{
+    BYTE abHeader[8], abCrc[4];
+    DWORD dw, cbWritten;
+
+    if (pw->fError)
+        return;
+    abHeader[0] = (BYTE)(cb >> 24);
+    abHeader[1] = (BYTE)(cb >> 16);
+    abHeader[2] = (BYTE)(cb >> 8);
+    abHeader[3] = (BYTE)cb;
+    memcpy(abHeader + 4, pszType, 4);
+    dw = PNG_Crc(PNG_Crc(0, abHeader + 4, 4), pb, cb);
+    abCrc[0] = (BYTE)(dw >> 24);
+    abCrc[1] = (BYTE)(dw >> 16);
+    abCrc[2] = (BYTE)(dw >> 8);
+    abCrc[3] = (BYTE)dw;
+    if (!WriteFile(pw->hFile, abHeader, 8, &cbWritten, NULL) ||
+        (cb != 0 && !WriteFile(pw->hFile, pb, cb, &cbWritten, NULL)) ||
+        !WriteFile(pw->hFile, abCrc, 4, &cbWritten, NULL))
+        pw->fError = TRUE;
+}
+
+static VOID Deflate_PutByte(PNG_WRITER *pw, BYTE b)
+{
+    pw->abOut[pw->cbOut++] = b;
+    if (pw->cbOut == PNG_IDAT_SIZE)
+    {
+        PNG_WriteChunk(pw, "IDAT", pw->abOut, pw->cbOut);
+        pw->cbOut = 0;
+    }
+}
+
+/* Writes n bits of dw, least significant first */
+static VOID Deflate_PutBits(PNG_WRITER *pw, DWORD dw, INT n)
+{
+    pw->dwBits |= dw << pw->cBits;
+    pw->cBits += n;
+    while (pw->cBits >= 8)
+    {
+        Deflate_PutByte(pw, (BYTE)pw->dwBits);
+        pw->dwBits >>= 8;
+        pw->cBits -= 8;
+    }
+}
+
+static VOID Deflate_AlignToByte(PNG_WRITER *pw)
+{
+    if (pw->cBits > 0)
+        Deflate_PutBits(pw, 0, 8 - pw->cBits);
+}
+
+static VOID Deflate_PutSymbol(PNG_WRITER *pw, INT nSym)
+{
+    Deflate_PutBits(pw, pw->awLitCode[nSym], pw->abLitLen[nSym]);
+}
+
+static INT Deflate_DistCode(DWORD dwDist)
+{
+    INT i;
+
+    for (i = 29; awDistBase[i] > dwDist; i--)
+        ;
+    return i;
+}
+
+static VOID Deflate_PutMatch(PNG_WRITER *pw, DWORD dwLen, DWORD dwDist)
+{
+    INT i;
+
+    i = pw->abLengthCode[dwLen - 3];
+    Deflate_PutSymbol(pw, 257 + i);
+    Deflate_PutBits(pw, dwLen - awLengthBase[i], abLengthExtra[i]);
+
+    i = Deflate_DistCode(dwDist);
+    Deflate_PutBits(pw, pw->awDistCode[i], pw->abDistLen[i]);
+    Deflate_PutBits(pw, dwDist - awDistBase[i], abDistExtra[i]);
+}
+
+/* Assigns the canonical codes of the cSymbols lengths abLen, bit-reversed
+ * to be written least significant bit first */
+static VOID Deflate_MakeCodes(const BYTE *abLen, INT cSymbols, WORD *awCode)
+{
+    INT acCount[HUFF_BITS + 1], aNext[HUFF_BITS + 1];
+    INT i, j, nCode, nRev;
+
+    memset(acCount, 0, sizeof(acCount));
+    for (i = 0; i < cSymbols; i++)
+        acCount[abLen[i]]++;
+    acCount[0] = 0;
+    nCode = 0;
+    for (i = 1; i <= HUFF_BITS; i++)
+    {
+        nCode = (nCode + acCount[i - 1]) << 1;
+        aNext[i] = nCode;
+    }
+    for (i = 0; i < cSymbols; i++)
+    {
+        if (abLen[i] == 0)
+            continue;
+        nCode = aNext[abLen[i]]++;
+        for (nRev = 0, j = 0; j < abLen[i]; j++)
+            nRev |= ((nCode >> j) & 1) << (abLen[i] - 1 - j);
+        awCode[i] = (WORD)nRev;
+    }
+}
+
+static VOID Deflate_FixedLengths(BYTE *abLitLen, BYTE *abDistLen)
+{
+    INT i;
+
+    for (i = 0; i < 144; i++) abLitLen[i] = 8;
+    for (; i < 256; i++) abLitLen[i] = 9;
+    for (; i < 280; i++) abLitLen[i] = 7;
+    for (; i < 288; i++) abLitLen[i] = 8;
+    for (i = 0; i < 30; i++) abDistLen[i] = 5;
+}
+
+/* The code lengths of a Huffman code for the n weights of anA, which are in
+ * ascending order, replace the weights; by A. Moffat and J. Katajainen,
+ * "In-place calculation of minimum-redundancy codes" */
+static VOID Deflate_MinimumRedundancy(INT *anA, INT n)
+{
+    INT iRoot, iLeaf, iNext, cAvail, cUsed, nDepth;
+
+    anA[0] += anA[1];
+    iRoot = 0;
+    iLeaf = 2;
+    for (iNext = 1; iNext < n - 1; iNext++)
+    {
+        if (iLeaf >= n || anA[iRoot] < anA[iLeaf])
+        {
+            anA[iNext] = anA[iRoot];
+            anA[iRoot++] = iNext;
+        }
+        else
+            anA[iNext] = anA[iLeaf++];
+        if (iLeaf >= n || (iRoot < iNext && anA[iRoot] < anA[iLeaf]))
+        {
+            anA[iNext] += anA[iRoot];
+            anA[iRoot++] = iNext;
+        }
+        else
+            anA[iNext] += anA[iLeaf++];
+    }
+
+    anA[n - 2] = 0;
+    for (iNext = n - 3; iNext >= 0; iNext--)
+        anA[iNext] = anA[anA[iNext]] + 1;
+
+    cAvail = 1;
+    cUsed = nDepth = 0;
+    iRoot = n - 2;
+    iNext = n - 1;
+    while (cAvail > 0)
+    {
+        while (iRoot >= 0 && anA[iRoot] == nDepth)
+        {
+            cUsed++;
+            iRoot--;
+        }
+        while (cAvail > cUsed)
+        {
+            anA[iNext--] = nDepth;
+            cAvail--;
+        }
+        cAvail = 2 * cUsed;
+        nDepth++;
+        cUsed = 0;
+    }
+}
+
+/* Works out the code lengths abLen of a Huffman code, none longer than
+ * nMaxLen, for the cSymbols frequencies adwFreq */
+static VOID Deflate_BuildLengths(const DWORD *adwFreq, INT cSymbols,
+                                 INT nMaxLen, BYTE *abLen)
+{
+    INT aiSym[288], anA[288], acCount[288];
+    INT n, i, j, nLen, nTotal;
+
+    memset(abLen, 0, cSymbols);
+    for (n = 0, i = 0; i < cSymbols; i++)
+    {
+        if (adwFreq[i] == 0)
+            continue;
+        /* insertion sort by frequency */
+        for (j = n++; j > 0 && adwFreq[aiSym[j - 1]] > adwFreq[i]; j--)
+            aiSym[j] = aiSym[j - 1];
+        aiSym[j] = i;
+    }
+    if (n == 0)
+        return;
+    if (n == 1)
+    {
+        abLen[aiSym[0]] = 1;
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        anA[i] = adwFreq[aiSym[i]];
+    Deflate_MinimumRedundancy(anA, n);
+
+    /* push the codes that are too long up to nMaxLen, then lengthen
+     * shorter ones until the code is complete again */
+    memset(acCount, 0, sizeof(acCount));
+    for (i = 0; i < n; i++)
+        acCount[min(anA[i], nMaxLen)]++;
+    nTotal = 0;
+    for (nLen = 1; nLen <= nMaxLen; nLen++)
+        nTotal += acCount[nLen] << (nMaxLen - nLen);
+    while (nTotal > 1 << nMaxLen)
+    {
+        acCount[nMaxLen]--;
+        for (nLen = nMaxLen - 1; nLen > 0; nLen--)
+        {
+            if (acCount[nLen] != 0)
+            {
+                acCount[nLen]--;
+                acCount[nLen + 1] += 2;
+                break;
+            }
+        }
+        nTotal--;
+    }
+
+    /* the rarest symbols get the longest codes */
+    i = 0;
+    for (nLen = nMaxLen; nLen > 0; nLen--)
+    {
+        for (j = acCount[nLen]; j > 0; j--)
+            abLen[aiSym[i++]] = (BYTE)nLen;
+    }
+}
+
+/* Run-length codes the cLengths code lengths abLengths with the symbols of
+ * a dynamic block header: abRle[i] is a symbol and abRleExtra[i] the value
+ * of its extra bits.  Returns the number of symbols. */
+static INT Deflate_RleLengths(const BYTE *abLengths, INT cLengths,
+                              BYTE *abRle, BYTE *abRleExtra)
+{
+    INT i, n, cRun;
+
+    for (i = 0, n = 0; i < cLengths; i += cRun)
+    {
+        for (cRun = 1; i + cRun < cLengths && abLengths[i + cRun] == abLengths[i];
+             cRun++)
+            ;
+        if (abLengths[i] == 0 && cRun >= 3)
+        {
+            cRun = min(cRun, 138);
+            abRle[n] = (cRun >= 11) ? 18 : 17;
+            abRleExtra[n++] = (BYTE)(cRun - ((cRun >= 11) ? 11 : 3));
+        }
+        else if (abLengths[i] != 0 && cRun >= 4)
+        {
+            /* the length, then 3 to 6 repeats of it */
+            cRun = 1 + min(cRun - 1, 6);
+            abRle[n] = abLengths[i];
+            abRleExtra[n++] = 0;
+            abRle[n] = 16;
+            abRleExtra[n++] = (BYTE)(cRun - 4);
+        }
+        else
+        {
+            cRun = 1;
+            abRle[n] = abLengths[i];
+            abRleExtra[n++] = 0;
+        }
+    }
+    return n;
+}
+
+/* Writes the symbols gathered since the last block as a block of its own,
+ * stored, with the fixed codes or with codes of its own, whichever is
+ * smallest */
+static VOID Deflate_FlushBlock(PNG_WRITER *pw)
+{
+    static const BYTE abRleExtraBits[3] = {2, 3, 7};
+    DWORD adwLitFreq[286], adwDistFreq[30], adwRleFreq[19];
+    DWORD dwExtra, dwFixed, dwDynamic, dwStored, cbRaw, i;
+    BYTE abFixedLit[288], abFixedDist[30], abLengths[286 + 30];
+    BYTE abRle[286 + 30], abRleExtra[286 + 30], abRleLen[19];
+    WORD awRleCode[19];
+    INT cLit, cDist, cRle, cRleLen, nSym;
+
+    cbRaw = pw->iPos - pw->iBlockStart;
+    if (cbRaw == 0)
+        return;
+
+    memset(adwLitFreq, 0, sizeof(adwLitFreq));
+    memset(adwDistFreq, 0, sizeof(adwDistFreq));
+    dwExtra = 0;
+    for (i = 0; i < (DWORD)pw->cSymbols; i++)
+    {
+        if (pw->awSymDist[i] == 0)
+        {
+            adwLitFreq[pw->awSymLen[i]]++;
+            continue;
+        }
+        nSym = pw->abLengthCode[pw->awSymLen[i] - 3];
+        adwLitFreq[257 + nSym]++;
+        dwExtra += abLengthExtra[nSym];
+        nSym = Deflate_DistCode(pw->awSymDist[i]);
+        adwDistFreq[nSym]++;
+        dwExtra += abDistExtra[nSym];
+    }
+    adwLitFreq[256] = 1;
+
+    Deflate_FixedLengths(abFixedLit, abFixedDist);
+    Deflate_BuildLengths(adwLitFreq, 286, HUFF_BITS, pw->abLitLen);
+    Deflate_BuildLengths(adwDistFreq, 30, HUFF_BITS, pw->abDistLen);
+    /* one distance code at least, as zlib writes it, if there are none */
+    for (cDist = 30; cDist > 1 && pw->abDistLen[cDist - 1] == 0; cDist--)
+        ;
+    if (pw->abDistLen[0] == 0 && cDist == 1)
+        pw->abDistLen[0] = 1;
+    for (cLit = 286; pw->abLitLen[cLit - 1] == 0; cLit--)
+        ;
+
+    /* the header of a dynamic block */
+    memcpy(abLengths, pw->abLitLen, cLit);
+    memcpy(abLengths + cLit, pw->abDistLen, cDist);
+    cRle = Deflate_RleLengths(abLengths, cLit + cDist, abRle, abRleExtra);
+    memset(adwRleFreq, 0, sizeof(adwRleFreq));
+    for (i = 0; i < (DWORD)cRle; i++)
+        adwRleFreq[abRle[i]]++;
+    Deflate_BuildLengths(adwRleFreq, 19, 7, abRleLen);
+    for (cRleLen = 19; cRleLen > 4 && abRleLen[abCodeLengthOrder[cRleLen - 1]] == 0;
+         cRleLen--)
+        ;
+
+    /* the size of each kind of block, in bits */
+    dwFixed = 3 + dwExtra;
+    dwDynamic = 3 + 5 + 5 + 4 + 3 * cRleLen + dwExtra;
+    for (i = 0; i < 286; i++)
+    {
+        dwFixed += adwLitFreq[i] * abFixedLit[i];
+        dwDynamic += adwLitFreq[i] * pw->abLitLen[i];
+    }
+    for (i = 0; i < 30; i++)
+    {
+        dwFixed += adwDistFreq[i] * 5;
+        dwDynamic += adwDistFreq[i] * pw->abDistLen[i];
+    }
+    for (i = 0; i < 19; i++)
+        dwDynamic += adwRleFreq[i] * abRleLen[i];
+    for (i = 0; i < (DWORD)cRle; i++)
+    {
+        if (abRle[i] >= 16)
+            dwDynamic += abRleExtraBits[abRle[i] - 16];
+    }
+    dwStored = ((cbRaw + 0xFFFE) / 0xFFFF) * (3 + 7 + 32) + cbRaw * 8;
+
+    if (dwStored < dwFixed && dwStored < dwDynamic)
+    {
+        for (i = pw->iBlockStart; i < pw->iPos; )
+        {
+            cbRaw = min(pw->iPos - i, 0xFFFF);
+            Deflate_PutBits(pw, 0, 3);
+            Deflate_AlignToByte(pw);
+            Deflate_PutBits(pw, cbRaw, 16);
+            Deflate_PutBits(pw, cbRaw ^ 0xFFFF, 16);
+            while (cbRaw-- > 0)
+                Deflate_PutByte(pw, pw->abBuffer[i++]);
+        }
+    }
+    else
+    {
+        if (dwFixed <= dwDynamic)
+        {
+            Deflate_PutBits(pw, 1 << 1, 3);
+            memcpy(pw->abLitLen, abFixedLit, sizeof(abFixedLit));
+            memcpy(pw->abDistLen, abFixedDist, sizeof(abFixedDist));
+            cLit = 288;
+            cDist = 30;
+        }
+        else
+        {
+            Deflate_PutBits(pw, 2 << 1, 3);
+            Deflate_PutBits(pw, cLit - 257, 5);
+            Deflate_PutBits(pw, cDist - 1, 5);
+            Deflate_PutBits(pw, cRleLen - 4, 4);
+            for (i = 0; i < (DWORD)cRleLen; i++)
+                Deflate_PutBits(pw, abRleLen[abCodeLengthOrder[i]], 3);
+            Deflate_MakeCodes(abRleLen, 19, awRleCode);
+            for (i = 0; i < (DWORD)cRle; i++)
+            {
+                Deflate_PutBits(pw, awRleCode[abRle[i]], abRleLen[abRle[i]]);
+                if (abRle[i] >= 16)
+                    Deflate_PutBits(pw, abRleExtra[i],
+                                    abRleExtraBits[abRle[i] - 16]);
+            }
+        }
+        Deflate_MakeCodes(pw->abLitLen, cLit, pw->awLitCode);
+        Deflate_MakeCodes(pw->abDistLen, cDist, pw->awDistCode);
+
+        for (i = 0; i < (DWORD)pw->cSymbols; i++)
+        {
+            if (pw->awSymDist[i] == 0)
+                Deflate_PutSymbol(pw, pw->awSymLen[i]);
+            else
+                Deflate_PutMatch(pw, pw->awSymLen[i], pw->awSymDist[i]);
+        }
+        Deflate_PutSymbol(pw, 256);
+    }
+
+    pw->iBlockStart = pw->iPos;
+    pw->cSymbols = 0;
+}
+
+/* Adds a literal, if dwDist is 0, or a match to the block being gathered */
+static VOID Deflate_AddSymbol(PNG_WRITER *pw, DWORD dwLenOrByte, DWORD dwDist)
+{
+    if (pw->cSymbols == DEFLATE_SYMBOLS)
+        Deflate_FlushBlock(pw);
+    pw->awSymLen[pw->cSymbols] = (WORD)dwLenOrByte;
+    pw->awSymDist[pw->cSymbols++] = (WORD)dwDist;
+}
+
+static UINT Deflate_Hash(const BYTE *pb)
+{
+    return ((pb[0] << 10) ^ (pb[1] << 5) ^ pb[2]) & ((1 << DEFLATE_HASH_BITS) - 1);
+}
+
+static VOID Deflate_Insert(PNG_WRITER *pw, DWORD iPos)
+{
+    UINT h = Deflate_Hash(pw->abBuffer + iPos);
+
+    pw->aPrev[iPos & (DEFLATE_HISTORY - 1)] = pw->aHead[h];
+    pw->aHead[h] = iPos;
+}
+
+/* Compresses the buffered data, keeping DEFLATE_LOOKAHEAD bytes back
+ * unless fAll */
+static VOID Deflate_Compress(PNG_WRITER *pw, BOOL fAll)
+{
+    DWORD cbAvail, dwBestLen, dwBestDist, dwLen, dwMaxLen, i;
+    INT iMatch, cChain;
+    const BYTE *pb;
+
+    if (pw->nEffort == 0)
+    {
+        /* stored blocks, never final: the stream ends with an empty one */
+        while (pw->cbBuffer - pw->iPos >= (fAll ? 1 : DEFLATE_HISTORY))
+        {
+            dwLen = min(pw->cbBuffer - pw->iPos, 0xFFFF);
+            Deflate_PutBits(pw, 0, 3);
+            Deflate_AlignToByte(pw);
+            Deflate_PutBits(pw, dwLen, 16);
+            Deflate_PutBits(pw, dwLen ^ 0xFFFF, 16);
+            for (i = 0; i < dwLen; i++)
+                Deflate_PutByte(pw, pw->abBuffer[pw->iPos + i]);
+            pw->iPos += dwLen;
+        }
+        return;
+    }
+
+    while ((cbAvail = pw->cbBuffer - pw->iPos) > (fAll ? 0 : DEFLATE_LOOKAHEAD))
+    {
+        pb = pw->abBuffer + pw->iPos;
+        dwBestLen = 0;
+        dwBestDist = 0;
+        if (cbAvail >= 3)
+        {
+            dwMaxLen = min(cbAvail, 258);
+            iMatch = pw->aHead[Deflate_Hash(pb)];
+            for (cChain = pw->cMaxChain; iMatch >= 0 && cChain > 0; cChain--)
+            {
+                if (pw->iPos - iMatch > DEFLATE_HISTORY)
+                    break;
+                if (pw->abBuffer[iMatch + dwBestLen] == pb[dwBestLen])
+                {
+                    for (dwLen = 0; dwLen < dwMaxLen &&
+                         pw->abBuffer[iMatch + dwLen] == pb[dwLen]; dwLen++)
+                        ;
+                    if (dwLen > dwBestLen)
+                    {
+                        dwBestLen = dwLen;
+                        dwBestDist = pw->iPos - iMatch;
+                        if (dwLen == dwMaxLen)
+                            break;
+                    }
+                }
+                iMatch = pw->aPrev[iMatch & (DEFLATE_HISTORY - 1)];
+            }
+        }
+
+        if (dwBestLen >= 3)
+        {
+            Deflate_AddSymbol(pw, dwBestLen, dwBestDist);
+            for (i = 0; i < dwBestLen; i++)
+            {
+                if (pw->cbBuffer - pw->iPos >= 3)
+                    Deflate_Insert(pw, pw->iPos);
+                pw->iPos++;
+            }
+        }
+        else
+        {
+            Deflate_AddSymbol(pw, *pb, 0);
+            if (cbAvail >= 3)
+                Deflate_Insert(pw, pw->iPos);
+            pw->iPos++;
+        }
+    }
+}
+
+/* Adds cb bytes to the zlib stream */
+static VOID Deflate_Write(PNG_WRITER *pw, const BYTE *pb, DWORD cb)
+{
+    DWORD n;
+    INT i;
+
+    pw->dwAdler = PNG_Adler(pw->dwAdler, pb, cb);
+    while (cb > 0 && !pw->fError)
+    {
+        if (pw->cbBuffer == DEFLATE_BUFFER)
+        {
+            /* drop the oldest half; what is left to compress is shorter
+             * than DEFLATE_HISTORY, and positions keep their aPrev slots */
+            Deflate_Compress(pw, FALSE);
+            if (pw->nEffort != 0)
+            {
+                /* a stored block would need the bytes about to go */
+                if (pw->iBlockStart < DEFLATE_HISTORY)
+                    Deflate_FlushBlock(pw);
+                pw->iBlockStart -= DEFLATE_HISTORY;
+            }
+            memmove(pw->abBuffer, pw->abBuffer + DEFLATE_HISTORY,
+                    pw->cbBuffer - DEFLATE_HISTORY);
+            pw->cbBuffer -= DEFLATE_HISTORY;
+            pw->iPos -= DEFLATE_HISTORY;
+            for (i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+                pw->aHead[i] = max(pw->aHead[i] - DEFLATE_HISTORY, -1);
+            for (i = 0; i < DEFLATE_HISTORY; i++)
+                pw->aPrev[i] = max(pw->aPrev[i] - DEFLATE_HISTORY, -1);
+        }
+        n = min(cb, DEFLATE_BUFFER - pw->cbBuffer);
+        memcpy(pw->abBuffer + pw->cbBuffer, pb, n);
+        pw->cbBuffer += n;
+        pb += n;
+        cb -= n;
+    }
+}
+
+static VOID Deflate_Start(PNG_WRITER *pw)
+{
+    static const INT acChain[10] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    INT i;
+
+    pw->cMaxChain = acChain[pw->nEffort];
+    pw->dwAdler = 1;
+    for (i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+        pw->aHead[i] = -1;
+    for (i = 0; i < DEFLATE_HISTORY; i++)
+        pw->aPrev[i] = -1;
+    for (i = 0; i < 29; i++)
+        memset(pw->abLengthCode + awLengthBase[i] - 3, i,
+               (i < 28 ? awLengthBase[i + 1] : 259) - awLengthBase[i]);
+
+    /* zlib header, with the level hint */
+    Deflate_PutByte(pw, 0x78);
+    Deflate_PutByte(pw, pw->nEffort == 0 ? 0x01 : pw->nEffort < 6 ? 0x5E :
+                        pw->nEffort < 8 ? 0x9C : 0xDA);
+}
+
+static VOID Deflate_Finish(PNG_WRITER *pw)
+{
+    Deflate_Compress(pw, TRUE);
+    if (pw->nEffort != 0)
+        Deflate_FlushBlock(pw);
+
+    /* an empty final block with the fixed codes, in which the end of
+     * block code is seven 0 bits */
+    Deflate_PutBits(pw, 1 | (1 << 1), 3);
+    Deflate_PutBits(pw, 0, 7);
+    Deflate_AlignToByte(pw);
+
+    Deflate_PutByte(pw, (BYTE)(pw->dwAdler >> 24));
+    Deflate_PutByte(pw, (BYTE)(pw->dwAdler >> 16));
+    Deflate_PutByte(pw, (BYTE)(pw->dwAdler >> 8));
+    Deflate_PutByte(pw, (BYTE)pw->dwAdler);
+    if (pw->cbOut != 0)
+        PNG_WriteChunk(pw, "IDAT", pw->abOut, pw->cbOut);
+    pw->cbOut = 0;
+}
+
+/* Sum of the filtered bytes taken as signed, the usual estimate of how
+ * well a row will compress */
+/* The sum of the filtered bytes of pb taken as signed, which the filter
+ * with the smallest one is chosen by */
+static DWORD PNG_Cost(const BYTE *pb, DWORD cb)
+{
+    DWORD i = 0, dwSum = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128i vZero = _mm_setzero_si128();
+        __m128i v, vSum = vZero;
+
+        /* min(x, 256 - x) is the size of x as a signed byte */
+        for (; i + 16 <= cb; i += 16)
+        {
+            v = _mm_loadu_si128((const __m128i *)(pb + i));
+            v = _mm_min_epu8(v, _mm_sub_epi8(vZero, v));
+            vSum = _mm_add_epi64(vSum, _mm_sad_epu8(v, vZero));
+        }
+        dwSum = _mm_cvtsi128_si32(vSum) +
+                _mm_cvtsi128_si32(_mm_unpackhi_epi64(vSum, vSum));
+    }
+#endif
+    for (; i < cb; i++)
+        dwSum += (pb[i] < 128) ? pb[i] : 256 - pb[i];
+    return dwSum;
+}
+
+/* Filters pbRow, with pbPrev above it and n bytes to a pixel, into the five
+ * rows of apbOut, each preceded by its filter byte, and returns the one to
+ * use */
+static const BYTE *PNG_Filter(const BYTE *pbRow, const BYTE *pbPrev, DWORD cb,
+                              INT n, LPBYTE *apbOut, INT nEffort)
+{
+    LPBYTE pbNone = apbOut[0] + 1, pbSub = apbOut[1] + 1, pbUp = apbOut[2] + 1;
+    LPBYTE pbAvg = apbOut[3] + 1, pbPaeth = apbOut[4] + 1;
+    DWORD i, iFirst, dwCost, dwBest;
+    INT iBest, iFilter;
+
+    for (i = 0; i < 5; i++)
+        apbOut[i][0] = (BYTE)i;
+    memcpy(pbNone, pbRow, cb);
+    if (nEffort == 0)
+        return apbOut[0];
+
+    for (i = 0; i < (DWORD)n && i < cb; i++)
+    {
+        pbSub[i] = pbRow[i];
+        pbAvg[i] = pbRow[i] - (pbPrev[i] >> 1);
+        pbPaeth[i] = pbRow[i] - pbPrev[i];
+    }
+    iFirst = i;
+#ifdef __SSE2__
+    {
+        const __m128i vOne = _mm_set1_epi8(1);
+        __m128i vRow, vLeft, vUp, vAvg;
+
+        for (; i + 16 <= cb; i += 16)
+        {
+            vRow = _mm_loadu_si128((const __m128i *)(pbRow + i));
+            vLeft = _mm_loadu_si128((const __m128i *)(pbRow + i - n));
+            vUp = _mm_loadu_si128((const __m128i *)(pbPrev + i));
+            _mm_storeu_si128((__m128i *)(pbSub + i), _mm_sub_epi8(vRow, vLeft));
+            /* pavgb rounds up; the floor is one less when the sum is odd */
+            vAvg = _mm_sub_epi8(_mm_avg_epu8(vLeft, vUp),
+                                _mm_and_si128(_mm_xor_si128(vLeft, vUp), vOne));
+            _mm_storeu_si128((__m128i *)(pbAvg + i), _mm_sub_epi8(vRow, vAvg));
+        }
+    }
+#endif
+    for (; i < cb; i++)
+    {
+        pbSub[i] = pbRow[i] - pbRow[i - n];
+        pbAvg[i] = pbRow[i] - ((pbRow[i - n] + pbPrev[i]) >> 1);
+    }
+    for (i = iFirst; i < cb; i++)
+        pbPaeth[i] = pbRow[i] - PNG_Paeth(pbRow[i - n], pbPrev[i], pbPrev[i - n]);
+
+    i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= cb; i += 16)
+        _mm_storeu_si128((__m128i *)(pbUp + i),
+            _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(pbRow + i)),
+                         _mm_loadu_si128((const __m128i *)(pbPrev + i))));
+#endif
+    for (; i < cb; i++)
+        pbUp[i] = pbRow[i] - pbPrev[i];
+
+    iBest = 0;
+    dwBest = PNG_Cost(pbNone, cb);
+    for (iFilter = 1; iFilter < 5; iFilter++)
+    {
+        dwCost = PNG_Cost(apbOut[iFilter] + 1, cb);
+        if (dwCost < dwBest)
+        {
+            dwBest = dwCost;
+            iBest = iFilter;
+        }
+    }
+    return apbOut[iBest];
+}
+
+/* Writes the 24 or 32 bpp image ppx to hFile as an 8 bit RGB PNG.  The
+ * alpha of a 32 bpp image is left out: the canvas shows every image
+ * opaque, and the GDI tools clear alpha where they draw, so the file gets
+ * what is on the screen.  nEffort goes from 0, no compression, to 9, the
+ * smallest files. */
+BOOL PNG_Write(HANDLE hFile, const BM_PIXELS *ppx, INT nEffort,
+               BM_PROGRESSPROC pfnProgress, LPARAM lParam)
+{
+    PNG_WRITER *pw;
+    BYTE abHeader[13];
+    LPBYTE pbMem, pbRow, pbPrev, pbSwap, apbOut[5];
+    const BYTE *pbIn, *pbFiltered;
+    DWORD cbRow, cbWritten, i;
+    INT cbPixel = ppx->wBitCount / 8, nPercent = -1;
+    LONG x, y;
+    BOOL f;
+
+    if ((ppx->wBitCount != 24 && ppx->wBitCount != 32) || nEffort < 0 ||
+        nEffort > 9)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    cbRow = ppx->cx * 3;
+    pw = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PNG_WRITER));
+    pbMem = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, 7 * (cbRow + 1));
+    if (pw == NULL || pbMem == NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, pw);
+        HeapFree(GetProcessHeap(), 0, pbMem);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    pbRow = pbMem;
+    pbPrev = pbMem + cbRow + 1;
+    for (i = 0; i < 5; i++)
+        apbOut[i] = pbMem + (2 + i) * (cbRow + 1);
+    pw->hFile = hFile;
+    pw->nEffort = nEffort;
+
+    abHeader[0] = (BYTE)(ppx->cx >> 24);
+    abHeader[1] = (BYTE)(ppx->cx >> 16);
+    abHeader[2] = (BYTE)(ppx->cx >> 8);
+    abHeader[3] = (BYTE)ppx->cx;
+    abHeader[4] = (BYTE)(ppx->cy >> 24);
+    abHeader[5] = (BYTE)(ppx->cy >> 16);
+    abHeader[6] = (BYTE)(ppx->cy >> 8);
+    abHeader[7] = (BYTE)ppx->cy;
+    abHeader[8] = 8;        /* bit depth */
+    abHeader[9] = 2;        /* RGB */
+    abHeader[10] = abHeader[11] = abHeader[12] = 0;
+    if (!WriteFile(hFile, abSignature, sizeof(abSignature), &cbWritten, NULL))
+        pw->fError = TRUE;
+    PNG_WriteChunk(pw, "IHDR", abHeader, sizeof(abHeader));
+
+    Deflate_Start(pw);
+    for (y = 0; y < ppx->cy && !pw->fError; y++)
+    {
+        pbIn = BM_ScanLine(ppx, y);
+        for (x = 0; x < ppx->cx; x++, pbIn += cbPixel)
+        {
+            pbRow[x * 3] = pbIn[2];
+            pbRow[x * 3 + 1] = pbIn[1];
+            pbRow[x * 3 + 2] = pbIn[0];
+        }
+        pbFiltered = PNG_Filter(pbRow, pbPrev, cbRow, 3, apbOut, nEffort);
+        Deflate_Write(pw, pbFiltered, cbRow + 1);
+
+        pbSwap = pbPrev;
+        pbPrev = pbRow;
+        pbRow = pbSwap;
+
+        if (pfnProgress != NULL && y * 100 / ppx->cy != nPercent)
+        {
+            nPercent = y * 100 / ppx->cy;
+            pfnProgress(nPercent, lParam);
+        }
+    }
+    Deflate_Finish(pw);
+    PNG_WriteChunk(pw, "IEND", NULL, 0);
+    if (!pw->fError && pfnProgress != NULL)
+        pfnProgress(100, lParam);
+
+    f = !pw->fError;
+    HeapFree(GetProcessHeap(), 0, pbMem);
+    HeapFree(GetProcessHeap(), 0, pw);
+    return f;
+}
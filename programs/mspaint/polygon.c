@@ -0,0 +1,237 @@
+/*
+ *  Paint (polygon.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Polygon tool.
+ *
+ * The vertices clicked so far live in Globals.pPolyline, which grows by
+ * doubling so that adding one is cheap however many there are.  When the
+ * polygon is closed its inside is filled by a scanline rasterizer working
+ * on the bits of the image: the edges are sorted by the row they start
+ * on, and each row samples the active ones at the pixel centers, fills
+ * between the crossings by the ALTERNATE or WINDING rule and steps them on
+ * to the next row.
+ */
+
+#include <windows.h>
+#include <stdlib.h>
+
+#include "main.h"
+
+/* Appends pt to Globals.pPolyline */
+BOOL Polyline_Append(POINT pt)
+{
+    POINT *ppt;
+    INT cMax;
+
+    if (Globals.cPolyline == Globals.cPolylineMax)
+    {
+        cMax = max(Globals.cPolylineMax * 2, 16);
+        if (Globals.pPolyline == NULL)
+            ppt = HeapAlloc(GetProcessHeap(), 0, cMax * sizeof(POINT));
+        else
+            ppt = HeapReAlloc(GetProcessHeap(), 0, Globals.pPolyline,
+                              cMax * sizeof(POINT));
+        if (ppt == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+        Globals.pPolyline = ppt;
+        Globals.cPolylineMax = cMax;
+    }
+    Globals.pPolyline[Globals.cPolyline++] = pt;
+    return TRUE;
+}
+
+/* Forgets the polygon being drawn */
+VOID Polyline_Free(VOID)
+{
+    HeapFree(GetProcessHeap(), 0, Globals.pPolyline);
+    Globals.pPolyline = NULL;
+    Globals.cPolyline = Globals.cPolylineMax = 0;
+}
+
+typedef struct
+{
+    INT         yTop;       /* first row sampled */
+    INT         yBottom;    /* row after the last */
+    INT         nWinding;   /* 1 going down, -1 going up */
+    LONGLONG    x;          /* 16.16 crossing of the current row */
+    LONGLONG    dx;         /* change of x from one row to the next */
+} POLYGON_EDGE;
+
+static int Polygon_CompareEdges(const void *p1, const void *p2)
+{
+    const POLYGON_EDGE *pe1 = p1, *pe2 = p2;
+
+    if (pe1->yTop != pe2->yTop)
+        return (pe1->yTop < pe2->yTop) ? -1 : 1;
+    return (pe1->x < pe2->x) ? -1 : (pe1->x > pe2->x);
+}
+
+/* Fills pixels xLeft to xRight - 1 of row pb with ab */
+static VOID Polygon_FillSpan(LPBYTE pb, INT cbPixel, INT xLeft, INT xRight,
+                             const BYTE *ab)
+{
+    pb += xLeft * cbPixel;
+    for (; xLeft < xRight; xLeft++, pb += cbPixel)
+    {
+        pb[0] = ab[0];
+        pb[1] = ab[1];
+        pb[2] = ab[2];
+    }
+}
+
+/* Fills the inside of the polygon apt[0] to apt[cpt - 1] of the 24 or
+ * 32 bpp image ppx with rgb, by iFillMode ALTERNATE or WINDING.  As with
+ * GDI, a pixel is inside if its center is, so the polygon is drawn
+ * without its right and bottom edges.  *prcChanged, if not NULL, gets
+ * the box of what was filled.  Returns FALSE with the last error set if
+ * the parameters are bad or memory runs out. */
+BOOL BM_FillPolygon(BM_PIXELS *ppx, const POINT *apt, INT cpt, INT iFillMode,
+                    COLORREF rgb, RECT *prcChanged)
+{
+    POLYGON_EDGE *aEdges, **apActive, *pe;
+    INT cEdges, cActive, iNext, i, j, y, nWinding, xLeft, xRight;
+    INT cbPixel = ppx->wBitCount / 8;
+    LONGLONG xLimit = (LONGLONG)ppx->cx << 16;
+    POINT pt0, pt1;
+    BYTE ab[3];
+
+    if (prcChanged != NULL)
+        SetRectEmpty(prcChanged);
+    if ((ppx->wBitCount != 24 && ppx->wBitCount != 32) || cpt < 0 ||
+        (cpt > 0 && apt == NULL) ||
+        (iFillMode != ALTERNATE && iFillMode != WINDING))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (cpt < 3)
+        return TRUE;
+
+    aEdges = HeapAlloc(GetProcessHeap(), 0, cpt * sizeof(POLYGON_EDGE));
+    apActive = HeapAlloc(GetProcessHeap(), 0, cpt * sizeof(POLYGON_EDGE *));
+    if (aEdges == NULL || apActive == NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, aEdges);
+        HeapFree(GetProcessHeap(), 0, apActive);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    /* row y is sampled at y + 0.5, so an edge from y0 down to y1 crosses
+     * rows y0 to y1 - 1; horizontal edges cross none */
+    cEdges = 0;
+    for (i = 0; i < cpt; i++)
+    {
+        pt0 = apt[i];
+        pt1 = apt[(i + 1) % cpt];
+        if (pt0.y == pt1.y)
+            continue;
+
+        pe = &aEdges[cEdges++];
+        pe->nWinding = 1;
+        if (pt0.y > pt1.y)
+        {
+            pt0 = pt1;
+            pt1 = apt[i];
+            pe->nWinding = -1;
+        }
+        pe->yTop = pt0.y;
+        pe->yBottom = pt1.y;
+        pe->dx = (LONGLONG)(pt1.x - pt0.x) * 0x10000 / (pt1.y - pt0.y);
+        pe->x = (LONGLONG)pt0.x * 0x10000 + pe->dx / 2;
+    }
+    qsort(aEdges, cEdges, sizeof(POLYGON_EDGE), Polygon_CompareEdges);
+
+    ab[0] = GetBValue(rgb);
+    ab[1] = GetGValue(rgb);
+    ab[2] = GetRValue(rgb);
+
+    cActive = iNext = 0;
+    y = (cEdges > 0) ? max(aEdges[0].yTop, 0) : ppx->cy;
+    for (; y < ppx->cy && (cActive > 0 || iNext < cEdges); y++)
+    {
+        /* drop the edges that ended, bring in the ones starting here */
+        for (i = j = 0; i < cActive; i++)
+        {
+            if (apActive[i]->yBottom > y)
+                apActive[j++] = apActive[i];
+        }
+        cActive = j;
+        for (; iNext < cEdges && aEdges[iNext].yTop <= y; iNext++)
+        {
+            pe = &aEdges[iNext];
+            if (pe->yBottom <= y)
+                continue;
+            /* edges starting above the image catch up in one step */
+            pe->x += pe->dx * (y - pe->yTop);
+            apActive[cActive++] = pe;
+        }
+
+        /* the crossings change order only where edges cross, so an
+         * insertion sort has little to do */
+        for (i = 1; i < cActive; i++)
+        {
+            pe = apActive[i];
+            for (j = i; j > 0 && apActive[j - 1]->x > pe->x; j--)
+                apActive[j] = apActive[j - 1];
+            apActive[j] = pe;
+        }
+
+        /* fill the pixels whose centers lie between crossings that are
+         * inside by the rule */
+        nWinding = 0;
+        for (i = 0; i < cActive; i++)
+        {
+            if (iFillMode == ALTERNATE)
+                nWinding ^= 1;
+            else
+                nWinding += apActive[i]->nWinding;
+            if (nWinding == 0 || i + 1 == cActive)
+                continue;
+
+            xLeft = (INT)((min(max(apActive[i]->x, 0), xLimit) + 0x7FFF) >> 16);
+            xRight = (INT)((min(max(apActive[i + 1]->x, 0), xLimit) + 0x7FFF) >> 16);
+            if (xLeft >= xRight)
+                continue;
+
+            Polygon_FillSpan(BM_ScanLine(ppx, y), cbPixel, xLeft, xRight, ab);
+            if (prcChanged != NULL)
+            {
+                if (IsRectEmpty(prcChanged))
+                    SetRect(prcChanged, xLeft, y, xRight, y + 1);
+                prcChanged->left = min(prcChanged->left, xLeft);
+                prcChanged->right = max(prcChanged->right, xRight);
+                prcChanged->bottom = y + 1;
+            }
+        }
+
+        for (i = 0; i < cActive; i++)
+            apActive[i]->x += apActive[i]->dx;
+    }
+
+    HeapFree(GetProcessHeap(), 0, aEdges);
+    HeapFree(GetProcessHeap(), 0, apActive);
+    return TRUE;
+}
@@ -0,0 +1,578 @@
+/*
+ *  Paint (resample.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Resampling for Stretch and Skew.
+ *
+ * Stretching is separable.  Each row of the result is first a weighted sum
+ * of a few whole source rows, which is then filtered across into the
+ * destination.  The weights of both directions are worked out once, in
+ * fixed point, before any pixel is touched.  Skewing maps each pixel of the
+ * result back into the source and interpolates between the four pixels
+ * around it.
+ *
+ * Either way the rows of the result are independent, so they are split
+ * into bands that run on threads of their own, one per processor.  With
+ * SSE2 both passes of a stretch work on whole pixels, or 16 bytes of a
+ * row, at a time.
+ *
+ * Between two 32 bpp images alpha is resampled along with the colors.
+ */
+
+#include <math.h>
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "main.h"
+
+#define RESAMPLE_WEIGHT_BITS    12      /* the weights sum to 1 << 12 */
+#define RESAMPLE_EXTRA_BITS     6       /* precision kept between passes */
+#define RESAMPLE_DOWN_SHIFT     (RESAMPLE_WEIGHT_BITS - RESAMPLE_EXTRA_BITS)
+#define RESAMPLE_ACROSS_SHIFT   (RESAMPLE_WEIGHT_BITS + RESAMPLE_EXTRA_BITS)
+#define RESAMPLE_MAX_THREADS    16
+#define RESAMPLE_MIN_BAND       32      /* rows not worth a thread of their own */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* The weights for one direction: destination pixel i is the sum over
+ * t < acTaps[i] of pnWeights[i * cMaxTaps + t] times source pixel
+ * aiFirst[i] + t */
+typedef struct
+{
+    INT    *aiFirst;
+    INT    *acTaps;
+    INT    *pnWeights;
+    INT     cMaxTaps;
+} RESAMPLE_AXIS;
+
+typedef struct RESAMPLE_JOB RESAMPLE_JOB;
+
+struct RESAMPLE_JOB
+{
+    /* makes row y of the result, with a buffer of cbRowBuffer bytes */
+    VOID  (*pfnRow)(const RESAMPLE_JOB *pJob, INT y, LPVOID pvRow);
+    SIZE_T          cbRowBuffer;
+    const BM_PIXELS *ppxSrc;
+    BM_PIXELS      *ppxDst;
+    INT             cChannels;  /* 4 if alpha is resampled too, else 3 */
+
+    /* stretching */
+    RESAMPLE_AXIS   axX;
+    RESAMPLE_AXIS   axY;
+
+    /* skewing: the source point at the middle of pixel (0, y) of the
+     * result, in 1/65536 of a pixel, is (xOrg + y * dxRow, yOrg + y * dyRow),
+     * and it moves by (dxCol, dyCol) from one column to the next */
+    double          xOrg, yOrg, dxRow, dyRow, dxCol, dyCol;
+    BYTE            abBack[4];
+};
+
+typedef struct
+{
+    const RESAMPLE_JOB *pJob;
+    INT     y0;
+    INT     y1;
+} RESAMPLE_BAND;
+
+static double Resample_Kernel(INT iFilter, double x)
+{
+    x = fabs(x);
+    switch (iFilter)
+    {
+    case RESAMPLE_BOX:
+        return (x < 0.5) ? 1.0 : 0.0;
+
+    case RESAMPLE_BILINEAR:
+        return (x < 1.0) ? 1.0 - x : 0.0;
+
+    case RESAMPLE_BICUBIC:
+        /* Catmull-Rom */
+        if (x < 1.0)
+            return (1.5 * x - 2.5) * x * x + 1.0;
+        if (x < 2.0)
+            return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+        return 0.0;
+
+    default:
+        if (x < 1e-8)
+            return 1.0;
+        if (x < 3.0)
+            return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+        return 0.0;
+    }
+}
+
+static double Resample_Support(INT iFilter)
+{
+    static const double adSupport[] = {0.5, 1.0, 2.0, 3.0};
+
+    return adSupport[iFilter];
+}
+
+static VOID Resample_FreeAxis(RESAMPLE_AXIS *pax)
+{
+    HeapFree(GetProcessHeap(), 0, pax->aiFirst);
+    pax->aiFirst = NULL;
+}
+
+/* Works out the weights for stretching cSrc pixels into cDst */
+static BOOL Resample_InitAxis(RESAMPLE_AXIS *pax, INT cSrc, INT cDst,
+                              INT iFilter)
+{
+    double dScale, dWidth, dSupport, dCenter, dSum, *adWeights;
+    INT i, j, iFirst, iLast, nSum, iMax, *pn;
+
+    dScale = (double)cSrc / cDst;
+    /* shrinking widens the filter so that every source pixel counts */
+    dWidth = max(dScale, 1.0);
+    dSupport = Resample_Support(iFilter) * dWidth;
+    pax->cMaxTaps = min((INT)ceil(dSupport * 2) + 2, cSrc);
+
+    pax->aiFirst = HeapAlloc(GetProcessHeap(), 0,
+                             cDst * (2 + pax->cMaxTaps) * sizeof(INT));
+    adWeights = HeapAlloc(GetProcessHeap(), 0, pax->cMaxTaps * sizeof(double));
+    if (pax->aiFirst == NULL || adWeights == NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, pax->aiFirst);
+        HeapFree(GetProcessHeap(), 0, adWeights);
+        pax->aiFirst = NULL;
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+    pax->acTaps = pax->aiFirst + cDst;
+    pax->pnWeights = pax->acTaps + cDst;
+
+    for (i = 0; i < cDst; i++)
+    {
+        dCenter = (i + 0.5) * dScale;
+        iFirst = max((INT)floor(dCenter - dSupport), 0);
+        iLast = min((INT)ceil(dCenter + dSupport), cSrc - 1);
+        iLast = min(iLast, iFirst + pax->cMaxTaps - 1);
+
+        dSum = 0;
+        for (j = iFirst; j <= iLast; j++)
+        {
+            adWeights[j - iFirst] =
+                Resample_Kernel(iFilter, (j + 0.5 - dCenter) / dWidth);
+            dSum += adWeights[j - iFirst];
+        }
+        if (dSum == 0)
+        {
+            /* nothing in reach, which the box filter can do at the edges */
+            iFirst = iLast = min((INT)dCenter, cSrc - 1);
+            adWeights[0] = dSum = 1;
+        }
+
+        /* round to fixed point, making the sum exact */
+        pn = pax->pnWeights + i * pax->cMaxTaps;
+        nSum = 0;
+        iMax = 0;
+        for (j = 0; j <= iLast - iFirst; j++)
+        {
+            pn[j] = (INT)floor(adWeights[j] / dSum * (1 << RESAMPLE_WEIGHT_BITS) + 0.5);
+            nSum += pn[j];
+            if (pn[j] > pn[iMax])
+                iMax = j;
+        }
+        pn[iMax] += (1 << RESAMPLE_WEIGHT_BITS) - nSum;
+
+        /* the weights at the ends may have rounded to nothing */
+        while (iLast > iFirst && pn[iLast - iFirst] == 0)
+            iLast--;
+        while (iFirst < iLast && pn[0] == 0)
+        {
+            for (j = 0; j < iLast - iFirst; j++)
+                pn[j] = pn[j + 1];
+            iFirst++;
+        }
+
+        pax->aiFirst[i] = iFirst;
+        pax->acTaps[i] = iLast - iFirst + 1;
+    }
+
+    HeapFree(GetProcessHeap(), 0, adWeights);
+    return TRUE;
+}
+
+#ifdef __SSE2__
+/* pn[i] = pb[i] * nWeight, or pn[i] += pb[i] * nWeight if not fFirst, for
+ * 16 bytes.  Each byte widened to a DWORD, whose high WORD is then 0, times
+ * the weight in the low WORD is the whole product. */
+static VOID Resample_AddBytes16(INT *pn, const BYTE *pb, INT nWeight,
+                                BOOL fFirst)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vWeight = _mm_set1_epi32(nWeight & 0xFFFF);
+    __m128i v = _mm_loadu_si128((const __m128i *)pb), avWords[2], vProduct;
+    INT i;
+
+    avWords[0] = _mm_unpacklo_epi8(v, vZero);
+    avWords[1] = _mm_unpackhi_epi8(v, vZero);
+    for (i = 0; i < 4; i++)
+    {
+        v = (i & 1) ? _mm_unpackhi_epi16(avWords[i / 2], vZero) :
+                      _mm_unpacklo_epi16(avWords[i / 2], vZero);
+        vProduct = _mm_madd_epi16(v, vWeight);
+        if (!fFirst)
+            vProduct = _mm_add_epi32(vProduct,
+                                     _mm_loadu_si128((__m128i *)pn + i));
+        _mm_storeu_si128((__m128i *)pn + i, vProduct);
+    }
+}
+
+/* Rounds 8 sums of the pass down to RESAMPLE_EXTRA_BITS and saturates them
+ * to a WORD */
+static VOID Resample_Narrow8(INT *pn)
+{
+    const __m128i vRound = _mm_set1_epi32(1 << (RESAMPLE_DOWN_SHIFT - 1));
+    __m128i v0 = _mm_loadu_si128((__m128i *)pn);
+    __m128i v1 = _mm_loadu_si128((__m128i *)pn + 1);
+
+    v0 = _mm_srai_epi32(_mm_add_epi32(v0, vRound), RESAMPLE_DOWN_SHIFT);
+    v1 = _mm_srai_epi32(_mm_add_epi32(v1, vRound), RESAMPLE_DOWN_SHIFT);
+    v0 = _mm_packs_epi32(v0, v1);
+    v1 = _mm_srai_epi32(_mm_unpackhi_epi16(v0, v0), 16);
+    v0 = _mm_srai_epi32(_mm_unpacklo_epi16(v0, v0), 16);
+    _mm_storeu_si128((__m128i *)pn, v0);
+    _mm_storeu_si128((__m128i *)pn + 1, v1);
+}
+#endif
+
+/* Row y of a stretch.  pvRow holds a row of the source, one INT per byte,
+ * and one INT more for the SSE2 pass across to read past the end.  The
+ * INTs are kept within a WORD, which they only leave for weights far from
+ * any of the filters here, so that SSE2 can multiply them 16 bits wide. */
+static VOID Resample_StretchRow(const RESAMPLE_JOB *pJob, INT y, LPVOID pvRow)
+{
+    const BM_PIXELS *ppxSrc = pJob->ppxSrc;
+    const RESAMPLE_AXIS *pax;
+    const BYTE *pbSrc;
+    const INT *pnWeights, *pnSrc;
+    INT *pnRow = pvRow;
+    INT cbRow, cbSrcPixel, cbDstPixel, nWeight, anSum[4], i, t, c;
+    LPBYTE pbDst;
+
+    cbSrcPixel = ppxSrc->wBitCount / 8;
+    cbDstPixel = pJob->ppxDst->wBitCount / 8;
+    cbRow = ppxSrc->cx * cbSrcPixel;
+
+    /* down: a weighted sum of whole source rows */
+    pax = &pJob->axY;
+    pnWeights = pax->pnWeights + y * pax->cMaxTaps;
+    for (t = 0; t < pax->acTaps[y]; t++)
+    {
+        pbSrc = BM_ScanLine(ppxSrc, pax->aiFirst[y] + t);
+        nWeight = pnWeights[t];
+        i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= cbRow; i += 16)
+            Resample_AddBytes16(pnRow + i, pbSrc + i, nWeight, t == 0);
+#endif
+        if (t == 0)
+        {
+            for (; i < cbRow; i++)
+                pnRow[i] = pbSrc[i] * nWeight;
+        }
+        else
+        {
+            for (; i < cbRow; i++)
+                pnRow[i] += pbSrc[i] * nWeight;
+        }
+    }
+    i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= cbRow; i += 8)
+        Resample_Narrow8(pnRow + i);
+#endif
+    for (; i < cbRow; i++)
+    {
+        t = (pnRow[i] + (1 << (RESAMPLE_DOWN_SHIFT - 1))) >>
+            RESAMPLE_DOWN_SHIFT;
+        pnRow[i] = min(max(t, -32768), 32767);
+    }
+    pnRow[cbRow] = 0;
+
+    /* across, into the destination */
+    pax = &pJob->axX;
+    pbDst = BM_ScanLine(pJob->ppxDst, y);
+    for (i = 0; i < pJob->ppxDst->cx; i++, pbDst += cbDstPixel)
+    {
+        pnWeights = pax->pnWeights + i * pax->cMaxTaps;
+        pnSrc = pnRow + pax->aiFirst[i] * cbSrcPixel;
+#ifdef __SSE2__
+        {
+            /* four channels at once; of a 24 bpp pixel the fourth is the
+             * next pixel, or the INT past the end, and is thrown away */
+            __m128i vSum = _mm_set1_epi32(1 << (RESAMPLE_ACROSS_SHIFT - 1));
+            DWORD dw;
+
+            for (t = 0; t < pax->acTaps[i]; t++, pnSrc += cbSrcPixel)
+            {
+                vSum = _mm_add_epi32(vSum,
+                    _mm_madd_epi16(_mm_loadu_si128((const __m128i *)pnSrc),
+                                   _mm_set1_epi32(pnWeights[t] & 0xFFFF)));
+            }
+            vSum = _mm_srai_epi32(vSum, RESAMPLE_ACROSS_SHIFT);
+            vSum = _mm_packs_epi32(vSum, vSum);
+            dw = _mm_cvtsi128_si32(_mm_packus_epi16(vSum, vSum));
+            for (c = 0; c < pJob->cChannels; c++)
+                pbDst[c] = (BYTE)(dw >> (c * 8));
+            continue;
+        }
+#endif
+        for (c = 0; c < pJob->cChannels; c++)
+            anSum[c] = 1 << (RESAMPLE_ACROSS_SHIFT - 1);
+        for (t = 0; t < pax->acTaps[i]; t++, pnSrc += cbSrcPixel)
+        {
+            for (c = 0; c < pJob->cChannels; c++)
+                anSum[c] += pnSrc[c] * pnWeights[t];
+        }
+        for (c = 0; c < pJob->cChannels; c++)
+        {
+            anSum[c] >>= RESAMPLE_ACROSS_SHIFT;
+            pbDst[c] = (BYTE)min(max(anSum[c], 0), 255);
+        }
+    }
+}
+
+/* Row y of a skew, sampled bilinearly, with the background outside */
+static VOID Resample_SkewRow(const RESAMPLE_JOB *pJob, INT y, LPVOID pvRow)
+{
+    const BM_PIXELS *ppxSrc = pJob->ppxSrc;
+    const BYTE *apb[4];
+    INT cbSrcPixel = ppxSrc->wBitCount / 8, cbDstPixel = pJob->ppxDst->wBitCount / 8;
+    LONGLONG xs, ys, dxs, dys;
+    LONG x0, y0, fx, fy, x;
+    INT c, n;
+    LPBYTE pbDst;
+
+    /* 16.16 fixed point, with the pixel centers at the integers */
+    xs = (LONGLONG)floor(pJob->xOrg + y * pJob->dxRow - 32768.0 + 0.5);
+    ys = (LONGLONG)floor(pJob->yOrg + y * pJob->dyRow - 32768.0 + 0.5);
+    dxs = (LONGLONG)floor(pJob->dxCol + 0.5);
+    dys = (LONGLONG)floor(pJob->dyCol + 0.5);
+
+    pbDst = BM_ScanLine(pJob->ppxDst, y);
+    for (x = 0; x < pJob->ppxDst->cx; x++, xs += dxs, ys += dys,
+         pbDst += cbDstPixel)
+    {
+        /* pulled in from far outside the source, but never into it */
+        x0 = (LONG)max(min(xs >> 16, ppxSrc->cx), -2);
+        y0 = (LONG)max(min(ys >> 16, ppxSrc->cy), -2);
+        fx = (LONG)(xs & 0xFFFF) >> 8;
+        fy = (LONG)(ys & 0xFFFF) >> 8;
+
+        apb[0] = (x0 >= 0 && y0 >= 0 && x0 < ppxSrc->cx && y0 < ppxSrc->cy) ?
+                 BM_ScanLine(ppxSrc, y0) + x0 * cbSrcPixel : pJob->abBack;
+        apb[1] = (x0 + 1 >= 0 && y0 >= 0 && x0 + 1 < ppxSrc->cx && y0 < ppxSrc->cy) ?
+                 BM_ScanLine(ppxSrc, y0) + (x0 + 1) * cbSrcPixel : pJob->abBack;
+        apb[2] = (x0 >= 0 && y0 + 1 >= 0 && x0 < ppxSrc->cx && y0 + 1 < ppxSrc->cy) ?
+                 BM_ScanLine(ppxSrc, y0 + 1) + x0 * cbSrcPixel : pJob->abBack;
+        apb[3] = (x0 + 1 >= 0 && y0 + 1 >= 0 && x0 + 1 < ppxSrc->cx &&
+                  y0 + 1 < ppxSrc->cy) ?
+                 BM_ScanLine(ppxSrc, y0 + 1) + (x0 + 1) * cbSrcPixel : pJob->abBack;
+
+        for (c = 0; c < pJob->cChannels; c++)
+        {
+            n = (apb[0][c] * (256 - fx) + apb[1][c] * fx) * (256 - fy) +
+                (apb[2][c] * (256 - fx) + apb[3][c] * fx) * fy;
+            pbDst[c] = (BYTE)((n + 32768) >> 16);
+        }
+    }
+}
+
+static DWORD WINAPI Resample_BandProc(LPVOID pParam)
+{
+    const RESAMPLE_BAND *pBand = pParam;
+    LPVOID pvRow = NULL;
+    INT y;
+
+    if (pBand->pJob->cbRowBuffer != 0)
+    {
+        pvRow = HeapAlloc(GetProcessHeap(), 0, pBand->pJob->cbRowBuffer);
+        if (pvRow == NULL)
+            return FALSE;
+    }
+    for (y = pBand->y0; y < pBand->y1; y++)
+        pBand->pJob->pfnRow(pBand->pJob, y, pvRow);
+    HeapFree(GetProcessHeap(), 0, pvRow);
+    return TRUE;
+}
+
+/* Makes every row of the result, in bands spread over the processors */
+static BOOL Resample_Run(const RESAMPLE_JOB *pJob)
+{
+    RESAMPLE_BAND aBands[RESAMPLE_MAX_THREADS];
+    HANDLE ahThreads[RESAMPLE_MAX_THREADS];
+    SYSTEM_INFO si;
+    INT cBands, cy = pJob->ppxDst->cy, i;
+    DWORD dwExit;
+    BOOL f;
+
+    GetSystemInfo(&si);
+    cBands = min((INT)si.dwNumberOfProcessors, RESAMPLE_MAX_THREADS);
+    cBands = max(min(cBands, cy / RESAMPLE_MIN_BAND), 1);
+
+    for (i = 0; i < cBands; i++)
+    {
+        aBands[i].pJob = pJob;
+        aBands[i].y0 = MulDiv(cy, i, cBands);
+        aBands[i].y1 = MulDiv(cy, i + 1, cBands);
+        ahThreads[i] = NULL;
+        if (i > 0)
+            ahThreads[i] = CreateThread(NULL, 0, Resample_BandProc, &aBands[i],
+                                        0, NULL);
+    }
+
+    /* the first band here, and those no thread could be made for */
+    f = Resample_BandProc(&aBands[0]);
+    for (i = 1; i < cBands; i++)
+    {
+        if (ahThreads[i] == NULL)
+            f = Resample_BandProc(&aBands[i]) && f;
+    }
+    for (i = 1; i < cBands; i++)
+    {
+        if (ahThreads[i] != NULL)
+        {
+            WaitForSingleObject(ahThreads[i], INFINITE);
+            if (!GetExitCodeThread(ahThreads[i], &dwExit) || !dwExit)
+                f = FALSE;
+            CloseHandle(ahThreads[i]);
+        }
+    }
+
+    if (!f)
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return f;
+}
+
+/* Stretches the 24 or 32 bpp image ppxSrc over the whole of ppxDst, with
+ * one of the RESAMPLE_ filters.  Alpha is stretched too if both are 32 bpp,
+ * otherwise any alpha of ppxDst is left alone. */
+BOOL BM_Resample(const BM_PIXELS *ppxSrc, BM_PIXELS *ppxDst, INT iFilter)
+{
+    RESAMPLE_JOB job;
+    BOOL f;
+
+    if ((ppxSrc->wBitCount != 24 && ppxSrc->wBitCount != 32) ||
+        (ppxDst->wBitCount != 24 && ppxDst->wBitCount != 32) ||
+        iFilter < RESAMPLE_BOX || iFilter > RESAMPLE_LANCZOS3 ||
+        ppxSrc->cx <= 0 || ppxSrc->cy <= 0 || ppxDst->cx <= 0 || ppxDst->cy <= 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    ZeroMemory(&job, sizeof(job));
+    job.pfnRow = Resample_StretchRow;
+    job.cbRowBuffer = (ppxSrc->cx * (ppxSrc->wBitCount / 8) + 1) * sizeof(INT);
+    job.ppxSrc = ppxSrc;
+    job.ppxDst = ppxDst;
+    job.cChannels =
+        (ppxSrc->wBitCount == 32 && ppxDst->wBitCount == 32) ? 4 : 3;
+    if (!Resample_InitAxis(&job.axX, ppxSrc->cx, ppxDst->cx, iFilter))
+        return FALSE;
+    if (!Resample_InitAxis(&job.axY, ppxSrc->cy, ppxDst->cy, iFilter))
+    {
+        Resample_FreeAxis(&job.axX);
+        return FALSE;
+    }
+
+    f = Resample_Run(&job);
+
+    Resample_FreeAxis(&job.axX);
+    Resample_FreeAxis(&job.axY);
+    return f;
+}
+
+/* The size of an image of size siz once skewed by nDegreeX and nDegreeY */
+SIZE BM_GetSkewedSize(SIZE siz, INT nDegreeX, INT nDegreeY)
+{
+    double tx = tan(nDegreeX * M_PI / 180), ty = tan(nDegreeY * M_PI / 180);
+    SIZE sizNew;
+
+    sizNew.cx = siz.cx + (LONG)ceil(fabs(tx) * siz.cy - 1e-6);
+    sizNew.cy = siz.cy + (LONG)ceil(fabs(ty) * sizNew.cx - 1e-6);
+    return sizNew;
+}
+
+/* Skews the 24 or 32 bpp image ppxSrc into ppxDst, which must be of the
+ * size BM_GetSkewedSize gives: first each row moves right by tan(nDegreeX)
+ * times its distance from the top, then each column moves down by
+ * tan(nDegreeY) times its distance from the left.  The corners left
+ * uncovered get the color rgbBack, opaque if alpha is skewed too, as it is
+ * between two 32 bpp images. */
+BOOL BM_Skew(const BM_PIXELS *ppxSrc, BM_PIXELS *ppxDst, INT nDegreeX,
+             INT nDegreeY, COLORREF rgbBack)
+{
+    RESAMPLE_JOB job;
+    double tx, ty, xOff, yOff;
+    SIZE siz, sizNew;
+
+    siz.cx = ppxSrc->cx;
+    siz.cy = ppxSrc->cy;
+    sizNew = BM_GetSkewedSize(siz, nDegreeX, nDegreeY);
+    if ((ppxSrc->wBitCount != 24 && ppxSrc->wBitCount != 32) ||
+        (ppxDst->wBitCount != 24 && ppxDst->wBitCount != 32) ||
+        nDegreeX <= -90 || nDegreeX >= 90 || nDegreeY <= -90 || nDegreeY >= 90 ||
+        ppxDst->cx != sizNew.cx || ppxDst->cy != sizNew.cy)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    /* forward, with the result moved to start at 0:
+     *   x' = x + tx * y + xOff
+     *   y' = y + ty * x' + yOff
+     * and back again:
+     *   y = y' - ty * x' - yOff
+     *   x = x' - tx * y - xOff */
+    tx = tan(nDegreeX * M_PI / 180);
+    ty = tan(nDegreeY * M_PI / 180);
+    xOff = (tx < 0) ? -tx * siz.cy : 0;
+    yOff = (ty < 0) ? -ty * sizNew.cx : 0;
+
+    ZeroMemory(&job, sizeof(job));
+    job.pfnRow = Resample_SkewRow;
+    job.ppxSrc = ppxSrc;
+    job.ppxDst = ppxDst;
+    job.cChannels =
+        (ppxSrc->wBitCount == 32 && ppxDst->wBitCount == 32) ? 4 : 3;
+    job.abBack[0] = GetBValue(rgbBack);
+    job.abBack[1] = GetGValue(rgbBack);
+    job.abBack[2] = GetRValue(rgbBack);
+    job.abBack[3] = 0xFF;
+
+    /* at the middle of pixel (0.5, y + 0.5) of the result */
+    job.yOrg = (0.5 - ty * 0.5 - yOff) * 65536;
+    job.dyRow = 65536;
+    job.dyCol = -ty * 65536;
+    job.xOrg = (0.5 - xOff) * 65536 - tx * job.yOrg;
+    job.dxRow = -tx * job.dyRow;
+    job.dxCol = 65536 - tx * job.dyCol;
+
+    return Resample_Run(&job);
+}
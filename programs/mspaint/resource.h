@@ -42,6 +42,7 @@
 #define IDD_STRETCH_SKEW        0x208
 #define IDD_ATTRIBUTES          0x209
 #define IDD_FLIP_ROTATE         0x20A
+#define IDD_BRIGHTNESS_CONTRAST 0x211
 #define IDI_PAINT               0x1
 
 /* Commands */
@@ -87,6 +88,10 @@
 #define CMD_HELP_CONTENTS       0x127
 #define CMD_HELP_ON_HELP        0x128
 #define CMD_HELP_ABOUT_PAINT    0x129
+#define CMD_GRAYSCALE           0x12A
+#define CMD_BLACK_AND_WHITE     0x12B
+#define CMD_SWAP_RED_BLUE       0x12C
+#define CMD_BRIGHTNESS_CONTRAST 0x12D
 
 #define IDC_STATIC -1
 
@@ -118,6 +123,7 @@
 #define STRING_POSITIVE_INT     0x211
 #define STRING_INVALID_BM       0x212
 #define STRING_LOSS_COLOR       0x213
+#define STRING_SAVING           0x214
 #define STRING_MONOCROME_BM     0x215
 #define STRING_16COLOR_BM       0x216
 #define STRING_256COLOR_BM      0x217
@@ -130,6 +136,9 @@
 #define STRING_PCX_FILES        0x21E
 #define STRING_ALL_PICTURE      0x21F
 #define STRING_PALETTE          0x220
+#define STRING_SKEW_ANGLE       0x221
+#define STRING_PIXELOP_SPEED    0x222
+#define STRING_PERCENT_RANGE    0x223
 #define STRING_NEW                  0x300
 #define STRING_OPEN                 0x301
 #define STRING_SAVE                 0x302
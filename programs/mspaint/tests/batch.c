@@ -0,0 +1,209 @@
+/*
+ * Unit tests for mspaint /batch
+ *
+ * Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "wine/test.h"
+
+#define CFILES  16
+
+static CHAR szDir[MAX_PATH];
+
+/* The test images are checkerboards of 5x3 cells, black and white, with a
+ * white cell at the top left.  Every file has its own size so that the
+ * fills do not all need buffers of the same size. */
+static BOOL IsWhite(INT x, INT y)
+{
+    return ((x / 5 + y / 3) & 1) == 0;
+}
+
+static INT RowSize(INT cx, INT wBitCount)
+{
+    return (cx * wBitCount / 8 + 3) & ~3;
+}
+
+static void write_checkerboard(LPCSTR pszFile, INT cx, INT cy)
+{
+    BITMAPFILEHEADER bf;
+    BITMAPINFOHEADER bi;
+    BYTE *pbRow;
+    INT x, y, cbRow = RowSize(cx, 24);
+    DWORD cbWritten;
+    HANDLE hFile;
+
+    ZeroMemory(&bi, sizeof(bi));
+    bi.biSize = sizeof(bi);
+    bi.biWidth = cx;
+    bi.biHeight = cy;
+    bi.biPlanes = 1;
+    bi.biBitCount = 24;
+    bi.biSizeImage = cbRow * cy;
+    ZeroMemory(&bf, sizeof(bf));
+    bf.bfType = 'B' | ('M' << 8);
+    bf.bfOffBits = sizeof(bf) + sizeof(bi);
+    bf.bfSize = bf.bfOffBits + bi.biSizeImage;
+
+    hFile = CreateFileA(pszFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+    ok(hFile != INVALID_HANDLE_VALUE, "cannot create %s\n", pszFile);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    WriteFile(hFile, &bf, sizeof(bf), &cbWritten, NULL);
+    WriteFile(hFile, &bi, sizeof(bi), &cbWritten, NULL);
+
+    pbRow = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, cbRow);
+    for (y = cy - 1; y >= 0; y--)
+    {
+        for (x = 0; x < cx; x++)
+            memset(pbRow + x * 3, IsWhite(x, y) ? 0xFF : 0, 3);
+        WriteFile(hFile, pbRow, cbRow, &cbWritten, NULL);
+    }
+    HeapFree(GetProcessHeap(), 0, pbRow);
+    CloseHandle(hFile);
+}
+
+/* Checks that only the top left cell of the checkerboard in pszFile is red.
+ * The cells touch their neighbours of the same color only at the corners,
+ * so a fill from (0, 0) must stop at the first cell. */
+static void check_filled(LPCSTR pszFile, INT cx, INT cy)
+{
+    BITMAPFILEHEADER bf;
+    BITMAPINFOHEADER bi;
+    BYTE *pbBits, *pb;
+    INT x, y, cbRow, cWrong = 0;
+    DWORD cbRead;
+    HANDLE hFile;
+
+    hFile = CreateFileA(pszFile, GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ok(hFile != INVALID_HANDLE_VALUE, "%s was not written\n", pszFile);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    ReadFile(hFile, &bf, sizeof(bf), &cbRead, NULL);
+    ReadFile(hFile, &bi, sizeof(bi), &cbRead, NULL);
+    ok(bi.biWidth == cx && abs(bi.biHeight) == cy,
+       "%s: got %dx%d, expected %dx%d\n", pszFile,
+       bi.biWidth, bi.biHeight, cx, cy);
+    ok(bi.biBitCount == 24 || bi.biBitCount == 32,
+       "%s: got %d bpp\n", pszFile, bi.biBitCount);
+    if (bi.biWidth != cx || abs(bi.biHeight) != cy ||
+        (bi.biBitCount != 24 && bi.biBitCount != 32))
+    {
+        CloseHandle(hFile);
+        return;
+    }
+
+    cbRow = RowSize(cx, bi.biBitCount);
+    pbBits = HeapAlloc(GetProcessHeap(), 0, cbRow * cy);
+    SetFilePointer(hFile, bf.bfOffBits, NULL, FILE_BEGIN);
+    ReadFile(hFile, pbBits, cbRow * cy, &cbRead, NULL);
+    CloseHandle(hFile);
+    ok(cbRead == (DWORD)(cbRow * cy), "%s is short\n", pszFile);
+
+    for (y = 0; y < cy; y++)
+    {
+        pb = pbBits + (bi.biHeight > 0 ? cy - 1 - y : y) * cbRow;
+        for (x = 0; x < cx; x++, pb += bi.biBitCount / 8)
+        {
+            if (x < 5 && y < 3)
+                cWrong += pb[0] != 0 || pb[1] != 0 || pb[2] != 0xFF;
+            else if (IsWhite(x, y))
+                cWrong += pb[0] != 0xFF || pb[1] != 0xFF || pb[2] != 0xFF;
+            else
+                cWrong += pb[0] != 0 || pb[1] != 0 || pb[2] != 0;
+        }
+    }
+    ok(cWrong == 0, "%s: %d pixels wrong\n", pszFile, cWrong);
+    HeapFree(GetProcessHeap(), 0, pbBits);
+}
+
+static DWORD run_mspaint(LPSTR pszArgs)
+{
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    CHAR szCmdLine[MAX_PATH * 3];
+    DWORD dwExitCode;
+
+    sprintf(szCmdLine, "mspaint.exe %s", pszArgs);
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(NULL, szCmdLine, NULL, NULL, FALSE, 0, NULL, NULL,
+                        &si, &pi))
+        return ~0u;
+    ok(WaitForSingleObject(pi.hProcess, 60000) == WAIT_OBJECT_0,
+       "mspaint did not finish\n");
+    GetExitCodeProcess(pi.hProcess, &dwExitCode);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return dwExitCode;
+}
+
+/* Fills many files at once, which /batch shares out among its threads */
+static void test_fill_files(void)
+{
+    CHAR szFile[MAX_PATH], szArgs[MAX_PATH * 2];
+    DWORD dwExitCode;
+    INT i;
+
+    for (i = 0; i < CFILES; i++)
+    {
+        sprintf(szFile, "%s\\in\\%02d.bmp", szDir, i);
+        write_checkerboard(szFile, 40 + i * 23, 30 + i * 17);
+    }
+
+    sprintf(szArgs, "/batch /fill:0,0,ff0000 \"%s\\in\\*.bmp\" \"%s\\out\"",
+            szDir, szDir);
+    dwExitCode = run_mspaint(szArgs);
+    if (dwExitCode == ~0u)
+    {
+        skip("cannot run mspaint.exe (error %u)\n", GetLastError());
+        return;
+    }
+    ok(dwExitCode == 0, "mspaint /batch returned %u\n", dwExitCode);
+
+    for (i = 0; i < CFILES; i++)
+    {
+        sprintf(szFile, "%s\\out\\%02d.bmp", szDir, i);
+        check_filled(szFile, 40 + i * 23, 30 + i * 17);
+        DeleteFileA(szFile);
+        sprintf(szFile, "%s\\in\\%02d.bmp", szDir, i);
+        DeleteFileA(szFile);
+    }
+}
+
+START_TEST(batch)
+{
+    CHAR szTemp[MAX_PATH], szSub[MAX_PATH];
+
+    GetTempPathA(MAX_PATH, szTemp);
+    sprintf(szDir, "%smspaint_batch", szTemp);
+    CreateDirectoryA(szDir, NULL);
+    sprintf(szSub, "%s\\in", szDir);
+    CreateDirectoryA(szSub, NULL);
+
+    test_fill_files();
+
+    RemoveDirectoryA(szSub);
+    sprintf(szSub, "%s\\out", szDir);
+    RemoveDirectoryA(szSub);
+    RemoveDirectoryA(szDir);
+}
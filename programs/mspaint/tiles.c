@@ -0,0 +1,317 @@
+/*
+ *  Paint (tiles.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Tile store.
+ *
+ * The image is divided into TILE_SIZE square tiles.  A TILE holds the
+ * run-length encoded pixels of one of them; it never changes once created
+ * and is shared by reference count, so taking a snapshot of an area only
+ * costs a reference per tile.
+ *
+ * GDI draws into Globals.hbmImage, which therefore stays a plain DIB
+ * section.  The store remembers, for every tile of it, a TILE that still
+ * matches its pixels.  Anything that is about to draw over the image
+ * calls Tiles_Invalidate first; the tile is captured again only the next
+ * time somebody asks for it.
+ */
+
+#include <string.h>
+#include <windows.h>
+
+#include "main.h"
+
+/* Worst case encoded size of n pixels: a literal header every 128 pixels */
+#define TILE_MAX_RLE(n, cbPixel) ((n) * (cbPixel) + ((n) + 127) / 128)
+
+static TILE **ppStoreTiles;     /* current tile or NULL, row by row */
+static SIZE sizStore;
+static WORD wStoreBitCount;
+static LPBYTE pStoreBits;
+static INT cxStoreTiles, cyStoreTiles;
+
+/* Encodes n pixels.  A header byte h < 128 is followed by h + 1 literal
+ * pixels, a header h >= 128 by one pixel repeated h - 126 times. */
+static DWORD Tile_Encode(LPBYTE pbOut, const BYTE *pb, INT n, INT cbPixel)
+{
+    LPBYTE pbStart = pbOut;
+    INT i, cRun, cLit;
+
+    i = 0;
+    while (i < n)
+    {
+        cRun = 1;
+        while (i + cRun < n && cRun < 129 &&
+               !memcmp(pb + (i + cRun) * cbPixel, pb + i * cbPixel, cbPixel))
+            cRun++;
+
+        if (cRun >= 2)
+        {
+            *pbOut++ = (BYTE)(cRun + 126);
+            memcpy(pbOut, pb + i * cbPixel, cbPixel);
+            pbOut += cbPixel;
+            i += cRun;
+            continue;
+        }
+
+        /* literals run up to the next pair of equal pixels */
+        cLit = 1;
+        while (i + cLit < n && cLit < 128 &&
+               (i + cLit + 1 >= n ||
+                memcmp(pb + (i + cLit) * cbPixel,
+                       pb + (i + cLit + 1) * cbPixel, cbPixel)))
+            cLit++;
+        *pbOut++ = (BYTE)(cLit - 1);
+        memcpy(pbOut, pb + i * cbPixel, cLit * cbPixel);
+        pbOut += cLit * cbPixel;
+        i += cLit;
+    }
+    return (DWORD)(pbOut - pbStart);
+}
+
+static VOID Tile_Decode(LPBYTE pb, const BYTE *pbIn, DWORD cbIn, INT cbPixel)
+{
+    const BYTE *pbEnd = pbIn + cbIn;
+    INT n;
+
+    while (pbIn < pbEnd)
+    {
+        if (*pbIn < 128)
+        {
+            n = (*pbIn++ + 1) * cbPixel;
+            memcpy(pb, pbIn, n);
+            pbIn += n;
+            pb += n;
+        }
+        else
+        {
+            for (n = *pbIn++ - 126; n > 0; n--)
+            {
+                memcpy(pb, pbIn, cbPixel);
+                pb += cbPixel;
+            }
+            pbIn += cbPixel;
+        }
+    }
+}
+
+/* Computes the pixel rectangle of tile (x, y) of the image ppx */
+VOID Tile_GetRect(const BM_PIXELS *ppx, INT x, INT y, RECT *prc)
+{
+    prc->left = x * TILE_SIZE;
+    prc->top = y * TILE_SIZE;
+    prc->right = min(prc->left + TILE_SIZE, ppx->cx);
+    prc->bottom = min(prc->top + TILE_SIZE, ppx->cy);
+}
+
+/* Encodes tile (x, y) of the 24 or 32 bpp image ppx.  The new tile has
+ * one reference. */
+TILE *Tile_Capture(const BM_PIXELS *ppx, INT x, INT y)
+{
+    BYTE abPixels[TILE_SIZE * TILE_SIZE * 4];
+    BYTE abRLE[TILE_MAX_RLE(TILE_SIZE * TILE_SIZE, 4)];
+    TILE *pTile;
+    RECT rc;
+    INT cbPixel, cbRow, i;
+    DWORD cb;
+
+    Tile_GetRect(ppx, x, y, &rc);
+    cbPixel = ppx->wBitCount / 8;
+    cbRow = (rc.right - rc.left) * cbPixel;
+    for (i = rc.top; i < rc.bottom; i++)
+    {
+        memcpy(abPixels + (i - rc.top) * cbRow,
+               BM_ScanLine(ppx, i) + rc.left * cbPixel, cbRow);
+    }
+    cb = Tile_Encode(abRLE, abPixels,
+                     (rc.right - rc.left) * (rc.bottom - rc.top), cbPixel);
+
+    pTile = HeapAlloc(GetProcessHeap(), 0, FIELD_OFFSET(TILE, ab[cb]));
+    if (pTile == NULL)
+        return NULL;
+    pTile->cRefs = 1;
+    pTile->x = x;
+    pTile->y = y;
+    pTile->wBitCount = ppx->wBitCount;
+    pTile->cb = cb;
+    memcpy(pTile->ab, abRLE, cb);
+    return pTile;
+}
+
+/* Decodes pTile into its place in the image ppx, which must have the
+ * same bit count */
+VOID Tile_Draw(const TILE *pTile, BM_PIXELS *ppx)
+{
+    BYTE abPixels[TILE_SIZE * TILE_SIZE * 4];
+    RECT rc;
+    INT cbPixel, cbRow, i;
+
+    Tile_GetRect(ppx, pTile->x, pTile->y, &rc);
+    cbPixel = ppx->wBitCount / 8;
+    cbRow = (rc.right - rc.left) * cbPixel;
+    Tile_Decode(abPixels, pTile->ab, pTile->cb, cbPixel);
+    for (i = rc.top; i < rc.bottom; i++)
+    {
+        memcpy(BM_ScanLine(ppx, i) + rc.left * cbPixel,
+               abPixels + (i - rc.top) * cbRow, cbRow);
+    }
+}
+
+VOID Tile_AddRef(TILE *pTile)
+{
+    pTile->cRefs++;
+}
+
+VOID Tile_Release(TILE *pTile)
+{
+    if (pTile != NULL && --pTile->cRefs == 0)
+        HeapFree(GetProcessHeap(), 0, pTile);
+}
+
+/* Memory held by pTile, for budgets */
+SIZE_T Tile_GetSize(const TILE *pTile)
+{
+    return FIELD_OFFSET(TILE, ab[pTile->cb]);
+}
+
+/* Forgets all tiles, e.g. after the image has been replaced */
+VOID Tiles_Reset(VOID)
+{
+    INT i;
+
+    if (ppStoreTiles != NULL)
+    {
+        for (i = 0; i < cxStoreTiles * cyStoreTiles; i++)
+            Tile_Release(ppStoreTiles[i]);
+        HeapFree(GetProcessHeap(), 0, ppStoreTiles);
+        ppStoreTiles = NULL;
+    }
+    sizStore.cx = sizStore.cy = 0;
+    cxStoreTiles = cyStoreTiles = 0;
+    pStoreBits = NULL;
+}
+
+/* Gets the pixels of the image and makes sure the store belongs to them */
+static BOOL Tiles_Bind(BM_PIXELS *ppx)
+{
+    if (Globals.hbmImage == NULL || !BM_GetPixels(Globals.hbmImage, ppx) ||
+        (ppx->wBitCount != 24 && ppx->wBitCount != 32))
+    {
+        Tiles_Reset();
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    if (ppStoreTiles != NULL && ppx->cx == sizStore.cx &&
+        ppx->cy == sizStore.cy && ppx->wBitCount == wStoreBitCount &&
+        ppx->pBits == pStoreBits)
+        return TRUE;
+
+    Tiles_Reset();
+    cxStoreTiles = (ppx->cx + TILE_SIZE - 1) / TILE_SIZE;
+    cyStoreTiles = (ppx->cy + TILE_SIZE - 1) / TILE_SIZE;
+    ppStoreTiles = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                             cxStoreTiles * cyStoreTiles * sizeof(TILE *));
+    if (ppStoreTiles == NULL)
+    {
+        cxStoreTiles = cyStoreTiles = 0;
+        return FALSE;
+    }
+    sizStore.cx = ppx->cx;
+    sizStore.cy = ppx->cy;
+    wStoreBitCount = ppx->wBitCount;
+    pStoreBits = ppx->pBits;
+    return TRUE;
+}
+
+/* Returns a new reference to a tile holding the current pixels of tile
+ * (x, y) of the image, capturing it if it has been drawn over */
+TILE *Tiles_Get(INT x, INT y)
+{
+    BM_PIXELS px;
+    TILE *pTile;
+
+    if (!Tiles_Bind(&px))
+        return NULL;
+    if (x < 0 || y < 0 || x >= cxStoreTiles || y >= cyStoreTiles)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    pTile = ppStoreTiles[y * cxStoreTiles + x];
+    if (pTile == NULL)
+    {
+        GdiFlush();
+        pTile = Tile_Capture(&px, x, y);
+        if (pTile == NULL)
+            return NULL;
+        ppStoreTiles[y * cxStoreTiles + x] = pTile;
+    }
+    Tile_AddRef(pTile);
+    return pTile;
+}
+
+/* Writes pTile back into the image, where it becomes the current tile */
+VOID Tiles_Put(TILE *pTile)
+{
+    BM_PIXELS px;
+    TILE **ppSlot;
+
+    if (!BM_GetPixels(Globals.hbmImage, &px) ||
+        px.wBitCount != pTile->wBitCount)
+        return;
+
+    GdiFlush();
+    Tile_Draw(pTile, &px);
+    if (Tiles_Bind(&px))
+    {
+        ppSlot = &ppStoreTiles[pTile->y * cxStoreTiles + pTile->x];
+        Tile_Release(*ppSlot);
+        Tile_AddRef(pTile);
+        *ppSlot = pTile;
+    }
+}
+
+/* Drops the tiles of the image area *prc, which is about to be drawn over */
+VOID Tiles_Invalidate(const RECT *prc)
+{
+    INT x, y, x0, y0, x1, y1;
+
+    if (ppStoreTiles == NULL)
+        return;
+
+    x0 = max(min(prc->left, prc->right), 0) / TILE_SIZE;
+    y0 = max(min(prc->top, prc->bottom), 0) / TILE_SIZE;
+    x1 = min(max(prc->left, prc->right), sizStore.cx);
+    y1 = min(max(prc->top, prc->bottom), sizStore.cy);
+    x1 = (x1 + TILE_SIZE - 1) / TILE_SIZE;
+    y1 = (y1 + TILE_SIZE - 1) / TILE_SIZE;
+
+    for (y = y0; y < y1; y++)
+    {
+        for (x = x0; x < x1; x++)
+        {
+            Tile_Release(ppStoreTiles[y * cxStoreTiles + x]);
+            ppStoreTiles[y * cxStoreTiles + x] = NULL;
+        }
+    }
+}
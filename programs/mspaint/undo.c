@@ -0,0 +1,377 @@
+/*
+ *  Paint (undo.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Undo history.
+ *
+ * A step keeps the tiles (see tiles.c) an operation is about to draw over.
+ * The first time an operation touches a tile, the step takes a reference
+ * to it, so a stroke costs about as much as the area it covers and tiles
+ * that did not change since they were captured are shared rather than
+ * copied.  Undoing a step exchanges its tiles with the current ones, after
+ * which the same step redoes the operation.  Operations that resize or
+ * transform the whole image save all of it in a "full" step, which also
+ * remembers the size.
+ *
+ * Steps are dropped oldest first once the history takes more than the
+ * memory budget.
+ */
+
+#include <windows.h>
+
+#include "main.h"
+
+typedef struct tagUNDO_STEP
+{
+    struct tagUNDO_STEP *pNext;  /* next older step */
+    BOOL        fFull;
+    SIZE        siz;            /* image size the tiles belong to */
+    WORD        wBitCount;
+    INT         cxTiles;
+    INT         cyTiles;
+    INT         cTiles;
+    INT         cMaxTiles;
+    TILE      **ppTiles;
+    LPBYTE      pbSaved;        /* one bit per tile, set once saved */
+    SIZE_T      cb;             /* memory held by the step */
+} UNDO_STEP;
+
+static UNDO_STEP *pUndoSteps;   /* newest first */
+static UNDO_STEP *pRedoSteps;   /* most recently undone first */
+static SIZE_T cbUndoUsed;
+static SIZE_T cbUndoBudget = 64 * 1024 * 1024;
+
+/* Sets up an empty step for an image of size siz.  Its own size is
+ * accounted for, the tiles are not. */
+static BOOL Undo_InitStep(UNDO_STEP *pStep, SIZE siz, WORD wBitCount)
+{
+    INT cbSaved;
+
+    ZeroMemory(pStep, sizeof(UNDO_STEP));
+    pStep->siz = siz;
+    pStep->wBitCount = wBitCount;
+    pStep->cxTiles = (siz.cx + TILE_SIZE - 1) / TILE_SIZE;
+    pStep->cyTiles = (siz.cy + TILE_SIZE - 1) / TILE_SIZE;
+    cbSaved = (pStep->cxTiles * pStep->cyTiles + 7) / 8;
+    pStep->pbSaved = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                               max(cbSaved, 1));
+    if (pStep->pbSaved == NULL)
+        return FALSE;
+    pStep->cb = sizeof(UNDO_STEP) + cbSaved;
+    cbUndoUsed += pStep->cb;
+    return TRUE;
+}
+
+/* Releases what pStep holds, but not pStep itself */
+static VOID Undo_ClearStep(UNDO_STEP *pStep)
+{
+    INT i;
+
+    for (i = 0; i < pStep->cTiles; i++)
+        Tile_Release(pStep->ppTiles[i]);
+    HeapFree(GetProcessHeap(), 0, pStep->ppTiles);
+    HeapFree(GetProcessHeap(), 0, pStep->pbSaved);
+    cbUndoUsed -= pStep->cb;
+}
+
+static VOID Undo_FreeStep(UNDO_STEP *pStep)
+{
+    Undo_ClearStep(pStep);
+    HeapFree(GetProcessHeap(), 0, pStep);
+}
+
+static VOID Undo_FreeList(UNDO_STEP **ppList)
+{
+    UNDO_STEP *pStep;
+
+    while (*ppList != NULL)
+    {
+        pStep = *ppList;
+        *ppList = pStep->pNext;
+        Undo_FreeStep(pStep);
+    }
+}
+
+/* Drops the oldest steps until the history fits the budget.  The newest
+ * step is always kept. */
+static VOID Undo_Trim(VOID)
+{
+    UNDO_STEP **ppStep;
+
+    while (cbUndoUsed > cbUndoBudget && pUndoSteps != NULL &&
+           pUndoSteps->pNext != NULL)
+    {
+        ppStep = &pUndoSteps->pNext;
+        while ((*ppStep)->pNext != NULL)
+            ppStep = &(*ppStep)->pNext;
+        Undo_FreeStep(*ppStep);
+        *ppStep = NULL;
+    }
+}
+
+/* Adds the current tiles that intersect *prc, and are not in pStep yet,
+ * to pStep */
+static BOOL Undo_SaveRect(UNDO_STEP *pStep, const RECT *prc)
+{
+    TILE *pTile;
+    TILE **ppTiles;
+    INT tx, ty, i, cMax;
+
+    for (ty = prc->top / TILE_SIZE; ty <= (prc->bottom - 1) / TILE_SIZE; ty++)
+    {
+        for (tx = prc->left / TILE_SIZE;
+             tx <= (prc->right - 1) / TILE_SIZE; tx++)
+        {
+            i = ty * pStep->cxTiles + tx;
+            if (pStep->pbSaved[i / 8] & (1 << (i % 8)))
+                continue;
+
+            if (pStep->cTiles == pStep->cMaxTiles)
+            {
+                cMax = pStep->cMaxTiles ? pStep->cMaxTiles * 2 : 16;
+                if (pStep->ppTiles == NULL)
+                    ppTiles = HeapAlloc(GetProcessHeap(), 0,
+                                        cMax * sizeof(TILE *));
+                else
+                    ppTiles = HeapReAlloc(GetProcessHeap(), 0, pStep->ppTiles,
+                                          cMax * sizeof(TILE *));
+                if (ppTiles == NULL)
+                    return FALSE;
+                pStep->ppTiles = ppTiles;
+                pStep->cMaxTiles = cMax;
+            }
+
+            pTile = Tiles_Get(tx, ty);
+            if (pTile == NULL)
+                return FALSE;
+            pStep->ppTiles[pStep->cTiles++] = pTile;
+            pStep->pbSaved[i / 8] |= 1 << (i % 8);
+            pStep->cb += Tile_GetSize(pTile) + sizeof(TILE *);
+            cbUndoUsed += Tile_GetSize(pTile) + sizeof(TILE *);
+        }
+    }
+    return TRUE;
+}
+
+/* Starts a new step for the current image.  The redo steps are lost. */
+BOOL Undo_Begin(VOID)
+{
+    UNDO_STEP *pStep;
+    BM_PIXELS px;
+    SIZE siz;
+
+    Undo_FreeList(&pRedoSteps);
+    if (Globals.hbmImage == NULL || !BM_GetPixels(Globals.hbmImage, &px) ||
+        (px.wBitCount != 24 && px.wBitCount != 32))
+    {
+        Undo_Clear();
+        return FALSE;
+    }
+
+    pStep = HeapAlloc(GetProcessHeap(), 0, sizeof(UNDO_STEP));
+    if (pStep == NULL)
+        return FALSE;
+    siz.cx = px.cx;
+    siz.cy = px.cy;
+    if (!Undo_InitStep(pStep, siz, px.wBitCount))
+    {
+        HeapFree(GetProcessHeap(), 0, pStep);
+        return FALSE;
+    }
+
+    pStep->pNext = pUndoSteps;
+    pUndoSteps = pStep;
+    return TRUE;
+}
+
+/* Records the part *prc of the image, in image coordinates, in the newest
+ * step before it gets drawn over */
+VOID Undo_Touch(const RECT *prc)
+{
+    UNDO_STEP *pStep = pUndoSteps;
+    BM_PIXELS px;
+    RECT rc;
+
+    if (pStep != NULL && !pStep->fFull)
+    {
+        if (!BM_GetPixels(Globals.hbmImage, &px) || px.cx != pStep->siz.cx ||
+            px.cy != pStep->siz.cy || px.wBitCount != pStep->wBitCount)
+        {
+            /* the image was replaced behind our back */
+            Undo_Clear();
+            return;
+        }
+
+        rc.left = max(min(prc->left, prc->right), 0);
+        rc.top = max(min(prc->top, prc->bottom), 0);
+        rc.right = min(max(prc->left, prc->right), px.cx);
+        rc.bottom = min(max(prc->top, prc->bottom), px.cy);
+        if (rc.left < rc.right && rc.top < rc.bottom)
+        {
+            Undo_FreeList(&pRedoSteps);
+            if (!Undo_SaveRect(pStep, &rc))
+            {
+                /* an incomplete step cannot be undone */
+                pUndoSteps = pStep->pNext;
+                Undo_FreeStep(pStep);
+            }
+            Undo_Trim();
+        }
+    }
+
+    Tiles_Invalidate(prc);
+}
+
+/* Starts a step that saves the whole image, for operations that replace it */
+VOID Undo_BeginFull(VOID)
+{
+    UNDO_STEP *pStep;
+    RECT rc;
+
+    if (Undo_Begin())
+    {
+        pStep = pUndoSteps;
+        SetRect(&rc, 0, 0, pStep->siz.cx, pStep->siz.cy);
+        Undo_Touch(&rc);
+        if (pUndoSteps == pStep)
+            pStep->fFull = TRUE;
+    }
+    Tiles_Reset();
+}
+
+/* Exchanges the tiles of pStep with the image.  Nothing is changed unless
+ * it succeeds. */
+static BOOL Undo_Swap(UNDO_STEP *pStep)
+{
+    UNDO_STEP stepNew;
+    BM_PIXELS px;
+    HBITMAP hbmNew = NULL;
+    RECT rc;
+    SIZE siz;
+    INT i;
+
+    if (!BM_GetPixels(Globals.hbmImage, &px))
+        return FALSE;
+    if (!pStep->fFull && (px.cx != pStep->siz.cx || px.cy != pStep->siz.cy ||
+                          px.wBitCount != pStep->wBitCount))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+
+    /* take the current tiles of the same places, or of the whole image
+     * if the step is going to replace it */
+    siz.cx = px.cx;
+    siz.cy = px.cy;
+    if (!Undo_InitStep(&stepNew, siz, px.wBitCount))
+        return FALSE;
+    if (pStep->fFull)
+    {
+        SetRect(&rc, 0, 0, px.cx, px.cy);
+        if (!Undo_SaveRect(&stepNew, &rc))
+            goto fail;
+
+        hbmNew = (pStep->wBitCount == 32) ? BM_Create32(pStep->siz) :
+                                            BM_Create(pStep->siz);
+        if (hbmNew == NULL)
+            goto fail;
+    }
+    else
+    {
+        for (i = 0; i < pStep->cTiles; i++)
+        {
+            Tile_GetRect(&px, pStep->ppTiles[i]->x, pStep->ppTiles[i]->y, &rc);
+            if (!Undo_SaveRect(&stepNew, &rc))
+                goto fail;
+        }
+    }
+
+    if (hbmNew != NULL)
+    {
+        DeleteObject(Globals.hbmImage);
+        Globals.hbmImage = hbmNew;
+        Globals.sizImage = pStep->siz;
+        Tiles_Reset();
+    }
+    for (i = 0; i < pStep->cTiles; i++)
+        Tiles_Put(pStep->ppTiles[i]);
+
+    Undo_ClearStep(pStep);
+    stepNew.pNext = pStep->pNext;
+    stepNew.fFull = pStep->fFull;
+    *pStep = stepNew;
+    return TRUE;
+
+fail:
+    Undo_ClearStep(&stepNew);
+    return FALSE;
+}
+
+/* Reverts the newest step */
+BOOL Undo_Undo(VOID)
+{
+    UNDO_STEP *pStep = pUndoSteps;
+
+    if (pStep == NULL || !Undo_Swap(pStep))
+        return FALSE;
+    pUndoSteps = pStep->pNext;
+    pStep->pNext = pRedoSteps;
+    pRedoSteps = pStep;
+    return TRUE;
+}
+
+/* Reapplies the most recently undone step */
+BOOL Undo_Redo(VOID)
+{
+    UNDO_STEP *pStep = pRedoSteps;
+
+    if (pStep == NULL || !Undo_Swap(pStep))
+        return FALSE;
+    pRedoSteps = pStep->pNext;
+    pStep->pNext = pUndoSteps;
+    pUndoSteps = pStep;
+    return TRUE;
+}
+
+BOOL Undo_CanUndo(VOID)
+{
+    return pUndoSteps != NULL;
+}
+
+BOOL Undo_CanRedo(VOID)
+{
+    return pRedoSteps != NULL;
+}
+
+/* Forgets the whole history, e.g. when another image is loaded */
+VOID Undo_Clear(VOID)
+{
+    Undo_FreeList(&pUndoSteps);
+    Undo_FreeList(&pRedoSteps);
+    Tiles_Reset();
+}
+
+/* Sets the memory the history may take, in bytes */
+VOID Undo_SetBudget(SIZE_T cb)
+{
+    cbUndoBudget = cb;
+    Undo_Trim();
+}
@@ -0,0 +1,205 @@
+/*
+ *  Paint (zoom.c)
+ *
+ *  Copyright 2008 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+ *  Copyright 2010 Austin English
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * The magnified view.  When zoomed in, the canvas writes the visible part
+ * of the image, enlarged, straight into its 32 bpp buffer instead of going
+ * through StretchBlt and then drawing the pixel grid line by line with
+ * GDI.  Only the rectangle being repainted is written, each source row is
+ * enlarged once and copied down for the rows it covers, and the grid goes
+ * into the same pass.  The fills take four pixels at a time with SSE2.
+ */
+
+#include <string.h>
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "main.h"
+
+/* grid colors, as 32 bpp DIB pixels */
+#define ZOOM_GRID_LIGHT 0x00C0C0C0
+#define ZOOM_GRID_DARK  0x00808080
+
+static DWORD ZOOM_Pixel(const BYTE *pb)
+{
+    return pb[0] | (pb[1] << 8) | (pb[2] << 16);
+}
+
+/* Sets n pixels at pdw to dw */
+static void ZOOM_Fill(DWORD *pdw, DWORD dw, INT n)
+{
+#ifdef __SSE2__
+    if (n >= 4)
+    {
+        __m128i v = _mm_set1_epi32(dw);
+        INT i;
+
+        for (i = 0; i + 4 <= n; i += 4)
+            _mm_storeu_si128((__m128i *)(pdw + i), v);
+        /* the rest overlaps the last store, which is harmless */
+        if (i < n)
+            _mm_storeu_si128((__m128i *)(pdw + n - 4), v);
+        return;
+    }
+#endif
+    while (n-- > 0)
+        *pdw++ = dw;
+}
+
+/* Writes cx pixels of the magnified scanline pbSrc, starting at magnified
+ * column zx */
+static void ZOOM_ExpandRow(DWORD *pdw, INT cx, const BYTE *pbSrc,
+                           INT cbPixel, INT zx, INT nZoom)
+{
+    const BYTE *pb = pbSrc + (zx / nZoom) * cbPixel;
+    INT n = nZoom - zx % nZoom;
+    INT x = 0;
+
+#ifdef __SSE2__
+    /* at 1x and 2x a pixel is too narrow for ZOOM_Fill, so gather four
+     * source pixels and replicate them in registers */
+    if (nZoom == 1 || (nZoom == 2 && n == 2))
+    {
+        for (; x + 4 * nZoom <= cx; x += 4 * nZoom, pb += 4 * cbPixel)
+        {
+            __m128i v = _mm_set_epi32(ZOOM_Pixel(pb + 3 * cbPixel),
+                                      ZOOM_Pixel(pb + 2 * cbPixel),
+                                      ZOOM_Pixel(pb + cbPixel),
+                                      ZOOM_Pixel(pb));
+            if (nZoom == 1)
+            {
+                _mm_storeu_si128((__m128i *)(pdw + x), v);
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i *)(pdw + x), _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128((__m128i *)(pdw + x + 4), _mm_unpackhi_epi32(v, v));
+            }
+        }
+    }
+#endif
+
+    while (x < cx)
+    {
+        if (n > cx - x)
+            n = cx - x;
+        ZOOM_Fill(pdw + x, ZOOM_Pixel(pb), n);
+        x += n;
+        pb += cbPixel;
+        n = nZoom;
+    }
+}
+
+/* Writes a horizontal grid line.  Like a PS_ALTERNATE pen over a light gray
+ * one, every other pixel is dark; on even rows the crossings with the
+ * vertical lines are dark as well. */
+static void ZOOM_GridRow(DWORD *pdw, INT cx, INT zx, INT zy, INT nZoom)
+{
+    DWORD dw0 = (zx & 1) ? ZOOM_GRID_LIGHT : ZOOM_GRID_DARK;
+    DWORD dw1 = (zx & 1) ? ZOOM_GRID_DARK : ZOOM_GRID_LIGHT;
+    INT x = 0;
+
+#ifdef __SSE2__
+    {
+        __m128i v = _mm_set_epi32(dw1, dw0, dw1, dw0);
+        for (; x + 4 <= cx; x += 4)
+            _mm_storeu_si128((__m128i *)(pdw + x), v);
+    }
+#endif
+    for (; x < cx; x++)
+        pdw[x] = (x & 1) ? dw1 : dw0;
+
+    if (!(zy & 1))
+    {
+        for (x = (nZoom - zx % nZoom) % nZoom; x < cx; x += nZoom)
+            pdw[x] = ZOOM_GRID_DARK;
+    }
+}
+
+/* Draws the 24 or 32 bpp image ppxSrc, magnified nZoom times with its top
+ * left corner at (xOrg, yOrg), into the part prcDst of the 32 bpp bitmap
+ * ppxDst.  prcDst must lie within both ppxDst and the magnified image.
+ * Each output row is expanded once and copied down to the following rows
+ * of the same source row; with fGrid the pixel grid is written in the same
+ * pass instead of being drawn over it. */
+BOOL BM_ZoomBlt(BM_PIXELS *ppxDst, const RECT *prcDst, INT xOrg, INT yOrg,
+                const BM_PIXELS *ppxSrc, INT nZoom, BOOL fGrid)
+{
+    DWORD *pdwRow[2];
+    INT syRow[2];
+    DWORD *pdw;
+    INT cx, x, y, zx, zy, sy, k, cbPixel;
+
+    if (ppxDst->wBitCount != 32 ||
+        (ppxSrc->wBitCount != 24 && ppxSrc->wBitCount != 32) ||
+        nZoom < 1 || prcDst->left < xOrg || prcDst->top < yOrg ||
+        (prcDst->right - xOrg + nZoom - 1) / nZoom > ppxSrc->cx ||
+        (prcDst->bottom - yOrg + nZoom - 1) / nZoom > ppxSrc->cy)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    cx = prcDst->right - prcDst->left;
+    if (cx <= 0)
+        return TRUE;
+    cbPixel = ppxSrc->wBitCount / 8;
+    zx = prcDst->left - xOrg;
+
+    /* with the grid on, vertical lines alternate in color from row to row,
+     * so only rows of the same parity can be copied */
+    pdwRow[0] = pdwRow[1] = NULL;
+    syRow[0] = syRow[1] = -1;
+
+    for (y = prcDst->top; y < prcDst->bottom; y++)
+    {
+        zy = y - yOrg;
+        sy = zy / nZoom;
+        k = fGrid ? (zy & 1) : 0;
+        pdw = (DWORD *)BM_ScanLine(ppxDst, y) + prcDst->left;
+
+        if (fGrid && zy % nZoom == 0)
+        {
+            ZOOM_GridRow(pdw, cx, zx, zy, nZoom);
+            continue;
+        }
+
+        if (syRow[k] == sy)
+        {
+            memcpy(pdw, pdwRow[k], cx * sizeof(DWORD));
+            continue;
+        }
+
+        ZOOM_ExpandRow(pdw, cx, BM_ScanLine(ppxSrc, sy), cbPixel, zx, nZoom);
+        if (fGrid)
+        {
+            DWORD dw = (zy & 1) ? ZOOM_GRID_LIGHT : ZOOM_GRID_DARK;
+            for (x = (nZoom - zx % nZoom) % nZoom; x < cx; x += nZoom)
+                pdw[x] = dw;
+        }
+        pdwRow[k] = pdw;
+        syRow[k] = sy;
+    }
+
+    return TRUE;
+}